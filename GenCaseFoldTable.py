@@ -0,0 +1,178 @@
+#
+# Copyright (c) 2007-Present The PureDarwin Project.
+# All rights reserved.
+#
+# @LICENSE_HEADER_START@
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+# IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+# EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+# PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+# LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+# NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# @LICENSE_HEADER_END@
+#
+#
+# @FILE
+#  GenCaseFoldTable.py
+#  Generates HFSPlusCaseFold.h, the case-folding table used by the HFS+
+#  catalog key comparison (FastUnicodeCompare, Apple TN1150)
+#
+# @AUTHOR
+# Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+#
+# Usage: python3 GenCaseFoldTable.py > HFSPlusCaseFold.h
+#
+
+import sys
+
+# The lower-case mappings of TN1150's gLowerCaseTable. HFS+ froze them at
+# Unicode 2.0, and only letters without a canonical decomposition fold:
+# names are stored decomposed, so precomposed capitals such as U+00C0 or
+# U+0130 never reach the table and keep their own value. The runs are
+# (first, last, step, delta): every step-th code from first to last maps to
+# code + delta.
+LOWER_CASE_RUNS = [
+    (0x0041, 0x005A, 1, 0x20),  # Basic Latin
+    (0x00C6, 0x00C6, 1, 0x20),
+    (0x00D0, 0x00D0, 1, 0x20),
+    (0x00D8, 0x00D8, 1, 0x20),
+    (0x00DE, 0x00DE, 1, 0x20),
+    (0x0110, 0x0110, 1, 1),     # Latin Extended-A
+    (0x0126, 0x0126, 1, 1),
+    (0x0132, 0x0132, 1, 1),
+    (0x013F, 0x013F, 1, 1),
+    (0x0141, 0x0141, 1, 1),
+    (0x014A, 0x014A, 1, 1),
+    (0x0152, 0x0152, 1, 1),
+    (0x0166, 0x0166, 1, 1),
+    (0x0182, 0x0184, 2, 1),     # Latin Extended-B
+    (0x0187, 0x0187, 1, 1),
+    (0x018B, 0x018B, 1, 1),
+    (0x0191, 0x0191, 1, 1),
+    (0x0198, 0x0198, 1, 1),
+    (0x01A2, 0x01A4, 2, 1),
+    (0x01A7, 0x01A7, 1, 1),
+    (0x01AC, 0x01AC, 1, 1),
+    (0x01B3, 0x01B5, 2, 1),
+    (0x01B8, 0x01B8, 1, 1),
+    (0x01BC, 0x01BC, 1, 1),
+    (0x01C4, 0x01C4, 1, 2),
+    (0x01C5, 0x01C5, 1, 1),
+    (0x01C7, 0x01C7, 1, 2),
+    (0x01C8, 0x01C8, 1, 1),
+    (0x01CA, 0x01CA, 1, 2),
+    (0x01CB, 0x01CB, 1, 1),
+    (0x01E4, 0x01E4, 1, 1),
+    (0x01F1, 0x01F1, 1, 2),
+    (0x01F2, 0x01F2, 1, 1),
+    (0x0391, 0x03A1, 1, 0x20),  # Greek
+    (0x03A3, 0x03A9, 1, 0x20),
+    (0x03E2, 0x03EE, 2, 1),     # Coptic in the Greek block
+    (0x0402, 0x0402, 1, 0x50),  # Cyrillic
+    (0x0404, 0x0406, 1, 0x50),
+    (0x0408, 0x040B, 1, 0x50),
+    (0x040F, 0x040F, 1, 0x50),
+    (0x0410, 0x0418, 1, 0x20),
+    (0x041A, 0x042F, 1, 0x20),
+    (0x0460, 0x0474, 2, 1),
+    (0x0478, 0x0480, 2, 1),
+    (0x0490, 0x04BE, 2, 1),
+    (0x04C3, 0x04C3, 1, 1),
+    (0x04C7, 0x04C7, 1, 1),
+    (0x04CB, 0x04CB, 1, 1),
+    (0x04D4, 0x04D8, 4, 1),
+    (0x04E0, 0x04E8, 8, 1),
+    (0x0531, 0x0556, 1, 0x30),  # Armenian
+    (0x10A0, 0x10C5, 1, 0x30),  # Georgian
+    (0x2160, 0x216F, 1, 0x10),  # Roman numerals
+    (0xFF21, 0xFF3A, 1, 0x20),  # Fullwidth Latin
+]
+
+# Capitals of Latin Extended-B whose small letter lives in the IPA block
+IPA_LOWER_CASE = {
+    0x0181: 0x0253, 0x0186: 0x0254, 0x0189: 0x0256, 0x018A: 0x0257,
+    0x018E: 0x01DD, 0x018F: 0x0259, 0x0190: 0x025B, 0x0193: 0x0260,
+    0x0194: 0x0263, 0x0196: 0x0269, 0x0197: 0x0268, 0x019C: 0x026F,
+    0x019D: 0x0272, 0x019F: 0x0275, 0x01A9: 0x0283, 0x01AE: 0x0288,
+    0x01B1: 0x028A, 0x01B2: 0x028B, 0x01B7: 0x0292,
+}
+
+# Characters that HFS+ ignores when comparing names
+IGNORED_RANGES = [
+    (0x200C, 0x200F),
+    (0x202A, 0x202E),
+    (0x206A, 0x206F),
+    (0xFEFF, 0xFEFF),
+]
+
+
+def build_map():
+    mapping = {0x0000: 0xFFFF}  # An embedded NUL sorts after everything
+
+    for first, last, step, delta in LOWER_CASE_RUNS:
+        for code in range(first, last + 1, step):
+            mapping[code] = code + delta
+    mapping.update(IPA_LOWER_CASE)
+
+    for first, last in IGNORED_RANGES:
+        for code in range(first, last + 1):
+            mapping[code] = 0
+
+    return mapping
+
+
+def main():
+    mapping = build_map()
+    pages = sorted({code >> 8 for code in mapping})
+
+    out = sys.stdout
+    out.write('//\n')
+    out.write('// HFSPlusCaseFold.h\n')
+    out.write('// Generated by GenCaseFoldTable.py from the TN1150 lower-case table. Do not edit.\n')
+    out.write('//\n')
+    out.write('// Two-level table: mHfsCaseFoldIndex maps the high byte of a UTF-16 code\n')
+    out.write('// unit to a page of mHfsCaseFoldPages (1-based, 0 = no mapping in that\n')
+    out.write('// page). A folded value of 0 marks a character that is ignored.\n')
+    out.write('//\n\n')
+    out.write('#ifndef HFSPLUS_CASE_FOLD_H\n#define HFSPLUS_CASE_FOLD_H\n\n')
+    out.write('#define HFSPLUS_CASE_FOLD_PAGES  %d\n\n' % len(pages))
+
+    out.write('STATIC CONST UINT8 mHfsCaseFoldIndex[256] = {\n')
+    index = [0] * 256
+    for number, page in enumerate(pages):
+        index[page] = number + 1
+    for row in range(0, 256, 16):
+        out.write('    ' + ' '.join('%d,' % value for value in index[row:row + 16]) + '\n')
+    out.write('};\n\n')
+
+    out.write('STATIC CONST UINT16 mHfsCaseFoldPages[HFSPLUS_CASE_FOLD_PAGES][256] = {\n')
+    for page in pages:
+        out.write('    // 0x%02X00\n    {\n' % page)
+        for row in range(0, 256, 8):
+            values = []
+            for low in range(row, row + 8):
+                code = (page << 8) | low
+                values.append('0x%04X,' % mapping.get(code, code))
+            out.write('        ' + ' '.join(values) + '\n')
+        out.write('    },\n')
+    out.write('};\n\n#endif // HFSPLUS_CASE_FOLD_H\n')
+
+
+if __name__ == '__main__':
+    main()
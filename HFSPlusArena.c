@@ -0,0 +1,190 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusArena.c
+//  This file is the c source for the HFS+ per-volume temporary buffers
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+#define ARENA_CHUNK_HEADER  ALIGN_VALUE(sizeof(HFSPLUS_ARENA_CHUNK), HFSPLUS_ARENA_ALIGNMENT)
+
+// Set up the arena of a new volume. Nothing is allocated until the first
+// buffer is asked for.
+VOID ArenaInit(
+    HFSPLUS_ARENA *Arena,
+    UINT32 BlockSize
+) {
+    ZeroMem(Arena, sizeof(HFSPLUS_ARENA));
+    Arena->Blocks.BufferSize = MAX(BlockSize, (UINT32)sizeof(VOID *));
+}
+
+// Free a list of scratch chunks
+STATIC
+VOID
+FreeChunks(
+    HFSPLUS_ARENA_CHUNK *Chunk
+) {
+    while (Chunk != NULL) {
+        HFSPLUS_ARENA_CHUNK *Next = Chunk->Next;
+        FreePool(Chunk);
+        Chunk = Next;
+    }
+}
+
+// Release everything the arena holds. Slab buffers still acquired belong
+// to their holders, who free them with SlabRelease before this.
+VOID ArenaFree(
+    HFSPLUS_ARENA *Arena
+) {
+    HFSPLUS_SLAB *Slab = &Arena->Blocks;
+
+    while (Slab->FreeList != NULL) {
+        VOID *Next = *(VOID **)Slab->FreeList;
+        FreePool(Slab->FreeList);
+        Slab->FreeList = Next;
+    }
+    Slab->FreeCount = 0;
+
+    FreeChunks(Arena->Chunks);
+    FreeChunks(Arena->Spare);
+    Arena->Chunks = NULL;
+    Arena->Spare = NULL;
+}
+
+// Take a buffer of the slab's size: the last one released, or a new one
+// from pool when the free list is empty
+VOID *SlabAcquire(
+    HFSPLUS_SLAB *Slab
+) {
+    VOID *Buffer = Slab->FreeList;
+
+    if (Buffer != NULL) {
+        Slab->FreeList = *(VOID **)Buffer;
+        Slab->FreeCount--;
+    } else {
+        Buffer = AllocatePool(Slab->BufferSize);
+        if (Buffer == NULL) {
+            return NULL;
+        }
+    }
+
+    Slab->Outstanding++;
+    return Buffer;
+}
+
+// Hand a buffer back to its slab. NULL is ignored, so callers that
+// acquire lazily can release unconditionally.
+VOID SlabRelease(
+    HFSPLUS_SLAB *Slab,
+    VOID *Buffer
+) {
+    if (Buffer == NULL) {
+        return;
+    }
+
+    *(VOID **)Buffer = Slab->FreeList;
+    Slab->FreeList = Buffer;
+    Slab->FreeCount++;
+    Slab->Outstanding--;
+}
+
+// Remember the current end of the scratch arena for ArenaReset
+VOID ArenaMark(
+    HFSPLUS_ARENA *Arena,
+    HFSPLUS_ARENA_MARK *Mark
+) {
+    Mark->Chunk = Arena->Chunks;
+    Mark->Used = (Arena->Chunks != NULL) ? Arena->Chunks->Used : 0;
+}
+
+// Bump allocate Size bytes of scratch memory, aligned to
+// HFSPLUS_ARENA_ALIGNMENT. The memory is not zeroed and lives until the
+// caller resets the arena to a mark taken before it. When the newest chunk
+// is full a spare chunk that fits is reused before a new one is taken from
+// pool.
+VOID *ArenaAlloc(
+    HFSPLUS_ARENA *Arena,
+    UINTN Size
+) {
+    HFSPLUS_ARENA_CHUNK *Chunk = Arena->Chunks;
+
+    Size = ALIGN_VALUE(MAX(Size, 1), HFSPLUS_ARENA_ALIGNMENT);
+
+    if (Chunk == NULL || Chunk->Size - Chunk->Used < Size) {
+        HFSPLUS_ARENA_CHUNK **Link = &Arena->Spare;
+
+        while (*Link != NULL && (*Link)->Size < Size) {
+            Link = &(*Link)->Next;
+        }
+
+        Chunk = *Link;
+        if (Chunk != NULL) {
+            *Link = Chunk->Next;
+        } else {
+            UINTN ChunkSize = MAX(Size, HFSPLUS_ARENA_CHUNK_SIZE);
+            Chunk = AllocatePool(ARENA_CHUNK_HEADER + ChunkSize);
+            if (Chunk == NULL) {
+                return NULL;
+            }
+            Chunk->Size = ChunkSize;
+        }
+
+        Chunk->Used = 0;
+        Chunk->Next = Arena->Chunks;
+        Arena->Chunks = Chunk;
+    }
+
+    VOID *Memory = (UINT8 *)Chunk + ARENA_CHUNK_HEADER + Chunk->Used;
+    Chunk->Used += Size;
+    return Memory;
+}
+
+// Drop every scratch allocation made since Mark was taken. Chunks started
+// after the mark move to the spare list for the next allocations.
+VOID ArenaReset(
+    HFSPLUS_ARENA *Arena,
+    CONST HFSPLUS_ARENA_MARK *Mark
+) {
+    while (Arena->Chunks != NULL && Arena->Chunks != Mark->Chunk) {
+        HFSPLUS_ARENA_CHUNK *Chunk = Arena->Chunks;
+        Arena->Chunks = Chunk->Next;
+        Chunk->Next = Arena->Spare;
+        Arena->Spare = Chunk;
+    }
+
+    if (Arena->Chunks != NULL) {
+        Arena->Chunks->Used = Mark->Used;
+    }
+}
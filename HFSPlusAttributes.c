@@ -0,0 +1,150 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusAttributes.c
+//  This file is the c source for HFS+ extended attribute lookups
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Search key of an attribute lookup
+typedef struct {
+    UINT32 FileID;
+    CONST CHAR16 *Name;
+    UINTN NameLength;
+} ATTRIBUTE_SEARCH_KEY;
+
+// Compare a search key with an on-disk attributes key. Keys sort by file
+// ID, then by attribute name as binary UTF-16, then by start block.
+STATIC
+INTN
+CompareAttributeKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+) {
+    CONST ATTRIBUTE_SEARCH_KEY *Search = (CONST ATTRIBUTE_SEARCH_KEY *)Context;
+    CONST HFSPlusAttrKey *AttrKey = (CONST HFSPlusAttrKey *)Key;
+    UINT32 KeyFileID;
+    UINT32 KeyStartBlock;
+    UINTN KeyNameLength;
+
+    // A key running past the record sorts last, so it is never matched
+    if (RecordLength < OFFSET_OF(HFSPlusAttrKey, attrName)) {
+        return -1;
+    }
+
+    KeyFileID = HFS_BE32(&AttrKey->fileID);
+    if (Search->FileID != KeyFileID) {
+        return (Search->FileID < KeyFileID) ? -1 : 1;
+    }
+
+    KeyNameLength = HFS_BE16(&AttrKey->attrNameLen);
+    if (OFFSET_OF(HFSPlusAttrKey, attrName) + 2 * KeyNameLength > RecordLength) {
+        return -1;
+    }
+
+    for (UINTN Index = 0; Index < MIN(Search->NameLength, KeyNameLength); Index++) {
+        UINT16 KeyChar = HFS_BE16(&AttrKey->attrName[Index]);
+
+        if (Search->Name[Index] != KeyChar) {
+            return (Search->Name[Index] < KeyChar) ? -1 : 1;
+        }
+    }
+    if (Search->NameLength != KeyNameLength) {
+        return (Search->NameLength < KeyNameLength) ? -1 : 1;
+    }
+
+    // Only the first record of an attribute, at block 0, is ever looked up
+    KeyStartBlock = HFS_BE32(&AttrKey->startBlock);
+    return (KeyStartBlock == 0) ? 0 : -1;
+}
+
+// Read an extended attribute of a file into a newly allocated buffer. Only
+// attributes stored inline in their B-tree record are supported, which is
+// how every attribute the loader needs is written.
+EFI_STATUS HfsReadAttribute(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    CONST CHAR16 *Name,
+    VOID **Data,
+    UINTN *DataSize
+) {
+    HFSPLUS_BTREE *Tree = &Volume->AttributesTree;
+    ATTRIBUTE_SEARCH_KEY Search;
+    HFSPLUS_BTREE_CURSOR Cursor;
+    UINT8 *Record;
+    UINT16 RecordLength;
+    UINT8 *RecordData;
+    UINT16 DataLength;
+
+    // The header node is only read when attributes are first needed
+    EFI_STATUS Status = PrepareBTree(Volume, &Volume->AttributesFile, HFSPLUS_ATTRIBUTES_FILE_ID, Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Search.FileID = FileID;
+    Search.Name = Name;
+    Search.NameLength = StrLen(Name);
+
+    Status = SearchBTree(Tree, CompareAttributeKey, &Search, &Cursor, &Record, &RecordLength);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = GetBTreeRecordData(Record, RecordLength, &RecordData, &DataLength);
+    if (EFI_ERROR(Status) || DataLength < OFFSET_OF(HFSPlusAttrData, attrData)) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    CONST HFSPlusAttrData *AttrData = (CONST HFSPlusAttrData *)RecordData;
+    if (HFS_BE32(&AttrData->recordType) != HFSPLUS_ATTR_INLINE_DATA) {
+        DEBUG((DEBUG_ERROR, "Attribute of file %u is not stored inline\n", FileID));
+        return EFI_UNSUPPORTED;
+    }
+
+    UINT32 Size = HFS_BE32(&AttrData->attrSize);
+    if (OFFSET_OF(HFSPlusAttrData, attrData) + (UINT64)Size > DataLength) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    // The record lives in the node cache, so hand back a copy
+    *Data = AllocateCopyPool(Size, AttrData->attrData);
+    if (*Data == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    *DataSize = Size;
+    return EFI_SUCCESS;
+}
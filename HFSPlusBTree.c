@@ -0,0 +1,430 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusBTree.c
+//  This file is the c source for the HFS+ B-tree node access
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Read one node of a B-tree file. Node numbers are relative to the start of
+// the tree's fork and are mapped to disk blocks through its extent list.
+EFI_STATUS ReadBTreeNodeFromDisk(
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    UINT8 *Buffer
+) {
+    if (NodeNumber >= Tree->TotalNodes && Tree->TotalNodes != 0) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    EFI_STATUS Status = ReadForkRange(
+        Tree->Volume,
+        Tree->Extents,
+        Tree->ExtentCount,
+        Tree->Fork.logicalSize,
+        (UINT64)NodeNumber * Tree->NodeSize,
+        Tree->NodeSize,
+        Buffer
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // The record offset table must at least be able to describe the node
+    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Buffer;
+    UINT32 NumRecords = SwapBytes16(NodeDesc->numRecords);
+    if (sizeof(BTNodeDescriptor) + 2 * (NumRecords + 1) > Tree->NodeSize) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Build the extent list a B-tree is read through. The extents tree cannot
+// describe itself, so it only ever has the extents of its header fork; every
+// other tree gets its overflow records too.
+STATIC
+EFI_STATUS
+GatherBTreeExtents(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *Fork,
+    UINT32 TreeId,
+    HFSPLUS_BTREE *Tree
+) {
+    if (TreeId != HFSPLUS_EXTENTS_FILE_ID) {
+        return GatherForkExtents(Volume, Fork, TreeId, HFSPLUS_DATA_FORK, FALSE, &Tree->Extents, &Tree->ExtentCount);
+    }
+
+    Tree->Extents = AllocateCopyPool(sizeof(Fork->extents), Fork->extents);
+    if (Tree->Extents == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Tree->ExtentCount = 8;
+    return EFI_SUCCESS;
+}
+
+// Open a B-tree by gathering its extents and reading its header node (node 0)
+EFI_STATUS OpenBTree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *Fork,
+    UINT32 TreeId,
+    HFSPLUS_BTREE *Tree
+) {
+    UINT8 HeaderBuffer[sizeof(BTNodeDescriptor) + sizeof(BTHeaderRec)];
+    EFI_STATUS Status;
+
+    CloseBTree(Tree);
+    Tree->Volume = Volume;
+    Tree->Fork = *Fork;
+    Tree->TreeId = TreeId;
+
+    Status = GatherBTreeExtents(Volume, Fork, TreeId, Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // The node size is only known from the header record itself, so read
+    // just the descriptor and header record first
+    Status = ReadForkRange(Volume, Tree->Extents, Tree->ExtentCount, Fork->logicalSize, 0, sizeof(HeaderBuffer), HeaderBuffer);
+    if (EFI_ERROR(Status)) {
+        goto Failed;
+    }
+
+    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)HeaderBuffer;
+    BTHeaderRec *Header = (BTHeaderRec *)(HeaderBuffer + sizeof(BTNodeDescriptor));
+
+    if (NodeDesc->kind != BT_HEADER_NODE) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Failed;
+    }
+
+    Tree->NodeSize = SwapBytes16(Header->nodeSize);
+    Tree->TreeDepth = SwapBytes16(Header->treeDepth);
+    Tree->MaxKeyLength = SwapBytes16(Header->maxKeyLength);
+    Tree->RootNode = SwapBytes32(Header->rootNode);
+    Tree->FirstLeafNode = SwapBytes32(Header->firstLeafNode);
+    Tree->LastLeafNode = SwapBytes32(Header->lastLeafNode);
+    Tree->TotalNodes = SwapBytes32(Header->totalNodes);
+    Tree->Attributes = SwapBytes32(Header->attributes);
+    Tree->KeyCompareType = Header->keyCompareType;
+
+    if (Tree->NodeSize < BT_MIN_NODE_SIZE || Tree->NodeSize > BT_MAX_NODE_SIZE ||
+        (Tree->NodeSize & (Tree->NodeSize - 1)) != 0 || Tree->TreeDepth > BT_MAX_DEPTH) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Failed;
+    }
+
+    if ((UINT64)Tree->TotalNodes * Tree->NodeSize > Fork->logicalSize) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Failed;
+    }
+
+    Tree->Valid = TRUE;
+    return EFI_SUCCESS;
+
+Failed:
+    CloseBTree(Tree);
+    return Status;
+}
+
+// Release the extent list of a B-tree and mark it closed
+VOID CloseBTree(
+    HFSPLUS_BTREE *Tree
+) {
+    if (Tree->Extents != NULL) {
+        FreePool(Tree->Extents);
+    }
+    ZeroMem(Tree, sizeof(*Tree));
+}
+
+// Locate a record through the offset table at the end of the node.
+// Offsets are stored in reverse order, record 0 last.
+EFI_STATUS GetBTreeRecord(
+    HFSPLUS_BTREE *Tree,
+    UINT8 *NodeBuffer,
+    UINT16 RecordIndex,
+    UINT8 **Record,
+    UINT16 *RecordLength
+) {
+    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)NodeBuffer;
+    UINT16 NumRecords = SwapBytes16(NodeDesc->numRecords);
+
+    if (RecordIndex >= NumRecords) {
+        return EFI_NOT_FOUND;
+    }
+
+    UINT8 *OffsetTable = NodeBuffer + Tree->NodeSize;
+    UINT16 Start = HFS_BE16(OffsetTable - 2 * (RecordIndex + 1));
+    UINT16 End = HFS_BE16(OffsetTable - 2 * (RecordIndex + 2));
+    UINT32 TableStart = Tree->NodeSize - 2 * (NumRecords + 1);
+
+    if (Start < sizeof(BTNodeDescriptor) || End <= Start || End > TableStart) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    *Record = NodeBuffer + Start;
+    if (RecordLength != NULL) {
+        *RecordLength = End - Start;
+    }
+    return EFI_SUCCESS;
+}
+
+// Convert a big-endian on-disk fork to host byte order. Catalog records are
+// only 2-byte aligned, so the fields are read by byte offset.
+VOID HfsForkDataFromDisk(
+    CONST HFSPlusForkData *DiskFork,
+    HFSPlusForkData *Fork
+) {
+    CONST UINT8 *Raw = (CONST UINT8 *)DiskFork;
+
+    Fork->logicalSize = HFS_BE64(Raw);
+    Fork->clumpSize = HFS_BE32(Raw + 8);
+    Fork->totalBlocks = HFS_BE32(Raw + 12);
+
+    for (UINTN Index = 0; Index < 8; Index++) {
+        Fork->extents[Index].startBlock = HFS_BE32(Raw + 16 + 8 * Index);
+        Fork->extents[Index].blockCount = HFS_BE32(Raw + 20 + 8 * Index);
+    }
+}
+
+// Open a volume's special B-tree on first use. The header node is only read
+// when the tree is first searched.
+EFI_STATUS PrepareBTree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *Fork,
+    UINT32 TreeId,
+    HFSPLUS_BTREE *Tree
+) {
+    if (Tree->Valid) {
+        return EFI_SUCCESS;
+    }
+    if (Fork->logicalSize == 0) {
+        return EFI_NOT_FOUND;
+    }
+    return OpenBTree(Volume, Fork, TreeId, Tree);
+}
+
+// Split a leaf record into its key and its data. Keys of every HFS+ tree
+// start with a 16-bit length, and the data that follows is 2-byte aligned.
+EFI_STATUS GetBTreeRecordData(
+    UINT8 *Record,
+    UINT16 RecordLength,
+    UINT8 **Data,
+    UINT16 *DataLength
+) {
+    UINT32 DataOffset;
+
+    if (RecordLength < sizeof(UINT16)) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    DataOffset = ALIGN_VALUE(2 + HFS_BE16(Record), 2);
+    if (DataOffset >= RecordLength) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    *Data = Record + DataOffset;
+    if (DataLength != NULL) {
+        *DataLength = (UINT16)(RecordLength - DataOffset);
+    }
+    return EFI_SUCCESS;
+}
+
+// Binary search a node for the last record whose key sorts at or before the
+// search key. Match is -1 when the search key sorts before every record, and
+// Exact tells whether the matched key is equal to it.
+STATIC
+EFI_STATUS
+SearchBTreeNode(
+    HFSPLUS_BTREE *Tree,
+    UINT8 *Node,
+    HFSPLUS_BTREE_COMPARE Compare,
+    VOID *Context,
+    INT32 *Match,
+    BOOLEAN *Exact
+) {
+    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Node;
+    INT32 Left = 0;
+    INT32 Right = (INT32)SwapBytes16(NodeDesc->numRecords) - 1;
+
+    *Match = -1;
+    *Exact = FALSE;
+
+    while (Left <= Right) {
+        INT32 Mid = (Left + Right) / 2;
+        UINT8 *Record;
+        UINT16 RecordLength;
+
+        EFI_STATUS Status = GetBTreeRecord(Tree, Node, (UINT16)Mid, &Record, &RecordLength);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        INTN Order = Compare(Context, Record, RecordLength);
+        if (Order >= 0) {
+            *Match = Mid;
+            *Exact = (Order == 0);
+            if (Order == 0) {
+                break;  // Keys are unique
+            }
+            Left = Mid + 1;
+        } else {
+            Right = Mid - 1;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Search a B-tree for a key with one descent from the root, every node read
+// through the volume's node cache with the levels near the root pinned. The
+// cursor is left on the first leaf record at or after the key, which may be
+// one past the end of its leaf. Returns EFI_SUCCESS and the record (when
+// Record is given) on an exact match, EFI_NOT_FOUND otherwise; either way
+// the cursor can be walked forward with ReadBTreeCursor.
+EFI_STATUS SearchBTree(
+    HFSPLUS_BTREE *Tree,
+    HFSPLUS_BTREE_COMPARE Compare,
+    VOID *Context,
+    HFSPLUS_BTREE_CURSOR *Cursor,
+    UINT8 **Record,
+    UINT16 *RecordLength
+) {
+    UINT32 NodeNumber = Tree->RootNode;
+    EFI_STATUS Status;
+
+    Cursor->NodeNumber = 0;
+    Cursor->RecordIndex = 0;
+
+    if (Tree->TreeDepth == 0) {
+        return EFI_NOT_FOUND;  // Empty tree
+    }
+
+    for (UINT32 Depth = 1; Depth <= Tree->TreeDepth; Depth++) {
+        UINT8 *Node;
+        INT32 Match;
+        BOOLEAN Exact;
+
+        Status = NodeCacheGet(&Tree->Volume->NodeCache, Tree, NodeNumber, Depth <= HFSPLUS_NODE_CACHE_PINNED_LEVELS, &Node);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        // A node's height must match its distance from the root
+        BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Node;
+        if (NodeDesc->height != Tree->TreeDepth - Depth + 1) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        Status = SearchBTreeNode(Tree, Node, Compare, Context, &Match, &Exact);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        if (NodeDesc->kind == BT_LEAF_NODE) {
+            Cursor->NodeNumber = NodeNumber;
+            Cursor->RecordIndex = (UINT16)(Exact ? Match : Match + 1);
+            if (!Exact) {
+                return EFI_NOT_FOUND;
+            }
+            if (Record == NULL) {
+                return EFI_SUCCESS;
+            }
+            return GetBTreeRecord(Tree, Node, (UINT16)Match, Record, RecordLength);
+        }
+
+        if (NodeDesc->kind != BT_INDEX_NODE || Depth == Tree->TreeDepth) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        // Keys before the first index key can only live in its subtree
+        UINT8 *IndexRecord;
+        UINT16 IndexRecordLength;
+        Status = GetBTreeRecord(Tree, Node, (UINT16)MAX(Match, 0), &IndexRecord, &IndexRecordLength);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        // The child pointer follows the key, which is either as long as it
+        // says or padded to the tree's maximum key length
+        UINT32 KeySize = 2 + ((Tree->Attributes & BT_VARIABLE_INDEX_KEYS_MASK) ? HFS_BE16(IndexRecord) : Tree->MaxKeyLength);
+        if (KeySize + sizeof(UINT32) > IndexRecordLength) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        NodeNumber = HFS_BE32(IndexRecord + KeySize);
+    }
+
+    return EFI_VOLUME_CORRUPTED;
+}
+
+// Return the leaf record under a cursor, following the leaf chain when the
+// cursor has run off the end of its node. Advancing is left to the caller
+// (RecordIndex++). The node is fetched through the cache on every call, so a
+// cursor stays usable across other lookups. Returns EFI_NOT_FOUND past the
+// last record of the tree.
+EFI_STATUS ReadBTreeCursor(
+    HFSPLUS_BTREE *Tree,
+    HFSPLUS_BTREE_CURSOR *Cursor,
+    UINT8 **Record,
+    UINT16 *RecordLength
+) {
+    // A corrupt chain could loop, so never follow more links than nodes
+    for (UINT32 Hops = 0; Hops <= Tree->TotalNodes; Hops++) {
+        UINT8 *Node;
+
+        if (Cursor->NodeNumber == 0) {
+            return EFI_NOT_FOUND;
+        }
+
+        EFI_STATUS Status = NodeCacheGet(&Tree->Volume->NodeCache, Tree, Cursor->NodeNumber, FALSE, &Node);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Node;
+        if (NodeDesc->kind != BT_LEAF_NODE) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        if (Cursor->RecordIndex < SwapBytes16(NodeDesc->numRecords)) {
+            return GetBTreeRecord(Tree, Node, Cursor->RecordIndex, Record, RecordLength);
+        }
+
+        Cursor->NodeNumber = SwapBytes32(NodeDesc->fLink);
+        Cursor->RecordIndex = 0;
+    }
+
+    return EFI_VOLUME_CORRUPTED;
+}
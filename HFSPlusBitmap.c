@@ -0,0 +1,378 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusBitmap.c
+//  This file is the c source for the HFS+ allocation bitmap cache
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bit-reversed byte values. The on-disk bitmap stores block 0 in the most
+// significant bit of byte 0; the cache keeps block 0 in bit 0 of word 0 so
+// that LowBitSet64 directly yields the lowest block number.
+STATIC UINT8 mReversedByte[256];
+STATIC BOOLEAN mReversedByteReady = FALSE;
+
+STATIC
+VOID
+InitReversedByteTable(VOID) {
+    if (mReversedByteReady) {
+        return;
+    }
+
+    for (UINTN Value = 0; Value < 256; Value++) {
+        UINT8 Reversed = 0;
+        for (UINTN Bit = 0; Bit < 8; Bit++) {
+            if (Value & (1 << Bit)) {
+                Reversed |= (UINT8)(0x80 >> Bit);
+            }
+        }
+        mReversedByte[Value] = Reversed;
+    }
+
+    mReversedByteReady = TRUE;
+}
+
+STATIC
+UINT32
+CountBits64(UINT64 Word) {
+    Word = Word - ((Word >> 1) & 0x5555555555555555ULL);
+    Word = (Word & 0x3333333333333333ULL) + ((Word >> 2) & 0x3333333333333333ULL);
+    Word = (Word + (Word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (UINT32)((Word * 0x0101010101010101ULL) >> 56);
+}
+
+// Return the index of the first word in [Index, End) that differs from
+// Pattern (all ones or all zeros), or End if there is none
+STATIC
+UINT64
+SkipUniformWords(
+    CONST UINT64 *Words,
+    UINT64 Index,
+    UINT64 End,
+    UINT64 Pattern
+) {
+#if defined(__SSE2__)
+    __m128i Wanted = _mm_set1_epi32((INT32)(UINT32)Pattern);
+
+    while (Index < End && (Index & 1) != 0) {
+        if (Words[Index] != Pattern) {
+            return Index;
+        }
+        Index++;
+    }
+
+    while (Index + 4 <= End) {
+        __m128i Low = _mm_load_si128((CONST __m128i *)&Words[Index]);
+        __m128i High = _mm_load_si128((CONST __m128i *)&Words[Index + 2]);
+        __m128i Same = _mm_and_si128(_mm_cmpeq_epi32(Low, Wanted), _mm_cmpeq_epi32(High, Wanted));
+        if (_mm_movemask_epi8(Same) != 0xFFFF) {
+            break;
+        }
+        Index += 4;
+    }
+#endif
+
+    while (Index < End && Words[Index] == Pattern) {
+        Index++;
+    }
+
+    return Index;
+}
+
+// Recompute the summary entry for one on-disk bitmap block
+STATIC
+VOID
+RefreshBitmapSummary(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 SummaryIndex
+) {
+    HFSPLUS_BITMAP_SUMMARY *Summary = &Cache->Summary[SummaryIndex];
+    CONST UINT64 *Words = Cache->Words + SummaryIndex * Cache->WordsPerBitmapBlock;
+    UINT32 FreeCount = 0;
+    UINT32 Leading = 0;
+    UINT32 Current = 0;
+    UINT32 Largest = 0;
+    BOOLEAN InLeading = TRUE;
+
+    for (UINT32 Index = 0; Index < Cache->WordsPerBitmapBlock; Index++) {
+        UINT64 Free = ~Words[Index];
+        UINT32 FreeBits = CountBits64(Free);
+
+        FreeCount += FreeBits;
+
+        if (FreeBits == 64) {
+            Current += 64;
+            continue;
+        }
+
+        if (FreeBits == 0) {
+            if (InLeading) {
+                Leading = Current;
+                InLeading = FALSE;
+            }
+            Largest = MAX(Largest, Current);
+            Current = 0;
+            continue;
+        }
+
+        for (UINT32 Bit = 0; Bit < 64; Bit++) {
+            if (Free & LShiftU64(1, Bit)) {
+                Current++;
+            } else {
+                if (InLeading) {
+                    Leading = Current;
+                    InLeading = FALSE;
+                }
+                Largest = MAX(Largest, Current);
+                Current = 0;
+            }
+        }
+    }
+
+    if (InLeading) {
+        Leading = Current;
+    }
+
+    Summary->FreeCount = FreeCount;
+    Summary->LeadingFree = Leading;
+    Summary->TrailingFree = Current;
+    Summary->LargestFreeRun = MAX(Largest, Current);
+}
+
+// Load the volume's allocation file into an in-memory bitmap cache, on the
+// first allocation. Free space is summarised per device block of the
+// bitmap, the unit in which changed bits are written back. The file is read
+// straight into the word array and converted in place one bitmap block at a
+// time, so the bitmap is only held once.
+EFI_STATUS LoadBitmapCache(
+    HFSPLUS_VOLUME *Volume,
+    HFSPLUS_BITMAP_CACHE *Cache
+) {
+    HFSPlusForkData *AllocationFile = &Volume->AllocationFile;
+    EFI_STATUS Status;
+
+    FreeBitmapCache(Cache);
+    InitReversedByteTable();
+
+    // The extent list is kept for writing changed bitmap blocks back
+    Status = GatherForkExtents(Volume, AllocationFile, HFSPLUS_ALLOCATION_FILE_ID, HFSPLUS_DATA_FORK, FALSE, &Cache->Extents, &Cache->ExtentCount);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Cache->BitsPerBitmapBlock = Volume->DeviceBlockSize * 8;
+    Cache->WordsPerBitmapBlock = Cache->BitsPerBitmapBlock / 64;
+    Cache->BitCount = AllocationFile->logicalSize * 8;
+    Cache->SummaryCount = (Cache->BitCount + Cache->BitsPerBitmapBlock - 1) / Cache->BitsPerBitmapBlock;
+    Cache->WordCount = Cache->SummaryCount * Cache->WordsPerBitmapBlock;
+
+    // The word array is padded to whole bitmap blocks with allocated bits so
+    // the scanners never need a partial-word bounds check
+    Cache->Words = AllocatePool((UINTN)(Cache->WordCount * sizeof(UINT64)) + 16);
+    Cache->Summary = AllocatePool((UINTN)(Cache->SummaryCount * sizeof(HFSPLUS_BITMAP_SUMMARY)));
+    if (Cache->Words == NULL || Cache->Summary == NULL) {
+        FreeBitmapCache(Cache);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Keep the word array 16-byte aligned for the SSE2 scanner
+    Cache->WordsAllocation = Cache->Words;
+    Cache->Words = (UINT64 *)ALIGN_VALUE((UINTN)Cache->Words, 16);
+
+    UINT8 *Bytes = (UINT8 *)Cache->Words;
+    Status = ReadForkRange(Volume, Cache->Extents, Cache->ExtentCount, AllocationFile->logicalSize, 0, (UINTN)AllocationFile->logicalSize, Bytes);
+    if (EFI_ERROR(Status)) {
+        FreeBitmapCache(Cache);
+        return Status;
+    }
+    SetMem(Bytes + AllocationFile->logicalSize, (UINTN)(Cache->WordCount * sizeof(UINT64) - AllocationFile->logicalSize), 0xFF);
+
+    UINTN BlockBytes = Cache->BitsPerBitmapBlock / 8;
+    for (UINT64 Index = 0; Index < Cache->SummaryCount; Index++) {
+        UINT8 *Block = Bytes + Index * BlockBytes;
+
+        for (UINTN Byte = 0; Byte < BlockBytes; Byte++) {
+            Block[Byte] = mReversedByte[Block[Byte]];
+        }
+        RefreshBitmapSummary(Cache, Index);
+        Cache->FreeBlocks += Cache->Summary[Index].FreeCount;
+    }
+
+    Cache->Loaded = TRUE;
+    return EFI_SUCCESS;
+}
+
+// Release the memory held by a bitmap cache
+VOID FreeBitmapCache(
+    HFSPLUS_BITMAP_CACHE *Cache
+) {
+    if (Cache->WordsAllocation != NULL) {
+        FreePool(Cache->WordsAllocation);
+    }
+    if (Cache->Summary != NULL) {
+        FreePool(Cache->Summary);
+    }
+    if (Cache->Extents != NULL) {
+        FreePool(Cache->Extents);
+    }
+    ZeroMem(Cache, sizeof(*Cache));
+}
+
+// Return the first bit at or after Bit whose state is Allocated, or Limit
+STATIC
+UINT64
+FindNextBitInState(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 Bit,
+    UINT64 Limit,
+    BOOLEAN Allocated
+) {
+    while (Bit < Limit) {
+        UINT64 SummaryIndex = Bit / Cache->BitsPerBitmapBlock;
+
+        // Whole bitmap blocks in the wrong state are skipped from the summary
+        if (Bit % Cache->BitsPerBitmapBlock == 0) {
+            UINT32 FreeCount = Cache->Summary[SummaryIndex].FreeCount;
+            if ((Allocated && FreeCount == Cache->BitsPerBitmapBlock) || (!Allocated && FreeCount == 0)) {
+                Bit += Cache->BitsPerBitmapBlock;
+                continue;
+            }
+        }
+
+        UINT64 WordIndex = Bit / 64;
+        UINT64 Word = Allocated ? Cache->Words[WordIndex] : ~Cache->Words[WordIndex];
+
+        Word &= LShiftU64(~0ULL, (UINTN)(Bit % 64));
+        if (Word != 0) {
+            return MIN(WordIndex * 64 + (UINT64)LowBitSet64(Word), Limit);
+        }
+
+        UINT64 BlockEndWord = (SummaryIndex + 1) * Cache->WordsPerBitmapBlock;
+        WordIndex = SkipUniformWords(Cache->Words, WordIndex + 1, BlockEndWord, Allocated ? 0 : ~0ULL);
+        Bit = WordIndex * 64;
+    }
+
+    return Limit;
+}
+
+// Find the next free run at or after *Cursor and below Limit that could be at
+// least MinLength blocks long. Bitmap blocks whose summary proves that no run
+// of that length can start inside them are skipped without being scanned.
+BOOLEAN BitmapCacheNextFreeRun(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 *Cursor,
+    UINT64 Limit,
+    UINT32 MinLength,
+    UINT64 *RunStart,
+    UINT64 *RunLength
+) {
+    UINT64 Bit = *Cursor;
+
+    while (Bit < Limit) {
+        if (MinLength > 1 && Bit % Cache->BitsPerBitmapBlock == 0) {
+            HFSPLUS_BITMAP_SUMMARY *Summary = &Cache->Summary[Bit / Cache->BitsPerBitmapBlock];
+            if (Summary->TrailingFree == 0 && Summary->LargestFreeRun < MinLength) {
+                Bit += Cache->BitsPerBitmapBlock;
+                continue;
+            }
+        }
+
+        UINT64 Start = FindNextBitInState(Cache, Bit, Limit, FALSE);
+        if (Start >= Limit) {
+            break;
+        }
+
+        UINT64 End = FindNextBitInState(Cache, Start, Limit, TRUE);
+        *Cursor = End;
+        *RunStart = Start;
+        *RunLength = End - Start;
+        return TRUE;
+    }
+
+    *Cursor = Limit;
+    return FALSE;
+}
+
+// Set or clear a range of bits in the cache and refresh the affected summaries
+VOID BitmapCacheSetRange(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 StartBit,
+    UINT64 BitCount,
+    BOOLEAN Allocated
+) {
+    UINT64 Bit = StartBit;
+    UINT64 EndBit = MIN(StartBit + BitCount, Cache->BitCount);
+
+    while (Bit < EndBit) {
+        UINT64 WordIndex = Bit / 64;
+        UINT32 Shift = (UINT32)(Bit % 64);
+        UINT64 Span = MIN(64 - Shift, EndBit - Bit);
+        UINT64 Mask = (Span == 64) ? ~0ULL : LShiftU64(LShiftU64(1, (UINTN)Span) - 1, Shift);
+
+        if (Allocated) {
+            Cache->Words[WordIndex] |= Mask;
+        } else {
+            Cache->Words[WordIndex] &= ~Mask;
+        }
+
+        Bit += Span;
+    }
+
+    UINT64 FirstSummary = StartBit / Cache->BitsPerBitmapBlock;
+    UINT64 LastSummary = (EndBit - 1) / Cache->BitsPerBitmapBlock;
+    for (UINT64 Index = FirstSummary; Index <= LastSummary && StartBit < EndBit; Index++) {
+        Cache->FreeBlocks -= Cache->Summary[Index].FreeCount;
+        RefreshBitmapSummary(Cache, Index);
+        Cache->FreeBlocks += Cache->Summary[Index].FreeCount;
+    }
+}
+
+// Convert one cached bitmap block back to on-disk bit order
+VOID BitmapCacheExportBlock(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 SummaryIndex,
+    UINT8 *Buffer
+) {
+    CONST UINT8 *Bytes = (CONST UINT8 *)(Cache->Words + SummaryIndex * Cache->WordsPerBitmapBlock);
+    UINT32 ByteCount = Cache->BitsPerBitmapBlock / 8;
+
+    for (UINT32 Index = 0; Index < ByteCount; Index++) {
+        Buffer[Index] = mReversedByte[Bytes[Index]];
+    }
+}
@@ -0,0 +1,547 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusDecmpfs.c
+//  This file is the c source for reading HFS+ compressed (decmpfs) files
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Chunks decoded by one HfsParallelFor batch
+typedef struct {
+    HFSPLUS_DECMPFS *Decmpfs;
+    UINT64 FileSize;
+    CONST UINT8 *Source;    // Compressed data of the first chunk
+    UINT64 SourceOffset;    // Offset of Source in the attribute or resource fork
+    UINT32 FirstChunk;
+    UINT8 *Destination;
+    EFI_STATUS Status[HFSPLUS_DECMPFS_BATCH_CHUNKS];
+} DECMPFS_BATCH;
+
+#if !HFSPLUS_ENABLE_THREADS
+// Run work items one after another. Builds with threads provide their own
+// HfsParallelFor.
+VOID HfsParallelFor(
+    UINTN Count,
+    HFSPLUS_WORK_ITEM Work,
+    VOID *Context
+) {
+    for (UINTN Index = 0; Index < Count; Index++) {
+        Work(Context, Index);
+    }
+}
+#endif
+
+// Uncompressed length of a chunk; only the last one is short
+STATIC
+UINT32
+ChunkLength(
+    HFSPLUS_DECMPFS *Decmpfs,
+    UINT64 FileSize,
+    UINT32 Chunk
+) {
+    UINT64 Start = (UINT64)Chunk * Decmpfs->ChunkSize;
+
+    return (UINT32)MIN((UINT64)Decmpfs->ChunkSize, FileSize - Start);
+}
+
+// Decompress one chunk, which must produce exactly Length bytes. Chunks
+// that did not shrink are stored raw behind a marker byte that no
+// compressed stream of their type starts with.
+STATIC
+EFI_STATUS
+DecodeChunk(
+    UINT32 Type,
+    CONST UINT8 *Source,
+    UINT32 SourceSize,
+    UINT8 *Destination,
+    UINT32 Length
+) {
+    UINTN Decompressed = 0;
+    EFI_STATUS Status;
+
+    switch (Type) {
+    case HFSPLUS_DECMPFS_ZLIB_ATTR:
+    case HFSPLUS_DECMPFS_ZLIB_RSRC:
+        if ((Source[0] & 0x0F) == 0x0F) {
+            break;
+        }
+        Status = HfsZlibDecompress(Source, SourceSize, Destination, Length, &Decompressed);
+        return (EFI_ERROR(Status) || Decompressed != Length) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+
+    case HFSPLUS_DECMPFS_LZVN_ATTR:
+    case HFSPLUS_DECMPFS_LZVN_RSRC:
+        if (Source[0] == 0x06) {
+            break;
+        }
+        Status = HfsLzvnDecompress(Source, SourceSize, Destination, Length, &Decompressed);
+        return (EFI_ERROR(Status) || Decompressed != Length) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+
+    case HFSPLUS_DECMPFS_LZFSE_ATTR:
+    case HFSPLUS_DECMPFS_LZFSE_RSRC:
+        if (Source[0] == 0x06) {
+            break;
+        }
+        Status = HfsLzfseDecompress(Source, SourceSize, Destination, Length, &Decompressed);
+        if (Status == EFI_UNSUPPORTED || Status == EFI_OUT_OF_RESOURCES) {
+            return Status;
+        }
+        return (EFI_ERROR(Status) || Decompressed != Length) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+
+    default:
+        // Uncompressed attribute data has no marker
+        if (SourceSize != Length) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        CopyMem(Destination, Source, Length);
+        return EFI_SUCCESS;
+    }
+
+    if (SourceSize - 1 != Length) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    CopyMem(Destination, Source + 1, Length);
+    return EFI_SUCCESS;
+}
+
+// HfsParallelFor work item: decode chunk Index of a batch into its place
+STATIC
+VOID
+DecodeBatchChunk(
+    VOID *Context,
+    UINTN Index
+) {
+    DECMPFS_BATCH *Batch = Context;
+    HFSPLUS_DECMPFS *Decmpfs = Batch->Decmpfs;
+    UINT32 Chunk = Batch->FirstChunk + (UINT32)Index;
+    HFSPLUS_DECMPFS_CHUNK *Entry = &Decmpfs->Chunks[Chunk];
+
+    Batch->Status[Index] = DecodeChunk(
+        Decmpfs->Type,
+        Batch->Source + (Entry->Offset - Batch->SourceOffset),
+        Entry->Size,
+        Batch->Destination + (UINTN)Index * Decmpfs->ChunkSize,
+        ChunkLength(Decmpfs, Batch->FileSize, Chunk)
+    );
+}
+
+// Decode up to *Count consecutive chunks into Destination. Chunks in the
+// resource fork are read with one device request for the whole batch;
+// *Count is cut short when their compressed bytes do not fit the buffer.
+STATIC
+EFI_STATUS
+DecodeChunks(
+    HFSPLUS_FORK *Fork,
+    UINT32 FirstChunk,
+    UINT32 *Count,
+    UINT8 *Destination
+) {
+    HFSPLUS_DECMPFS *Decmpfs = Fork->Compressed;
+    HFSPLUS_DECMPFS_CHUNK *First = &Decmpfs->Chunks[FirstChunk];
+    DECMPFS_BATCH Batch;
+    EFI_STATUS Status;
+
+    ZeroMem(&Batch, sizeof(Batch));
+    Batch.Decmpfs = Decmpfs;
+    Batch.FileSize = Fork->Size;
+    Batch.FirstChunk = FirstChunk;
+    Batch.Destination = Destination;
+    Batch.SourceOffset = First->Offset;
+
+    if (Decmpfs->ResourceFork == NULL) {
+        Batch.Source = Decmpfs->Attribute + First->Offset;
+    } else {
+        UINT64 Span;
+        UINTN Length;
+
+        // A single chunk always fits, so this ends with at least one
+        while (TRUE) {
+            HFSPLUS_DECMPFS_CHUNK *Last = &Decmpfs->Chunks[FirstChunk + *Count - 1];
+            Span = Last->Offset + Last->Size - First->Offset;
+            if (Span <= HFSPLUS_DECMPFS_BATCH_CHUNKS * HFSPLUS_DECMPFS_MAX_CHUNK || *Count == 1) {
+                break;
+            }
+            (*Count)--;
+        }
+
+        if (Decmpfs->Compressed == NULL) {
+            Decmpfs->Compressed = AllocatePool(HFSPLUS_DECMPFS_BATCH_CHUNKS * HFSPLUS_DECMPFS_MAX_CHUNK);
+            if (Decmpfs->Compressed == NULL) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+        }
+
+        Length = (UINTN)Span;
+        Status = InternalReadAt(Decmpfs->ResourceFork, First->Offset, &Length, Decmpfs->Compressed);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        if (Length != Span) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        Batch.Source = Decmpfs->Compressed;
+    }
+
+    HfsParallelFor(*Count, DecodeBatchChunk, &Batch);
+
+    for (UINT32 Index = 0; Index < *Count; Index++) {
+        if (EFI_ERROR(Batch.Status[Index])) {
+            DEBUG((DEBUG_ERROR, "Compressed chunk %u of file %u is corrupted\n", FirstChunk + Index, Fork->FileID));
+            return Batch.Status[Index];
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+// Read the chunk table at the start of the resource fork. zlib files keep
+// it in the data of a classic resource fork as (offset, size) pairs
+// relative to the table; LZVN and LZFSE files start with the offsets of
+// every chunk and of the end of the last one.
+STATIC
+EFI_STATUS
+ReadChunkTable(
+    HFSPLUS_DECMPFS *Decmpfs
+) {
+    HFSPLUS_FORK *ResourceFork = Decmpfs->ResourceFork;
+    UINT32 Count = Decmpfs->ChunkCount;
+    UINTN TableSize;
+    UINTN Length;
+    UINT8 *Table;
+    UINT64 TableOffset;
+    EFI_STATUS Status;
+
+    Decmpfs->Chunks = AllocatePool((UINTN)Count * sizeof(HFSPLUS_DECMPFS_CHUNK));
+    if (Decmpfs->Chunks == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (Decmpfs->Type == HFSPLUS_DECMPFS_ZLIB_RSRC) {
+        UINT8 Header[4];
+
+        Length = sizeof(Header);
+        Status = InternalReadAt(ResourceFork, 0, &Length, Header);
+        if (EFI_ERROR(Status) || Length != sizeof(Header)) {
+            return EFI_ERROR(Status) ? Status : EFI_VOLUME_CORRUPTED;
+        }
+
+        // Resource data offset, then the data length and the chunk count
+        TableOffset = (UINT64)HFS_BE32(Header) + 4;
+        TableSize = 4 + (UINTN)Count * 8;
+    } else {
+        TableOffset = 0;
+        TableSize = ((UINTN)Count + 1) * 4;
+    }
+
+    Table = AllocatePool(TableSize);
+    if (Table == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Length = TableSize;
+    Status = InternalReadAt(ResourceFork, TableOffset, &Length, Table);
+    if (!EFI_ERROR(Status) && Length != TableSize) {
+        Status = EFI_VOLUME_CORRUPTED;
+    }
+    if (!EFI_ERROR(Status) && Decmpfs->Type == HFSPLUS_DECMPFS_ZLIB_RSRC && ReadUnaligned32((UINT32 *)Table) != Count) {
+        Status = EFI_VOLUME_CORRUPTED;
+    }
+
+    for (UINT32 Index = 0; Index < Count && !EFI_ERROR(Status); Index++) {
+        HFSPLUS_DECMPFS_CHUNK *Chunk = &Decmpfs->Chunks[Index];
+        UINT64 End;
+
+        if (Decmpfs->Type == HFSPLUS_DECMPFS_ZLIB_RSRC) {
+            Chunk->Offset = TableOffset + ReadUnaligned32((UINT32 *)(Table + 4 + 8 * Index));
+            Chunk->Size = ReadUnaligned32((UINT32 *)(Table + 8 + 8 * Index));
+            End = Chunk->Offset + Chunk->Size;
+        } else {
+            Chunk->Offset = ReadUnaligned32((UINT32 *)(Table + 4 * Index));
+            End = ReadUnaligned32((UINT32 *)(Table + 4 * Index + 4));
+            Chunk->Size = (End > Chunk->Offset) ? (UINT32)(End - Chunk->Offset) : 0;
+        }
+
+        // Batches read the span between chunks, so they must not overlap
+        if (Chunk->Size == 0 || Chunk->Size > HFSPLUS_DECMPFS_MAX_CHUNK || End > ResourceFork->Size ||
+            Chunk->Offset < TableOffset + TableSize ||
+            (Index > 0 && Chunk->Offset < Decmpfs->Chunks[Index - 1].Offset + Decmpfs->Chunks[Index - 1].Size)) {
+            Status = EFI_VOLUME_CORRUPTED;
+        }
+    }
+
+    FreePool(Table);
+    return Status;
+}
+
+// Uncompressed size of a compressed file, from its decmpfs header alone.
+// Lets directory listings report sizes without opening each file.
+EFI_STATUS DecmpfsGetSize(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    UINT64 *FileSize
+) {
+    UINT8 *Attribute;
+    UINTN AttributeSize;
+
+    EFI_STATUS Status = HfsReadAttribute(Volume, FileID, HFSPLUS_DECMPFS_ATTRIBUTE, (VOID **)&Attribute, &AttributeSize);
+    if (EFI_ERROR(Status)) {
+        return (Status == EFI_NOT_FOUND) ? EFI_VOLUME_CORRUPTED : Status;
+    }
+
+    HFSPlusDecmpfsHeader *Header = (HFSPlusDecmpfsHeader *)Attribute;
+    if (AttributeSize < sizeof(HFSPlusDecmpfsHeader) ||
+        ReadUnaligned32(&Header->compressionMagic) != HFSPLUS_DECMPFS_MAGIC) {
+        Status = EFI_VOLUME_CORRUPTED;
+    } else {
+        *FileSize = ReadUnaligned64(&Header->uncompressedSize);
+    }
+
+    FreePool(Attribute);
+    return Status;
+}
+
+// Open the contents of a compressed file as a read-only fork. The
+// com.apple.decmpfs attribute says how the file is compressed; files whose
+// data lives in the resource fork have their chunk table read here, so
+// reads only touch the chunks they need.
+EFI_STATUS DecmpfsOpen(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    HFSPlusForkData *ResourceFork,
+    HFSPLUS_FORK **Fork
+) {
+    HFSPLUS_DECMPFS *Decmpfs;
+    HFSPLUS_FORK *NewFork;
+    UINT8 *Attribute;
+    UINTN AttributeSize;
+    UINT64 FileSize;
+    EFI_STATUS Status;
+
+    Status = HfsReadAttribute(Volume, FileID, HFSPLUS_DECMPFS_ATTRIBUTE, (VOID **)&Attribute, &AttributeSize);
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Compressed file %u has no usable decmpfs attribute: %r\n", FileID, Status));
+        return (Status == EFI_NOT_FOUND) ? EFI_VOLUME_CORRUPTED : Status;
+    }
+
+    // The header is little-endian, the byte order of every UEFI platform
+    HFSPlusDecmpfsHeader *Header = (HFSPlusDecmpfsHeader *)Attribute;
+    if (AttributeSize < sizeof(HFSPlusDecmpfsHeader) ||
+        ReadUnaligned32(&Header->compressionMagic) != HFSPLUS_DECMPFS_MAGIC) {
+        FreePool(Attribute);
+        return EFI_VOLUME_CORRUPTED;
+    }
+    FileSize = ReadUnaligned64(&Header->uncompressedSize);
+
+    Decmpfs = AllocateZeroPool(sizeof(HFSPLUS_DECMPFS));
+    NewFork = AllocateZeroPool(sizeof(HFSPLUS_FORK));
+    if (Decmpfs == NULL || NewFork == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Failed;
+    }
+
+    Decmpfs->Type = ReadUnaligned32(&Header->compressionType);
+    Decmpfs->CachedChunk = MAX_UINT32;
+    NewFork->Volume = Volume;
+    NewFork->FileID = FileID;
+    NewFork->ForkType = HFSPLUS_DATA_FORK;
+    NewFork->Size = FileSize;
+    NewFork->Compressed = Decmpfs;
+
+    switch (Decmpfs->Type) {
+    case HFSPLUS_DECMPFS_UNCOMPRESSED_ATTR:
+    case HFSPLUS_DECMPFS_ZLIB_ATTR:
+    case HFSPLUS_DECMPFS_LZVN_ATTR:
+    case HFSPLUS_DECMPFS_LZFSE_ATTR:
+        // One chunk: the whole file, compressed behind the header
+        if (FileSize > HFSPLUS_DECMPFS_MAX_INLINE ||
+            (FileSize != 0 && AttributeSize == sizeof(HFSPlusDecmpfsHeader))) {
+            Status = EFI_VOLUME_CORRUPTED;
+            goto Failed;
+        }
+        Decmpfs->ChunkSize = (UINT32)MAX(FileSize, 1);
+        Decmpfs->ChunkCount = (FileSize != 0) ? 1 : 0;
+        Decmpfs->Chunks = AllocatePool(sizeof(HFSPLUS_DECMPFS_CHUNK));
+        if (Decmpfs->Chunks == NULL) {
+            Status = EFI_OUT_OF_RESOURCES;
+            goto Failed;
+        }
+        Decmpfs->Chunks[0].Offset = sizeof(HFSPlusDecmpfsHeader);
+        Decmpfs->Chunks[0].Size = (UINT32)(AttributeSize - sizeof(HFSPlusDecmpfsHeader));
+        Decmpfs->Attribute = Attribute;
+        Attribute = NULL;
+        break;
+
+    case HFSPLUS_DECMPFS_ZLIB_RSRC:
+    case HFSPLUS_DECMPFS_LZVN_RSRC:
+    case HFSPLUS_DECMPFS_LZFSE_RSRC:
+        Decmpfs->ChunkSize = HFSPLUS_DECMPFS_CHUNK_SIZE;
+        if (FileSize > (UINT64)MAX_UINT32 * HFSPLUS_DECMPFS_CHUNK_SIZE ||
+            FileSize / HFSPLUS_DECMPFS_CHUNK_SIZE > ResourceFork->logicalSize) {
+            Status = EFI_VOLUME_CORRUPTED;
+            goto Failed;
+        }
+        Decmpfs->ChunkCount = (UINT32)((FileSize + HFSPLUS_DECMPFS_CHUNK_SIZE - 1) / HFSPLUS_DECMPFS_CHUNK_SIZE);
+
+        Status = InternalOpenFork(Volume, ResourceFork, FileID, HFSPLUS_RESOURCE_FORK, &Decmpfs->ResourceFork);
+        if (EFI_ERROR(Status)) {
+            goto Failed;
+        }
+        Status = ReadChunkTable(Decmpfs);
+        if (EFI_ERROR(Status)) {
+            goto Failed;
+        }
+        break;
+
+    default:
+        DEBUG((DEBUG_ERROR, "File %u uses unknown compression type %u\n", FileID, Decmpfs->Type));
+        Status = EFI_UNSUPPORTED;
+        goto Failed;
+    }
+
+    if (Attribute != NULL) {
+        FreePool(Attribute);
+    }
+    *Fork = NewFork;
+    return EFI_SUCCESS;
+
+Failed:
+    if (Attribute != NULL) {
+        FreePool(Attribute);
+    }
+    DecmpfsFree(Decmpfs);
+    if (NewFork != NULL) {
+        FreePool(NewFork);
+    }
+    return Status;
+}
+
+// Read up to *Length bytes of the uncompressed contents at Offset, with the
+// same semantics as InternalReadAt. Runs of whole chunks are decompressed
+// in batches straight into Buffer; the ends of a read that only cover part
+// of a chunk go through the chunk cache.
+EFI_STATUS DecmpfsReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+) {
+    HFSPLUS_DECMPFS *Decmpfs = Fork->Compressed;
+    UINT8 *Destination = Buffer;
+    UINT64 Remaining;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Offset >= Fork->Size) {
+        *Length = 0;
+        return EFI_SUCCESS;
+    }
+
+    Remaining = MIN((UINT64)*Length, Fork->Size - Offset);
+    *Length = (UINTN)Remaining;
+
+    while (Remaining > 0) {
+        UINT32 Chunk = (UINT32)(Offset / Decmpfs->ChunkSize);
+        UINT32 Within = (UINT32)(Offset % Decmpfs->ChunkSize);
+        UINT32 Available = ChunkLength(Decmpfs, Fork->Size, Chunk) - Within;
+        UINTN Copied;
+
+        if (Within == 0 && Remaining >= Available) {
+            // Whole chunks: every one the read covers, a batch at a time
+            UINT32 Count = 1;
+            UINT64 Covered = Available;
+
+            while (Count < HFSPLUS_DECMPFS_BATCH_CHUNKS && Chunk + Count < Decmpfs->ChunkCount &&
+                   Covered + ChunkLength(Decmpfs, Fork->Size, Chunk + Count) <= Remaining) {
+                Covered += ChunkLength(Decmpfs, Fork->Size, Chunk + Count);
+                Count++;
+            }
+
+            Status = DecodeChunks(Fork, Chunk, &Count, Destination);
+            if (EFI_ERROR(Status)) {
+                break;
+            }
+            Copied = (UINTN)((UINT64)(Count - 1) * Decmpfs->ChunkSize + ChunkLength(Decmpfs, Fork->Size, Chunk + Count - 1));
+        } else {
+            if (Decmpfs->CachedChunk != Chunk) {
+                UINT32 One = 1;
+
+                if (Decmpfs->Cache == NULL) {
+                    Decmpfs->Cache = AllocatePool(Decmpfs->ChunkSize);
+                    if (Decmpfs->Cache == NULL) {
+                        Status = EFI_OUT_OF_RESOURCES;
+                        break;
+                    }
+                }
+                Decmpfs->CachedChunk = MAX_UINT32;
+                Status = DecodeChunks(Fork, Chunk, &One, Decmpfs->Cache);
+                if (EFI_ERROR(Status)) {
+                    break;
+                }
+                Decmpfs->CachedChunk = Chunk;
+            }
+            Copied = (UINTN)MIN(Remaining, (UINT64)Available);
+            CopyMem(Destination, Decmpfs->Cache + Within, Copied);
+        }
+
+        Destination += Copied;
+        Offset += Copied;
+        Remaining -= Copied;
+    }
+
+    if (EFI_ERROR(Status)) {
+        *Length -= (UINTN)Remaining;
+    }
+    return Status;
+}
+
+// Release the decompression state of a compressed file
+VOID DecmpfsFree(
+    HFSPLUS_DECMPFS *Decmpfs
+) {
+    if (Decmpfs == NULL) {
+        return;
+    }
+    HfsCloseFork(Decmpfs->ResourceFork);
+    if (Decmpfs->Chunks != NULL) {
+        FreePool(Decmpfs->Chunks);
+    }
+    if (Decmpfs->Attribute != NULL) {
+        FreePool(Decmpfs->Attribute);
+    }
+    if (Decmpfs->Compressed != NULL) {
+        FreePool(Decmpfs->Compressed);
+    }
+    if (Decmpfs->Cache != NULL) {
+        FreePool(Decmpfs->Cache);
+    }
+    FreePool(Decmpfs);
+}
@@ -0,0 +1,1104 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusDecompress.c
+//  This file is the c source for the zlib, LZVN and LZFSE decoders of HFS+ compressed files
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+#define INFLATE_FAST_BITS     10   // Codes up to this long decode with one table lookup
+#define INFLATE_MAX_BITS      15
+#define INFLATE_LITLEN_CODES  288
+#define INFLATE_DIST_CODES    30
+#define INFLATE_INVALID       0xFFFF
+
+// Huffman decoding table for one alphabet. The next INFLATE_FAST_BITS
+// input bits index Fast directly; longer codes, and bit patterns that are
+// no code at all, fall back to a canonical decode from Count and Symbol.
+typedef struct {
+    UINT16 Fast[1 << INFLATE_FAST_BITS];  // Symbol << 4 | code length, 0 for the slow path
+    UINT16 Count[INFLATE_MAX_BITS + 1];   // Codes of each length
+    UINT16 Symbol[INFLATE_LITLEN_CODES];  // Symbols in canonical code order
+} INFLATE_TABLE;
+
+// Input is consumed least significant bit first through a 64-bit buffer
+typedef struct {
+    CONST UINT8 *In;
+    CONST UINT8 *InEnd;
+    UINT64 Bits;
+    UINT32 BitCount;
+    BOOLEAN Overrun;  // More bits were wanted than the input holds
+    UINT8 *Out;
+    UINT8 *OutStart;
+    UINT8 *OutEnd;
+} INFLATE_STATE;
+
+STATIC CONST UINT16 mLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+STATIC CONST UINT8 mLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+STATIC CONST UINT16 mDistanceBase[INFLATE_DIST_CODES] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+STATIC CONST UINT8 mDistanceExtra[INFLATE_DIST_CODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Order in which a dynamic block lists the code length code lengths
+STATIC CONST UINT8 mCodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Copy a match from Distance bytes back. Overlapping matches repeat the
+// bytes just written, so they are copied forwards one byte at a time.
+STATIC
+VOID
+CopyMatch(
+    UINT8 *Out,
+    UINTN Distance,
+    UINTN Length
+) {
+    CONST UINT8 *From = Out - Distance;
+
+    if (Distance >= Length) {
+        CopyMem(Out, From, Length);
+        return;
+    }
+    while (Length-- > 0) {
+        *Out++ = *From++;
+    }
+}
+
+// Top the bit buffer up to at least 56 bits while input lasts. Away from
+// the end a whole word is loaded at once (UEFI platforms are little-endian);
+// bits above BitCount then hold the following input, which the next load
+// ORs in again unchanged.
+STATIC
+VOID
+InflateRefill(
+    INFLATE_STATE *State
+) {
+    if (State->InEnd - State->In >= 8) {
+        State->Bits |= LShiftU64(ReadUnaligned64((CONST UINT64 *)State->In), State->BitCount);
+        State->In += (63 - State->BitCount) >> 3;
+        State->BitCount |= 56;
+        return;
+    }
+
+    while (State->BitCount <= 56 && State->In < State->InEnd) {
+        State->Bits |= LShiftU64(*State->In++, State->BitCount);
+        State->BitCount += 8;
+    }
+}
+
+// Take Count (at most 32) bits from the input
+STATIC
+UINT32
+InflateBits(
+    INFLATE_STATE *State,
+    UINT32 Count
+) {
+    if (State->BitCount < Count) {
+        InflateRefill(State);
+        if (State->BitCount < Count) {
+            State->Overrun = TRUE;
+            return 0;
+        }
+    }
+
+    UINT32 Value = (UINT32)State->Bits & (UINT32)(LShiftU64(1, Count) - 1);
+    State->Bits = RShiftU64(State->Bits, Count);
+    State->BitCount -= Count;
+    return Value;
+}
+
+// Skip to the next byte boundary and give the whole bytes still in the bit
+// buffer back to the input, for stored blocks and the trailer
+STATIC
+VOID
+InflateAlign(
+    INFLATE_STATE *State
+) {
+    InflateBits(State, State->BitCount & 7);
+    State->In -= State->BitCount / 8;
+    State->Bits = 0;
+    State->BitCount = 0;
+}
+
+// Decode one symbol; INFLATE_INVALID if the bits are no code of the table
+STATIC
+UINT32
+InflateDecode(
+    INFLATE_STATE *State,
+    CONST INFLATE_TABLE *Table
+) {
+    if (State->BitCount < INFLATE_MAX_BITS) {
+        InflateRefill(State);
+    }
+
+    UINT16 Entry = Table->Fast[State->Bits & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (Entry != 0 && (UINT32)(Entry & 0xF) <= State->BitCount) {
+        State->Bits = RShiftU64(State->Bits, Entry & 0xF);
+        State->BitCount -= Entry & 0xF;
+        return Entry >> 4;
+    }
+
+    // Codes are stored most significant bit first, so build the code up
+    // bit by bit until it falls inside the range of its length
+    INT32 Code = 0;
+    INT32 First = 0;
+    INT32 Index = 0;
+    for (UINT32 Length = 1; Length <= INFLATE_MAX_BITS && Length <= State->BitCount; Length++) {
+        INT32 Count = Table->Count[Length];
+
+        Code |= (INT32)(RShiftU64(State->Bits, Length - 1) & 1);
+        if (Code - First < Count) {
+            State->Bits = RShiftU64(State->Bits, Length);
+            State->BitCount -= Length;
+            return Table->Symbol[Index + Code - First];
+        }
+        Index += Count;
+        First = (First + Count) << 1;
+        Code <<= 1;
+    }
+
+    State->Overrun = TRUE;
+    return INFLATE_INVALID;
+}
+
+// Build the decoding table of a code from its code lengths. Over-subscribed
+// codes are rejected; incomplete ones are allowed, as deflate permits a
+// lone distance code, and their unused patterns decode as invalid.
+STATIC
+EFI_STATUS
+InflateBuildTable(
+    INFLATE_TABLE *Table,
+    CONST UINT8 *Lengths,
+    UINT32 SymbolCount
+) {
+    UINT16 Offsets[INFLATE_MAX_BITS + 2];
+    INT32 Left = 1;
+
+    ZeroMem(Table->Count, sizeof(Table->Count));
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        Table->Count[Lengths[Symbol]]++;
+    }
+    Table->Count[0] = 0;
+
+    for (UINT32 Length = 1; Length <= INFLATE_MAX_BITS; Length++) {
+        Left = (Left << 1) - Table->Count[Length];
+        if (Left < 0) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+    }
+
+    Offsets[1] = 0;
+    for (UINT32 Length = 1; Length <= INFLATE_MAX_BITS; Length++) {
+        Offsets[Length + 1] = Offsets[Length] + Table->Count[Length];
+    }
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        if (Lengths[Symbol] != 0) {
+            Table->Symbol[Offsets[Lengths[Symbol]]++] = (UINT16)Symbol;
+        }
+    }
+
+    // Canonical codes are handed out in Symbol order; each short code fills
+    // every table slot whose low bits are the code reversed
+    ZeroMem(Table->Fast, sizeof(Table->Fast));
+    UINT32 Code = 0;
+    UINT32 Index = 0;
+    for (UINT32 Length = 1; Length <= INFLATE_FAST_BITS; Length++) {
+        for (UINT32 Count = 0; Count < Table->Count[Length]; Count++, Code++, Index++) {
+            UINT32 Reversed = 0;
+
+            for (UINT32 Bit = 0; Bit < Length; Bit++) {
+                Reversed |= ((Code >> Bit) & 1) << (Length - 1 - Bit);
+            }
+            for (UINT32 Slot = Reversed; Slot < (1 << INFLATE_FAST_BITS); Slot += 1 << Length) {
+                Table->Fast[Slot] = (UINT16)((Table->Symbol[Index] << 4) | Length);
+            }
+        }
+        Code <<= 1;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Decode the literals and matches of one Huffman-coded block
+STATIC
+EFI_STATUS
+InflateCodes(
+    INFLATE_STATE *State,
+    CONST INFLATE_TABLE *LiteralLength,
+    CONST INFLATE_TABLE *Distance
+) {
+    for (;;) {
+        UINT32 Symbol = InflateDecode(State, LiteralLength);
+
+        if (Symbol < 256) {
+            if (State->Out == State->OutEnd) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+            *State->Out++ = (UINT8)Symbol;
+            continue;
+        }
+        if (Symbol == 256) {
+            return State->Overrun ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+        }
+
+        Symbol -= 257;
+        if (Symbol >= ARRAY_SIZE(mLengthBase)) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        UINTN Length = mLengthBase[Symbol] + InflateBits(State, mLengthExtra[Symbol]);
+
+        Symbol = InflateDecode(State, Distance);
+        if (Symbol >= INFLATE_DIST_CODES) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        UINTN Back = mDistanceBase[Symbol] + InflateBits(State, mDistanceExtra[Symbol]);
+
+        if (State->Overrun || Back > (UINTN)(State->Out - State->OutStart) ||
+            Length > (UINTN)(State->OutEnd - State->Out)) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        CopyMatch(State->Out, Back, Length);
+        State->Out += Length;
+    }
+}
+
+// A block stored without compression
+STATIC
+EFI_STATUS
+InflateStored(
+    INFLATE_STATE *State
+) {
+    InflateAlign(State);
+    if (State->InEnd - State->In < 4) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINTN Length = State->In[0] | (State->In[1] << 8);
+    UINTN Complement = State->In[2] | (State->In[3] << 8);
+    State->In += 4;
+
+    if (Length != (~Complement & 0xFFFF) ||
+        Length > (UINTN)(State->InEnd - State->In) ||
+        Length > (UINTN)(State->OutEnd - State->Out)) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    CopyMem(State->Out, State->In, Length);
+    State->In += Length;
+    State->Out += Length;
+    return EFI_SUCCESS;
+}
+
+// A block coded with the fixed Huffman codes of RFC 1951
+STATIC
+EFI_STATUS
+InflateFixed(
+    INFLATE_STATE *State
+) {
+    INFLATE_TABLE LiteralLength;
+    INFLATE_TABLE Distance;
+    UINT8 Lengths[INFLATE_LITLEN_CODES];
+
+    SetMem(Lengths, 144, 8);
+    SetMem(Lengths + 144, 112, 9);
+    SetMem(Lengths + 256, 24, 7);
+    SetMem(Lengths + 280, 8, 8);
+    InflateBuildTable(&LiteralLength, Lengths, INFLATE_LITLEN_CODES);
+
+    SetMem(Lengths, INFLATE_DIST_CODES, 5);
+    InflateBuildTable(&Distance, Lengths, INFLATE_DIST_CODES);
+
+    return InflateCodes(State, &LiteralLength, &Distance);
+}
+
+// A block that carries its own Huffman codes, themselves Huffman coded
+STATIC
+EFI_STATUS
+InflateDynamic(
+    INFLATE_STATE *State
+) {
+    INFLATE_TABLE LiteralLength;
+    INFLATE_TABLE Distance;
+    UINT8 Lengths[286 + INFLATE_DIST_CODES];
+    UINT8 CodeLengths[19];
+    EFI_STATUS Status;
+
+    UINT32 LiteralCount = InflateBits(State, 5) + 257;
+    UINT32 DistanceCount = InflateBits(State, 5) + 1;
+    UINT32 CodeLengthCount = InflateBits(State, 4) + 4;
+    if (LiteralCount > 286 || DistanceCount > INFLATE_DIST_CODES) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    ZeroMem(CodeLengths, sizeof(CodeLengths));
+    for (UINT32 Index = 0; Index < CodeLengthCount; Index++) {
+        CodeLengths[mCodeLengthOrder[Index]] = (UINT8)InflateBits(State, 3);
+    }
+
+    // The code length code is short lived, so it borrows the distance table
+    Status = InflateBuildTable(&Distance, CodeLengths, ARRAY_SIZE(CodeLengths));
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT32 Total = LiteralCount + DistanceCount;
+    for (UINT32 Index = 0; Index < Total;) {
+        UINT32 Symbol = InflateDecode(State, &Distance);
+        UINT32 Repeat;
+        UINT8 Value = 0;
+
+        if (Symbol < 16) {
+            Lengths[Index++] = (UINT8)Symbol;
+            continue;
+        }
+        if (Symbol == 16) {
+            if (Index == 0) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+            Value = Lengths[Index - 1];
+            Repeat = 3 + InflateBits(State, 2);
+        } else if (Symbol == 17) {
+            Repeat = 3 + InflateBits(State, 3);
+        } else if (Symbol == 18) {
+            Repeat = 11 + InflateBits(State, 7);
+        } else {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        if (Repeat > Total - Index) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        SetMem(Lengths + Index, Repeat, Value);
+        Index += Repeat;
+    }
+
+    // A block without an end-of-block code could never finish
+    if (State->Overrun || Lengths[256] == 0) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    Status = InflateBuildTable(&LiteralLength, Lengths, LiteralCount);
+    if (!EFI_ERROR(Status)) {
+        Status = InflateBuildTable(&Distance, Lengths + LiteralCount, DistanceCount);
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    return InflateCodes(State, &LiteralLength, &Distance);
+}
+
+// Adler-32 of the decompressed data, as the zlib trailer stores it
+STATIC
+UINT32
+Adler32(
+    CONST UINT8 *Data,
+    UINTN Length
+) {
+    UINT32 A = 1;
+    UINT32 B = 0;
+
+    // 5552 bytes is the most that cannot overflow B before the reduction
+    while (Length > 0) {
+        UINTN Block = MIN(Length, 5552);
+
+        Length -= Block;
+        while (Block-- > 0) {
+            A += *Data++;
+            B += A;
+        }
+        A %= 65521;
+        B %= 65521;
+    }
+    return (B << 16) | A;
+}
+
+// Decompress a zlib stream (RFC 1950 around RFC 1951 deflate) into a
+// buffer of DestinationSize bytes. The stream must end within the buffer
+// and match its Adler-32 trailer; *DecompressedSize returns the bytes
+// produced. Nothing is allocated, so chunks can be decoded concurrently.
+EFI_STATUS HfsZlibDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+) {
+    CONST UINT8 *Input = Source;
+    INFLATE_STATE State;
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Final = 0;
+
+    *DecompressedSize = 0;
+
+    // Deflate with a window of at most 32 KiB and no preset dictionary
+    if (SourceSize < 6 || (Input[0] & 0x0F) != 8 || (Input[0] >> 4) > 7 ||
+        ((Input[0] << 8) | Input[1]) % 31 != 0 || (Input[1] & 0x20) != 0) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    ZeroMem(&State, sizeof(State));
+    State.In = Input + 2;
+    State.InEnd = Input + SourceSize;
+    State.Out = Destination;
+    State.OutStart = Destination;
+    State.OutEnd = State.Out + DestinationSize;
+
+    while (!Final && !EFI_ERROR(Status)) {
+        Final = InflateBits(&State, 1);
+
+        switch (InflateBits(&State, 2)) {
+        case 0:
+            Status = InflateStored(&State);
+            break;
+        case 1:
+            Status = InflateFixed(&State);
+            break;
+        case 2:
+            Status = InflateDynamic(&State);
+            break;
+        default:
+            Status = EFI_VOLUME_CORRUPTED;
+            break;
+        }
+
+        if (State.Overrun) {
+            Status = EFI_VOLUME_CORRUPTED;
+        }
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    InflateAlign(&State);
+    if (State.InEnd - State.In < 4 ||
+        HFS_BE32(State.In) != Adler32(State.OutStart, (UINTN)(State.Out - State.OutStart))) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    *DecompressedSize = (UINTN)(State.Out - State.OutStart);
+    return EFI_SUCCESS;
+}
+
+// Decompress an LZVN stream into a buffer of DestinationSize bytes. Each
+// opcode carries up to three literals and a match, or a longer run of
+// either; matches may reuse the previous distance. Decoding stops at the
+// end-of-stream opcode or the end of the input.
+EFI_STATUS HfsLzvnDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+) {
+    CONST UINT8 *In = Source;
+    CONST UINT8 *InEnd = In + SourceSize;
+    UINT8 *Out = Destination;
+    UINT8 *OutStart = Destination;
+    UINT8 *OutEnd = Out + DestinationSize;
+    UINTN Distance = 0;
+
+    *DecompressedSize = 0;
+
+    while (In < InEnd) {
+        UINT8 Opcode = In[0];
+        UINTN OpcodeSize = 1;
+        UINTN Literals = 0;
+        UINTN Match = 0;
+
+        if (Opcode == 0x06) {
+            break;  // End of stream
+        }
+        if (Opcode == 0x0E || Opcode == 0x16) {
+            In++;   // No operation
+            continue;
+        }
+
+        if (Opcode >= 0xF0) {
+            // Match at the previous distance: 1111MMMM, or 11110000 and a length byte
+            if (Opcode == 0xF0) {
+                OpcodeSize = 2;
+                Match = (InEnd - In >= 2) ? In[1] + 16 : 0;
+            } else {
+                Match = Opcode & 0x0F;
+            }
+        } else if (Opcode >= 0xE0) {
+            // Literals only: 1110LLLL, or 11100000 and a length byte
+            if (Opcode == 0xE0) {
+                OpcodeSize = 2;
+                Literals = (InEnd - In >= 2) ? In[1] + 16 : 0;
+            } else {
+                Literals = Opcode & 0x0F;
+            }
+        } else if ((Opcode & 0xF0) == 0x70 || (Opcode & 0xF0) == 0xD0) {
+            return EFI_VOLUME_CORRUPTED;
+        } else if ((Opcode & 0xE0) == 0xA0) {
+            // Medium distance: 101LLMMM DDDDDDMM DDDDDDDD
+            OpcodeSize = 3;
+            if (InEnd - In < 3) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+            UINT32 Operand = In[1] | (In[2] << 8);
+            Literals = (Opcode >> 3) & 3;
+            Match = (((Opcode & 7) << 2) | (Operand & 3)) + 3;
+            Distance = Operand >> 2;
+        } else {
+            // LLMMMDDD: a small distance in the low bits and a byte, a large
+            // one in two bytes (DDD = 7), or the previous one (DDD = 6)
+            Literals = Opcode >> 6;
+            Match = ((Opcode >> 3) & 7) + 3;
+            if ((Opcode & 7) == 6) {
+                if (Literals == 0) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+            } else if ((Opcode & 7) == 7) {
+                OpcodeSize = 3;
+                if (InEnd - In < 3) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+                Distance = In[1] | (In[2] << 8);
+            } else {
+                OpcodeSize = 2;
+                if (InEnd - In < 2) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+                Distance = ((Opcode & 7) << 8) | In[1];
+            }
+        }
+
+        if ((UINTN)(InEnd - In) < OpcodeSize + Literals || Literals > (UINTN)(OutEnd - Out)) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        In += OpcodeSize;
+        CopyMem(Out, In, Literals);
+        In += Literals;
+        Out += Literals;
+
+        if (Match != 0) {
+            if (Distance == 0 || Distance > (UINTN)(Out - OutStart) || Match > (UINTN)(OutEnd - Out)) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+            CopyMatch(Out, Distance, Match);
+            Out += Match;
+        }
+    }
+
+    *DecompressedSize = (UINTN)(Out - OutStart);
+    return EFI_SUCCESS;
+}
+
+#define LZFSE_END_MAGIC          0x24787662  // 'bvx$'
+#define LZFSE_RAW_MAGIC          0x2D787662  // 'bvx-'
+#define LZFSE_V1_MAGIC           0x31787662  // 'bvx1'
+#define LZFSE_V2_MAGIC           0x32787662  // 'bvx2'
+#define LZFSE_LZVN_MAGIC         0x6E787662  // 'bvxn'
+#define LZFSE_V2_HEADER_SIZE     32          // Before the frequency tables
+#define LZFSE_L_SYMBOLS          20
+#define LZFSE_M_SYMBOLS          20
+#define LZFSE_D_SYMBOLS          64
+#define LZFSE_LITERAL_SYMBOLS    256
+#define LZFSE_L_STATE_BITS       6
+#define LZFSE_M_STATE_BITS       6
+#define LZFSE_D_STATE_BITS       8
+#define LZFSE_LITERAL_STATE_BITS 10
+#define LZFSE_MATCHES_PER_BLOCK  10000
+#define LZFSE_LITERALS_PER_BLOCK (4 * LZFSE_MATCHES_PER_BLOCK)
+#define LZFSE_FREQUENCIES        (LZFSE_L_SYMBOLS + LZFSE_M_SYMBOLS + LZFSE_D_SYMBOLS + LZFSE_LITERAL_SYMBOLS)
+
+// Literal, match length and distance symbols stand for a base value plus
+// that many extra bits
+STATIC CONST UINT8 mLzfseLExtra[LZFSE_L_SYMBOLS] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 5, 8
+};
+STATIC CONST UINT32 mLzfseLBase[LZFSE_L_SYMBOLS] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 20, 28, 60
+};
+STATIC CONST UINT8 mLzfseMExtra[LZFSE_M_SYMBOLS] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 5, 8, 11
+};
+STATIC CONST UINT32 mLzfseMBase[LZFSE_M_SYMBOLS] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 24, 56, 312
+};
+STATIC CONST UINT8 mLzfseDExtra[LZFSE_D_SYMBOLS] = {
+    0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+    8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15
+};
+STATIC CONST UINT32 mLzfseDBase[LZFSE_D_SYMBOLS] = {
+    0, 1, 2, 3, 4, 6, 8, 10, 12, 16, 20, 24, 28, 36, 44, 52,
+    60, 76, 92, 108, 124, 156, 188, 220, 252, 316, 380, 444, 508, 636, 764, 892,
+    1020, 1276, 1532, 1788, 2044, 2556, 3068, 3580, 4092, 5116, 6140, 7164, 8188, 10236, 12284, 14332,
+    16380, 20476, 24572, 28668, 32764, 40956, 49148, 57340, 65532, 81916, 98300, 114684, 131068, 163836, 196604, 229372
+};
+
+// One state of a finite state entropy decoding table. Decoding a state
+// reads TotalBits bits: the high ones, plus Delta, are the next state and
+// the low ValueBits ones are added to Base for the decoded value.
+typedef struct {
+    UINT8 TotalBits;
+    UINT8 ValueBits;
+    UINT16 Delta;
+    UINT32 Base;
+} LZFSE_ENTRY;
+
+// Decoding tables and literals of one compressed block. It is too large
+// for a firmware stack, so a stream allocates it at its first such block.
+typedef struct {
+    LZFSE_ENTRY L[1 << LZFSE_L_STATE_BITS];
+    LZFSE_ENTRY M[1 << LZFSE_M_STATE_BITS];
+    LZFSE_ENTRY D[1 << LZFSE_D_STATE_BITS];
+    LZFSE_ENTRY Literal[1 << LZFSE_LITERAL_STATE_BITS];
+    UINT16 Frequency[LZFSE_FREQUENCIES];  // L, M, D, then literal symbols
+    UINT8 Literals[LZFSE_LITERALS_PER_BLOCK];
+} LZFSE_WORKSPACE;
+
+// Entropy coded payloads are read backwards from their end, most
+// significant bit first
+typedef struct {
+    CONST UINT8 *In;       // Bytes below In are still to be loaded
+    CONST UINT8 *InStart;  // Lowest byte the stream may load
+    UINT64 Bits;
+    UINT32 BitCount;
+    BOOLEAN Overrun;
+} LZFSE_READER;
+
+// Little-endian value of Count (at most 8) bytes
+STATIC
+UINT64
+LzfseLoad(
+    CONST UINT8 *Bytes,
+    UINTN Count
+) {
+    UINT64 Value = 0;
+
+    while (Count-- > 0) {
+        Value = LShiftU64(Value, 8) | Bytes[Count];
+    }
+    return Value;
+}
+
+// Start reading a payload that ends at End. The last byte holds 8 + Extra
+// valid bits (Extra is -7 to 0); the stream may load bytes down to Start.
+STATIC
+EFI_STATUS
+LzfseInitReader(
+    LZFSE_READER *Reader,
+    CONST UINT8 *Start,
+    CONST UINT8 *End,
+    INT32 Extra
+) {
+    UINTN Count = (Extra == 0) ? 7 : 8;
+
+    if ((UINTN)(End - Start) < Count) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    Reader->In = End - Count;
+    Reader->InStart = Start;
+    Reader->Bits = LzfseLoad(Reader->In, Count);
+    Reader->BitCount = (UINT32)(8 * Count + Extra);
+    Reader->Overrun = FALSE;
+
+    return (RShiftU64(Reader->Bits, Reader->BitCount) != 0) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+}
+
+// Load whole bytes until at least 56 bits are buffered
+STATIC
+VOID
+LzfseRefill(
+    LZFSE_READER *Reader
+) {
+    UINT32 Count = (63 - Reader->BitCount) & ~7U;
+
+    if ((UINTN)(Reader->In - Reader->InStart) < Count / 8) {
+        Reader->Overrun = TRUE;
+        return;
+    }
+    Reader->In -= Count / 8;
+    Reader->Bits = LShiftU64(Reader->Bits, Count) | LzfseLoad(Reader->In, Count / 8);
+    Reader->BitCount += Count;
+}
+
+// Decode one value and move State on. A refill before each group of
+// values keeps enough bits buffered for the group.
+STATIC
+UINT32
+LzfseDecode(
+    LZFSE_READER *Reader,
+    UINT16 *State,
+    CONST LZFSE_ENTRY *Table
+) {
+    CONST LZFSE_ENTRY *Entry = &Table[*State];
+
+    if (Entry->TotalBits > Reader->BitCount) {
+        Reader->Overrun = TRUE;
+        return 0;
+    }
+    Reader->BitCount -= Entry->TotalBits;
+    UINT32 Bits = (UINT32)RShiftU64(Reader->Bits, Reader->BitCount);
+    Reader->Bits &= LShiftU64(1, Reader->BitCount) - 1;
+
+    *State = (UINT16)(Entry->Delta + (Bits >> Entry->ValueBits));
+    return Entry->Base + (Bits & ((1U << Entry->ValueBits) - 1));
+}
+
+// Build the decoding table of 1 << StateBits states for one alphabet. Each
+// symbol owns as many consecutive states as its frequency; states left
+// over by frequencies that do not add up decode as symbol 0.
+STATIC
+EFI_STATUS
+LzfseBuildTable(
+    UINT32 StateBits,
+    UINT32 SymbolCount,
+    CONST UINT16 *Frequency,
+    CONST UINT8 *Extra,
+    CONST UINT32 *Base,
+    LZFSE_ENTRY *Table
+) {
+    UINT32 States = 1U << StateBits;
+    UINT32 Used = 0;
+
+    ZeroMem(Table, States * sizeof(LZFSE_ENTRY));
+
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        UINT32 Count = Frequency[Symbol];
+
+        if (Count == 0) {
+            continue;
+        }
+        if (Count > States - Used) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        // States are read with K bits, or K - 1 above the first J0
+        UINT32 K = StateBits - (UINT32)HighBitSet64(Count);
+        UINT32 J0 = ((2 * States) >> K) - Count;
+        for (UINT32 J = 0; J < Count; J++) {
+            LZFSE_ENTRY *Entry = &Table[Used + J];
+
+            Entry->ValueBits = (Extra != NULL) ? Extra[Symbol] : 0;
+            Entry->Base = (Base != NULL) ? Base[Symbol] : Symbol;
+            if (J < J0) {
+                Entry->TotalBits = (UINT8)(K + Entry->ValueBits);
+                Entry->Delta = (UINT16)(((Count + J) << K) - States);
+            } else {
+                Entry->TotalBits = (UINT8)(K - 1 + Entry->ValueBits);
+                Entry->Delta = (UINT16)((J - J0) << (K - 1));
+            }
+        }
+        Used += Count;
+    }
+    return EFI_SUCCESS;
+}
+
+// Read the frequency tables of a version 2 header: one variable-length
+// code per symbol, least significant bit first
+STATIC
+EFI_STATUS
+LzfseReadFrequencies(
+    CONST UINT8 *In,
+    CONST UINT8 *InEnd,
+    UINT16 *Frequency
+) {
+    STATIC CONST UINT8 CodeBits[32] = {
+        2, 3, 2, 5, 2, 3, 2, 8, 2, 3, 2, 5, 2, 3, 2, 14,
+        2, 3, 2, 5, 2, 3, 2, 8, 2, 3, 2, 5, 2, 3, 2, 14
+    };
+    STATIC CONST UINT8 CodeValue[32] = {
+        0, 2, 1, 4, 0, 3, 1, 0, 0, 2, 1, 5, 0, 3, 1, 0,
+        0, 2, 1, 6, 0, 3, 1, 0, 0, 2, 1, 7, 0, 3, 1, 0
+    };
+    UINT32 Bits = 0;
+    UINT32 BitCount = 0;
+
+    for (UINT32 Index = 0; Index < LZFSE_FREQUENCIES; Index++) {
+        while (In < InEnd && BitCount <= 24) {
+            Bits |= (UINT32)*In++ << BitCount;
+            BitCount += 8;
+        }
+
+        UINT32 Code = Bits & 31;
+        UINT32 Length = CodeBits[Code];
+        if (Length > BitCount) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        if (Length == 8) {
+            Frequency[Index] = (UINT16)(8 + ((Bits >> 4) & 0xF));
+        } else if (Length == 14) {
+            Frequency[Index] = (UINT16)(24 + ((Bits >> 4) & 0x3FF));
+        } else {
+            Frequency[Index] = CodeValue[Code];
+        }
+        Bits >>= Length;
+        BitCount -= Length;
+    }
+
+    // The tables fill the header up to its last byte
+    return (In != InEnd || BitCount >= 8) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+}
+
+// Decode a version 2 compressed block of RawSize bytes at In into Out.
+// Its literals are decoded first, four interleaved streams into the
+// workspace, and then the (literal count, match length, distance) triples
+// that place them and copy the matches.
+STATIC
+EFI_STATUS
+LzfseDecodeBlock(
+    LZFSE_WORKSPACE *Work,
+    CONST UINT8 *In,
+    UINTN InSize,
+    UINT8 *OutStart,
+    UINT8 *Out,
+    UINT32 RawSize,
+    UINTN *BlockSize
+) {
+    UINT64 Fields0 = ReadUnaligned64((CONST UINT64 *)(In + 8));
+    UINT64 Fields1 = ReadUnaligned64((CONST UINT64 *)(In + 16));
+    UINT64 Fields2 = ReadUnaligned64((CONST UINT64 *)(In + 24));
+    UINT32 LiteralCount = (UINT32)Fields0 & 0xFFFFF;
+    UINT32 LiteralPayload = (UINT32)RShiftU64(Fields0, 20) & 0xFFFFF;
+    UINT32 MatchCount = (UINT32)RShiftU64(Fields0, 40) & 0xFFFFF;
+    INT32 LiteralExtra = (INT32)(RShiftU64(Fields0, 60) & 7) - 7;
+    UINT32 LmdPayload = (UINT32)RShiftU64(Fields1, 40) & 0xFFFFF;
+    INT32 LmdExtra = (INT32)(RShiftU64(Fields1, 60) & 7) - 7;
+    UINT32 HeaderSize = (UINT32)Fields2;
+    UINT16 LState = (UINT16)(RShiftU64(Fields2, 32) & 0x3FF);
+    UINT16 MState = (UINT16)(RShiftU64(Fields2, 42) & 0x3FF);
+    UINT16 DState = (UINT16)(RShiftU64(Fields2, 52) & 0x3FF);
+    UINT16 LiteralState[4];
+    LZFSE_READER Reader;
+    EFI_STATUS Status;
+
+    for (UINT32 Stream = 0; Stream < 4; Stream++) {
+        LiteralState[Stream] = (UINT16)(RShiftU64(Fields1, 10 * Stream) & 0x3FF);
+    }
+
+    if (HeaderSize < LZFSE_V2_HEADER_SIZE || HeaderSize > InSize ||
+        (UINT64)LiteralPayload + LmdPayload > InSize - HeaderSize ||
+        LiteralCount > LZFSE_LITERALS_PER_BLOCK || LiteralCount % 4 != 0 || MatchCount > LZFSE_MATCHES_PER_BLOCK ||
+        LState >= (1 << LZFSE_L_STATE_BITS) || MState >= (1 << LZFSE_M_STATE_BITS) || DState >= (1 << LZFSE_D_STATE_BITS)) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    Status = LzfseReadFrequencies(In + LZFSE_V2_HEADER_SIZE, In + HeaderSize, Work->Frequency);
+    if (!EFI_ERROR(Status)) {
+        Status = LzfseBuildTable(LZFSE_L_STATE_BITS, LZFSE_L_SYMBOLS, Work->Frequency, mLzfseLExtra, mLzfseLBase, Work->L);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = LzfseBuildTable(LZFSE_M_STATE_BITS, LZFSE_M_SYMBOLS, Work->Frequency + LZFSE_L_SYMBOLS, mLzfseMExtra, mLzfseMBase, Work->M);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = LzfseBuildTable(LZFSE_D_STATE_BITS, LZFSE_D_SYMBOLS, Work->Frequency + LZFSE_L_SYMBOLS + LZFSE_M_SYMBOLS, mLzfseDExtra, mLzfseDBase, Work->D);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = LzfseBuildTable(LZFSE_LITERAL_STATE_BITS, LZFSE_LITERAL_SYMBOLS, Work->Frequency + LZFSE_L_SYMBOLS + LZFSE_M_SYMBOLS + LZFSE_D_SYMBOLS, NULL, NULL, Work->Literal);
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // Both streams may load bytes back into the header, as padding
+    CONST UINT8 *Payload = In + HeaderSize;
+    Status = LzfseInitReader(&Reader, In, Payload + LiteralPayload, LiteralExtra);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    for (UINT32 Index = 0; Index < LiteralCount; Index += 4) {
+        LzfseRefill(&Reader);
+        for (UINT32 Stream = 0; Stream < 4; Stream++) {
+            Work->Literals[Index + Stream] = (UINT8)LzfseDecode(&Reader, &LiteralState[Stream], Work->Literal);
+        }
+    }
+    if (Reader.Overrun) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    CONST UINT8 *Lmd = Payload + LiteralPayload;
+    Status = LzfseInitReader(&Reader, In, Lmd + LmdPayload, LmdExtra);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CONST UINT8 *Literal = Work->Literals;
+    CONST UINT8 *LiteralEnd = Work->Literals + LiteralCount;
+    UINT8 *BlockOut = Out;
+    UINT8 *OutEnd = Out + RawSize;
+    UINTN Distance = 0;
+
+    for (UINT32 Index = 0; Index < MatchCount; Index++) {
+        LzfseRefill(&Reader);
+        UINT32 Literals = LzfseDecode(&Reader, &LState, Work->L);
+        UINT32 Match = LzfseDecode(&Reader, &MState, Work->M);
+        UINT32 NewDistance = LzfseDecode(&Reader, &DState, Work->D);
+
+        // A zero distance repeats the previous one
+        if (NewDistance != 0) {
+            Distance = NewDistance;
+        }
+        if (Reader.Overrun || Literals > (UINTN)(LiteralEnd - Literal) || Literals > (UINTN)(OutEnd - Out)) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        CopyMem(Out, Literal, Literals);
+        Literal += Literals;
+        Out += Literals;
+
+        if (Match != 0) {
+            if (Distance == 0 || Distance > (UINTN)(Out - OutStart) || Match > (UINTN)(OutEnd - Out)) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+            CopyMatch(Out, Distance, Match);
+            Out += Match;
+        }
+    }
+
+    if (Out != BlockOut + RawSize) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    *BlockSize = HeaderSize + LiteralPayload + LmdPayload;
+    return EFI_SUCCESS;
+}
+
+// Decompress an LZFSE stream into a buffer of DestinationSize bytes. The
+// stream is a series of blocks, each behind a magic number: stored bytes,
+// an LZVN stream, or literals and matches coded with finite state entropy
+// (version 2 headers only), up to the end-of-stream block. The entropy
+// coded blocks need a workspace of about 50 KiB, which is allocated for
+// the call.
+EFI_STATUS HfsLzfseDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+) {
+    CONST UINT8 *In = Source;
+    CONST UINT8 *InEnd = In + SourceSize;
+    UINT8 *Out = Destination;
+    UINT8 *OutStart = Destination;
+    UINT8 *OutEnd = Out + DestinationSize;
+    LZFSE_WORKSPACE *Work = NULL;
+    EFI_STATUS Status = EFI_VOLUME_CORRUPTED;
+
+    *DecompressedSize = 0;
+
+    while (InEnd - In >= 4) {
+        UINT32 Magic = ReadUnaligned32((CONST UINT32 *)In);
+        UINTN Remaining = (UINTN)(InEnd - In);
+        UINTN BlockSize;
+        UINT32 RawSize;
+
+        if (Magic == LZFSE_END_MAGIC) {
+            Status = EFI_SUCCESS;
+            break;
+        }
+
+        if (Remaining < 8) {
+            break;
+        }
+        RawSize = ReadUnaligned32((CONST UINT32 *)(In + 4));
+        if (RawSize > (UINTN)(OutEnd - Out)) {
+            break;
+        }
+
+        if (Magic == LZFSE_RAW_MAGIC) {
+            if (Remaining - 8 < RawSize) {
+                break;
+            }
+            CopyMem(Out, In + 8, RawSize);
+            BlockSize = 8 + (UINTN)RawSize;
+        } else if (Magic == LZFSE_LZVN_MAGIC) {
+            UINTN Decompressed;
+
+            if (Remaining < 12 || Remaining - 12 < ReadUnaligned32((CONST UINT32 *)(In + 8))) {
+                break;
+            }
+            BlockSize = 12 + (UINTN)ReadUnaligned32((CONST UINT32 *)(In + 8));
+            Status = HfsLzvnDecompress(In + 12, BlockSize - 12, Out, RawSize, &Decompressed);
+            if (EFI_ERROR(Status) || Decompressed != RawSize) {
+                Status = EFI_VOLUME_CORRUPTED;
+                break;
+            }
+            Status = EFI_VOLUME_CORRUPTED;
+        } else if (Magic == LZFSE_V2_MAGIC) {
+            if (Remaining < LZFSE_V2_HEADER_SIZE) {
+                break;
+            }
+            if (Work == NULL) {
+                Work = AllocatePool(sizeof(LZFSE_WORKSPACE));
+                if (Work == NULL) {
+                    Status = EFI_OUT_OF_RESOURCES;
+                    break;
+                }
+            }
+            Status = LzfseDecodeBlock(Work, In, Remaining, OutStart, Out, RawSize, &BlockSize);
+            if (EFI_ERROR(Status)) {
+                break;
+            }
+            Status = EFI_VOLUME_CORRUPTED;
+        } else {
+            // Version 1 headers, which current encoders no longer write,
+            // are not decoded
+            Status = (Magic == LZFSE_V1_MAGIC) ? EFI_UNSUPPORTED : EFI_VOLUME_CORRUPTED;
+            break;
+        }
+
+        In += BlockSize;
+        Out += RawSize;
+    }
+
+    if (Work != NULL) {
+        FreePool(Work);
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    *DecompressedSize = (UINTN)(Out - OutStart);
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,243 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusDirectory.c
+//  This file is the c source for HFS+ directory enumeration
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Decode the parts of a file or folder record a listing needs. The name
+// lives in the key and is left to the caller.
+VOID HfsDirectoryEntryFromRecord(
+    HFSPLUS_VOLUME *Volume,
+    CONST VOID *CatalogRecord,
+    HFSPLUS_DIR_ENTRY *Entry
+) {
+    // Files and folders share the layout up to the Finder info
+    CONST HFSPlusCatalogFile *File = CatalogRecord;
+
+    Entry->RecordType = HFS_BE16(&File->recordType);
+    Entry->NodeID = HFS_BE32(&File->fileID);
+    Entry->Compressed = FALSE;
+    Entry->FinderFlags = HFS_BE16(File->userInfo + 8);
+    Entry->CreateDate = HFS_BE32(&File->createDate);
+    Entry->ContentModDate = HFS_BE32(&File->contentModDate);
+    Entry->AccessDate = HFS_BE32(&File->accessDate);
+    Entry->Size = 0;
+    Entry->PhysicalSize = 0;
+
+    if (Entry->RecordType == HFSPLUS_FILE_RECORD) {
+        Entry->Compressed = (File->permissions.ownerFlags & HFSPLUS_UF_COMPRESSED) != 0;
+        HFSPlusForkData Stored;
+
+        // Records are only 2-byte aligned, so read the fork by byte offset
+        HfsForkDataFromDisk(&File->dataFork, &Stored);
+        Entry->Size = Stored.logicalSize;
+        if (Entry->Compressed) {
+            HfsForkDataFromDisk(&File->resourceFork, &Stored);
+        }
+        Entry->PhysicalSize = (UINT64)Stored.totalBlocks * Volume->AllocationBlockSize;
+    }
+}
+
+// Position an iterator on the first child of a folder: the folder's thread
+// record is keyed (FolderID, "") and sorts before every child
+EFI_STATUS HfsOpenDirectory(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FolderID,
+    BOOLEAN Prefetch,
+    HFSPLUS_DIR_ITERATOR *Iterator
+) {
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    HFSPLUS_CATALOG_SEARCH Search = { FolderID, L"", 0 };
+    UINT8 *Record;
+    UINT16 RecordLength;
+    UINT8 *Data;
+
+    EFI_STATUS Status = PrepareBTree(Volume, &Volume->CatalogFile, HFSPLUS_CATALOG_FILE_ID, Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    ZeroMem(Iterator, sizeof(*Iterator));
+    Status = SearchBTree(Tree, Volume->CatalogCompare, &Search, &Iterator->Cursor, &Record, &RecordLength);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = GetBTreeRecordData(Record, RecordLength, &Data, NULL);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    if (HFS_BE16(Data) != HFSPLUS_FOLDER_THREAD_RECORD) {
+        return EFI_NOT_FOUND;  // A file, which has no children
+    }
+
+    Iterator->Volume = Volume;
+    Iterator->FolderID = FolderID;
+    Iterator->Prefetch = Prefetch;
+    Iterator->Cursor.RecordIndex++;
+    return EFI_SUCCESS;
+}
+
+// Read ahead the leaves after the cursor's leaf, with one device read, when
+// the folder continues past it, i.e. the leaf's last record is still one of
+// the folder's children. Failures are left for the walk to report.
+STATIC
+VOID
+PrefetchDirectoryLeaves(
+    HFSPLUS_DIR_ITERATOR *Iterator
+) {
+    HFSPLUS_VOLUME *Volume = Iterator->Volume;
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    UINT8 *Node;
+    UINT8 *Record;
+    UINT16 RecordLength;
+
+    Iterator->PrefetchedLeaf = Iterator->Cursor.NodeNumber;
+
+    if (EFI_ERROR(NodeCacheGet(&Volume->NodeCache, Tree, Iterator->Cursor.NodeNumber, FALSE, &Node))) {
+        return;
+    }
+
+    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Node;
+    UINT32 NextLeaf = SwapBytes32(NodeDesc->fLink);
+    UINT16 NumRecords = SwapBytes16(NodeDesc->numRecords);
+    if (NextLeaf == 0 || NumRecords == 0 ||
+        EFI_ERROR(GetBTreeRecord(Tree, Node, NumRecords - 1, &Record, &RecordLength)) ||
+        RecordLength < 6 || HFS_BE32(Record + 2) != Iterator->FolderID) {
+        return;
+    }
+
+    NodeCachePrefetch(&Volume->NodeCache, Tree, NextLeaf, HFSPLUS_DIR_PREFETCH_NODES);
+}
+
+// Decode the next children of a folder into Entries. On input EntryCount is
+// the room in Entries, on output the number filled; fewer than asked (zero
+// once the folder is exhausted) means the listing is complete. Entries come
+// in catalog order, which is name order; the root's private folders are
+// skipped.
+EFI_STATUS HfsReadDirectory(
+    HFSPLUS_DIR_ITERATOR *Iterator,
+    HFSPLUS_DIR_ENTRY *Entries,
+    UINTN *EntryCount
+) {
+    HFS_STATS_START(Start);
+    HFSPLUS_VOLUME *Volume = Iterator->Volume;
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    UINTN Capacity = *EntryCount;
+    UINTN Count = 0;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    // The root holds the private folders behind hard links, which are
+    // never listed
+    if (Iterator->FolderID == HFSPLUS_ROOT_FOLDER_ID && !Iterator->Done) {
+        Status = HfsFindPrivateFolders(Volume);
+    }
+
+    while (Count < Capacity && !Iterator->Done && !EFI_ERROR(Status)) {
+        UINT8 *Record;
+        UINT16 RecordLength;
+        UINT8 *Data;
+        UINT16 DataLength;
+
+        Status = ReadBTreeCursor(Tree, &Iterator->Cursor, &Record, &RecordLength);
+        if (Status == EFI_NOT_FOUND) {
+            Iterator->Done = TRUE;  // The folder's children end the catalog
+            Status = EFI_SUCCESS;
+            break;
+        }
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        HFSPlusCatalogKey *Key = (HFSPlusCatalogKey *)Record;
+        if (RecordLength < 8 || HFS_BE32(&Key->parentID) != Iterator->FolderID) {
+            Iterator->Done = TRUE;
+            break;
+        }
+
+        Status = GetBTreeRecordData(Record, RecordLength, &Data, &DataLength);
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        // Only the folder's own thread record is keyed by its ID; children
+        // are all file and folder records
+        UINT16 RecordType = HFS_BE16(Data);
+        UINTN NameLength = HFS_BE16(&Key->nodeName.length);
+        if (!((RecordType == HFSPLUS_FILE_RECORD && DataLength >= sizeof(HFSPlusCatalogFile)) ||
+              (RecordType == HFSPLUS_FOLDER_RECORD && DataLength >= sizeof(HFSPlusCatalogFolder))) ||
+            NameLength > HFSPLUS_MAX_NAME_LENGTH || 8 + 2 * NameLength > RecordLength) {
+            Status = EFI_VOLUME_CORRUPTED;
+            break;
+        }
+
+        if (Iterator->FolderID == HFSPLUS_ROOT_FOLDER_ID && RecordType == HFSPLUS_FOLDER_RECORD) {
+            UINT32 FolderID = HFS_BE32(&((HFSPlusCatalogFolder *)Data)->folderID);
+            if (FolderID == Volume->Links.FilePrivateID || FolderID == Volume->Links.FolderPrivateID) {
+                Iterator->Cursor.RecordIndex++;
+                continue;
+            }
+        }
+
+        HFSPLUS_DIR_ENTRY *Entry = &Entries[Count];
+        for (UINTN Index = 0; Index < NameLength; Index++) {
+            Entry->Name[Index] = HFS_BE16(&Key->nodeName.unicode[Index]);
+        }
+        Entry->Name[NameLength] = 0;
+        Entry->NameLength = (UINT16)NameLength;
+
+        // A hard link is listed under its own name with what its inode
+        // holds. Resolving it may read other nodes; the cursor copes.
+        VOID *Resolved = Data;
+        Status = HfsResolveLink(Volume, &Resolved);
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+        HfsDirectoryEntryFromRecord(Volume, Resolved, Entry);
+        Count++;
+
+        // The record is no longer needed, so the cache may be refilled
+        if (Iterator->Prefetch && Iterator->Cursor.NodeNumber != Iterator->PrefetchedLeaf) {
+            PrefetchDirectoryLeaves(Iterator);
+        }
+        Iterator->Cursor.RecordIndex++;
+    }
+
+    *EntryCount = Count;
+    HFS_STATS_API(Volume, HfsStatsReadDirectory, Start, Status);
+    return Status;
+}
@@ -0,0 +1,716 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusDriver.c
+//  This file is the c source for the HFS+ SimpleFileSystem driver
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+#define HFSPLUS_FINDER_INVISIBLE  0x4000  // fdFlags / frFlags kIsInvisible
+#define HFSPLUS_DRIVER_DIR_BATCH  16      // Children decoded per catalog step by a folder Read
+
+// Days from 1904-01-01 (the HFS+ epoch) to 1970-01-01
+#define HFSPLUS_EPOCH_DAYS_BEFORE_1970  24107
+
+STATIC EFI_FILE_PROTOCOL mHfsPlusFileTemplate;
+
+// Convert an HFS+ date (seconds since 1904-01-01 GMT) to EFI_TIME
+STATIC
+VOID
+HfsTimeToEfiTime(
+    UINT32 Seconds,
+    EFI_TIME *Time
+) {
+    // Civil date from a day count, with years starting on March 1st so
+    // the leap day falls at the end
+    INT64 Days = (INT64)(Seconds / 86400) - HFSPLUS_EPOCH_DAYS_BEFORE_1970 + 719468;
+    UINT32 Era = (UINT32)(Days / 146097);
+    UINT32 DayOfEra = (UINT32)(Days - (INT64)Era * 146097);
+    UINT32 YearOfEra = (DayOfEra - DayOfEra / 1460 + DayOfEra / 36524 - DayOfEra / 146096) / 365;
+    UINT32 DayOfYear = DayOfEra - (365 * YearOfEra + YearOfEra / 4 - YearOfEra / 100);
+    UINT32 MonthIndex = (5 * DayOfYear + 2) / 153;
+    UINT32 Month = (MonthIndex < 10) ? MonthIndex + 3 : MonthIndex - 9;
+    UINT32 SecondOfDay = Seconds % 86400;
+
+    ZeroMem(Time, sizeof(*Time));
+    Time->Year = (UINT16)(YearOfEra + Era * 400 + (Month <= 2));
+    Time->Month = (UINT8)Month;
+    Time->Day = (UINT8)(DayOfYear - (153 * MonthIndex + 2) / 5 + 1);
+    Time->Hour = (UINT8)(SecondOfDay / 3600);
+    Time->Minute = (UINT8)(SecondOfDay / 60 % 60);
+    Time->Second = (UINT8)(SecondOfDay % 60);
+    Time->TimeZone = 0;  // HFS+ dates are GMT
+}
+
+// Copy a node's name from its thread record into Name, which holds
+// HFSPLUS_MAX_NAME_LENGTH + 1 characters. The root folder's name is the
+// volume label.
+STATIC
+EFI_STATUS
+HfsNodeName(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 NodeID,
+    CHAR16 *Name,
+    UINTN *NameLength
+) {
+    VOID *Record;
+
+    EFI_STATUS Status = TraverseCatalogBTree(Volume, NodeID, L"", &Record);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    HFSPlusCatalogThread *Thread = (HFSPlusCatalogThread *)Record;
+    UINT16 RecordType = HFS_BE16(&Thread->recordType);
+    UINTN Length = HFS_BE16(&Thread->nodeName.length);
+    if ((RecordType != HFSPLUS_FOLDER_THREAD_RECORD && RecordType != HFSPLUS_FILE_THREAD_RECORD) ||
+        Length > HFSPLUS_MAX_NAME_LENGTH) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    for (UINTN Index = 0; Index < Length; Index++) {
+        Name[Index] = HFS_BE16(&Thread->nodeName.unicode[Index]);
+    }
+    Name[Length] = 0;
+    *NameLength = Length;
+    return EFI_SUCCESS;
+}
+
+// Create a file handle for a path relative to FolderID. The catalog record
+// is copied out of the node cache before the fork is opened.
+STATIC
+EFI_STATUS
+HfsOpenNode(
+    HFSPLUS_FILE_SYSTEM *FileSystem,
+    UINT32 FolderID,
+    CONST CHAR16 *Path,
+    HFSPLUS_FILE **File
+) {
+    HFSPLUS_VOLUME *Volume = FileSystem->Volume;
+    UINT32 NodeID;
+    UINT32 LinkID;
+    VOID *Record;
+
+    EFI_STATUS Status = ResolveRelativePath(Volume, FolderID, Path, &NodeID, &Record, &LinkID);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT16 RecordType = HFS_BE16(Record);
+    if (RecordType != HFSPLUS_FILE_RECORD && RecordType != HFSPLUS_FOLDER_RECORD) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    HFSPLUS_FILE *NewFile = AllocateZeroPool(sizeof(HFSPLUS_FILE));
+    if (NewFile == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    NewFile->Signature = HFSPLUS_FILE_SIGNATURE;
+    NewFile->File = mHfsPlusFileTemplate;
+    NewFile->FileSystem = FileSystem;
+    NewFile->NodeID = NodeID;
+    NewFile->LinkID = LinkID;
+    NewFile->Directory = (RecordType == HFSPLUS_FOLDER_RECORD);
+    CopyMem(&NewFile->Record, Record, NewFile->Directory ? sizeof(HFSPlusCatalogFolder) : sizeof(HFSPlusCatalogFile));
+
+    if (!NewFile->Directory) {
+        Status = HfsOpenFile(Volume, &NewFile->Record, &NewFile->Fork);
+        if (EFI_ERROR(Status)) {
+            FreePool(NewFile);
+            return Status;
+        }
+    }
+
+    FileSystem->OpenFiles++;
+    *File = NewFile;
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.Open: paths are relative to This unless they start
+// with a separator. The volume is read-only.
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileOpen(
+    IN EFI_FILE_PROTOCOL *This,
+    OUT EFI_FILE_PROTOCOL **NewHandle,
+    IN CHAR16 *FileName,
+    IN UINT64 OpenMode,
+    IN UINT64 Attributes
+) {
+    HFSPLUS_FILE *Parent = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+    HFSPLUS_FILE *File;
+
+    if (NewHandle == NULL || FileName == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (OpenMode != EFI_FILE_MODE_READ) {
+        return ((OpenMode & ~(EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE)) != 0)
+            ? EFI_INVALID_PARAMETER
+            : EFI_WRITE_PROTECTED;
+    }
+
+    // A file has no children to be relative to
+    if (!Parent->Directory && FileName[0] != L'\\' && FileName[0] != L'/') {
+        return EFI_NOT_FOUND;
+    }
+
+    EFI_STATUS Status = HfsOpenNode(Parent->FileSystem, Parent->NodeID, FileName, &File);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    *NewHandle = &File->File;
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.Close
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileClose(
+    IN EFI_FILE_PROTOCOL *This
+) {
+    HFSPLUS_FILE *File = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+
+    HfsCloseFork(File->Fork);
+    if (File->Entries != NULL) {
+        FreePool(File->Entries);
+    }
+    File->FileSystem->OpenFiles--;
+    File->Signature = 0;
+    FreePool(File);
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.Delete: nothing can be deleted, but the handle is
+// closed as the specification requires
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileDelete(
+    IN EFI_FILE_PROTOCOL *This
+) {
+    HfsFileClose(This);
+    return EFI_WARN_DELETE_FAILURE;
+}
+
+// Fill an EFI_FILE_INFO from a decoded catalog entry
+STATIC
+EFI_STATUS
+HfsFillFileInfo(
+    CONST HFSPLUS_DIR_ENTRY *Entry,
+    UINT64 FileSize,
+    UINTN *BufferSize,
+    VOID *Buffer
+) {
+    UINTN Size = SIZE_OF_EFI_FILE_INFO + (Entry->NameLength + 1) * sizeof(CHAR16);
+    if (*BufferSize < Size) {
+        *BufferSize = Size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    EFI_FILE_INFO *Info = Buffer;
+    ZeroMem(Info, Size);
+    Info->Size = Size;
+    Info->FileSize = FileSize;
+    Info->PhysicalSize = Entry->PhysicalSize;
+    Info->Attribute = EFI_FILE_READ_ONLY;
+    if (Entry->RecordType == HFSPLUS_FOLDER_RECORD) {
+        Info->Attribute |= EFI_FILE_DIRECTORY;
+    }
+    if ((Entry->FinderFlags & HFSPLUS_FINDER_INVISIBLE) != 0) {
+        Info->Attribute |= EFI_FILE_HIDDEN;
+    }
+
+    HfsTimeToEfiTime(Entry->CreateDate, &Info->CreateTime);
+    HfsTimeToEfiTime(Entry->AccessDate, &Info->LastAccessTime);
+    HfsTimeToEfiTime(Entry->ContentModDate, &Info->ModificationTime);
+    CopyMem(Info->FileName, Entry->Name, (Entry->NameLength + 1) * sizeof(CHAR16));
+
+    *BufferSize = Size;
+    return EFI_SUCCESS;
+}
+
+// Read for folders: the EFI_FILE_INFO of the next child, or nothing once
+// all have been returned. Children are decoded a batch at a time from one
+// catalog walk; an entry that does not fit the buffer is kept for the
+// next call.
+STATIC
+EFI_STATUS
+HfsReadDirectoryEntry(
+    HFSPLUS_FILE *File,
+    UINTN *BufferSize,
+    VOID *Buffer
+) {
+    HFSPLUS_VOLUME *Volume = File->FileSystem->Volume;
+    EFI_STATUS Status;
+
+    if (File->Entries == NULL) {
+        File->Entries = AllocatePool(HFSPLUS_DRIVER_DIR_BATCH * sizeof(HFSPLUS_DIR_ENTRY));
+        if (File->Entries == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+    }
+
+    if (File->Iterator.Volume == NULL) {
+        Status = HfsOpenDirectory(Volume, File->NodeID, TRUE, &File->Iterator);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        File->EntryCount = 0;
+        File->EntryIndex = 0;
+    }
+
+    if (File->EntryIndex == File->EntryCount) {
+        File->EntryCount = HFSPLUS_DRIVER_DIR_BATCH;
+        File->EntryIndex = 0;
+        Status = HfsReadDirectory(&File->Iterator, File->Entries, &File->EntryCount);
+        if (EFI_ERROR(Status)) {
+            File->EntryCount = 0;
+            return Status;
+        }
+        if (File->EntryCount == 0) {
+            *BufferSize = 0;
+            return EFI_SUCCESS;
+        }
+    }
+
+    // A compressed file's size is only in its decmpfs header. A header that
+    // cannot be decoded only costs that entry its size; the listing goes on
+    // with the stored size unless the device itself failed.
+    HFSPLUS_DIR_ENTRY *Entry = &File->Entries[File->EntryIndex];
+    UINT64 FileSize = Entry->Size;
+    if (Entry->Compressed) {
+        Status = DecmpfsGetSize(Volume, Entry->NodeID, &FileSize);
+        if (Status == EFI_DEVICE_ERROR) {
+            return Status;
+        }
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_WARN, "No decmpfs size for HFS+ file %u: %r\n", Entry->NodeID, Status));
+            FileSize = Entry->Size;
+        }
+    }
+
+    Status = HfsFillFileInfo(Entry, FileSize, BufferSize, Buffer);
+    if (!EFI_ERROR(Status)) {
+        File->EntryIndex++;
+    }
+    return Status;
+}
+
+// EFI_FILE_PROTOCOL.Read. Files are read from the current position through
+// the open fork, which continues from its extent cursor.
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileRead(
+    IN EFI_FILE_PROTOCOL *This,
+    IN OUT UINTN *BufferSize,
+    OUT VOID *Buffer
+) {
+    HFSPLUS_FILE *File = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+
+    if (BufferSize == NULL || (Buffer == NULL && *BufferSize != 0)) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (File->Directory) {
+        return HfsReadDirectoryEntry(File, BufferSize, Buffer);
+    }
+
+    if (File->Position > File->Fork->Size) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    EFI_STATUS Status = HfsReadAt(File->Fork, File->Position, BufferSize, Buffer);
+    if (EFI_ERROR(Status)) {
+        *BufferSize = 0;
+        return Status;
+    }
+
+    File->Position += *BufferSize;
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.Write
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileWrite(
+    IN EFI_FILE_PROTOCOL *This,
+    IN OUT UINTN *BufferSize,
+    IN VOID *Buffer
+) {
+    return EFI_ACCESS_DENIED;  // Every handle is opened read-only
+}
+
+// EFI_FILE_PROTOCOL.SetPosition. MAX_UINT64 moves to the end of a file;
+// directories can only be rewound.
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileSetPosition(
+    IN EFI_FILE_PROTOCOL *This,
+    IN UINT64 Position
+) {
+    HFSPLUS_FILE *File = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+
+    if (File->Directory) {
+        if (Position != 0) {
+            return EFI_UNSUPPORTED;
+        }
+        ZeroMem(&File->Iterator, sizeof(File->Iterator));
+        File->EntryCount = 0;
+        File->EntryIndex = 0;
+        return EFI_SUCCESS;
+    }
+
+    File->Position = (Position == MAX_UINT64) ? File->Fork->Size : Position;
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.GetPosition
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileGetPosition(
+    IN EFI_FILE_PROTOCOL *This,
+    OUT UINT64 *Position
+) {
+    HFSPLUS_FILE *File = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+
+    if (Position == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (File->Directory) {
+        return EFI_UNSUPPORTED;
+    }
+
+    *Position = File->Position;
+    return EFI_SUCCESS;
+}
+
+// Fill an EFI_FILE_INFO for an open handle from its catalog record
+STATIC
+EFI_STATUS
+HfsGetFileInfo(
+    HFSPLUS_FILE *File,
+    UINTN *BufferSize,
+    VOID *Buffer
+) {
+    HFSPLUS_VOLUME *Volume = File->FileSystem->Volume;
+    HFSPLUS_DIR_ENTRY Entry;
+    UINTN NameLength = 0;
+
+    HfsDirectoryEntryFromRecord(Volume, &File->Record, &Entry);
+
+    // The root's name is the volume label, which the root has no use for.
+    // A file opened through a hard link goes by the link's name, not the
+    // inode's.
+    if (File->NodeID != HFSPLUS_ROOT_FOLDER_ID) {
+        UINT32 NameID = (File->LinkID != 0) ? File->LinkID : File->NodeID;
+        EFI_STATUS Status = HfsNodeName(Volume, NameID, Entry.Name, &NameLength);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+    Entry.Name[NameLength] = 0;
+    Entry.NameLength = (UINT16)NameLength;
+
+    return HfsFillFileInfo(&Entry, File->Directory ? 0 : File->Fork->Size, BufferSize, Buffer);
+}
+
+// Fill an EFI_FILE_SYSTEM_INFO from the mounted volume
+STATIC
+EFI_STATUS
+HfsGetFileSystemInfo(
+    HFSPLUS_FILE *File,
+    UINTN *BufferSize,
+    VOID *Buffer
+) {
+    HFSPLUS_VOLUME *Volume = File->FileSystem->Volume;
+    CHAR16 Label[HFSPLUS_MAX_NAME_LENGTH + 1];
+    UINTN LabelLength;
+
+    EFI_STATUS Status = HfsNodeName(Volume, HFSPLUS_ROOT_FOLDER_ID, Label, &LabelLength);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINTN Size = SIZE_OF_EFI_FILE_SYSTEM_INFO + (LabelLength + 1) * sizeof(CHAR16);
+    if (*BufferSize < Size) {
+        *BufferSize = Size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    EFI_FILE_SYSTEM_INFO *Info = Buffer;
+    ZeroMem(Info, Size);
+    Info->Size = Size;
+    Info->ReadOnly = TRUE;
+    Info->VolumeSize = (UINT64)Volume->TotalBlocks * Volume->AllocationBlockSize;
+    Info->FreeSpace = (UINT64)Volume->FreeBlocks * Volume->AllocationBlockSize;
+    Info->BlockSize = Volume->AllocationBlockSize;
+    CopyMem(Info->VolumeLabel, Label, (LabelLength + 1) * sizeof(CHAR16));
+
+    *BufferSize = Size;
+    return EFI_SUCCESS;
+}
+
+// EFI_FILE_PROTOCOL.GetInfo: EFI_FILE_INFO and EFI_FILE_SYSTEM_INFO
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileGetInfo(
+    IN EFI_FILE_PROTOCOL *This,
+    IN EFI_GUID *InformationType,
+    IN OUT UINTN *BufferSize,
+    OUT VOID *Buffer
+) {
+    HFSPLUS_FILE *File = CR(This, HFSPLUS_FILE, File, HFSPLUS_FILE_SIGNATURE);
+
+    if (InformationType == NULL || BufferSize == NULL || (Buffer == NULL && *BufferSize != 0)) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (CompareGuid(InformationType, &gEfiFileInfoGuid)) {
+        return HfsGetFileInfo(File, BufferSize, Buffer);
+    }
+    if (CompareGuid(InformationType, &gEfiFileSystemInfoGuid)) {
+        return HfsGetFileSystemInfo(File, BufferSize, Buffer);
+    }
+    return EFI_UNSUPPORTED;
+}
+
+// EFI_FILE_PROTOCOL.SetInfo
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileSetInfo(
+    IN EFI_FILE_PROTOCOL *This,
+    IN EFI_GUID *InformationType,
+    IN UINTN BufferSize,
+    IN VOID *Buffer
+) {
+    return EFI_WRITE_PROTECTED;
+}
+
+// EFI_FILE_PROTOCOL.Flush
+STATIC
+EFI_STATUS
+EFIAPI
+HfsFileFlush(
+    IN EFI_FILE_PROTOCOL *This
+) {
+    return EFI_ACCESS_DENIED;  // Read-only handles have nothing to flush
+}
+
+STATIC EFI_FILE_PROTOCOL mHfsPlusFileTemplate = {
+    EFI_FILE_PROTOCOL_REVISION,
+    HfsFileOpen,
+    HfsFileClose,
+    HfsFileDelete,
+    HfsFileRead,
+    HfsFileWrite,
+    HfsFileGetPosition,
+    HfsFileSetPosition,
+    HfsFileGetInfo,
+    HfsFileSetInfo,
+    HfsFileFlush
+};
+
+// EFI_SIMPLE_FILE_SYSTEM_PROTOCOL.OpenVolume: a handle on the root folder
+STATIC
+EFI_STATUS
+EFIAPI
+HfsOpenVolume(
+    IN EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *This,
+    OUT EFI_FILE_PROTOCOL **Root
+) {
+    HFSPLUS_FILE_SYSTEM *FileSystem = CR(This, HFSPLUS_FILE_SYSTEM, SimpleFileSystem, HFSPLUS_FILE_SYSTEM_SIGNATURE);
+    HFSPLUS_FILE *File;
+
+    if (Root == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    EFI_STATUS Status = HfsOpenNode(FileSystem, HFSPLUS_ROOT_FOLDER_ID, L"\\", &File);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    *Root = &File->File;
+    return EFI_SUCCESS;
+}
+
+// Driver binding: a device is supported when it holds an HFS+ or HFSX
+// volume, or an HFS wrapper whose embedded volume starts on a device block
+STATIC
+EFI_STATUS
+EFIAPI
+HfsPlusDriverSupported(
+    IN EFI_DRIVER_BINDING_PROTOCOL *This,
+    IN EFI_HANDLE ControllerHandle,
+    IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath OPTIONAL
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    HFSPLUS_PARTITION Partition;
+
+    EFI_STATUS Status = gBS->OpenProtocol(ControllerHandle, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo,
+                                          This->DriverBindingHandle, ControllerHandle, EFI_OPEN_PROTOCOL_BY_DRIVER);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ProbeHfsPlusDevice(BlockIo, &Partition);
+    if (!EFI_ERROR(Status) && Partition.VolumeOffset % BlockIo->Media->BlockSize != 0) {
+        Status = EFI_UNSUPPORTED;
+    }
+
+    gBS->CloseProtocol(ControllerHandle, &gEfiBlockIoProtocolGuid, This->DriverBindingHandle, ControllerHandle);
+    return EFI_ERROR(Status) ? EFI_UNSUPPORTED : EFI_SUCCESS;
+}
+
+// Driver binding: mount the volume once and publish it
+STATIC
+EFI_STATUS
+EFIAPI
+HfsPlusDriverStart(
+    IN EFI_DRIVER_BINDING_PROTOCOL *This,
+    IN EFI_HANDLE ControllerHandle,
+    IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath OPTIONAL
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    HFSPLUS_FILE_SYSTEM *FileSystem = NULL;
+
+    EFI_STATUS Status = gBS->OpenProtocol(ControllerHandle, &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo,
+                                          This->DriverBindingHandle, ControllerHandle, EFI_OPEN_PROTOCOL_BY_DRIVER);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    FileSystem = AllocateZeroPool(sizeof(HFSPLUS_FILE_SYSTEM));
+    if (FileSystem == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Failed;
+    }
+
+    FileSystem->Signature = HFSPLUS_FILE_SYSTEM_SIGNATURE;
+    FileSystem->Handle = ControllerHandle;
+    FileSystem->BlockIo = BlockIo;
+    FileSystem->SimpleFileSystem.Revision = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
+    FileSystem->SimpleFileSystem.OpenVolume = HfsOpenVolume;
+
+    Status = MountHfsPlusVolume(BlockIo, &FileSystem->Volume);
+    if (EFI_ERROR(Status)) {
+        goto Failed;
+    }
+
+    Status = gBS->InstallProtocolInterface(&FileSystem->Handle, &gEfiSimpleFileSystemProtocolGuid,
+                                           EFI_NATIVE_INTERFACE, &FileSystem->SimpleFileSystem);
+    if (EFI_ERROR(Status)) {
+        goto Failed;
+    }
+
+    DEBUG((DEBUG_INFO, "HFS+ volume published on handle %p\n", ControllerHandle));
+    return EFI_SUCCESS;
+
+Failed:
+    if (FileSystem != NULL) {
+        UnmountHfsPlusVolume(FileSystem->Volume);
+        FreePool(FileSystem);
+    }
+    gBS->CloseProtocol(ControllerHandle, &gEfiBlockIoProtocolGuid, This->DriverBindingHandle, ControllerHandle);
+    return Status;
+}
+
+// Driver binding: unpublish and unmount. A volume with open files stays.
+STATIC
+EFI_STATUS
+EFIAPI
+HfsPlusDriverStop(
+    IN EFI_DRIVER_BINDING_PROTOCOL *This,
+    IN EFI_HANDLE ControllerHandle,
+    IN UINTN NumberOfChildren,
+    IN EFI_HANDLE *ChildHandleBuffer OPTIONAL
+) {
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *SimpleFileSystem;
+
+    EFI_STATUS Status = gBS->OpenProtocol(ControllerHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&SimpleFileSystem,
+                                          This->DriverBindingHandle, ControllerHandle, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+    if (EFI_ERROR(Status)) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    HFSPLUS_FILE_SYSTEM *FileSystem = CR(SimpleFileSystem, HFSPLUS_FILE_SYSTEM, SimpleFileSystem, HFSPLUS_FILE_SYSTEM_SIGNATURE);
+    if (FileSystem->OpenFiles != 0) {
+        return EFI_ACCESS_DENIED;
+    }
+
+    Status = gBS->UninstallProtocolInterface(ControllerHandle, &gEfiSimpleFileSystemProtocolGuid, &FileSystem->SimpleFileSystem);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UnmountHfsPlusVolume(FileSystem->Volume);
+    gBS->CloseProtocol(ControllerHandle, &gEfiBlockIoProtocolGuid, This->DriverBindingHandle, ControllerHandle);
+    FileSystem->Signature = 0;
+    FreePool(FileSystem);
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_DRIVER_BINDING_PROTOCOL mHfsPlusDriverBinding = {
+    HfsPlusDriverSupported,
+    HfsPlusDriverStart,
+    HfsPlusDriverStop,
+    0x10,
+    NULL,
+    NULL
+};
+
+// Driver entry point: install the driver binding on the image handle
+EFI_STATUS
+EFIAPI
+HfsPlusDriverEntryPoint(
+    IN EFI_HANDLE ImageHandle,
+    IN EFI_SYSTEM_TABLE *SystemTable
+) {
+    mHfsPlusDriverBinding.ImageHandle = ImageHandle;
+    mHfsPlusDriverBinding.DriverBindingHandle = ImageHandle;
+
+    return gBS->InstallProtocolInterface(&mHfsPlusDriverBinding.DriverBindingHandle, &gEfiDriverBindingProtocolGuid,
+                                         EFI_NATIVE_INTERFACE, &mHfsPlusDriverBinding);
+}
@@ -0,0 +1,470 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusExtents.c
+//  This file is the c source for the HFS+ extent gathering and batched fork reads
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Search key of an extents overflow lookup
+typedef struct {
+    UINT32 FileID;
+    UINT8 ForkType;
+    UINT32 StartBlock;
+} EXTENT_SEARCH_KEY;
+
+// Compare a search key with an on-disk extents overflow key. Keys sort by
+// file ID, then fork type, then the first fork block they describe.
+STATIC
+INTN
+CompareExtentKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+) {
+    CONST EXTENT_SEARCH_KEY *Search = (CONST EXTENT_SEARCH_KEY *)Context;
+    CONST HFSPlusExtentKey *ExtentKey = (CONST HFSPlusExtentKey *)Key;
+
+    if (RecordLength < sizeof(HFSPlusExtentKey)) {
+        return -1;  // Never matched
+    }
+
+    UINT32 KeyFileID = HFS_BE32(&ExtentKey->fileID);
+    UINT32 KeyStartBlock = HFS_BE32(&ExtentKey->startBlock);
+
+    if (Search->FileID != KeyFileID) {
+        return (Search->FileID < KeyFileID) ? -1 : 1;
+    }
+    if (Search->ForkType != ExtentKey->forkType) {
+        return (Search->ForkType < ExtentKey->forkType) ? -1 : 1;
+    }
+    if (Search->StartBlock != KeyStartBlock) {
+        return (Search->StartBlock < KeyStartBlock) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Append an extent to a growing list, merging it into the previous one when
+// the two are physically adjacent
+STATIC
+EFI_STATUS
+AppendExtent(
+    HFSPLUS_ARENA *Arena,
+    HFSPlusExtentDescriptor **Extents,
+    UINTN *ExtentCount,
+    UINTN *Capacity,
+    UINT32 StartBlock,
+    UINT32 BlockCount
+) {
+    if (*ExtentCount > 0) {
+        HFSPlusExtentDescriptor *Last = &(*Extents)[*ExtentCount - 1];
+
+        if ((UINT64)Last->startBlock + Last->blockCount == StartBlock &&
+            (UINT64)Last->blockCount + BlockCount <= MAX_UINT32) {
+            Last->blockCount += BlockCount;
+            return EFI_SUCCESS;
+        }
+    }
+
+    if (*ExtentCount == *Capacity) {
+        UINTN NewCapacity = *Capacity * 2;
+        HFSPlusExtentDescriptor *Grown;
+
+        // The outgrown scratch copy stays until the caller resets the arena
+        if (Arena != NULL) {
+            Grown = ArenaAlloc(Arena, NewCapacity * sizeof(HFSPlusExtentDescriptor));
+            if (Grown != NULL) {
+                CopyMem(Grown, *Extents, *Capacity * sizeof(HFSPlusExtentDescriptor));
+            }
+        } else {
+            Grown = ReallocatePool(
+                *Capacity * sizeof(HFSPlusExtentDescriptor),
+                NewCapacity * sizeof(HFSPlusExtentDescriptor),
+                *Extents
+            );
+        }
+        if (Grown == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        *Extents = Grown;
+        *Capacity = NewCapacity;
+    }
+
+    (*Extents)[*ExtentCount].startBlock = StartBlock;
+    (*Extents)[*ExtentCount].blockCount = BlockCount;
+    (*ExtentCount)++;
+    return EFI_SUCCESS;
+}
+
+// Build the complete extent list of a fork: the eight inline extents plus
+// every overflow record, collected with one descent of the extents B-tree
+// and a scan along the leaf chain. The list is in fork order with physically
+// adjacent extents merged. The caller frees it, or with Scratch it lives in
+// the volume's scratch arena until the caller's ArenaReset.
+EFI_STATUS GatherForkExtents(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    BOOLEAN Scratch,
+    HFSPlusExtentDescriptor **Extents,
+    UINTN *ExtentCount
+) {
+    UINT64 NeededBlocks = (ForkData->logicalSize + Volume->AllocationBlockSize - 1) / Volume->AllocationBlockSize;
+    UINT64 FoundBlocks = 0;
+    UINTN Capacity = 8;
+    HFSPLUS_ARENA *Arena = Scratch ? &Volume->Arena : NULL;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    *ExtentCount = 0;
+    *Extents = Scratch ? ArenaAlloc(Arena, Capacity * sizeof(HFSPlusExtentDescriptor))
+                       : AllocatePool(Capacity * sizeof(HFSPlusExtentDescriptor));
+    if (*Extents == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    for (UINT32 i = 0; i < 8 && FoundBlocks < NeededBlocks && ForkData->extents[i].blockCount != 0; i++) {
+        Status = AppendExtent(Arena, Extents, ExtentCount, &Capacity, ForkData->extents[i].startBlock, ForkData->extents[i].blockCount);
+        if (EFI_ERROR(Status)) {
+            goto Failed;
+        }
+        FoundBlocks += ForkData->extents[i].blockCount;
+    }
+
+    if (FoundBlocks >= NeededBlocks) {
+        return EFI_SUCCESS;
+    }
+
+    if (Volume->ExtentsFile.logicalSize == 0) {
+        DEBUG((DEBUG_ERROR, "File %u needs the extents overflow file, which is not available\n", FileID));
+        Status = EFI_NOT_FOUND;
+        goto Failed;
+    }
+
+    HFSPLUS_BTREE *Tree = &Volume->ExtentsTree;
+    Status = PrepareBTree(Volume, &Volume->ExtentsFile, HFSPLUS_EXTENTS_FILE_ID, Tree);
+    if (EFI_ERROR(Status)) {
+        goto Failed;
+    }
+
+    if (Tree->TreeDepth == 0) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Failed;
+    }
+
+    // One descent to the first record at or after the block the inline
+    // extents end at
+    EXTENT_SEARCH_KEY Search = { FileID, ForkType, (UINT32)FoundBlocks };
+    HFSPLUS_BTREE_CURSOR Cursor;
+    Status = SearchBTree(Tree, CompareExtentKey, &Search, &Cursor, NULL, NULL);
+    if (EFI_ERROR(Status) && Status != EFI_NOT_FOUND) {
+        goto Failed;
+    }
+
+    // Records of one fork are consecutive in key order, so walk forward
+    // through the leaf chain until the fork is covered
+    while (FoundBlocks < NeededBlocks) {
+        UINT8 *Record;
+        UINT16 RecordLength;
+
+        Status = ReadBTreeCursor(Tree, &Cursor, &Record, &RecordLength);
+        if (Status == EFI_NOT_FOUND) {
+            break;
+        }
+        if (EFI_ERROR(Status)) {
+            goto Failed;
+        }
+
+        CONST HFSPlusExtentKey *Key = (CONST HFSPlusExtentKey *)Record;
+        if (RecordLength < sizeof(HFSPlusExtentKey) || HFS_BE32(&Key->fileID) != FileID || Key->forkType != ForkType) {
+            break;
+        }
+
+        // Each record must continue exactly where the previous one ended
+        UINT8 *Data;
+        UINT16 DataLength;
+        Status = GetBTreeRecordData(Record, RecordLength, &Data, &DataLength);
+        if (EFI_ERROR(Status) || HFS_BE32(&Key->startBlock) != FoundBlocks || DataLength < 8 * sizeof(HFSPlusExtentDescriptor)) {
+            Status = EFI_VOLUME_CORRUPTED;
+            goto Failed;
+        }
+
+        for (UINT32 i = 0; i < 8 && FoundBlocks < NeededBlocks; i++) {
+            UINT32 StartBlock = HFS_BE32(Data + 8 * i);
+            UINT32 BlockCount = HFS_BE32(Data + 8 * i + 4);
+            if (BlockCount == 0) {
+                break;
+            }
+            Status = AppendExtent(Arena, Extents, ExtentCount, &Capacity, StartBlock, BlockCount);
+            if (EFI_ERROR(Status)) {
+                goto Failed;
+            }
+            FoundBlocks += BlockCount;
+        }
+
+        Cursor.RecordIndex++;
+    }
+
+    if (FoundBlocks < NeededBlocks) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Failed;
+    }
+
+    return EFI_SUCCESS;
+
+Failed:
+    if (!Scratch) {
+        FreePool(*Extents);
+    }
+    *Extents = NULL;
+    *ExtentCount = 0;
+    return Status;
+}
+
+// Find the Block I/O 2 instance on the handle that carries the volume's
+// Block I/O protocol, once per volume
+STATIC
+EFI_BLOCK_IO2_PROTOCOL *
+GetVolumeBlockIo2(
+    HFSPLUS_VOLUME *Volume
+) {
+    EFI_HANDLE *HandleBuffer;
+    UINTN HandleCount;
+
+    if (Volume->BlockIo2Probed) {
+        return Volume->BlockIo2;
+    }
+    Volume->BlockIo2Probed = TRUE;
+
+    EFI_STATUS Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &HandleCount, &HandleBuffer);
+    if (EFI_ERROR(Status)) {
+        return NULL;
+    }
+
+    for (UINTN Index = 0; Index < HandleCount; Index++) {
+        EFI_BLOCK_IO_PROTOCOL *BlockIo;
+        EFI_BLOCK_IO2_PROTOCOL *BlockIo2;
+
+        Status = gBS->HandleProtocol(HandleBuffer[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
+        if (EFI_ERROR(Status) || BlockIo != Volume->BlockIo) {
+            continue;
+        }
+
+        Status = gBS->HandleProtocol(HandleBuffer[Index], &gEfiBlockIo2ProtocolGuid, (VOID **)&BlockIo2);
+        if (!EFI_ERROR(Status)) {
+            Volume->BlockIo2 = BlockIo2;
+        }
+        break;
+    }
+
+    FreePool(HandleBuffer);
+    return Volume->BlockIo2;
+}
+
+STATIC
+INTN
+EFIAPI
+CompareIoRequest(
+    CONST VOID *Left,
+    CONST VOID *Right
+) {
+    UINT64 LeftLba = ((CONST HFSPLUS_IO_REQUEST *)Left)->Lba;
+    UINT64 RightLba = ((CONST HFSPLUS_IO_REQUEST *)Right)->Lba;
+
+    if (LeftLba == RightLba) {
+        return 0;
+    }
+    return (LeftLba < RightLba) ? -1 : 1;
+}
+
+// Issue the requests through Block I/O 2, keeping up to
+// HFSPLUS_IO_MAX_IN_FLIGHT of them queued. Completion is polled with
+// CheckEvent so this also works above TPL_APPLICATION. Statistics time
+// queued reads up to their submission only.
+STATIC
+EFI_STATUS
+ReadRequestsAsync(
+    HFSPLUS_VOLUME *Volume,
+    EFI_BLOCK_IO2_PROTOCOL *BlockIo2,
+    HFSPLUS_IO_REQUEST *Requests,
+    UINTN RequestCount,
+    UINT8 *Buffer
+) {
+    EFI_BLOCK_IO2_TOKEN Tokens[HFSPLUS_IO_MAX_IN_FLIGHT];
+    BOOLEAN Busy[HFSPLUS_IO_MAX_IN_FLIGHT];
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINTN Slots;
+
+    ZeroMem(Busy, sizeof(Busy));
+    for (Slots = 0; Slots < HFSPLUS_IO_MAX_IN_FLIGHT; Slots++) {
+        Tokens[Slots].TransactionStatus = EFI_SUCCESS;
+        if (EFI_ERROR(gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &Tokens[Slots].Event))) {
+            break;
+        }
+    }
+    if (Slots == 0) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    for (UINTN Index = 0; Index < RequestCount + Slots; Index++) {
+        UINTN Slot = Index % Slots;
+
+        // Retire the request that last used this slot
+        if (Busy[Slot]) {
+            while (gBS->CheckEvent(Tokens[Slot].Event) == EFI_NOT_READY) {
+            }
+            Busy[Slot] = FALSE;
+            if (EFI_ERROR(Tokens[Slot].TransactionStatus) && !EFI_ERROR(Status)) {
+                Status = Tokens[Slot].TransactionStatus;
+            }
+        }
+
+        if (Index >= RequestCount || EFI_ERROR(Status)) {
+            continue;
+        }
+
+        HFS_STATS_START(Start);
+        Status = BlockIo2->ReadBlocksEx(
+            BlockIo2,
+            BlockIo2->Media->MediaId,
+            Volume->StartLba + Requests[Index].Lba,
+            &Tokens[Slot],
+            Requests[Index].Length,
+            Buffer + Requests[Index].Offset
+        );
+        HFS_STATS_IO(Volume, HFSPLUS_TRACE_READ, Requests[Index].Lba, Requests[Index].Length, Start, Status);
+        Busy[Slot] = !EFI_ERROR(Status);
+    }
+
+    for (UINTN Slot = 0; Slot < Slots; Slot++) {
+        gBS->CloseEvent(Tokens[Slot].Event);
+    }
+    return Status;
+}
+
+// Read the first Length bytes of a fork described by a complete extent
+// list. The extents are cut into device requests of at most
+// HFSPLUS_IO_MAX_REQUEST bytes which are issued in disk order, through
+// Block I/O 2 when the device has it. Buffer must be large enough for
+// Length rounded up to whole device blocks.
+EFI_STATUS ReadExtentList(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Length,
+    VOID *Buffer
+) {
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 Wanted = (Length + DeviceBlockSize - 1) / DeviceBlockSize * DeviceBlockSize;
+    UINTN MaxRequest = MAX(HFSPLUS_IO_MAX_REQUEST - HFSPLUS_IO_MAX_REQUEST % DeviceBlockSize, DeviceBlockSize);
+    UINTN RequestCount = 0;
+    HFSPLUS_ARENA_MARK Mark;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Volume->DeviceBlocksPerAllocationBlock == 0) {
+        return EFI_UNSUPPORTED;
+    }
+
+    // Count the requests, then fill them in
+    for (UINTN Pass = 0; Pass < 2; Pass++) {
+        HFSPLUS_IO_REQUEST *Requests = NULL;
+        UINT64 Offset = 0;
+        UINTN Count = 0;
+
+        if (Pass == 1) {
+            if (RequestCount == 0) {
+                return EFI_SUCCESS;
+            }
+            ArenaMark(&Volume->Arena, &Mark);
+            Requests = ArenaAlloc(&Volume->Arena, RequestCount * sizeof(HFSPLUS_IO_REQUEST));
+            if (Requests == NULL) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+        }
+
+        for (UINTN i = 0; i < ExtentCount && Offset < Wanted; i++) {
+            UINT64 Lba = (UINT64)Extents[i].startBlock * Volume->DeviceBlocksPerAllocationBlock;
+            UINT64 Bytes = MIN((UINT64)Extents[i].blockCount * Volume->AllocationBlockSize, Wanted - Offset);
+
+            while (Bytes > 0) {
+                UINTN Chunk = (UINTN)MIN(Bytes, (UINT64)MaxRequest);
+                if (Requests != NULL) {
+                    Requests[Count].Lba = Lba;
+                    Requests[Count].Offset = Offset;
+                    Requests[Count].Length = Chunk;
+                }
+                Count++;
+                Lba += Chunk / DeviceBlockSize;
+                Offset += Chunk;
+                Bytes -= Chunk;
+            }
+        }
+
+        if (Pass == 0) {
+            if (Offset < Wanted) {
+                return EFI_VOLUME_CORRUPTED;  // Extents end before the data does
+            }
+            RequestCount = Count;
+            continue;
+        }
+
+        // Reading in disk order keeps the device streaming forward
+        HFSPLUS_IO_REQUEST Scratch;
+        QuickSort(Requests, RequestCount, sizeof(HFSPLUS_IO_REQUEST), CompareIoRequest, &Scratch);
+
+        EFI_BLOCK_IO2_PROTOCOL *BlockIo2 = GetVolumeBlockIo2(Volume);
+        if (BlockIo2 != NULL && RequestCount > 1) {
+            Status = ReadRequestsAsync(Volume, BlockIo2, Requests, RequestCount, Buffer);
+
+            // HfsReadDevice does this for the synchronous reads
+            for (UINTN i = 0; i < RequestCount && !EFI_ERROR(Status) && Volume->Journal.BlockCount != 0; i++) {
+                JournalOverlayRead(Volume, Requests[i].Lba, Requests[i].Length, (UINT8 *)Buffer + Requests[i].Offset);
+            }
+        } else {
+            for (UINTN i = 0; i < RequestCount && !EFI_ERROR(Status); i++) {
+                Status = HfsReadDevice(
+                    Volume,
+                    Requests[i].Lba,
+                    Requests[i].Length,
+                    (UINT8 *)Buffer + Requests[i].Offset
+                );
+            }
+        }
+
+        ArenaReset(&Volume->Arena, &Mark);
+    }
+
+    return Status;
+}
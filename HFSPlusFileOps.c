@@ -38,282 +38,1025 @@
 
 #include "HFSPlusFileOps.h"
 
-// Write file with fragmentation handling
-EFI_STATUS WriteFileWithFragmentation(
-    EFI_HANDLE ImageHandle,
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+// Map a fork-relative block number to a disk block through a list of
+// extents in fork order
+EFI_STATUS ExtentListBlockToDiskBlock(
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 ForkBlock,
+    UINT64 *DiskBlock,
+    UINT64 *ContiguousBlocks
+) {
+    for (UINTN i = 0; i < ExtentCount && Extents[i].blockCount != 0; i++) {
+        CONST HFSPlusExtentDescriptor *Extent = &Extents[i];
+
+        if (ForkBlock < Extent->blockCount) {
+            *DiskBlock = Extent->startBlock + ForkBlock;
+            if (ContiguousBlocks != NULL) {
+                *ContiguousBlocks = Extent->blockCount - ForkBlock;
+            }
+            return EFI_SUCCESS;
+        }
+
+        ForkBlock -= Extent->blockCount;
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+// Map a fork-relative block number to a disk block through the inline extents
+EFI_STATUS ForkBlockToDiskBlock(
     HFSPlusForkData *ForkData,
-    UINT32 TotalBlocks,
-    VOID *Data,
-    UINT64 DataSize,
-    HFSPlusForkData *AllocationFile,
-    HFSPlusForkData *ExtentOverflowFile
+    UINT64 ForkBlock,
+    UINT64 *DiskBlock,
+    UINT64 *ContiguousBlocks
 ) {
-    UINTN BlockSize = BlockIo->Media->BlockSize;
-    UINT32 RequiredBlocks = (DataSize + BlockSize - 1) / BlockSize;
+    return ExtentListBlockToDiskBlock(ForkData->extents, 8, ForkBlock, DiskBlock, ContiguousBlocks);
+}
 
-    UINT32 *FreeBlocks = AllocateZeroPool(RequiredBlocks * sizeof(UINT32));
-    if (FreeBlocks == NULL) {
-        return EFI_OUT_OF_RESOURCES;
+// Map a device-block aligned byte offset of a fork to the device block that
+// holds it, through the fork's complete extent list. Extents count
+// allocation blocks, which may span several device blocks.
+EFI_STATUS ForkOffsetToDeviceBlock(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Offset,
+    UINT64 *Lba
+) {
+    UINT64 DiskBlock;
+
+    if (Volume->DeviceBlocksPerAllocationBlock == 0 || Offset % Volume->DeviceBlockSize != 0) {
+        return EFI_UNSUPPORTED;
     }
 
-    EFI_STATUS Status = FindFreeBlocks(BlockIo, AllocationFile, TotalBlocks, RequiredBlocks, FreeBlocks);
+    EFI_STATUS Status = ExtentListBlockToDiskBlock(Extents, ExtentCount, Offset / Volume->AllocationBlockSize, &DiskBlock, NULL);
     if (EFI_ERROR(Status)) {
-        FreePool(FreeBlocks);
         return Status;
     }
 
-    UINT8 *DataPtr = (UINT8 *)Data;
-    UINT64 TotalBytesWritten = 0;
-    UINT32 ExtentIndex = 0;
+    *Lba = DiskBlock * Volume->DeviceBlocksPerAllocationBlock + (Offset % Volume->AllocationBlockSize) / Volume->DeviceBlockSize;
+    return EFI_SUCCESS;
+}
+
+// Read an arbitrary byte range of a fork of Size bytes, given its complete
+// extent list. Extents are in allocation blocks; device-block aligned parts
+// are read in place and unaligned edges go through a single bounce block.
+EFI_STATUS ReadForkRange(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Size,
+    UINT64 Offset,
+    UINTN Length,
+    VOID *Buffer
+) {
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT32 AllocationBlockSize = Volume->AllocationBlockSize;
+    UINT8 *Destination = Buffer;
+    UINT8 *BounceBlock = NULL;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Offset + Length > Size) {
+        return EFI_END_OF_FILE;
+    }
 
-    // Write the first 8 extents directly into ForkData
-    for (ExtentIndex = 0; ExtentIndex < 8 && TotalBytesWritten < DataSize; ExtentIndex++) {
-        UINT64 BytesToWrite = MIN(BlockSize, DataSize - TotalBytesWritten);
+    while (Length > 0) {
+        UINT64 DiskBlock;
+        UINT64 ContiguousBlocks;
 
-        Status = BlockIo->WriteBlocks(
-            BlockIo,
-            BlockIo->Media->MediaId,
-            FreeBlocks[ExtentIndex],
-            BlockSize,
-            DataPtr
-        );
+        Status = ExtentListBlockToDiskBlock(Extents, ExtentCount, Offset / AllocationBlockSize, &DiskBlock, &ContiguousBlocks);
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        UINT64 Within = Offset % AllocationBlockSize;
+        UINT64 DiskOffset = DiskBlock * AllocationBlockSize + Within;
+        UINT64 Available = MIN((UINT64)Length, ContiguousBlocks * AllocationBlockSize - Within);
+        UINT64 Lba = DiskOffset / DeviceBlockSize;
+        UINT32 Skip = (UINT32)(DiskOffset % DeviceBlockSize);
+        UINTN Chunk;
+
+        if (Skip == 0 && Available >= DeviceBlockSize) {
+            Chunk = (UINTN)(Available - Available % DeviceBlockSize);
+            Status = HfsReadDevice(Volume, Lba, Chunk, Destination);
+        } else {
+            Chunk = (UINTN)MIN(Available, (UINT64)(DeviceBlockSize - Skip));
+            if (BounceBlock == NULL) {
+                BounceBlock = SlabAcquire(&Volume->Arena.Blocks);
+                if (BounceBlock == NULL) {
+                    Status = EFI_OUT_OF_RESOURCES;
+                    break;
+                }
+            }
+            Status = HfsReadDevice(Volume, Lba, DeviceBlockSize, BounceBlock);
+            if (!EFI_ERROR(Status)) {
+                CopyMem(Destination, BounceBlock + Skip, Chunk);
+            }
+        }
+
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        Destination += Chunk;
+        Offset += Chunk;
+        Length -= Chunk;
+    }
+
+    SlabRelease(&Volume->Arena.Blocks, BounceBlock);
+    return Status;
+}
+
+// Remember a free run if it is one of the MaxRuns largest seen so far.
+// Runs is kept sorted by descending blockCount.
+VOID InsertLargestFreeRun(
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 MaxRuns,
+    UINT32 *RunCount,
+    UINT32 StartBlock,
+    UINT32 BlockCount
+) {
+    UINT32 Index = *RunCount;
 
+    if (Index == MaxRuns) {
+        if (Runs[MaxRuns - 1].blockCount >= BlockCount) {
+            return;
+        }
+        Index--;
+    } else {
+        (*RunCount)++;
+    }
+
+    while (Index > 0 && Runs[Index - 1].blockCount < BlockCount) {
+        Runs[Index] = Runs[Index - 1];
+        Index--;
+    }
+
+    Runs[Index].startBlock = StartBlock;
+    Runs[Index].blockCount = BlockCount;
+}
+
+// Find free space for RequiredBlocks as a list of contiguous runs.
+// The smallest single free run that holds the whole request wins (best fit);
+// otherwise the largest runs are taken first and the last piece is again
+// placed best-fit, so the request ends up in as few extents as possible.
+EFI_STATUS FindFreeBlocks(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 RequiredBlocks,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 MaxRuns,
+    UINT32 *RunCount
+) {
+    HFSPLUS_BITMAP_CACHE *Cache = &Volume->Bitmap;
+    EFI_STATUS Status;
+
+    *RunCount = 0;
+    if (RequiredBlocks == 0) {
+        return EFI_SUCCESS;
+    }
+    if (MaxRuns == 0) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    // The bitmap is cached by the first allocation
+    if (!Cache->Loaded) {
+        Status = LoadBitmapCache(Volume, Cache);
         if (EFI_ERROR(Status)) {
-            FreePool(FreeBlocks);
             return Status;
         }
+    }
 
-        ForkData->extents[ExtentIndex].startBlock = FreeBlocks[ExtentIndex];
-        ForkData->extents[ExtentIndex].blockCount = 1;
+    // Blocks not covered by the bitmap are treated as allocated
+    UINT64 Limit = MIN((UINT64)Volume->TotalBlocks, Cache->BitCount);
 
-        DataPtr += BytesToWrite;
-        TotalBytesWritten += BytesToWrite;
+    HFSPlusExtentDescriptor BestFit = {0, 0};
+    UINT32 Candidates = 0;
+    UINT64 Cursor = 0;
+    UINT64 RunStart;
+    UINT64 RunLength;
+
+    UINT32 MinLength = 1;
+
+    // Nothing to scan for when the volume cannot hold the request at all
+    if (Cache->FreeBlocks < RequiredBlocks) {
+        Cursor = Limit;
     }
 
-    // Write the remaining extents to the extent overflow file with fragmentation handling
-    if (TotalBytesWritten < DataSize) {
-        Status = WriteFragmentedExtents(
-            BlockIo,
-            ExtentOverflowFile,
-            DataPtr,
-            FreeBlocks + ExtentIndex,
-            RequiredBlocks - ExtentIndex,
-            &TotalBytesWritten
-        );
+    while (BitmapCacheNextFreeRun(Cache, &Cursor, Limit, MinLength, &RunStart, &RunLength)) {
+        UINT32 Length = (UINT32)MIN(RunLength, 0xFFFFFFFFULL);
+        if (Length >= RequiredBlocks && (BestFit.blockCount == 0 || Length < BestFit.blockCount)) {
+            BestFit.startBlock = (UINT32)RunStart;
+            BestFit.blockCount = Length;
+            if (Length == RequiredBlocks) {
+                break;
+            }
+        }
+
+        InsertLargestFreeRun(Runs, MaxRuns, &Candidates, (UINT32)RunStart, Length);
+
+        // Once the candidate list is full, only runs that would displace a
+        // candidate or improve the best fit are worth looking at
+        if (Candidates == MaxRuns) {
+            MinLength = MIN(Runs[MaxRuns - 1].blockCount + 1, RequiredBlocks);
+        }
     }
 
-    FreePool(FreeBlocks);
-    return Status;
+    if (BestFit.blockCount != 0) {
+        Runs[0].startBlock = BestFit.startBlock;
+        Runs[0].blockCount = RequiredBlocks;
+        *RunCount = 1;
+        return EFI_SUCCESS;
+    }
+
+    // Largest-first: Candidates are sorted by size, so take them in order
+    // until the remainder fits in a single run, then pick the smallest
+    // remaining candidate that still holds it.
+    UINT32 Remaining = RequiredBlocks;
+    UINT32 Used = 0;
+
+    while (Used < Candidates && Runs[Used].blockCount < Remaining) {
+        Remaining -= Runs[Used].blockCount;
+        Used++;
+    }
+
+    if (Used == Candidates) {
+        return EFI_VOLUME_FULL;
+    }
+
+    UINT32 Last = Used;
+    while (Last + 1 < Candidates && Runs[Last + 1].blockCount >= Remaining) {
+        Last++;
+    }
+
+    Runs[Used].startBlock = Runs[Last].startBlock;
+    Runs[Used].blockCount = Remaining;
+    *RunCount = Used + 1;
+    return EFI_SUCCESS;
 }
 
-// Read file with fragmentation handling
-EFI_STATUS ReadFileWithFragmentation(
-    EFI_HANDLE ImageHandle,
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *ForkData,
-    UINT32 TotalBlocks,
-    VOID **FileData,
-    HFSPlusForkData *ExtentOverflowFile
+// Set or clear the allocation bitmap bits for the given runs and write back
+// the bitmap blocks that changed, then the volume header with the new free
+// block count. The cache is summarised per device block, so each summary
+// entry is one device block of the allocation file. Both are metadata, so
+// on a journaled volume they join the caller's transaction.
+STATIC
+EFI_STATUS
+SetBlockRunsState(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount,
+    BOOLEAN Allocated
 ) {
-    UINTN BlockSize = BlockIo->Media->BlockSize;
-    UINT64 FileSize = ForkData->logicalSize;
-    UINT64 TotalBytesRead = 0;
+    HFSPLUS_BITMAP_CACHE *Cache = &Volume->Bitmap;
+    UINTN BlockSize = Volume->DeviceBlockSize;
+    EFI_STATUS Status = EFI_SUCCESS;
 
-    *FileData = AllocateZeroPool(FileSize);
-    if (*FileData == NULL) {
+    if (!Cache->Loaded) {
+        Status = LoadBitmapCache(Volume, Cache);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    UINT8 *BitmapBlock = SlabAcquire(&Volume->Arena.Blocks);
+    if (BitmapBlock == NULL) {
         return EFI_OUT_OF_RESOURCES;
     }
 
-    UINT8 *DataPtr = *FileData;
+    UINT64 FreeBefore = Cache->FreeBlocks;
 
-    // Read the first 8 extents from ForkData
-    for (UINT32 i = 0; i < 8 && TotalBytesRead < FileSize; i++) {
-        HFSPlusExtentDescriptor *Extent = &ForkData->extents[i];
+    for (UINT32 RunIndex = 0; RunIndex < RunCount && !EFI_ERROR(Status); RunIndex++) {
+        UINT64 StartBit = Runs[RunIndex].startBlock;
+        UINT64 EndBit = StartBit + Runs[RunIndex].blockCount;
 
-        if (Extent->blockCount == 0) {
-            break;
+        if (Runs[RunIndex].blockCount == 0) {
+            continue;
         }
 
-        UINT64 ExtentSize = Extent->blockCount * BlockIo->Media->BlockSize;
-        if (ExtentSize + TotalBytesRead > FileSize) {
-            ExtentSize = FileSize - TotalBytesRead;
+        BitmapCacheSetRange(Cache, StartBit, Runs[RunIndex].blockCount, Allocated);
+
+        // Only the bitmap blocks covering this run are written back
+        for (UINT64 SummaryIndex = StartBit / Cache->BitsPerBitmapBlock;
+             SummaryIndex <= (EndBit - 1) / Cache->BitsPerBitmapBlock;
+             SummaryIndex++) {
+            UINT64 Lba;
+
+            Status = ForkOffsetToDeviceBlock(Volume, Cache->Extents, Cache->ExtentCount, SummaryIndex * BlockSize, &Lba);
+            if (EFI_ERROR(Status)) {
+                break;
+            }
+
+            BitmapCacheExportBlock(Cache, SummaryIndex, BitmapBlock);
+            Status = HfsWriteMetadata(Volume, Lba, BlockSize, BitmapBlock);
+            if (EFI_ERROR(Status)) {
+                break;
+            }
         }
 
-        UINT8 *ExtentBuffer = AllocateZeroPool(ExtentSize);
-        if (ExtentBuffer == NULL) {
-            FreePool(*FileData);
-            return EFI_OUT_OF_RESOURCES;
+        if (Allocated) {
+            Volume->NextAllocation = (UINT32)EndBit;
         }
+    }
+    SlabRelease(&Volume->Arena.Blocks, BitmapBlock);
 
-        EFI_STATUS Status = BlockIo->ReadBlocks(
-            BlockIo,
-            BlockIo->Media->MediaId,
-            Extent->startBlock,
-            Extent->blockCount * BlockIo->Media->BlockSize,
-            ExtentBuffer
-        );
+    // The cache already holds bits that did not all reach the disk; drop it
+    // so the next allocation reloads what the disk has
+    if (EFI_ERROR(Status)) {
+        FreeBitmapCache(Cache);
+        return Status;
+    }
+
+    if (Allocated) {
+        UINT64 Taken = FreeBefore - Cache->FreeBlocks;
+        Volume->FreeBlocks = (UINT32)((Volume->FreeBlocks > Taken) ? Volume->FreeBlocks - Taken : 0);
+    } else {
+        UINT64 Released = Cache->FreeBlocks - FreeBefore;
+        Volume->FreeBlocks = (UINT32)MIN((UINT64)Volume->FreeBlocks + Released, Volume->TotalBlocks);
+    }
+    return HfsWriteVolumeHeader(Volume);
+}
+
+// Mark the given runs allocated on disk
+EFI_STATUS MarkBlockRunsAllocated(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount
+) {
+    return SetBlockRunsState(Volume, Runs, RunCount, TRUE);
+}
+
+// Mark the given runs free on disk
+EFI_STATUS MarkBlockRunsFree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount
+) {
+    return SetBlockRunsState(Volume, Runs, RunCount, FALSE);
+}
+
+// Write a contiguous run of device blocks from the source buffer. Whole
+// blocks are written in place; a trailing partial block is zero-padded in
+// the bounce block, which is taken from the volume's block slab on first
+// use and handed back by the caller with SlabRelease.
+EFI_STATUS WriteBlockRun(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT8 *Source,
+    UINT64 ByteCount,
+    UINT8 **BounceBlock
+) {
+    UINTN BlockSize = Volume->DeviceBlockSize;
+    UINT64 WholeBlocks = ByteCount / BlockSize;
+    UINT64 TailBytes = ByteCount - WholeBlocks * BlockSize;
+    EFI_STATUS Status;
+
+    ReadAheadInvalidate(Volume, Lba, WholeBlocks + (TailBytes != 0));
 
+    if (WholeBlocks > 0) {
+        Status = HfsWriteDevice(
+            Volume,
+            Lba,
+            (UINTN)(WholeBlocks * BlockSize),
+            Source
+        );
         if (EFI_ERROR(Status)) {
-            FreePool(*FileData);
-            FreePool(ExtentBuffer);
             return Status;
         }
+    }
+
+    if (TailBytes == 0) {
+        return EFI_SUCCESS;
+    }
+
+    if (*BounceBlock == NULL) {
+        *BounceBlock = SlabAcquire(&Volume->Arena.Blocks);
+        if (*BounceBlock == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+    }
+
+    CopyMem(*BounceBlock, Source + WholeBlocks * BlockSize, (UINTN)TailBytes);
+    ZeroMem(*BounceBlock + TailBytes, (UINTN)(BlockSize - TailBytes));
+
+    return HfsWriteDevice(
+        Volume,
+        Lba + WholeBlocks,
+        BlockSize,
+        *BounceBlock
+    );
+}
+
+// Write file with fragmentation handling. Space is found and recorded in
+// allocation blocks and written in device blocks. The data goes to new
+// space and the fork's previous extents are released in the same
+// transaction, so a failure leaves the old contents in place.
+STATIC
+EFI_STATUS
+InternalWriteFileWithFragmentation(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    VOID *Data,
+    UINT64 DataSize
+) {
+    UINT32 BlockSize = Volume->AllocationBlockSize;
+    UINT32 RequiredBlocks = (UINT32)((DataSize + BlockSize - 1) / BlockSize);
+    UINT8 *BounceBlock = NULL;
+    UINT32 RunCount = 0;
+    UINT64 InlineBlocks = 0;
+
+    // Extents beyond the eight inline ones would need extents overflow
+    // records, which cannot be inserted or removed yet
+    HFSPlusExtentDescriptor Runs[8];
+
+    if (Volume->DeviceBlocksPerAllocationBlock == 0) {
+        return EFI_UNSUPPORTED;
+    }
 
-        CopyMem(DataPtr + TotalBytesRead, ExtentBuffer, ExtentSize);
-        TotalBytesRead += ExtentSize;
-        FreePool(ExtentBuffer);
+    for (UINTN Index = 0; Index < 8; Index++) {
+        InlineBlocks += ForkData->extents[Index].blockCount;
     }
+    if (InlineBlocks < ForkData->totalBlocks) {
+        DEBUG((DEBUG_WARN, "Cannot rewrite a fork with overflow extents\n"));
+        return EFI_UNSUPPORTED;
+    }
+
+    // Free space that the eight largest runs cannot cover is as good as full
+    EFI_STATUS Status = FindFreeBlocks(Volume, RequiredBlocks, Runs, ARRAY_SIZE(Runs), &RunCount);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT8 *DataPtr = (UINT8 *)Data;
+    UINT64 TotalBytesWritten = 0;
+    UINT32 ExtentIndex = 0;
+
+    // The new fork is built aside and only handed to the caller once the
+    // allocation has committed, so a failure leaves the caller's fork alone
+    HFSPlusForkData NewFork = *ForkData;
+    ZeroMem(NewFork.extents, sizeof(NewFork.extents));
+    NewFork.logicalSize = DataSize;
+    NewFork.totalBlocks = RequiredBlocks;
+
+    // The allocation commits as one transaction, joining the caller's if
+    // it has one open
+    HfsBeginTransaction(Volume);
+
+    // Each free run becomes one extent and one multi-block write
+    for (ExtentIndex = 0; ExtentIndex < RunCount; ExtentIndex++) {
+        UINT64 BytesToWrite = MIN((UINT64)Runs[ExtentIndex].blockCount * BlockSize, DataSize - TotalBytesWritten);
 
-    // Read additional extents from the extent overflow file with fragmentation handling
-    if (TotalBytesRead < FileSize) {
-        EFI_STATUS Status = ReadFragmentedExtents(
-            ImageHandle,
-            BlockIo,
-            ExtentOverflowFile,
+        Status = WriteBlockRun(
+            Volume,
+            (UINT64)Runs[ExtentIndex].startBlock * Volume->DeviceBlocksPerAllocationBlock,
             DataPtr,
-            &TotalBytesRead,
-            FileSize
+            BytesToWrite,
+            &BounceBlock
         );
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        NewFork.extents[ExtentIndex] = Runs[ExtentIndex];
+
+        DataPtr += BytesToWrite;
+        TotalBytesWritten += BytesToWrite;
+    }
+
+    if (!EFI_ERROR(Status)) {
+        Status = MarkBlockRunsAllocated(Volume, Runs, RunCount);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MarkBlockRunsFree(Volume, ForkData->extents, 8);
+    }
+    EFI_STATUS CommitStatus = HfsEndTransaction(Volume, !EFI_ERROR(Status));
+    if (!EFI_ERROR(Status)) {
+        Status = CommitStatus;
+    }
+    if (!EFI_ERROR(Status)) {
+        *ForkData = NewFork;
+    }
+
+    SlabRelease(&Volume->Arena.Blocks, BounceBlock);
+    return Status;
+}
+
+// Write a file into free space, one extent per free run, and release the
+// space it held before
+EFI_STATUS WriteFileWithFragmentation(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    VOID *Data,
+    UINT64 DataSize
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalWriteFileWithFragmentation(Volume, ForkData, Data, DataSize);
+    HFS_STATS_API(Volume, HfsStatsWriteFile, Start, Status);
+    return Status;
+}
 
+// Read a physically contiguous run of blocks into the destination buffer.
+// Whole blocks are read in place; only a trailing partial block goes through
+// the bounce block, which is taken from the volume's block slab on first use
+// and handed back by the caller with SlabRelease.
+EFI_STATUS ReadBlockRun(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT64 BlockCount,
+    UINT8 *Destination,
+    UINT64 BytesWanted,
+    UINT8 **BounceBlock
+) {
+    UINTN BlockSize = Volume->DeviceBlockSize;
+    UINT64 WholeBlocks = MIN(BlockCount, BytesWanted / BlockSize);
+    UINT64 TailBytes = MIN(BytesWanted - WholeBlocks * BlockSize, BlockSize);
+    EFI_STATUS Status;
+
+    if (WholeBlocks > 0) {
+        Status = HfsReadDevice(
+            Volume,
+            Lba,
+            (UINTN)(WholeBlocks * BlockSize),
+            Destination
+        );
         if (EFI_ERROR(Status)) {
-            FreePool(*FileData);
             return Status;
         }
     }
 
+    if (TailBytes == 0 || WholeBlocks == BlockCount) {
+        return EFI_SUCCESS;
+    }
+
+    if (*BounceBlock == NULL) {
+        *BounceBlock = SlabAcquire(&Volume->Arena.Blocks);
+        if (*BounceBlock == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+    }
+
+    Status = HfsReadDevice(
+        Volume,
+        Lba + WholeBlocks,
+        BlockSize,
+        *BounceBlock
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CopyMem(Destination + WholeBlocks * BlockSize, *BounceBlock, (UINTN)TailBytes);
     return EFI_SUCCESS;
 }
 
-// Detect HFS+ partitions on all block devices
-EFI_STATUS DetectHfsPlusPartitions(EFI_BLOCK_IO_PROTOCOL **BlockIoProtocol, UINTN *HfsPartitionCount) {
+// Read a whole fork into a newly allocated buffer. The complete extent list
+// is gathered first, including any overflow records, and then read in
+// batches in disk order. The buffer is rounded up to whole device blocks so
+// every read lands in place.
+STATIC
+EFI_STATUS
+InternalReadFileWithFragmentation(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    VOID **FileData
+) {
+    UINTN BlockSize = Volume->DeviceBlockSize;
+    UINT64 FileSize = ForkData->logicalSize;
+    HFSPlusExtentDescriptor *Extents;
+    UINTN ExtentCount;
+    HFSPLUS_ARENA_MARK Mark;
     EFI_STATUS Status;
-    EFI_HANDLE *HandleBuffer;
-    UINTN HandleCount;
 
-    // Locate all Block I/O devices
-    Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &HandleCount, &HandleBuffer);
+    *FileData = NULL;
+
+    // The extent list is only needed for this read
+    ArenaMark(&Volume->Arena, &Mark);
+    Status = GatherForkExtents(Volume, ForkData, FileID, ForkType, TRUE, &Extents, &ExtentCount);
     if (EFI_ERROR(Status)) {
+        ArenaReset(&Volume->Arena, &Mark);
         return Status;
     }
 
-    *HfsPartitionCount = 0;
-    for (UINTN Index = 0; Index < HandleCount; Index++) {
-        EFI_BLOCK_IO_PROTOCOL *BlockIo;
-        Status = gBS->HandleProtocol(HandleBuffer[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo);
-        if (EFI_ERROR(Status) || !BlockIo->Media->LogicalPartition) {
-            continue;  // Skip non-partition devices
-        }
+    *FileData = AllocateZeroPool((UINTN)((FileSize + BlockSize - 1) / BlockSize * BlockSize));
+    if (*FileData == NULL) {
+        ArenaReset(&Volume->Arena, &Mark);
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-        // Read the first block (containing the volume header)
-        VOID *Buffer = AllocateZeroPool(BlockIo->Media->BlockSize);
-        if (Buffer == NULL) {
-            continue;
+    Status = ReadExtentList(Volume, Extents, ExtentCount, FileSize, *FileData);
+    ArenaReset(&Volume->Arena, &Mark);
+
+    if (EFI_ERROR(Status)) {
+        FreePool(*FileData);
+        *FileData = NULL;
+    }
+
+    return Status;
+}
+
+// Read a whole fork, extents overflow records included
+EFI_STATUS ReadFileWithFragmentation(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    VOID **FileData
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalReadFileWithFragmentation(Volume, ForkData, FileID, ForkType, FileData);
+    HFS_STATS_API(Volume, HfsStatsReadFile, Start, Status);
+    return Status;
+}
+
+// Volumes mounted through MountHfsPlusVolume, keyed by their Block I/O protocol
+STATIC HFSPLUS_VOLUME *mMountedVolumes[HFSPLUS_MAX_MOUNTED_VOLUMES];
+
+// Find the state of a mounted volume, or NULL if BlockIo is not mounted
+HFSPLUS_VOLUME *HfsLookupVolume(
+    EFI_BLOCK_IO_PROTOCOL *BlockIo
+) {
+    for (UINTN Index = 0; Index < HFSPLUS_MAX_MOUNTED_VOLUMES; Index++) {
+        if (mMountedVolumes[Index] != NULL && mMountedVolumes[Index]->BlockIo == BlockIo) {
+            return mMountedVolumes[Index];
         }
+    }
 
-        Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, 0, BlockIo->Media->BlockSize, Buffer);
-        if (EFI_ERROR(Status)) {
-            FreePool(Buffer);
-            continue;
+    return NULL;
+}
+
+// Release a volume and everything cached for it
+STATIC
+VOID
+HfsFreeVolume(
+    HFSPLUS_VOLUME *Volume
+) {
+    CloseJournal(Volume);
+    FreeBitmapCache(&Volume->Bitmap);
+    NodeCacheFree(&Volume->NodeCache);
+    CloseBTree(&Volume->CatalogTree);
+    CloseBTree(&Volume->ExtentsTree);
+    CloseBTree(&Volume->AttributesTree);
+    PathCacheFlush(Volume);
+    ReadAheadFree(&Volume->ReadAhead);
+    ArenaFree(&Volume->Arena);
+#if HFSPLUS_ENABLE_STATS
+    HfsStatsFree(Volume);
+#endif
+    FreePool(Volume);
+}
+
+// Release one mount of a volume, dropping its cached state once the last
+// mount is released
+VOID UnmountHfsPlusVolume(
+    HFSPLUS_VOLUME *Volume
+) {
+    if (Volume == NULL) {
+        return;
+    }
+
+    if (Volume->MountCount > 1) {
+        Volume->MountCount--;
+        return;
+    }
+
+    for (UINTN Index = 0; Index < HFSPLUS_MAX_MOUNTED_VOLUMES; Index++) {
+        if (mMountedVolumes[Index] == Volume) {
+            mMountedVolumes[Index] = NULL;
         }
+    }
+
+    HfsFreeVolume(Volume);
+}
+
+// Copy the fields of an on-disk volume header that the driver uses into the
+// volume, in host byte order
+STATIC
+VOID
+HfsParseVolumeHeader(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusVolumeHeader *Header
+) {
+    CopyMem(&Volume->Header, Header, sizeof(HFSPlusVolumeHeader));
+
+    Volume->Signature = HFS_BE16(&Header->signature);
+    Volume->Version = HFS_BE16(&Header->version);
+    Volume->Attributes = HFS_BE32(&Header->attributes);
+    Volume->Journaled = (Volume->Attributes & HFSPLUS_VOL_JOURNALED) != 0;
+    Volume->JournalInfoBlock = HFS_BE32(&Header->journalInfoBlock);
+    Volume->AllocationBlockSize = HFS_BE32(&Header->blockSize);
+    Volume->TotalBlocks = HFS_BE32(&Header->totalBlocks);
+    Volume->FreeBlocks = HFS_BE32(&Header->freeBlocks);
+    Volume->NextAllocation = HFS_BE32(&Header->nextAllocation);
+    Volume->NextCatalogID = HFS_BE32(&Header->nextCatalogID);
+    Volume->FileCount = HFS_BE32(&Header->fileCount);
+    Volume->FolderCount = HFS_BE32(&Header->folderCount);
+
+    HfsForkDataFromDisk(&Header->allocationFile, &Volume->AllocationFile);
+    HfsForkDataFromDisk(&Header->extentsFile, &Volume->ExtentsFile);
+    HfsForkDataFromDisk(&Header->catalogFile, &Volume->CatalogFile);
+    HfsForkDataFromDisk(&Header->attributesFile, &Volume->AttributesFile);
+    HfsForkDataFromDisk(&Header->startupFile, &Volume->StartupFile);
+}
+
+// Read the volume header into the volume and check it. The first read also
+// finds where the volume starts: byte 1024 holds either an HFS+ or HFSX
+// header, or the master directory block of an HFS wrapper, whose embedded
+// HFS+ volume is then read instead. Byte offsets are turned into device
+// blocks with the media's block size, so 512-byte and 4K-sector media read
+// only the blocks that hold the header.
+EFI_STATUS HfsReadVolumeHeader(
+    HFSPLUS_VOLUME *Volume
+) {
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 Lba = HFSPLUS_VOLUME_HEADER_OFFSET / DeviceBlockSize;
+    UINT32 Skip = HFSPLUS_VOLUME_HEADER_OFFSET % DeviceBlockSize;
+    UINTN ReadSize = (Skip + HFSPLUS_VOLUME_HEADER_SIZE + DeviceBlockSize - 1) / DeviceBlockSize * DeviceBlockSize;
+    HFSPLUS_PARTITION Partition;
+    HFSPLUS_ARENA_MARK Mark;
+
+    ArenaMark(&Volume->Arena, &Mark);
+    UINT8 *Buffer = ArenaAlloc(&Volume->Arena, ReadSize);
+    if (Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Read the device blocks holding the volume header
+    ZeroMem(&Partition, sizeof(Partition));
+    EFI_STATUS Status = HfsReadDevice(Volume, Lba, ReadSize, Buffer);
+    if (!EFI_ERROR(Status) && !HfsClassifyVolumeHeader(Buffer + Skip, &Partition)) {
+        Status = EFI_VOLUME_CORRUPTED;
+    }
 
-        // Check for HFS+ signature
-        UINT16 *Signature = (UINT16 *)((UINT8 *)Buffer + 1024);  // Signature is at offset 1024 bytes
-        if (*Signature == HFSPLUS_SIGNATURE) {
-            // Found an HFS+ partition
-            DEBUG((DEBUG_INFO, "HFS+ partition found on device %u\n", Index));
-            BlockIoProtocol[*HfsPartitionCount] = BlockIo;  // Store the Block I/O protocol
-            (*HfsPartitionCount)++;
+    // Move into a wrapper's embedded volume, which must start on a device
+    // block and may not be another wrapper
+    if (!EFI_ERROR(Status) && Partition.Kind == HfsProbeWrapped) {
+        if (Volume->StartLba != 0 || Partition.VolumeOffset % DeviceBlockSize != 0) {
+            Status = EFI_UNSUPPORTED;
+        } else {
+            Volume->StartLba = Partition.VolumeOffset / DeviceBlockSize;
+            Status = HfsReadDevice(Volume, Lba, ReadSize, Buffer);
+        }
+        if (!EFI_ERROR(Status) &&
+            (!HfsClassifyVolumeHeader(Buffer + Skip, &Partition) || Partition.Kind != HfsProbeHfsPlus)) {
+            Status = EFI_VOLUME_CORRUPTED;
         }
+    }
 
-        FreePool(Buffer);
+    if (!EFI_ERROR(Status)) {
+        HfsParseVolumeHeader(Volume, (HFSPlusVolumeHeader *)(Buffer + Skip));
+
+        UINT32 AllocationBlockSize = Volume->AllocationBlockSize;
+        if (Volume->TotalBlocks == 0 ||
+            AllocationBlockSize < 512 || (AllocationBlockSize & (AllocationBlockSize - 1)) != 0) {
+            Status = EFI_VOLUME_CORRUPTED;
+        }
     }
+    ArenaReset(&Volume->Arena, &Mark);
 
-    FreePool(HandleBuffer);
-    return EFI_SUCCESS;
+    // Fork extents are read and written as whole device blocks, which only
+    // works when an allocation block is a whole number of them
+    Volume->DeviceBlocksPerAllocationBlock = 0;
+    if (!EFI_ERROR(Status) && Volume->AllocationBlockSize % DeviceBlockSize == 0) {
+        Volume->DeviceBlocksPerAllocationBlock = Volume->AllocationBlockSize / DeviceBlockSize;
+    }
+    return Status;
 }
 
-// Detect and handle HFS+ journaled volumes
-EFI_STATUS MountHfsPlusVolume(EFI_BLOCK_IO_PROTOCOL *BlockIo, HFSPlusForkData *CatalogFile, HFSPlusForkData *AllocationFile, BOOLEAN *IsJournaled) {
-    VOID *Buffer = AllocateZeroPool(BlockIo->Media->BlockSize);
+// Write the volume's free space counters back into its on-disk header.
+// The header shares a device block with the boot blocks on large-sector
+// disks, so that block is read first; the whole block is written as
+// metadata.
+EFI_STATUS HfsWriteVolumeHeader(
+    HFSPLUS_VOLUME *Volume
+) {
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 Lba = HFSPLUS_VOLUME_HEADER_OFFSET / DeviceBlockSize;
+    UINT32 Skip = HFSPLUS_VOLUME_HEADER_OFFSET % DeviceBlockSize;
+    UINTN WriteSize = (Skip + HFSPLUS_VOLUME_HEADER_SIZE + DeviceBlockSize - 1) / DeviceBlockSize * DeviceBlockSize;
+    HFSPLUS_ARENA_MARK Mark;
+
+    ArenaMark(&Volume->Arena, &Mark);
+    UINT8 *Buffer = ArenaAlloc(&Volume->Arena, WriteSize);
     if (Buffer == NULL) {
         return EFI_OUT_OF_RESOURCES;
     }
 
-    // Read the HFS+ volume header (located at block 2)
-    EFI_STATUS Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, 2, BlockIo->Media->BlockSize, Buffer);
+    HFS_PUT32(&Volume->Header.freeBlocks, Volume->FreeBlocks);
+    HFS_PUT32(&Volume->Header.nextAllocation, Volume->NextAllocation);
+    HFS_PUT32(&Volume->Header.writeCount, HFS_BE32(&Volume->Header.writeCount) + 1);
+
+    // Nothing else to keep when the header fills the blocks
+    EFI_STATUS Status = EFI_SUCCESS;
+    if (WriteSize != sizeof(HFSPlusVolumeHeader)) {
+        Status = HfsReadDevice(Volume, Lba, WriteSize, Buffer);
+    }
+    if (!EFI_ERROR(Status)) {
+        CopyMem(Buffer + Skip, &Volume->Header, sizeof(HFSPlusVolumeHeader));
+        Status = HfsWriteMetadata(Volume, Lba, WriteSize, Buffer);
+    }
+    ArenaReset(&Volume->Arena, &Mark);
+    return Status;
+}
+
+// Pick how catalog names are ordered. HFS+ always folds case; an HFSX
+// catalog's header says whether its keys are case-folded or binary, and a
+// binary catalog gets the plain code unit compare.
+STATIC
+EFI_STATUS
+HfsSelectCatalogCompare(
+    HFSPLUS_VOLUME *Volume
+) {
+    Volume->CatalogCompare = CompareCatalogSearchKey;
+    if (Volume->Signature != HFSX_SIGNATURE || Volume->CatalogFile.logicalSize == 0) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS Status = PrepareBTree(Volume, &Volume->CatalogFile, HFSPLUS_CATALOG_FILE_ID, &Volume->CatalogTree);
     if (EFI_ERROR(Status)) {
-        FreePool(Buffer);
         return Status;
     }
 
-    // Parse the volume header
-    HFSPlusVolumeHeader *VolumeHeader = (HFSPlusVolumeHeader *)((UINT8 *)Buffer + 1024);  // Volume header starts at offset 1024
-
-    // Check the HFS+ signature
-    if (VolumeHeader->signature != HFSPLUS_SIGNATURE) {
-        FreePool(Buffer);
+    switch (Volume->CatalogTree.KeyCompareType) {
+    case HFSPLUS_KEY_BINARY_COMPARE:
+        Volume->CatalogCompare = CompareBinaryCatalogSearchKey;
+        return EFI_SUCCESS;
+    case HFSPLUS_KEY_CASE_FOLDING:
+        return EFI_SUCCESS;
+    default:
         return EFI_VOLUME_CORRUPTED;
     }
+}
+
+// Read and check the volume header, replay the journal if the volume has
+// one, then register the new volume
+STATIC
+EFI_STATUS
+InternalMountHfsPlusVolume(
+    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+    HFSPLUS_VOLUME **Volume
+) {
+    UINTN Slot;
+
+    *Volume = NULL;
+
+    for (Slot = 0; Slot < HFSPLUS_MAX_MOUNTED_VOLUMES && mMountedVolumes[Slot] != NULL; Slot++) {
+    }
+    if (Slot == HFSPLUS_MAX_MOUNTED_VOLUMES) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    HFSPLUS_VOLUME *NewVolume = AllocateZeroPool(sizeof(HFSPLUS_VOLUME));
+    if (NewVolume == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    NewVolume->BlockIo = BlockIo;
+    NewVolume->DeviceBlockSize = BlockIo->Media->BlockSize;
+    ArenaInit(&NewVolume->Arena, NewVolume->DeviceBlockSize);
+#if HFSPLUS_ENABLE_STATS
+    HfsStatsReset(NewVolume);
+#endif
+
+    EFI_STATUS Status = HfsReadVolumeHeader(NewVolume);
+
+    // The journal may hold newer copies of any metadata block, the volume
+    // header included, so replay it before trusting what was just read
+    if (!EFI_ERROR(Status) && NewVolume->Journaled) {
+        BOOLEAN Replayed;
 
-    // Check if the volume is journaled
-    if (VolumeHeader->attributes & HFSPLUS_VOL_JOURNALED) {
         DEBUG((DEBUG_INFO, "HFS+ journaled volume detected.\n"));
-        *IsJournaled = TRUE;
-    } else {
-        *IsJournaled = FALSE;
+        Status = ReplayJournal(NewVolume, &Replayed);
+        if (!EFI_ERROR(Status) && Replayed) {
+            Status = HfsReadVolumeHeader(NewVolume);
+        }
     }
 
-    // Store catalog and allocation file information
-    *CatalogFile = VolumeHeader->catalogFile;
-    *AllocationFile = VolumeHeader->allocationFile;
+    if (!EFI_ERROR(Status)) {
+        Status = HfsSelectCatalogCompare(NewVolume);
+    }
 
-    FreePool(Buffer);
+    if (EFI_ERROR(Status)) {
+        HfsFreeVolume(NewVolume);
+        return Status;
+    }
+
+    // The allocation bitmap is loaded by the first allocation, so read-only
+    // mounts never read it
+    NewVolume->MountCount = 1;
+    mMountedVolumes[Slot] = NewVolume;
+    *Volume = NewVolume;
     return EFI_SUCCESS;
 }
 
-// Load boot.efi from the HFS+ partition
-EFI_STATUS LoadBootEfi(
+// Mount an HFS+ volume: check its header and remember its special files.
+// A volume is mounted once; mounting it again returns the existing volume
+// without touching the disk. Each mount must be matched by an unmount.
+EFI_STATUS MountHfsPlusVolume(
     EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    HFSPlusForkData *AllocationFile,
-    VOID **BootEfiData
+    HFSPLUS_VOLUME **Volume
+) {
+    *Volume = HfsLookupVolume(BlockIo);
+    if (*Volume != NULL) {
+        (*Volume)->MountCount++;
+        return EFI_SUCCESS;
+    }
+
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalMountHfsPlusVolume(BlockIo, Volume);
+    HFS_STATS_API(*Volume, HfsStatsMount, Start, Status);
+    return Status;
+}
+
+// Locate boot.efi and open its contents for streaming
+STATIC
+EFI_STATUS
+OpenBootEfi(
+    HFSPLUS_VOLUME *Volume,
+    HFSPLUS_FORK **Fork
 ) {
-    // Use the HFS+ traversal functions to locate boot.efi and read its contents
+    // Resolve the standard boot path first and fall back to a boot.efi
+    // stored directly in the root folder
     VOID *BootEfiRecord = NULL;
-    EFI_STATUS Status = TraverseCatalogBTree(BlockIo, CatalogFile, HFSPLUS_BOOT_FOLDER_ID, L"boot.efi", &BootEfiRecord);
+    EFI_STATUS Status = ResolvePath(Volume, HFSPLUS_BOOT_EFI_PATH, NULL, &BootEfiRecord);
+    if (EFI_ERROR(Status)) {
+        Status = TraverseCatalogBTree(Volume, HFSPLUS_BOOT_FOLDER_ID, L"boot.efi", &BootEfiRecord);
+    }
     if (EFI_ERROR(Status)) {
         DEBUG((DEBUG_ERROR, "Failed to locate boot.efi: %r\n", Status));
         return Status;
     }
 
-    // Extract file information from the catalog record (e.g., size, fork data)
-    HFSPlusCatalogFile *BootEfiCatalogFile = (HFSPlusCatalogFile *)BootEfiRecord;
+    return HfsOpenFile(Volume, BootEfiRecord, Fork);
+}
 
-    // Allocate memory for the file contents
-    *BootEfiData = AllocateZeroPool(BootEfiCatalogFile->dataFork.logicalSize);
-    if (*BootEfiData == NULL) {
-        return EFI_OUT_OF_RESOURCES;
+// Load boot.efi from the HFS+ partition into a newly allocated buffer
+EFI_STATUS LoadBootEfi(
+    HFSPLUS_VOLUME *Volume,
+    VOID **BootEfiData
+) {
+    HFSPLUS_FORK *Fork;
+
+    HFS_STATS_START(Start);
+    *BootEfiData = NULL;
+
+    EFI_STATUS Status = OpenBootEfi(Volume, &Fork);
+    if (!EFI_ERROR(Status)) {
+        UINTN Length = (UINTN)Fork->Size;
+
+        *BootEfiData = AllocatePool(Length);
+        Status = (*BootEfiData != NULL) ? HfsReadAt(Fork, 0, &Length, *BootEfiData) : EFI_OUT_OF_RESOURCES;
+        HfsCloseFork(Fork);
+
+        if (EFI_ERROR(Status) && *BootEfiData != NULL) {
+            FreePool(*BootEfiData);
+            *BootEfiData = NULL;
+            DEBUG((DEBUG_ERROR, "Failed to read boot.efi: %r\n", Status));
+        }
     }
 
-    // Read the contents of boot.efi into memory
-    Status = ReadFileWithFragmentation(BlockIo, &BootEfiCatalogFile->dataFork, AllocationFile->totalBlocks, BootEfiData, NULL);
+    HFS_STATS_API(Volume, HfsStatsLoadBootEfi, Start, Status);
+    return Status;
+}
+
+// Stream boot.efi into a caller-provided buffer. If the buffer is too small
+// EFI_BUFFER_TOO_SMALL is returned with the required size in *BufferSize.
+EFI_STATUS ReadBootEfi(
+    HFSPLUS_VOLUME *Volume,
+    VOID *Buffer,
+    UINTN *BufferSize
+) {
+    HFSPLUS_FORK *Fork;
+
+    EFI_STATUS Status = OpenBootEfi(Volume, &Fork);
     if (EFI_ERROR(Status)) {
-        FreePool(*BootEfiData);
-        *BootEfiData = NULL;
-        DEBUG((DEBUG_ERROR, "Failed to read boot.efi: %r\n", Status));
+        return Status;
+    }
+
+    if (*BufferSize < Fork->Size) {
+        *BufferSize = (UINTN)Fork->Size;
+        HfsCloseFork(Fork);
+        return EFI_BUFFER_TOO_SMALL;
     }
 
+    *BufferSize = (UINTN)Fork->Size;
+    Status = HfsReadAt(Fork, 0, BufferSize, Buffer);
+    HfsCloseFork(Fork);
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Failed to read boot.efi: %r\n", Status));
+    }
     return Status;
 }
 
-// Find and load boot.efi from HFS+ partition
+// Find and load boot.efi from HFS+ partition. The volume stays mounted, so
+// later calls reuse its header and caches.
 EFI_STATUS FindAndLoadBootEfi(EFI_BLOCK_IO_PROTOCOL *BlockIo) {
-    HFSPlusForkData CatalogFile = {0};
-    HFSPlusForkData AllocationFile = {0};
+    HFSPLUS_VOLUME *Volume;
 
     // Mount the HFS+ volume
-    EFI_STATUS Status = MountHfsPlusVolume(BlockIo, &CatalogFile, &AllocationFile, NULL);
+    EFI_STATUS Status = MountHfsPlusVolume(BlockIo, &Volume);
     if (EFI_ERROR(Status)) {
         DEBUG((DEBUG_ERROR, "Failed to mount HFS+ volume: %r\n", Status));
         return Status;
@@ -321,7 +1064,7 @@ EFI_STATUS FindAndLoadBootEfi(EFI_BLOCK_IO_PROTOCOL *BlockIo) {
 
     // Load boot.efi
     VOID *BootEfiData = NULL;
-    Status = LoadBootEfi(BlockIo, &CatalogFile, &AllocationFile, &BootEfiData);
+    Status = LoadBootEfi(Volume, &BootEfiData);
     if (EFI_ERROR(Status)) {
         DEBUG((DEBUG_ERROR, "Failed to load boot.efi: %r\n", Status));
     } else {
@@ -335,144 +1078,113 @@ EFI_STATUS FindAndLoadBootEfi(EFI_BLOCK_IO_PROTOCOL *BlockIo) {
     return Status;
 }
 
-// Traverse the HFS+ catalog B-tree to find boot.efi
-EFI_STATUS TraverseCatalogBTree(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
+// Compare a search key (parent folder ID and name) with an on-disk catalog
+// key in HFS+ catalog order. Returns <0, 0 or >0 as the search key sorts
+// before, equal to or after the on-disk key.
+INTN CompareCatalogKey(
     UINT32 ParentFolderID,
-    CHAR16 *FileName,
-    VOID **CatalogRecord
+    CONST CHAR16 *FileName,
+    UINTN FileNameLength,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
 ) {
-    UINTN BlockSize = BlockIo->Media->BlockSize;
-    UINT8 *Buffer = AllocateZeroPool(BlockSize);
-    if (Buffer == NULL) {
-        return EFI_OUT_OF_RESOURCES;
-    }
+    CONST HFSPlusCatalogKey *CatalogKey = (CONST HFSPlusCatalogKey *)Key;
 
-    EFI_STATUS Status;
+    // A key running past the record sorts last, so it is never matched
+    if (RecordLength < OFFSET_OF(HFSPlusCatalogKey, nodeName.unicode)) {
+        return -1;
+    }
 
-    // Read the root node (start traversal from the root node)
-    Status = BlockIo->ReadBlocks(
-        BlockIo,
-        BlockIo->Media->MediaId,
-        CatalogFile->extents[0].startBlock,  // Starting block for root node
-        BlockSize,
-        Buffer
-    );
-    if (EFI_ERROR(Status)) {
-        FreePool(Buffer);
-        return Status;
+    UINT32 KeyParentID = HFS_BE32(&CatalogKey->parentID);
+    if (ParentFolderID != KeyParentID) {
+        return (ParentFolderID < KeyParentID) ? -1 : 1;
     }
 
-    // Begin recursive search through index nodes to find the correct leaf node
-    Status = TraverseBTreeNodeRecursively(BlockIo, CatalogFile, Buffer, ParentFolderID, FileName, CatalogRecord);
+    UINTN KeyNameLength = HFS_BE16(&CatalogKey->nodeName.length);
+    if (OFFSET_OF(HFSPlusCatalogKey, nodeName.unicode) + 2 * KeyNameLength > RecordLength) {
+        return -1;
+    }
+    if (KeyNameLength > 255) {
+        KeyNameLength = 255;
+    }
 
-    FreePool(Buffer);
-    return Status;
+    return HfsFastUnicodeCompare(FileName, FileNameLength, (CONST UINT8 *)CatalogKey->nodeName.unicode, KeyNameLength);
 }
 
-// Recursive traversal of B-tree nodes (index and leaf nodes)
-EFI_STATUS TraverseBTreeNodeRecursively(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    UINT8 *NodeBuffer,
-    UINT32 ParentFolderID,
-    CHAR16 *FileName,
-    VOID **CatalogRecord
+// CompareCatalogKey for the generic B-tree search
+INTN CompareCatalogSearchKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
 ) {
-    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)NodeBuffer;
+    HFSPLUS_CATALOG_SEARCH *Search = (HFSPLUS_CATALOG_SEARCH *)Context;
 
-    if (NodeDesc->kind == 0xFF) {
-        // Leaf node: Perform linear search for the file within the leaf node
-        return SearchLeafNodeForFile(BlockIo, NodeBuffer, ParentFolderID, FileName, CatalogRecord);
-    } else {
-        // Index node: Perform binary search for the child node
-        return SearchIndexNodeAndRecurse(BlockIo, CatalogFile, NodeBuffer, ParentFolderID, FileName, CatalogRecord);
-    }
+    return CompareCatalogKey(Search->ParentFolderID, Search->FileName, Search->FileNameLength, Key, RecordLength);
 }
 
-// Binary search in index nodes, recurse into child nodes
-EFI_STATUS SearchIndexNodeAndRecurse(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    UINT8 *NodeBuffer,
-    UINT32 ParentFolderID,
-    CHAR16 *FileName,
-    VOID **CatalogRecord
+// The catalog search of case-sensitive HFSX volumes: parent ID, then the
+// names as raw code units
+INTN CompareBinaryCatalogSearchKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
 ) {
-    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)NodeBuffer;
-
-    UINT8 *RecordPtr = NodeBuffer + sizeof(BTNodeDescriptor);
-    INT32 Left = 0;
-    INT32 Right = NodeDesc->numRecords - 1;
-
-    // Perform binary search on the index node
-    while (Left <= Right) {
-        INT32 Mid = (Left + Right) / 2;
-        HFSPlusCatalogKey *CatalogKey = (HFSPlusCatalogKey *)(RecordPtr + Mid * sizeof(HFSPlusCatalogKey));
-
-        if (CatalogKey->parentID == ParentFolderID) {
-            // Correct node found, now recurse into the child node
-            BTNodeDescriptor *ChildNode = GetChildNode(BlockIo, CatalogFile, CatalogKey);
-            return TraverseBTreeNodeRecursively(BlockIo, CatalogFile, (UINT8 *)ChildNode, ParentFolderID, FileName, CatalogRecord);
-        } else if (CatalogKey->parentID < ParentFolderID) {
-            Left = Mid + 1;
-        } else {
-            Right = Mid - 1;
-        }
+    HFSPLUS_CATALOG_SEARCH *Search = (HFSPLUS_CATALOG_SEARCH *)Context;
+    CONST HFSPlusCatalogKey *CatalogKey = (CONST HFSPlusCatalogKey *)Key;
+
+    if (RecordLength < OFFSET_OF(HFSPlusCatalogKey, nodeName.unicode)) {
+        return -1;
     }
 
-    return EFI_NOT_FOUND;
+    UINT32 KeyParentID = HFS_BE32(&CatalogKey->parentID);
+    if (Search->ParentFolderID != KeyParentID) {
+        return (Search->ParentFolderID < KeyParentID) ? -1 : 1;
+    }
+
+    UINTN KeyNameLength = HFS_BE16(&CatalogKey->nodeName.length);
+    if (OFFSET_OF(HFSPlusCatalogKey, nodeName.unicode) + 2 * KeyNameLength > RecordLength) {
+        return -1;
+    }
+    KeyNameLength = MIN(KeyNameLength, 255);
+    return HfsBinaryUnicodeCompare(Search->FileName, Search->FileNameLength,
+                                   (CONST UINT8 *)CatalogKey->nodeName.unicode, KeyNameLength);
 }
 
-// Search within leaf nodes for the target file or directory
-EFI_STATUS SearchLeafNodeForFile(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    UINT8 *NodeBuffer,
+// Look up a file or folder record in the HFS+ catalog B-tree. The returned
+// record points into the node cache and is only valid until the next
+// catalog access.
+EFI_STATUS TraverseCatalogBTree(
+    HFSPLUS_VOLUME *Volume,
     UINT32 ParentFolderID,
     CHAR16 *FileName,
     VOID **CatalogRecord
 ) {
-    BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)NodeBuffer;
-
-    UINT8 *RecordPtr = NodeBuffer + sizeof(BTNodeDescriptor);
-    for (UINT16 RecordIndex = 0; RecordIndex < NodeDesc->numRecords; RecordIndex++) {
-        HFSPlusCatalogKey *CatalogKey = (HFSPlusCatalogKey *)RecordPtr;
-
-        if (CatalogKey->parentID == ParentFolderID) {
-            CHAR16 *RecordFileName = GetFileNameFromKey(CatalogKey);  // Assume filename extraction function
-            if (StrCmp(RecordFileName, FileName) == 0) {
-                *CatalogRecord = (VOID *)(RecordPtr + sizeof(HFSPlusCatalogKey));
-                return EFI_SUCCESS;
-            }
-        }
-
-        RecordPtr += sizeof(HFSPlusCatalogKey) + CatalogKey->keyLength;
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    HFSPLUS_CATALOG_SEARCH Search;
+    HFSPLUS_BTREE_CURSOR Cursor;
+    UINT8 *Record;
+    UINT16 RecordLength;
+    UINT8 *Data;
+
+    EFI_STATUS Status = PrepareBTree(Volume, &Volume->CatalogFile, HFSPLUS_CATALOG_FILE_ID, Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
     }
 
-    return EFI_NOT_FOUND;
-}
+    Search.ParentFolderID = ParentFolderID;
+    Search.FileName = FileName;
+    Search.FileNameLength = StrLen(FileName);
 
-// Load child nodes from the disk for further traversal
-BTNodeDescriptor *GetChildNode(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    HFSPlusCatalogKey *CatalogKey
-) {
-    UINTN BlockSize = BlockIo->Media->BlockSize;
-    UINT8 *ChildNodeBuffer = AllocateZeroPool(BlockSize);
-    if (ChildNodeBuffer == NULL) {
-        return NULL;
+    Status = SearchBTree(Tree, Volume->CatalogCompare, &Search, &Cursor, &Record, &RecordLength);
+    if (EFI_ERROR(Status)) {
+        return Status;
     }
 
-    // Read the child node (block specified in CatalogKey)
-    BlockIo->ReadBlocks(
-        BlockIo,
-        BlockIo->Media->MediaId,
-        CatalogKey->parentID,  // Assume child node is pointed to by parentID (this can vary based on HFS+ structure)
-        BlockSize,
-        ChildNodeBuffer
-    );
+    Status = GetBTreeRecordData(Record, RecordLength, &Data, NULL);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
 
-    return (BTNodeDescriptor *)ChildNodeBuffer;
+    *CatalogRecord = Data;
+    return EFI_SUCCESS;
 }
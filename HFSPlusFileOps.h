@@ -43,13 +43,56 @@
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/UefiBootServicesTableLib.h>
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 #include <Protocol/SimpleFileSystem.h>
+#include <Protocol/DriverBinding.h>
 #include <Guid/Gpt.h>
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
 
-#define HFSPLUS_VOL_JOURNALED  0x00800000  // HFS+ Journaled attribute flag
+#define HFSPLUS_VOL_JOURNALED  0x00002000  // HFS+ Journaled attribute flag (bit 13)
 #define HFSPLUS_SIGNATURE 0x482B  // The HFS+ signature ('H+' in ASCII)
+#define HFSX_SIGNATURE    0x4858  // Case-sensitive HFS+ ('HX')
+#define HFS_SIGNATURE     0x4244  // HFS master directory block ('BD'), possibly wrapping HFS+
+#define HFSPLUS_VOLUME_HEADER_OFFSET  1024  // Byte offset of the volume header
+#define HFSPLUS_VOLUME_HEADER_SIZE    512
+#define HFSPLUS_KEY_CASE_FOLDING      0xCF  // Catalog keyCompareType: names compare case-insensitively
+#define HFSPLUS_KEY_BINARY_COMPARE    0xBC  // Catalog keyCompareType: names compare as raw UTF-16 (HFSX)
 #define HFSPLUS_BOOT_FOLDER_ID  0x00000002  // Example folder ID for the boot directory
+#define HFSPLUS_BOOT_EFI_PATH   L"\\System\\Library\\CoreServices\\boot.efi"
+
+// Build with HFSPLUS_ENABLE_STATS=1 to keep per-volume statistics and a
+// trace of API calls and device I/O (see HFSPlusStats.c)
+#ifndef HFSPLUS_ENABLE_STATS
+#define HFSPLUS_ENABLE_STATS  0
+#endif
+
+// Build with HFSPLUS_ENABLE_THREADS=1 where the environment provides an
+// HfsParallelFor that runs work items concurrently (the host build does,
+// with threads); otherwise the items run one after another
+#ifndef HFSPLUS_ENABLE_THREADS
+#define HFSPLUS_ENABLE_THREADS  0
+#endif
+
+// Catalog node IDs of the root folder and the special files
+#define HFSPLUS_ROOT_PARENT_ID      1
+#define HFSPLUS_ROOT_FOLDER_ID      2
+#define HFSPLUS_EXTENTS_FILE_ID     3
+#define HFSPLUS_CATALOG_FILE_ID     4
+#define HFSPLUS_ALLOCATION_FILE_ID  6
+#define HFSPLUS_ATTRIBUTES_FILE_ID  8
+#define HFSPLUS_FIRST_USER_ID       16
+
+// Longest catalog node name, in UTF-16 code units
+#define HFSPLUS_MAX_NAME_LENGTH  255
+
+// Fork types in extents overflow keys
+#define HFSPLUS_DATA_FORK      0x00
+#define HFSPLUS_RESOURCE_FORK  0xFF
 
 // Structures for HFS+ extents, catalog keys, volume header, and journal info
 typedef struct HFSPlusExtentDescriptor {
@@ -64,10 +107,19 @@ typedef struct HFSPlusForkData {
     HFSPlusExtentDescriptor extents[8];
 } HFSPlusForkData;
 
+// On-disk B-tree and catalog structures are big-endian and unaligned; they
+// are only ever read through the HFS_BE* accessors below
+#pragma pack(1)
+
+typedef struct HFSUniStr255 {
+    UINT16 length;
+    UINT16 unicode[255];
+} HFSUniStr255;
+
 typedef struct HFSPlusCatalogKey {
     UINT16 keyLength;
     UINT32 parentID;
-    // Variable-length file/folder name follows
+    HFSUniStr255 nodeName;  // Only nodeName.length characters are stored
 } HFSPlusCatalogKey;
 
 typedef struct BTNodeDescriptor {
@@ -79,102 +131,1430 @@ typedef struct BTNodeDescriptor {
     UINT16 reserved;
 } BTNodeDescriptor;
 
+typedef struct BTHeaderRec {
+    UINT16 treeDepth;
+    UINT32 rootNode;
+    UINT32 leafRecords;
+    UINT32 firstLeafNode;
+    UINT32 lastLeafNode;
+    UINT16 nodeSize;
+    UINT16 maxKeyLength;
+    UINT32 totalNodes;
+    UINT32 freeNodes;
+    UINT16 reserved1;
+    UINT32 clumpSize;
+    UINT8 btreeType;
+    UINT8 keyCompareType;
+    UINT32 attributes;
+    UINT32 reserved3[16];
+} BTHeaderRec;
+
+// Key of an extents overflow B-tree record
+typedef struct HFSPlusExtentKey {
+    UINT16 keyLength;
+    UINT8 forkType;
+    UINT8 pad;
+    UINT32 fileID;
+    UINT32 startBlock;
+} HFSPlusExtentKey;
+
+typedef struct HFSPlusBSDInfo {
+    UINT32 ownerID;
+    UINT32 groupID;
+    UINT8 adminFlags;
+    UINT8 ownerFlags;
+    UINT16 fileMode;
+    UINT32 special;  // iNodeNum, linkCount or rawDevice
+} HFSPlusBSDInfo;
+
+typedef struct HFSPlusCatalogFolder {
+    INT16 recordType;
+    UINT16 flags;
+    UINT32 valence;
+    UINT32 folderID;
+    UINT32 createDate;
+    UINT32 contentModDate;
+    UINT32 attributeModDate;
+    UINT32 accessDate;
+    UINT32 backupDate;
+    HFSPlusBSDInfo permissions;
+    UINT8 userInfo[16];
+    UINT8 finderInfo[16];
+    UINT32 textEncoding;
+    UINT32 folderCount;
+} HFSPlusCatalogFolder;
+
+typedef struct HFSPlusCatalogFile {
+    INT16 recordType;
+    UINT16 flags;
+    UINT32 reserved1;
+    UINT32 fileID;
+    UINT32 createDate;
+    UINT32 contentModDate;
+    UINT32 attributeModDate;
+    UINT32 accessDate;
+    UINT32 backupDate;
+    HFSPlusBSDInfo permissions;
+    UINT8 userInfo[16];
+    UINT8 finderInfo[16];
+    UINT32 textEncoding;
+    UINT32 reserved2;
+    HFSPlusForkData dataFork;
+    HFSPlusForkData resourceFork;
+} HFSPlusCatalogFile;
+
+typedef struct HFSPlusCatalogThread {
+    INT16 recordType;
+    INT16 reserved;
+    UINT32 parentID;
+    HFSUniStr255 nodeName;
+} HFSPlusCatalogThread;
+
+// Volume header, stored 1024 bytes from the start of the volume
 typedef struct HFSPlusVolumeHeader {
     UINT16 signature;
+    UINT16 version;
     UINT32 attributes;
+    UINT32 lastMountedVersion;
     UINT32 journalInfoBlock;
-    HFSPlusForkData catalogFile;
+    UINT32 createDate;
+    UINT32 modifyDate;
+    UINT32 backupDate;
+    UINT32 checkedDate;
+    UINT32 fileCount;
+    UINT32 folderCount;
+    UINT32 blockSize;
+    UINT32 totalBlocks;
+    UINT32 freeBlocks;
+    UINT32 nextAllocation;
+    UINT32 rsrcClumpSize;
+    UINT32 dataClumpSize;
+    UINT32 nextCatalogID;
+    UINT32 writeCount;
+    UINT64 encodingsBitmap;
+    UINT32 finderInfo[8];
     HFSPlusForkData allocationFile;
-    // Additional fields omitted for brevity
+    HFSPlusForkData extentsFile;
+    HFSPlusForkData catalogFile;
+    HFSPlusForkData attributesFile;
+    HFSPlusForkData startupFile;
 } HFSPlusVolumeHeader;
 
+// HFS master directory block, also stored 1024 bytes from the start of the
+// volume. Only its embedded-volume fields are used: an HFS wrapper holds an
+// HFS+ volume in drEmbedExtent, counted in drAlBlkSiz allocation blocks
+// from sector drAlBlSt.
+typedef struct HFSExtentDescriptor {
+    UINT16 startBlock;
+    UINT16 blockCount;
+} HFSExtentDescriptor;
+
+typedef struct HFSMasterDirectoryBlock {
+    UINT16 drSigWord;
+    UINT32 drCrDate;
+    UINT32 drLsMod;
+    UINT16 drAtrb;
+    UINT16 drNmFls;
+    UINT16 drVBMSt;
+    UINT16 drAllocPtr;
+    UINT16 drNmAlBlks;
+    UINT32 drAlBlkSiz;
+    UINT32 drClpSiz;
+    UINT16 drAlBlSt;
+    UINT32 drNxtCNID;
+    UINT16 drFreeBks;
+    UINT8 drVN[28];
+    UINT32 drVolBkUp;
+    UINT16 drVSeqNum;
+    UINT32 drWrCnt;
+    UINT32 drXTClpSiz;
+    UINT32 drCTClpSiz;
+    UINT16 drNmRtDirs;
+    UINT32 drFilCnt;
+    UINT32 drDirCnt;
+    UINT32 drFndrInfo[8];
+    UINT16 drEmbedSigWord;
+    HFSExtentDescriptor drEmbedExtent;
+    UINT32 drXTFlSize;
+    HFSExtentDescriptor drXTExtRec[3];
+    UINT32 drCTFlSize;
+    HFSExtentDescriptor drCTExtRec[3];
+} HFSMasterDirectoryBlock;
+
+// Journal info block, in allocation block journalInfoBlock. Big-endian like
+// the rest of the volume.
 typedef struct HFSPlusJournalInfoBlock {
-    UINT64 offset;
+    UINT32 flags;
+    UINT32 deviceSignature[8];
+    UINT64 offset;  // Byte offset of the journal from the start of the volume
     UINT64 size;
+    UINT32 reserved[32];
 } HFSPlusJournalInfoBlock;
 
+// The journal itself is written in the byte order of the machine that
+// wrote it; HFSPLUS_JOURNAL_ENDIAN tells which. Offsets in the header are
+// relative to the start of the journal, which wraps from size back to
+// jhdrSize.
+typedef struct HFSPlusJournalHeader {
+    UINT32 magic;
+    UINT32 endian;
+    UINT64 start;        // First block list still to be replayed
+    UINT64 end;          // Where the next block list goes
+    UINT64 size;         // Whole journal, header included
+    UINT32 blhdrSize;    // Size of a block list header
+    UINT32 checksum;
+    UINT32 jhdrSize;     // Size of this header; also the unit of block numbers
+    UINT32 sequenceNum;
+} HFSPlusJournalHeader;
+
+// A journaled block: bnum counts jhdrSize units from the start of the
+// volume and is -1 for a block that was superseded within its transaction
+typedef struct HFSPlusJournalBlockInfo {
+    UINT64 bnum;
+    UINT32 bsize;
+    UINT32 checksum;  // Of the block data when HFSPLUS_BLHDR_CHECK_CHECKSUMS is set
+} HFSPlusJournalBlockInfo;
+
+// Block list header, blhdrSize bytes, followed by the data of each block.
+// binfo[0] describes the list itself; the blocks are binfo[1..numBlocks-1].
+typedef struct HFSPlusJournalBlockListHeader {
+    UINT16 maxBlocks;
+    UINT16 numBlocks;
+    UINT32 bytesUsed;  // Header plus block data
+    UINT32 checksum;
+    UINT32 flags;
+    HFSPlusJournalBlockInfo binfo[1];
+} HFSPlusJournalBlockListHeader;
+
+// Key of an attributes B-tree record: the file, the attribute name and,
+// for the extents records of a large attribute, the first block they map
+typedef struct HFSPlusAttrKey {
+    UINT16 keyLength;
+    UINT16 pad;
+    UINT32 fileID;
+    UINT32 startBlock;
+    UINT16 attrNameLen;
+    UINT16 attrName[127];  // Only attrNameLen characters are stored
+} HFSPlusAttrKey;
+
+// An attribute value stored in its attributes B-tree record
+typedef struct HFSPlusAttrData {
+    UINT32 recordType;
+    UINT32 reserved[2];
+    UINT32 attrSize;
+    UINT8 attrData[2];  // attrSize bytes
+} HFSPlusAttrData;
+
+// Start of the com.apple.decmpfs attribute. Unlike the rest of the volume
+// it is little-endian.
+typedef struct HFSPlusDecmpfsHeader {
+    UINT32 compressionMagic;
+    UINT32 compressionType;
+    UINT64 uncompressedSize;
+} HFSPlusDecmpfsHeader;
+
+#pragma pack()
+
+// Journal info block flags
+#define HFSPLUS_JIB_JOURNAL_IN_FS         0x00000001
+#define HFSPLUS_JIB_JOURNAL_OTHER_DEVICE  0x00000002
+#define HFSPLUS_JIB_JOURNAL_NEED_INIT     0x00000004
+
+#define HFSPLUS_JOURNAL_MAGIC                 0x4A4E4C78  // 'JNLx'
+#define HFSPLUS_JOURNAL_ENDIAN                0x12345678
+#define HFSPLUS_JOURNAL_HEADER_CHECKSUM_SIZE  44  // Header up to sequenceNum
+#define HFSPLUS_BLOCK_LIST_CHECKSUM_SIZE      32  // Block list header through binfo[0]
+#define HFSPLUS_BLHDR_CHECK_CHECKSUMS         0x0001
+#define HFSPLUS_BLHDR_FIRST_HEADER            0x0002
+
+// Attributes B-tree record types
+#define HFSPLUS_ATTR_INLINE_DATA  0x10
+#define HFSPLUS_ATTR_FORK_DATA    0x20
+#define HFSPLUS_ATTR_EXTENTS      0x30
+
+// HFS+ compression. A compressed file has HFSPLUS_UF_COMPRESSED in its BSD
+// owner flags and an empty data fork; its com.apple.decmpfs attribute holds
+// the header and, for the attribute types, the compressed data. The
+// resource fork types keep the data in the resource fork instead, split
+// into independently compressed chunks of HFSPLUS_DECMPFS_CHUNK_SIZE bytes.
+#define HFSPLUS_UF_COMPRESSED         0x20
+#define HFSPLUS_DECMPFS_ATTRIBUTE     L"com.apple.decmpfs"
+#define HFSPLUS_DECMPFS_MAGIC         0x636D7066  // 'fpmc'
+#define HFSPLUS_DECMPFS_CHUNK_SIZE    65536
+#define HFSPLUS_DECMPFS_MAX_CHUNK     (HFSPLUS_DECMPFS_CHUNK_SIZE + HFSPLUS_DECMPFS_CHUNK_SIZE / 16)  // Compressed
+#define HFSPLUS_DECMPFS_MAX_INLINE    (16 * 1024 * 1024)  // Largest file of an attribute type
+#define HFSPLUS_DECMPFS_BATCH_CHUNKS  8  // Whole chunks read and decompressed together
+
+#define HFSPLUS_DECMPFS_UNCOMPRESSED_ATTR  1
+#define HFSPLUS_DECMPFS_ZLIB_ATTR          3
+#define HFSPLUS_DECMPFS_ZLIB_RSRC          4
+#define HFSPLUS_DECMPFS_LZVN_ATTR          7
+#define HFSPLUS_DECMPFS_LZVN_RSRC          8
+#define HFSPLUS_DECMPFS_LZFSE_ATTR         11
+#define HFSPLUS_DECMPFS_LZFSE_RSRC         12
+
+// Big-endian accessors for on-disk fields
+#define HFS_BE16(Pointer)  SwapBytes16(ReadUnaligned16((CONST UINT16 *)(CONST VOID *)(Pointer)))
+#define HFS_BE32(Pointer)  SwapBytes32(ReadUnaligned32((CONST UINT32 *)(CONST VOID *)(Pointer)))
+#define HFS_BE64(Pointer)  SwapBytes64(ReadUnaligned64((CONST UINT64 *)(CONST VOID *)(Pointer)))
+#define HFS_PUT16(Pointer, Value)  WriteUnaligned16((UINT16 *)(VOID *)(Pointer), SwapBytes16(Value))
+#define HFS_PUT32(Pointer, Value)  WriteUnaligned32((UINT32 *)(VOID *)(Pointer), SwapBytes32(Value))
+#define HFS_PUT64(Pointer, Value)  WriteUnaligned64((UINT64 *)(VOID *)(Pointer), SwapBytes64(Value))
+
+// B-tree node kinds
+#define BT_LEAF_NODE    0xFF
+#define BT_INDEX_NODE   0x00
+#define BT_HEADER_NODE  0x01
+#define BT_MAP_NODE     0x02
+
+// B-tree header attributes
+#define BT_BIG_KEYS_MASK            0x00000002
+#define BT_VARIABLE_INDEX_KEYS_MASK 0x00000004
+
+#define BT_MIN_NODE_SIZE  512
+#define BT_MAX_NODE_SIZE  32768
+#define BT_MAX_DEPTH      16
+
+// Catalog record types
+#define HFSPLUS_FOLDER_RECORD         0x0001
+#define HFSPLUS_FILE_RECORD           0x0002
+#define HFSPLUS_FOLDER_THREAD_RECORD  0x0003
+#define HFSPLUS_FILE_THREAD_RECORD    0x0004
+
+// Per on-disk bitmap block summary of free space, used to skip whole
+// bitmap blocks during free-run searches
+typedef struct {
+    UINT32 FreeCount;
+    UINT32 LeadingFree;
+    UINT32 TrailingFree;
+    UINT32 LargestFreeRun;
+} HFSPLUS_BITMAP_SUMMARY;
+
+// In-memory copy of the allocation bitmap. Bits are stored in 64-bit words
+// with block N at bit (N % 64) of word (N / 64); a set bit means allocated.
+typedef struct {
+    BOOLEAN Loaded;
+    UINT64 *Words;
+    VOID *WordsAllocation;
+    UINT64 WordCount;
+    UINT64 BitCount;
+    UINT64 FreeBlocks;
+    UINT32 BitsPerBitmapBlock;
+    UINT32 WordsPerBitmapBlock;
+    UINT64 SummaryCount;
+    HFSPLUS_BITMAP_SUMMARY *Summary;
+    HFSPlusExtentDescriptor *Extents;  // Allocation file, overflow records included
+    UINTN ExtentCount;
+} HFSPLUS_BITMAP_CACHE;
+
+// Entry points whose calls, errors and cycles are counted
+typedef enum {
+    HfsStatsMount,
+    HfsStatsResolvePath,
+    HfsStatsOpenFork,
+    HfsStatsReadAt,
+    HfsStatsReadFile,
+    HfsStatsWriteFile,
+    HfsStatsLoadBootEfi,
+    HfsStatsReadDirectory,
+    HfsStatsApiCount
+} HFSPLUS_STATS_API;
+
+#define HFSPLUS_STATS_TREES         4     // Catalog, extents, attributes, other
+#define HFSPLUS_STATS_LEVELS        8     // Node height: 0 header and map nodes, 1 leaves, ...
+#define HFSPLUS_STATS_SIZE_BUCKETS  12    // 512 bytes, 1 KiB, ... 1 MiB and larger
+#define HFSPLUS_STATS_TRACE_EVENTS  16384
+
+#define HFSPLUS_TRACE_API    0
+#define HFSPLUS_TRACE_READ   1
+#define HFSPLUS_TRACE_WRITE  2
+#define HFSPLUS_TRACE_FLUSH  3
+
+// One span of the trace, in AsmReadTsc() units
+typedef struct {
+    UINT64 Start;
+    UINT64 Cycles;
+    UINT64 Lba;
+    UINT32 Bytes;
+    UINT8 Kind;
+    UINT8 Api;
+    UINT16 Failed;
+} HFSPLUS_TRACE_EVENT;
+
+typedef struct {
+    UINT64 Calls;
+    UINT64 Errors;
+    UINT64 Cycles;
+    UINT64 MaxCycles;
+} HFSPLUS_API_STATS;
+
+// Counters for one mounted volume. Cache hit rates live with the caches.
+typedef struct {
+    HFSPLUS_API_STATS Api[HfsStatsApiCount];
+    UINT64 Reads;
+    UINT64 Writes;
+    UINT64 BytesRead;
+    UINT64 BytesWritten;
+    UINT64 ReadCycles;
+    UINT64 WriteCycles;
+    UINT64 Flushes;
+    UINT64 FlushCycles;
+    UINT64 ReadSizes[HFSPLUS_STATS_SIZE_BUCKETS];
+    UINT64 WriteSizes[HFSPLUS_STATS_SIZE_BUCKETS];
+    UINT64 NodeHits[HFSPLUS_STATS_TREES][HFSPLUS_STATS_LEVELS];
+    UINT64 NodeMisses[HFSPLUS_STATS_TREES][HFSPLUS_STATS_LEVELS];
+    HFSPLUS_TRACE_EVENT *Trace;  // First HFSPLUS_STATS_TRACE_EVENTS spans since the last reset
+    UINT32 TraceCount;
+    UINT64 TraceDropped;
+} HFSPLUS_STATS;
+
+#if HFSPLUS_ENABLE_STATS
+#define HFS_STATS_START(Start)                        UINT64 Start = AsmReadTsc()
+#define HFS_STATS_API(Volume, Api, Start, Status)     HfsStatsRecordApi((Volume), (Api), (Start), (Status))
+#define HFS_STATS_NODE(Cache, TreeId, Node, Hit)      HfsStatsRecordNode((Cache)->Stats, (TreeId), (Node), (Hit))
+#define HFS_STATS_IO(Volume, Kind, Lba, Size, Start, Status) \
+    HfsStatsRecordIo((Volume), (Kind), (Lba), (Size), (Start), (Status))
+#else
+#define HFS_STATS_START(Start)
+#define HFS_STATS_API(Volume, Api, Start, Status)
+#define HFS_STATS_NODE(Cache, TreeId, Node, Hit)
+#define HFS_STATS_IO(Volume, Kind, Lba, Size, Start, Status)
+#endif
+
+#define HFSPLUS_NODE_CACHE_ENTRIES        64
+#define HFSPLUS_NODE_CACHE_BUCKETS        128
+#define HFSPLUS_NODE_CACHE_MAX_PINNED     (HFSPLUS_NODE_CACHE_ENTRIES / 4)
+#define HFSPLUS_NODE_CACHE_PINNED_LEVELS  2     // Root plus the first index level
+#define HFSPLUS_NODE_CACHE_NONE           0xFFFF
+
+typedef struct {
+    UINT32 TreeId;
+    UINT32 NodeNumber;
+    UINT16 LruPrev;
+    UINT16 LruNext;
+    UINT16 HashNext;
+    BOOLEAN Valid;
+    BOOLEAN Pinned;
+    UINT8 *Data;
+} HFSPLUS_NODE_CACHE_ENTRY;
+
+// Bounded cache of B-tree nodes keyed by (tree file ID, node number).
+// Unpinned entries are kept on an LRU list, most recently used at the head.
+typedef struct {
+    UINT32 SlotSize;
+    UINT32 PinnedCount;
+    UINT16 LruHead;
+    UINT16 LruTail;
+    UINT16 Buckets[HFSPLUS_NODE_CACHE_BUCKETS];
+    HFSPLUS_NODE_CACHE_ENTRY Entries[HFSPLUS_NODE_CACHE_ENTRIES];
+    UINT8 *Buffer;
+    UINT64 Hits;
+    UINT64 Misses;
+    UINT64 Evictions;
+#if HFSPLUS_ENABLE_STATS
+    HFSPLUS_STATS *Stats;  // Owning volume's statistics
+#endif
+} HFSPLUS_NODE_CACHE;
+
+struct _HFSPLUS_VOLUME;
+
+// An open B-tree: the file it lives in, mapped through its complete extent
+// list, plus the fields of its header node
+typedef struct {
+    BOOLEAN Valid;
+    struct _HFSPLUS_VOLUME *Volume;
+    HFSPlusForkData Fork;
+    HFSPlusExtentDescriptor *Extents;  // Whole fork, overflow records included
+    UINTN ExtentCount;
+    UINT32 TreeId;
+    UINT32 NodeSize;
+    UINT16 TreeDepth;
+    UINT16 MaxKeyLength;
+    UINT32 RootNode;
+    UINT32 FirstLeafNode;
+    UINT32 LastLeafNode;
+    UINT32 TotalNodes;
+    UINT32 Attributes;
+    UINT8 KeyCompareType;
+} HFSPLUS_BTREE;
+
+// Orders a search key, described by Context, against an on-disk record key:
+// negative, zero or positive as the search key sorts before, equal to or
+// after it. RecordLength bounds what may be read of the key.
+typedef INTN (*HFSPLUS_BTREE_COMPARE)(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+);
+
+// Search key of a catalog lookup, for CompareCatalogSearchKey
+typedef struct {
+    UINT32 ParentFolderID;
+    CONST CHAR16 *FileName;
+    UINTN FileNameLength;
+} HFSPLUS_CATALOG_SEARCH;
+
+// A position in a B-tree's leaf level, as left by SearchBTree
+typedef struct {
+    UINT32 NodeNumber;  // 0 once the walk has passed the last leaf
+    UINT16 RecordIndex;
+} HFSPLUS_BTREE_CURSOR;
+
+#define HFSPLUS_PATH_CACHE_ENTRIES      256  // Power of two
+#define HFSPLUS_PATH_CACHE_NAME_LENGTH  64   // Longer names are looked up every time
+
+// One (parent folder ID, name) -> catalog node ID mapping
+typedef struct {
+    UINT32 ParentID;
+    UINT32 NodeID;  // 0 marks an empty slot
+    UINT32 LinkID;  // Hard link the name is, 0 for an ordinary file or folder
+    UINT16 RecordType;
+    UINT16 NameLength;
+    CHAR16 Name[HFSPLUS_PATH_CACHE_NAME_LENGTH];
+} HFSPLUS_PATH_CACHE_ENTRY;
+
+// Direct-mapped cache of path component lookups
+typedef struct {
+    HFSPLUS_PATH_CACHE_ENTRY Entries[HFSPLUS_PATH_CACHE_ENTRIES];
+    UINT64 Hits;
+    UINT64 Misses;
+} HFSPLUS_PATH_CACHE;
+
+// Hard links. A file hard link is a file record of type 'hlnk', creator
+// 'hfs+', whose BSD special field holds the number of its inode: the file
+// "iNode<n>" in the private data folder at the root, whose name starts with
+// four NULs. A directory hard link is of type 'fdrp', creator 'MACS', and
+// stands for the folder "dir_<n>" in the private directory data folder.
+#define HFSPLUS_HARDLINK_FILE_TYPE         0x686C6E6B  // 'hlnk'
+#define HFSPLUS_HARDLINK_CREATOR           0x6866732B  // 'hfs+'
+#define HFSPLUS_HARDLINK_FOLDER_TYPE       0x66647270  // 'fdrp'
+#define HFSPLUS_HARDLINK_FOLDER_CREATOR    0x4D414353  // 'MACS'
+#define HFSPLUS_PRIVATE_DATA_NAME          L"\0\0\0\0HFS+ Private Data"
+#define HFSPLUS_PRIVATE_DATA_NAME_LENGTH   21
+#define HFSPLUS_PRIVATE_DIR_NAME           L".HFS+ Private Directory Data\r"
+#define HFSPLUS_LINK_CACHE_ENTRIES         16  // Power of two
+
+// An inode a hard link resolved to, with a copy of its catalog record
+typedef struct {
+    UINT32 INodeNumber;          // 0 marks an empty slot
+    BOOLEAN Folder;
+    HFSPlusCatalogFile Record;   // On-disk copy; folders use the HFSPlusCatalogFolder prefix
+} HFSPLUS_LINK_CACHE_ENTRY;
+
+// Direct-mapped cache of resolved hard links, so opening a link again
+// costs no inode lookup. The private folders are looked up once.
+typedef struct {
+    UINT32 FilePrivateID;    // 0 until looked up, MAX_UINT32 when the volume has none
+    UINT32 FolderPrivateID;
+    HFSPLUS_LINK_CACHE_ENTRY Entries[HFSPLUS_LINK_CACHE_ENTRIES];
+    UINT64 Hits;
+    UINT64 Misses;
+} HFSPLUS_LINK_CACHE;
+
+#define HFSPLUS_IO_MAX_IN_FLIGHT  8                  // Block I/O 2 requests queued at once
+#define HFSPLUS_IO_MAX_REQUEST    (1024 * 1024)        // Largest single device read
+
+// One device read of a batched fork read
+typedef struct {
+    UINT64 Lba;
+    UINT64 Offset;  // Byte offset in the destination buffer
+    UINTN Length;
+} HFSPLUS_IO_REQUEST;
+
+#define HFSPLUS_READAHEAD_SLOTS       4
+#define HFSPLUS_READAHEAD_MIN_WINDOW  (32 * 1024)
+#define HFSPLUS_READAHEAD_MAX_WINDOW  (512 * 1024)  // Also the size of each slot
+
+// A run of device blocks read ahead of a sequential reader
+typedef struct {
+    UINT64 Lba;
+    UINTN BlockCount;  // 0 marks an empty slot
+    UINT64 LastUse;
+    UINT8 *Data;
+} HFSPLUS_READAHEAD_SLOT;
+
+// Per-volume pool of read-ahead buffers shared by all open forks
+typedef struct {
+    UINT32 BlockSize;
+    UINT64 Clock;
+    HFSPLUS_READAHEAD_SLOT Slots[HFSPLUS_READAHEAD_SLOTS];
+    UINT64 Hits;
+    UINT64 Fills;
+} HFSPLUS_READAHEAD_POOL;
+
+// A device block written inside the open journal transaction
+typedef struct {
+    UINT64 Lba;
+    UINT8 *Data;  // The new contents, one device block
+} HFSPLUS_TRANSACTION_BLOCK;
+
+// The journal of a mounted journaled volume. Metadata written between
+// HfsBeginTransaction and HfsEndTransaction collects in Blocks, sorted by
+// LBA with one copy per block, and reaches the disk as one transaction
+// when the outermost transaction ends.
+typedef struct {
+    BOOLEAN Writable;      // Found, replayed and able to take transactions
+    BOOLEAN Swap;          // Written by a machine of the other byte order
+    UINT64 Offset;         // Of the journal on the volume, in bytes
+    UINT64 Size;
+    UINT32 HeaderSize;     // jhdrSize
+    UINT32 BlockListSize;  // blhdrSize
+    UINT64 Start;
+    UINT64 End;
+    UINT8 *Header;         // First device block of the journal, as on disk
+    UINT32 Depth;          // Nesting of open transactions
+    EFI_STATUS TransactionStatus;  // First failure inside the open transaction
+    HFSPLUS_TRANSACTION_BLOCK *Blocks;
+    UINTN BlockCount;
+    UINTN BlockCapacity;
+} HFSPLUS_JOURNAL;
+
+#define HFSPLUS_ARENA_CHUNK_SIZE  (64 * 1024)  // Smallest scratch chunk taken from pool
+#define HFSPLUS_ARENA_ALIGNMENT   16
+
+// Buffers of one size, recycled through a free list threaded through the
+// released buffers themselves
+typedef struct {
+    UINT32 BufferSize;
+    UINT32 Outstanding;  // Acquired and not yet released
+    UINT32 FreeCount;
+    VOID *FreeList;
+} HFSPLUS_SLAB;
+
+// A scratch chunk; its data follows the header
+typedef struct _HFSPLUS_ARENA_CHUNK {
+    struct _HFSPLUS_ARENA_CHUNK *Next;  // Older chunk, or the next spare
+    UINTN Size;
+    UINTN Used;
+} HFSPLUS_ARENA_CHUNK;
+
+// A position in the scratch arena to reset back to
+typedef struct {
+    HFSPLUS_ARENA_CHUNK *Chunk;
+    UINTN Used;
+} HFSPLUS_ARENA_MARK;
+
+// Per-volume temporary memory. Device-block buffers come from a slab;
+// anything else a lookup or a write needs only until it returns is bump
+// allocated from scratch chunks and dropped in one go by ArenaReset. Chunks
+// and buffers are kept for the next caller, so a warm volume allocates
+// nothing for its temporaries.
+typedef struct {
+    HFSPLUS_SLAB Blocks;           // DeviceBlockSize buffers
+    HFSPLUS_ARENA_CHUNK *Chunks;   // In use, newest first
+    HFSPLUS_ARENA_CHUNK *Spare;    // Emptied by ArenaReset
+} HFSPLUS_ARENA;
+
+#define HFSPLUS_MAX_MOUNTED_VOLUMES  32
+
+struct _HFSPLUS_DECMPFS;
+
+// An open fork for streaming reads. The cursor remembers the extent of the
+// last read so sequential reads never search the extent list again.
+// The contents of a compressed file are opened as a fork too; they have no
+// extents and are read through Compressed.
+typedef struct {
+    struct _HFSPLUS_VOLUME *Volume;
+    UINT32 FileID;
+    UINT8 ForkType;
+    UINT64 Size;
+    HFSPlusExtentDescriptor *Extents;
+    UINTN ExtentCount;
+    UINTN CursorExtent;
+    UINT64 CursorOffset;   // Fork offset where the cursor extent starts
+    UINT8 *BounceBlock;    // One device block for unaligned edges
+    UINT64 NextOffset;     // Where a sequential reader continues
+    UINT32 ReadAheadWindow;
+    struct _HFSPLUS_DECMPFS *Compressed;
+} HFSPLUS_FORK;
+
+// Compressed bytes of one chunk of a compressed file
+typedef struct {
+    UINT64 Offset;  // In the resource fork, or in the attribute for the attribute types
+    UINT32 Size;
+} HFSPLUS_DECMPFS_CHUNK;
+
+// An open compressed file. Reads that cover whole chunks decompress them
+// straight into the caller's buffer; Cache keeps the last chunk that a
+// read only needed part of.
+typedef struct _HFSPLUS_DECMPFS {
+    UINT32 Type;
+    UINT32 ChunkSize;           // Uncompressed; the whole file for the attribute types
+    UINT32 ChunkCount;
+    HFSPLUS_DECMPFS_CHUNK *Chunks;
+    UINT8 *Attribute;           // Attribute data of the attribute types
+    HFSPLUS_FORK *ResourceFork;
+    UINT8 *Compressed;          // Up to HFSPLUS_DECMPFS_BATCH_CHUNKS chunks from the resource fork
+    UINT8 *Cache;
+    UINT32 CachedChunk;         // MAX_UINT32 when Cache holds nothing
+} HFSPLUS_DECMPFS;
+
+// A work item of HfsParallelFor
+typedef VOID (*HFSPLUS_WORK_ITEM)(VOID *Context, UINTN Index);
+
+// A mounted volume. MountHfsPlusVolume reads and checks the volume header
+// once and keeps it here with the caches, so every read, write and lookup
+// takes the volume instead of re-reading the header.
+typedef struct _HFSPLUS_VOLUME {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    UINTN MountCount;            // Mounts not yet matched by an unmount
+    UINT32 DeviceBlockSize;
+    EFI_LBA StartLba;            // Device block the HFS+ volume starts at; non-zero inside an HFS wrapper
+    UINT32 AllocationBlockSize;  // Unit of fork extents and of the allocation bitmap
+    UINT32 DeviceBlocksPerAllocationBlock;  // 0 when allocation blocks are smaller than device blocks
+    HFSPlusVolumeHeader Header;  // On-disk copy, big-endian
+    UINT16 Signature;
+    UINT16 Version;
+    UINT32 Attributes;
+    BOOLEAN Journaled;
+    UINT32 JournalInfoBlock;
+    UINT32 TotalBlocks;
+    UINT32 FreeBlocks;
+    UINT32 NextAllocation;
+    UINT32 NextCatalogID;
+    UINT32 FileCount;
+    UINT32 FolderCount;
+    HFSPlusForkData AllocationFile;
+    HFSPlusForkData ExtentsFile;
+    HFSPlusForkData CatalogFile;
+    HFSPlusForkData AttributesFile;
+    HFSPlusForkData StartupFile;
+    HFSPLUS_BITMAP_CACHE Bitmap;
+    HFSPLUS_NODE_CACHE NodeCache;
+    HFSPLUS_BTREE CatalogTree;
+    HFSPLUS_BTREE_COMPARE CatalogCompare;  // Catalog search order, picked from the catalog header
+    HFSPLUS_BTREE ExtentsTree;
+    HFSPLUS_BTREE AttributesTree;
+    HFSPLUS_PATH_CACHE *PathCache;
+    HFSPLUS_LINK_CACHE Links;
+    BOOLEAN BlockIo2Probed;
+    EFI_BLOCK_IO2_PROTOCOL *BlockIo2;  // NULL when the device only has Block I/O
+    HFSPLUS_READAHEAD_POOL ReadAhead;
+    HFSPLUS_JOURNAL Journal;
+    HFSPLUS_ARENA Arena;
+#if HFSPLUS_ENABLE_STATS
+    HFSPLUS_STATS Stats;
+#endif
+} HFSPLUS_VOLUME;
+
+// Kinds of volume DetectHfsPlusPartitions reports, in order of preference
+typedef enum {
+    HfsProbeHfsPlus,   // Plain HFS+
+    HfsProbeHfsx,      // Case-sensitive HFSX
+    HfsProbeWrapped    // HFS+ embedded in an HFS wrapper
+} HFSPLUS_PROBE_KIND;
+
+// A partition found by DetectHfsPlusPartitions. Journaled is only known
+// for unwrapped volumes; the embedded header of a wrapper is not read.
+typedef struct {
+    EFI_HANDLE Handle;
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    HFSPLUS_PROBE_KIND Kind;
+    UINT64 VolumeOffset;   // Byte offset of the HFS+ volume within the partition
+    BOOLEAN Journaled;
+    BOOLEAN Removable;
+} HFSPLUS_PARTITION;
+
+// One child of a folder, decoded from its catalog record by HfsReadDirectory
+typedef struct {
+    UINT32 NodeID;
+    UINT16 RecordType;     // HFSPLUS_FILE_RECORD or HFSPLUS_FOLDER_RECORD
+    BOOLEAN Compressed;    // The size is in the decmpfs attribute, not the data fork
+    UINT16 FinderFlags;
+    UINT32 CreateDate;
+    UINT32 ContentModDate;
+    UINT32 AccessDate;
+    UINT64 Size;           // Data fork length; 0 for folders
+    UINT64 PhysicalSize;   // Bytes allocated to the fork holding the contents
+    UINT16 NameLength;
+    CHAR16 Name[HFSPLUS_MAX_NAME_LENGTH + 1];
+} HFSPLUS_DIR_ENTRY;
+
+#define HFSPLUS_DIR_PREFETCH_NODES  8  // Leaves read ahead at once by a prefetching iterator
+
+// A walk over the children of one folder. The cursor starts after the
+// folder's thread record, (FolderID, ""), and moves along the leaf chain
+// until the parent ID changes, so listing a folder costs one descent.
+typedef struct {
+    HFSPLUS_VOLUME *Volume;
+    UINT32 FolderID;
+    HFSPLUS_BTREE_CURSOR Cursor;
+    UINT32 PrefetchedLeaf;  // Leaf whose successors were last read ahead
+    BOOLEAN Prefetch;
+    BOOLEAN Done;
+} HFSPLUS_DIR_ITERATOR;
+
+#define HFSPLUS_FILE_SYSTEM_SIGNATURE  SIGNATURE_32('h', 'f', 's', 'v')
+#define HFSPLUS_FILE_SIGNATURE         SIGNATURE_32('h', 'f', 's', 'f')
+
+// A volume published through EFI_SIMPLE_FILE_SYSTEM_PROTOCOL. The driver
+// mounts it once when it starts on the device, and every file handle
+// opened on it shares the mounted volume and its caches.
+typedef struct {
+    UINT32 Signature;
+    EFI_HANDLE Handle;
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    HFSPLUS_VOLUME *Volume;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL SimpleFileSystem;
+    UINTN OpenFiles;
+} HFSPLUS_FILE_SYSTEM;
+
+// An EFI_FILE_PROTOCOL handle. A file keeps its fork open, with the fork's
+// extent cursor, so each Read resumes where the last one stopped.
+typedef struct {
+    UINT32 Signature;
+    EFI_FILE_PROTOCOL File;
+    HFSPLUS_FILE_SYSTEM *FileSystem;
+    UINT32 NodeID;
+    UINT32 LinkID;                 // Hard link the file was opened through, 0 if none
+    BOOLEAN Directory;
+    HFSPLUS_FORK *Fork;            // NULL for folders
+    UINT64 Position;
+    HFSPlusCatalogFile Record;     // On-disk copy; folders use the HFSPlusCatalogFolder prefix
+    HFSPLUS_DIR_ITERATOR Iterator; // Folders: walk for Read, opened on the first Read
+    HFSPLUS_DIR_ENTRY *Entries;    // Folders: the batch Read hands out, one entry per call
+    UINTN EntryCount;
+    UINTN EntryIndex;
+} HFSPLUS_FILE;
+
 // Function declarations for file system and journal operations
+EFI_STATUS ExtentListBlockToDiskBlock(
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 ForkBlock,
+    UINT64 *DiskBlock,
+    UINT64 *ContiguousBlocks
+);
+
+EFI_STATUS ForkBlockToDiskBlock(
+    HFSPlusForkData *ForkData,
+    UINT64 ForkBlock,
+    UINT64 *DiskBlock,
+    UINT64 *ContiguousBlocks
+);
+
+EFI_STATUS ForkOffsetToDeviceBlock(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Offset,
+    UINT64 *Lba
+);
+
+EFI_STATUS FindFreeBlocks(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 RequiredBlocks,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 MaxRuns,
+    UINT32 *RunCount
+);
+
+EFI_STATUS MarkBlockRunsAllocated(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount
+);
+
+EFI_STATUS MarkBlockRunsFree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount
+);
+
+EFI_STATUS WriteBlockRun(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT8 *Source,
+    UINT64 ByteCount,
+    UINT8 **BounceBlock
+);
+
+// Replace a fork's contents, releasing its previous extents. The new data
+// is limited to the eight inline extents: when the eight largest free runs
+// cannot hold it the write fails with EFI_VOLUME_FULL, and a fork that
+// already uses the extents overflow tree cannot be rewritten
+// (EFI_UNSUPPORTED).
 EFI_STATUS WriteFileWithFragmentation(
-    EFI_HANDLE ImageHandle,
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+    HFSPLUS_VOLUME *Volume,
     HFSPlusForkData *ForkData,
-    UINT32 TotalBlocks,
     VOID *Data,
-    UINT64 DataSize,
-    HFSPlusForkData *AllocationFile,
-    HFSPlusForkData *ExtentOverflowFile
+    UINT64 DataSize
 );
 
 EFI_STATUS ReadFileWithFragmentation(
-    EFI_HANDLE ImageHandle,
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+    HFSPLUS_VOLUME *Volume,
     HFSPlusForkData *ForkData,
-    UINT32 TotalBlocks,
-    VOID **FileData,
-    HFSPlusForkData *ExtentOverflowFile
+    UINT32 FileID,
+    UINT8 ForkType,
+    VOID **FileData
+);
+
+EFI_STATUS GatherForkExtents(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    BOOLEAN Scratch,
+    HFSPlusExtentDescriptor **Extents,
+    UINTN *ExtentCount
+);
+
+EFI_STATUS ReadExtentList(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Length,
+    VOID *Buffer
+);
+
+EFI_STATUS ReadBlockRun(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT64 BlockCount,
+    UINT8 *Destination,
+    UINT64 BytesWanted,
+    UINT8 **BounceBlock
 );
 
 EFI_STATUS DetectHfsPlusPartitions(
-    EFI_BLOCK_IO_PROTOCOL **BlockIoProtocol,
-    UINTN *HfsPartitionCount
+    HFSPLUS_PARTITION **Partitions,
+    UINTN *PartitionCount
+);
+
+EFI_STATUS ProbeHfsPlusDevice(
+    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+    HFSPLUS_PARTITION *Partition
+);
+
+BOOLEAN HfsClassifyVolumeHeader(
+    CONST UINT8 *Header,
+    HFSPLUS_PARTITION *Partition
+);
+
+EFI_STATUS
+EFIAPI
+HfsPlusDriverEntryPoint(
+    IN EFI_HANDLE ImageHandle,
+    IN EFI_SYSTEM_TABLE *SystemTable
 );
 
 EFI_STATUS MountHfsPlusVolume(
     EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    HFSPlusForkData *AllocationFile,
-    BOOLEAN *IsJournaled
+    HFSPLUS_VOLUME **Volume
 );
 
-EFI_STATUS FindAndLoadBootEfi(
+HFSPLUS_VOLUME *HfsLookupVolume(
     EFI_BLOCK_IO_PROTOCOL *BlockIo
 );
 
-EFI_STATUS LoadBootEfi(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    HFSPlusForkData *AllocationFile,
-    VOID **BootEfiData
+VOID UnmountHfsPlusVolume(
+    HFSPLUS_VOLUME *Volume
 );
 
-EFI_STATUS TraverseCatalogBTree(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    UINT32 ParentFolderID,
-    CHAR16 *FileName,
-    VOID **CatalogRecord
+EFI_STATUS LoadBitmapCache(
+    HFSPLUS_VOLUME *Volume,
+    HFSPLUS_BITMAP_CACHE *Cache
 );
 
-EFI_STATUS TraverseBTreeNodeRecursively(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
+VOID FreeBitmapCache(
+    HFSPLUS_BITMAP_CACHE *Cache
+);
+
+BOOLEAN BitmapCacheNextFreeRun(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 *Cursor,
+    UINT64 Limit,
+    UINT32 MinLength,
+    UINT64 *RunStart,
+    UINT64 *RunLength
+);
+
+VOID BitmapCacheSetRange(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 StartBit,
+    UINT64 BitCount,
+    BOOLEAN Allocated
+);
+
+VOID BitmapCacheExportBlock(
+    HFSPLUS_BITMAP_CACHE *Cache,
+    UINT64 SummaryIndex,
+    UINT8 *Buffer
+);
+
+EFI_STATUS NodeCacheInit(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT32 SlotSize
+);
+
+VOID NodeCacheFree(
+    HFSPLUS_NODE_CACHE *Cache
+);
+
+EFI_STATUS NodeCacheGet(
+    HFSPLUS_NODE_CACHE *Cache,
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    BOOLEAN Pin,
+    UINT8 **Node
+);
+
+EFI_STATUS NodeCachePrefetch(
+    HFSPLUS_NODE_CACHE *Cache,
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    UINT32 Count
+);
+
+EFI_STATUS ReadForkRange(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusExtentDescriptor *Extents,
+    UINTN ExtentCount,
+    UINT64 Size,
+    UINT64 Offset,
+    UINTN Length,
+    VOID *Buffer
+);
+
+EFI_STATUS OpenBTree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *Fork,
+    UINT32 TreeId,
+    HFSPLUS_BTREE *Tree
+);
+
+VOID CloseBTree(
+    HFSPLUS_BTREE *Tree
+);
+
+EFI_STATUS ReadBTreeNodeFromDisk(
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    UINT8 *Buffer
+);
+
+EFI_STATUS GetBTreeRecord(
+    HFSPLUS_BTREE *Tree,
     UINT8 *NodeBuffer,
+    UINT16 RecordIndex,
+    UINT8 **Record,
+    UINT16 *RecordLength
+);
+
+EFI_STATUS PrepareBTree(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *Fork,
+    UINT32 TreeId,
+    HFSPLUS_BTREE *Tree
+);
+
+EFI_STATUS GetBTreeRecordData(
+    UINT8 *Record,
+    UINT16 RecordLength,
+    UINT8 **Data,
+    UINT16 *DataLength
+);
+
+EFI_STATUS SearchBTree(
+    HFSPLUS_BTREE *Tree,
+    HFSPLUS_BTREE_COMPARE Compare,
+    VOID *Context,
+    HFSPLUS_BTREE_CURSOR *Cursor,
+    UINT8 **Record,
+    UINT16 *RecordLength
+);
+
+EFI_STATUS ReadBTreeCursor(
+    HFSPLUS_BTREE *Tree,
+    HFSPLUS_BTREE_CURSOR *Cursor,
+    UINT8 **Record,
+    UINT16 *RecordLength
+);
+
+INTN HfsFastUnicodeCompare(
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    CONST UINT8 *DiskName,
+    UINTN DiskNameLength
+);
+
+INTN HfsBinaryUnicodeCompare(
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    CONST UINT8 *DiskName,
+    UINTN DiskNameLength
+);
+
+INTN CompareCatalogKey(
     UINT32 ParentFolderID,
-    CHAR16 *FileName,
+    CONST CHAR16 *FileName,
+    UINTN FileNameLength,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+);
+
+INTN CompareCatalogSearchKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+);
+
+INTN CompareBinaryCatalogSearchKey(
+    VOID *Context,
+    CONST UINT8 *Key,
+    UINT16 RecordLength
+);
+
+VOID HfsForkDataFromDisk(
+    CONST HFSPlusForkData *DiskFork,
+    HFSPlusForkData *Fork
+);
+
+VOID NodeCacheInvalidate(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT32 TreeId,
+    UINT32 NodeNumber
+);
+
+EFI_STATUS HfsOpenFork(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    HFSPLUS_FORK **Fork
+);
+
+EFI_STATUS HfsReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+);
+
+VOID HfsCloseFork(
+    HFSPLUS_FORK *Fork
+);
+
+EFI_STATUS HfsOpenFile(
+    HFSPLUS_VOLUME *Volume,
+    CONST VOID *CatalogRecord,
+    HFSPLUS_FORK **Fork
+);
+
+EFI_STATUS InternalOpenFork(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    HFSPLUS_FORK **Fork
+);
+
+EFI_STATUS InternalReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+);
+
+EFI_STATUS HfsReadAttribute(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    CONST CHAR16 *Name,
+    VOID **Data,
+    UINTN *DataSize
+);
+
+EFI_STATUS DecmpfsOpen(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    HFSPlusForkData *ResourceFork,
+    HFSPLUS_FORK **Fork
+);
+
+EFI_STATUS DecmpfsGetSize(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FileID,
+    UINT64 *FileSize
+);
+
+EFI_STATUS DecmpfsReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+);
+
+VOID DecmpfsFree(
+    HFSPLUS_DECMPFS *Decmpfs
+);
+
+EFI_STATUS HfsZlibDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+);
+
+EFI_STATUS HfsLzvnDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+);
+
+EFI_STATUS HfsLzfseDecompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize,
+    UINTN *DecompressedSize
+);
+
+VOID HfsParallelFor(
+    UINTN Count,
+    HFSPLUS_WORK_ITEM Work,
+    VOID *Context
+);
+
+UINTN ReadAheadLookup(
+    HFSPLUS_READAHEAD_POOL *Pool,
+    UINT64 Lba,
+    UINT32 Skip,
+    UINTN Length,
+    VOID *Destination
+);
+
+EFI_STATUS ReadAheadFill(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINTN BlockCount
+);
+
+VOID ReadAheadInvalidate(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT64 BlockCount
+);
+
+VOID ReadAheadFree(
+    HFSPLUS_READAHEAD_POOL *Pool
+);
+
+VOID ArenaInit(
+    HFSPLUS_ARENA *Arena,
+    UINT32 BlockSize
+);
+
+VOID ArenaFree(
+    HFSPLUS_ARENA *Arena
+);
+
+VOID *SlabAcquire(
+    HFSPLUS_SLAB *Slab
+);
+
+VOID SlabRelease(
+    HFSPLUS_SLAB *Slab,
+    VOID *Buffer
+);
+
+VOID ArenaMark(
+    HFSPLUS_ARENA *Arena,
+    HFSPLUS_ARENA_MARK *Mark
+);
+
+VOID *ArenaAlloc(
+    HFSPLUS_ARENA *Arena,
+    UINTN Size
+);
+
+VOID ArenaReset(
+    HFSPLUS_ARENA *Arena,
+    CONST HFSPLUS_ARENA_MARK *Mark
+);
+
+EFI_STATUS HfsReadDevice(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+);
+
+EFI_STATUS HfsWriteDevice(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+);
+
+EFI_STATUS HfsFlushDevice(
+    HFSPLUS_VOLUME *Volume
+);
+
+VOID HfsStatsRecordIo(
+    HFSPLUS_VOLUME *Volume,
+    UINT8 Kind,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    UINT64 Start,
+    EFI_STATUS Status
+);
+
+VOID HfsStatsRecordApi(
+    HFSPLUS_VOLUME *Volume,
+    HFSPLUS_STATS_API Api,
+    UINT64 Start,
+    EFI_STATUS Status
+);
+
+VOID HfsStatsRecordNode(
+    HFSPLUS_STATS *Stats,
+    UINT32 TreeId,
+    CONST UINT8 *Node,
+    BOOLEAN Hit
+);
+
+VOID HfsStatsReset(
+    HFSPLUS_VOLUME *Volume
+);
+
+VOID HfsStatsFree(
+    HFSPLUS_VOLUME *Volume
+);
+
+CONST CHAR8 *HfsStatsApiName(
+    HFSPLUS_STATS_API Api
+);
+
+CONST CHAR8 *HfsStatsTreeName(
+    UINTN Tree
+);
+
+EFI_STATUS ResolvePath(
+    HFSPLUS_VOLUME *Volume,
+    CONST CHAR16 *Path,
+    UINT32 *CatalogNodeID,
     VOID **CatalogRecord
 );
 
-EFI_STATUS SearchIndexNodeAndRecurse(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    UINT8 *NodeBuffer,
-    UINT32 ParentFolderID,
-    CHAR16 *FileName,
+VOID HfsDirectoryEntryFromRecord(
+    HFSPLUS_VOLUME *Volume,
+    CONST VOID *CatalogRecord,
+    HFSPLUS_DIR_ENTRY *Entry
+);
+
+EFI_STATUS HfsOpenDirectory(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FolderID,
+    BOOLEAN Prefetch,
+    HFSPLUS_DIR_ITERATOR *Iterator
+);
+
+EFI_STATUS HfsReadDirectory(
+    HFSPLUS_DIR_ITERATOR *Iterator,
+    HFSPLUS_DIR_ENTRY *Entries,
+    UINTN *EntryCount
+);
+
+EFI_STATUS ResolveRelativePath(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FolderID,
+    CONST CHAR16 *Path,
+    UINT32 *CatalogNodeID,
+    VOID **CatalogRecord,
+    UINT32 *LinkID
+);
+
+VOID PathCacheFlush(
+    HFSPLUS_VOLUME *Volume
+);
+
+BOOLEAN HfsIsHardLink(
+    CONST VOID *CatalogRecord
+);
+
+EFI_STATUS HfsResolveLink(
+    HFSPLUS_VOLUME *Volume,
     VOID **CatalogRecord
 );
 
-EFI_STATUS SearchLeafNodeForFile(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    UINT8 *NodeBuffer,
+EFI_STATUS HfsFindPrivateFolders(
+    HFSPLUS_VOLUME *Volume
+);
+
+VOID HfsInodeName(
+    CONST CHAR16 *Prefix,
+    UINT32 Number,
+    CHAR16 *Name
+);
+
+EFI_STATUS FindAndLoadBootEfi(
+    EFI_BLOCK_IO_PROTOCOL *BlockIo
+);
+
+EFI_STATUS LoadBootEfi(
+    HFSPLUS_VOLUME *Volume,
+    VOID **BootEfiData
+);
+
+EFI_STATUS ReadBootEfi(
+    HFSPLUS_VOLUME *Volume,
+    VOID *Buffer,
+    UINTN *BufferSize
+);
+
+EFI_STATUS TraverseCatalogBTree(
+    HFSPLUS_VOLUME *Volume,
     UINT32 ParentFolderID,
     CHAR16 *FileName,
     VOID **CatalogRecord
 );
 
-BTNodeDescriptor *GetChildNode(
-    EFI_BLOCK_IO_PROTOCOL *BlockIo,
-    HFSPlusForkData *CatalogFile,
-    HFSPlusCatalogKey *CatalogKey
+UINT32 HfsJournalChecksum(
+    CONST VOID *Data,
+    UINTN Length
+);
+
+EFI_STATUS ReplayJournal(
+    HFSPLUS_VOLUME *Volume,
+    BOOLEAN *Replayed
+);
+
+VOID CloseJournal(
+    HFSPLUS_VOLUME *Volume
+);
+
+EFI_STATUS HfsBeginTransaction(
+    HFSPLUS_VOLUME *Volume
+);
+
+EFI_STATUS HfsEndTransaction(
+    HFSPLUS_VOLUME *Volume,
+    BOOLEAN Commit
+);
+
+EFI_STATUS HfsWriteMetadata(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+);
+
+VOID JournalOverlayRead(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+);
+
+EFI_STATUS HfsReadVolumeHeader(
+    HFSPLUS_VOLUME *Volume
+);
+
+EFI_STATUS HfsWriteVolumeHeader(
+    HFSPLUS_VOLUME *Volume
 );
 
 #endif  // HFSPLUS_FILE_OPS_H
@@ -0,0 +1,277 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusFork.c
+//  This file is the c source for the HFS+ streaming fork reader
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Open a fork for streaming reads. The complete extent list and the bounce
+// block are set up here, so reads themselves allocate nothing.
+EFI_STATUS InternalOpenFork(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    HFSPLUS_FORK **Fork
+) {
+    HFSPLUS_FORK *NewFork;
+    EFI_STATUS Status;
+
+    if (Volume->DeviceBlocksPerAllocationBlock == 0) {
+        return EFI_UNSUPPORTED;
+    }
+
+    NewFork = AllocateZeroPool(sizeof(HFSPLUS_FORK));
+    if (NewFork == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    NewFork->Volume = Volume;
+    NewFork->FileID = FileID;
+    NewFork->ForkType = ForkType;
+    NewFork->Size = ForkData->logicalSize;
+
+    Status = GatherForkExtents(Volume, ForkData, FileID, ForkType, FALSE, &NewFork->Extents, &NewFork->ExtentCount);
+    if (EFI_ERROR(Status)) {
+        FreePool(NewFork);
+        return Status;
+    }
+
+    NewFork->BounceBlock = AllocatePool(Volume->DeviceBlockSize);
+    if (NewFork->BounceBlock == NULL) {
+        HfsCloseFork(NewFork);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    *Fork = NewFork;
+    return EFI_SUCCESS;
+}
+
+// Open a fork of a file for HfsReadAt
+EFI_STATUS HfsOpenFork(
+    HFSPLUS_VOLUME *Volume,
+    HFSPlusForkData *ForkData,
+    UINT32 FileID,
+    UINT8 ForkType,
+    HFSPLUS_FORK **Fork
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalOpenFork(Volume, ForkData, FileID, ForkType, Fork);
+    HFS_STATS_API(Volume, HfsStatsOpenFork, Start, Status);
+    return Status;
+}
+
+// Open the contents of a file from its catalog record. Compressed files
+// are opened through their decmpfs attribute, everything else through the
+// data fork; either way the fork is read with HfsReadAt.
+EFI_STATUS HfsOpenFile(
+    HFSPLUS_VOLUME *Volume,
+    CONST VOID *CatalogRecord,
+    HFSPLUS_FORK **Fork
+) {
+    CONST HFSPlusCatalogFile *File = CatalogRecord;
+    HFSPlusForkData ForkData;
+    EFI_STATUS Status;
+
+    if (HFS_BE16(&File->recordType) != HFSPLUS_FILE_RECORD) {
+        return EFI_NOT_FOUND;
+    }
+
+    HFS_STATS_START(Start);
+    UINT32 FileID = HFS_BE32(&File->fileID);
+
+    // The record lives in the node cache, so take host-order copies of the
+    // forks before anything else reads the disk
+    if ((File->permissions.ownerFlags & HFSPLUS_UF_COMPRESSED) != 0) {
+        HfsForkDataFromDisk(&File->resourceFork, &ForkData);
+        Status = DecmpfsOpen(Volume, FileID, &ForkData, Fork);
+    } else {
+        HfsForkDataFromDisk(&File->dataFork, &ForkData);
+        Status = InternalOpenFork(Volume, &ForkData, FileID, HFSPLUS_DATA_FORK, Fork);
+    }
+
+    HFS_STATS_API(Volume, HfsStatsOpenFork, Start, Status);
+    return Status;
+}
+
+// Release an open fork
+VOID HfsCloseFork(
+    HFSPLUS_FORK *Fork
+) {
+    if (Fork == NULL) {
+        return;
+    }
+    if (Fork->Extents != NULL) {
+        FreePool(Fork->Extents);
+    }
+    if (Fork->BounceBlock != NULL) {
+        FreePool(Fork->BounceBlock);
+    }
+    DecmpfsFree(Fork->Compressed);
+    FreePool(Fork);
+}
+
+// Move the cursor to the extent holding Offset. Sequential reads only ever
+// step forward by one extent.
+STATIC
+EFI_STATUS
+SeekForkCursor(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset
+) {
+    UINT32 AllocationBlockSize = Fork->Volume->AllocationBlockSize;
+
+    while (Offset < Fork->CursorOffset) {
+        Fork->CursorExtent--;
+        Fork->CursorOffset -= (UINT64)Fork->Extents[Fork->CursorExtent].blockCount * AllocationBlockSize;
+    }
+
+    while (Fork->CursorExtent < Fork->ExtentCount) {
+        UINT64 ExtentBytes = (UINT64)Fork->Extents[Fork->CursorExtent].blockCount * AllocationBlockSize;
+
+        if (Offset < Fork->CursorOffset + ExtentBytes) {
+            return EFI_SUCCESS;
+        }
+        Fork->CursorOffset += ExtentBytes;
+        Fork->CursorExtent++;
+    }
+
+    return EFI_VOLUME_CORRUPTED;
+}
+
+// Read up to *Length bytes at Offset into Buffer. *Length is cut short at
+// the end of the fork and returns the number of bytes read; reading at or
+// past the end returns zero bytes.
+EFI_STATUS InternalReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+) {
+    HFSPLUS_VOLUME *Volume = Fork->Volume;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT32 AllocationBlockSize = Volume->AllocationBlockSize;
+    UINT8 *Destination = Buffer;
+    UINT64 Remaining;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Offset >= Fork->Size) {
+        *Length = 0;
+        return EFI_SUCCESS;
+    }
+
+    Remaining = MIN((UINT64)*Length, Fork->Size - Offset);
+    *Length = (UINTN)Remaining;
+
+    // Reads that continue where the last one stopped double the read-ahead
+    // window; anything else turns read-ahead off until the pattern returns
+    if (Offset == Fork->NextOffset) {
+        Fork->ReadAheadWindow = (Fork->ReadAheadWindow == 0)
+            ? HFSPLUS_READAHEAD_MIN_WINDOW
+            : MIN(Fork->ReadAheadWindow * 2, HFSPLUS_READAHEAD_MAX_WINDOW);
+    } else {
+        Fork->ReadAheadWindow = 0;
+    }
+    Fork->NextOffset = Offset + Remaining;
+
+    while (Remaining > 0) {
+        Status = SeekForkCursor(Fork, Offset);
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        HFSPlusExtentDescriptor *Extent = &Fork->Extents[Fork->CursorExtent];
+        UINT64 Within = Offset - Fork->CursorOffset;
+        UINT64 DiskOffset = (UINT64)Extent->startBlock * AllocationBlockSize + Within;
+        UINT64 Available = MIN(Remaining, (UINT64)Extent->blockCount * AllocationBlockSize - Within);
+        UINT64 Lba = DiskOffset / DeviceBlockSize;
+        UINT32 Skip = (UINT32)(DiskOffset % DeviceBlockSize);
+        UINTN Chunk;
+
+        // Small sequential reads are served from the shared read-ahead pool,
+        // which is refilled with up to a window of the current extent
+        Chunk = ReadAheadLookup(&Volume->ReadAhead, Lba, Skip, (UINTN)Available, Destination);
+        if (Chunk == 0 && Fork->ReadAheadWindow > Available) {
+            UINT64 ExtentEndLba = ((UINT64)Extent->startBlock + Extent->blockCount) * Volume->DeviceBlocksPerAllocationBlock;
+            UINTN Blocks = (UINTN)MIN((UINT64)(Fork->ReadAheadWindow / DeviceBlockSize), ExtentEndLba - Lba);
+
+            if (!EFI_ERROR(ReadAheadFill(Volume, Lba, Blocks))) {
+                Chunk = ReadAheadLookup(&Volume->ReadAhead, Lba, Skip, (UINTN)Available, Destination);
+            }
+        }
+
+        if (Chunk != 0) {
+            Status = EFI_SUCCESS;
+        } else if (Skip == 0 && Available >= DeviceBlockSize) {
+            Chunk = (UINTN)(Available - Available % DeviceBlockSize);
+            Status = HfsReadDevice(Volume, Lba, Chunk, Destination);
+        } else {
+            Chunk = (UINTN)MIN(Available, (UINT64)(DeviceBlockSize - Skip));
+            Status = HfsReadDevice(Volume, Lba, DeviceBlockSize, Fork->BounceBlock);
+            if (!EFI_ERROR(Status)) {
+                CopyMem(Destination, Fork->BounceBlock + Skip, Chunk);
+            }
+        }
+
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+
+        Destination += Chunk;
+        Offset += Chunk;
+        Remaining -= Chunk;
+    }
+
+    if (EFI_ERROR(Status)) {
+        *Length -= (UINTN)Remaining;
+    }
+    return Status;
+}
+
+// Read from an open fork at any offset
+EFI_STATUS HfsReadAt(
+    HFSPLUS_FORK *Fork,
+    UINT64 Offset,
+    UINTN *Length,
+    VOID *Buffer
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = (Fork->Compressed != NULL)
+        ? DecmpfsReadAt(Fork, Offset, Length, Buffer)
+        : InternalReadAt(Fork, Offset, Length, Buffer);
+    HFS_STATS_API(Fork->Volume, HfsStatsReadAt, Start, Status);
+    return Status;
+}
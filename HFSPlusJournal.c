@@ -0,0 +1,938 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+//
+// @FILE
+//  HFSPlusJournal.c
+//  This file is the c source for HFS+ journal replay and transactions
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// The newest journaled copy of one device block
+typedef struct {
+    UINT64 Lba;
+    UINT64 DataOffset;  // Into the block lists read by ReplayJournal
+} HFSPLUS_JOURNAL_BLOCK;
+
+// Every device block the journal writes, each once. Blocks are appended on
+// first sight and later writes only move DataOffset, so replay cost follows
+// the number of distinct blocks. Table maps a hash of the LBA to an index
+// into Blocks plus one.
+typedef struct {
+    HFSPLUS_JOURNAL_BLOCK *Blocks;
+    UINTN Count;
+    UINTN Capacity;
+    UINT32 *Table;
+    UINTN TableMask;
+} HFSPLUS_JOURNAL_MAP;
+
+// Checksum used by the journal header, block list headers and block data
+UINT32 HfsJournalChecksum(
+    CONST VOID *Data,
+    UINTN Length
+) {
+    CONST UINT8 *Bytes = Data;
+    UINT32 Checksum = 0;
+
+    for (UINTN Index = 0; Index < Length; Index++) {
+        Checksum = (Checksum << 8) ^ (Checksum + Bytes[Index]);
+    }
+    return ~Checksum;
+}
+
+// Journal fields are in the byte order of the machine that wrote them
+STATIC
+UINT16
+JournalGet16(
+    CONST HFSPLUS_JOURNAL *Journal,
+    CONST VOID *Pointer
+) {
+    UINT16 Value = ReadUnaligned16((CONST UINT16 *)Pointer);
+    return Journal->Swap ? SwapBytes16(Value) : Value;
+}
+
+STATIC
+UINT32
+JournalGet32(
+    CONST HFSPLUS_JOURNAL *Journal,
+    CONST VOID *Pointer
+) {
+    UINT32 Value = ReadUnaligned32((CONST UINT32 *)Pointer);
+    return Journal->Swap ? SwapBytes32(Value) : Value;
+}
+
+STATIC
+UINT64
+JournalGet64(
+    CONST HFSPLUS_JOURNAL *Journal,
+    CONST VOID *Pointer
+) {
+    UINT64 Value = ReadUnaligned64((CONST UINT64 *)Pointer);
+    return Journal->Swap ? SwapBytes64(Value) : Value;
+}
+
+STATIC
+VOID
+JournalPut16(
+    CONST HFSPLUS_JOURNAL *Journal,
+    VOID *Pointer,
+    UINT16 Value
+) {
+    WriteUnaligned16((UINT16 *)Pointer, Journal->Swap ? SwapBytes16(Value) : Value);
+}
+
+STATIC
+VOID
+JournalPut32(
+    CONST HFSPLUS_JOURNAL *Journal,
+    VOID *Pointer,
+    UINT32 Value
+) {
+    WriteUnaligned32((UINT32 *)Pointer, Journal->Swap ? SwapBytes32(Value) : Value);
+}
+
+STATIC
+VOID
+JournalPut64(
+    CONST HFSPLUS_JOURNAL *Journal,
+    VOID *Pointer,
+    UINT64 Value
+) {
+    WriteUnaligned64((UINT64 *)Pointer, Journal->Swap ? SwapBytes64(Value) : Value);
+}
+
+// Checksum the first Length bytes of a structure as they were checksummed
+// when written, with the checksum field itself taken as zero
+STATIC
+UINT32
+JournalStructureChecksum(
+    CONST UINT8 *Structure,
+    UINTN ChecksumOffset,
+    UINTN Length
+) {
+    UINT8 Copy[HFSPLUS_JOURNAL_HEADER_CHECKSUM_SIZE];
+
+    CopyMem(Copy, Structure, Length);
+    ZeroMem(Copy + ChecksumOffset, sizeof(UINT32));
+    return HfsJournalChecksum(Copy, Length);
+}
+
+// Journal offset Length bytes after Position, wrapping from the end of the
+// journal back to just after its header
+STATIC
+UINT64
+JournalAdvance(
+    CONST HFSPLUS_JOURNAL *Journal,
+    UINT64 Position,
+    UINT64 Length
+) {
+    Position += Length;
+    if (Position >= Journal->Size) {
+        Position -= Journal->Size - Journal->HeaderSize;
+    }
+    return Position;
+}
+
+// Read or write Length bytes of the journal at journal offset Position,
+// wrapping from the end of the journal back to just after its header
+STATIC
+EFI_STATUS
+TransferJournalRange(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Position,
+    UINT64 Length,
+    UINT8 *Buffer,
+    BOOLEAN Write
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINTN MaxRequest = MAX(HFSPLUS_IO_MAX_REQUEST - HFSPLUS_IO_MAX_REQUEST % Volume->DeviceBlockSize, Volume->DeviceBlockSize);
+    EFI_STATUS Status;
+
+    while (Length > 0) {
+        if (Position == Journal->Size) {
+            Position = Journal->HeaderSize;
+        }
+
+        UINTN Chunk = (UINTN)MIN(MIN(Length, Journal->Size - Position), (UINT64)MaxRequest);
+        EFI_LBA Lba = (Journal->Offset + Position) / Volume->DeviceBlockSize;
+        if (Write) {
+            Status = HfsWriteDevice(Volume, Lba, Chunk, Buffer);
+        } else {
+            Status = HfsReadDevice(Volume, Lba, Chunk, Buffer);
+        }
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        Buffer += Chunk;
+        Position += Chunk;
+        Length -= Chunk;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Write the journal header with new start and end offsets
+STATIC
+EFI_STATUS
+JournalWriteHeader(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Start,
+    UINT64 End
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    HFSPlusJournalHeader *Header = (HFSPlusJournalHeader *)Journal->Header;
+
+    JournalPut64(Journal, &Header->start, Start);
+    JournalPut64(Journal, &Header->end, End);
+    JournalPut32(Journal, &Header->checksum, 0);
+    JournalPut32(Journal, &Header->checksum, HfsJournalChecksum(Journal->Header, HFSPLUS_JOURNAL_HEADER_CHECKSUM_SIZE));
+
+    EFI_STATUS Status = HfsWriteDevice(Volume, Journal->Offset / Volume->DeviceBlockSize, Volume->DeviceBlockSize, Journal->Header);
+    if (!EFI_ERROR(Status)) {
+        Journal->Start = Start;
+        Journal->End = End;
+    }
+    return Status;
+}
+
+// Find the journal through the journal info block and check its header.
+// Returns EFI_NOT_FOUND when the journal was never initialised.
+STATIC
+EFI_STATUS
+OpenJournal(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 VolumeBytes = (UINT64)Volume->TotalBlocks * Volume->AllocationBlockSize;
+
+    if (Volume->JournalInfoBlock == 0 || Volume->JournalInfoBlock >= Volume->TotalBlocks) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    if (Volume->DeviceBlocksPerAllocationBlock == 0) {
+        return EFI_UNSUPPORTED;
+    }
+
+    Journal->Header = AllocatePool(DeviceBlockSize);
+    if (Journal->Header == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // The info block fits in the first device block of its allocation block
+    EFI_STATUS Status = HfsReadDevice(Volume, (UINT64)Volume->JournalInfoBlock * Volume->DeviceBlocksPerAllocationBlock,
+                                      DeviceBlockSize, Journal->Header);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CONST HFSPlusJournalInfoBlock *InfoBlock = (CONST HFSPlusJournalInfoBlock *)Journal->Header;
+    UINT32 Flags = HFS_BE32(&InfoBlock->flags);
+    Journal->Offset = HFS_BE64(&InfoBlock->offset);
+    Journal->Size = HFS_BE64(&InfoBlock->size);
+
+    if ((Flags & HFSPLUS_JIB_JOURNAL_OTHER_DEVICE) != 0 || (Flags & HFSPLUS_JIB_JOURNAL_IN_FS) == 0) {
+        DEBUG((DEBUG_WARN, "HFS+ journal is not on the volume, not replaying it\n"));
+        return EFI_UNSUPPORTED;
+    }
+    if ((Flags & HFSPLUS_JIB_JOURNAL_NEED_INIT) != 0) {
+        return EFI_NOT_FOUND;  // Never initialised, so nothing was logged
+    }
+    if (Journal->Offset % DeviceBlockSize != 0 || Journal->Size % DeviceBlockSize != 0 ||
+        Journal->Size == 0 || Journal->Offset >= VolumeBytes || Journal->Size > VolumeBytes - Journal->Offset) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    Status = HfsReadDevice(Volume, Journal->Offset / DeviceBlockSize, DeviceBlockSize, Journal->Header);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CONST HFSPlusJournalHeader *Header = (CONST HFSPlusJournalHeader *)Journal->Header;
+    UINT32 Magic = ReadUnaligned32(&Header->magic);
+    if (Magic != HFSPLUS_JOURNAL_MAGIC && SwapBytes32(Magic) != HFSPLUS_JOURNAL_MAGIC) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    Journal->Swap = (Magic != HFSPLUS_JOURNAL_MAGIC);
+
+    Journal->Start = JournalGet64(Journal, &Header->start);
+    Journal->End = JournalGet64(Journal, &Header->end);
+    Journal->HeaderSize = JournalGet32(Journal, &Header->jhdrSize);
+    Journal->BlockListSize = JournalGet32(Journal, &Header->blhdrSize);
+
+    if (JournalGet32(Journal, &Header->endian) != HFSPLUS_JOURNAL_ENDIAN ||
+        JournalGet32(Journal, &Header->checksum) !=
+            JournalStructureChecksum(Journal->Header, OFFSET_OF(HFSPlusJournalHeader, checksum), HFSPLUS_JOURNAL_HEADER_CHECKSUM_SIZE) ||
+        JournalGet64(Journal, &Header->size) != Journal->Size) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    // Positions must be whole device blocks so the journal can be read in place
+    if (Journal->HeaderSize < sizeof(HFSPlusJournalHeader) || Journal->HeaderSize % DeviceBlockSize != 0 ||
+        Journal->HeaderSize >= Journal->Size || Journal->BlockListSize < HFSPLUS_BLOCK_LIST_CHECKSUM_SIZE ||
+        Journal->Start < Journal->HeaderSize || Journal->Start >= Journal->Size || Journal->Start % DeviceBlockSize != 0 ||
+        Journal->End < Journal->HeaderSize || Journal->End >= Journal->Size || Journal->End % DeviceBlockSize != 0) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Remember that device block Lba was last written with the data at
+// DataOffset, replacing any older copy
+STATIC
+VOID
+JournalMapRecord(
+    HFSPLUS_JOURNAL_MAP *Map,
+    UINT64 Lba,
+    UINT64 DataOffset
+) {
+    UINTN Slot = (UINTN)((Lba * 0x9E3779B97F4A7C15ULL) >> 32) & Map->TableMask;
+
+    while (Map->Table[Slot] != 0) {
+        HFSPLUS_JOURNAL_BLOCK *Block = &Map->Blocks[Map->Table[Slot] - 1];
+        if (Block->Lba == Lba) {
+            Block->DataOffset = DataOffset;
+            return;
+        }
+        Slot = (Slot + 1) & Map->TableMask;
+    }
+
+    Map->Blocks[Map->Count].Lba = Lba;
+    Map->Blocks[Map->Count].DataOffset = DataOffset;
+    Map->Table[Slot] = (UINT32)++Map->Count;
+}
+
+// Walk the block lists from the oldest, checking every checksum, and map
+// each journaled device block to its newest copy. Nothing is written, so
+// a damaged journal leaves the volume untouched.
+STATIC
+EFI_STATUS
+ParseBlockLists(
+    HFSPLUS_VOLUME *Volume,
+    CONST UINT8 *Data,
+    UINT64 DataSize,
+    HFSPLUS_JOURNAL_MAP *Map
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 DeviceBlocks = Volume->BlockIo->Media->LastBlock + 1 - Volume->StartLba;
+    UINT64 Position = 0;
+
+    while (Position < DataSize) {
+        CONST UINT8 *List = Data + Position;
+        CONST HFSPlusJournalBlockListHeader *Header = (CONST HFSPlusJournalBlockListHeader *)List;
+        CONST HFSPlusJournalBlockInfo *Info = (CONST HFSPlusJournalBlockInfo *)(List + OFFSET_OF(HFSPlusJournalBlockListHeader, binfo));
+
+        if (DataSize - Position < Journal->BlockListSize ||
+            JournalGet32(Journal, &Header->checksum) !=
+                JournalStructureChecksum(List, OFFSET_OF(HFSPlusJournalBlockListHeader, checksum), HFSPLUS_BLOCK_LIST_CHECKSUM_SIZE)) {
+            DEBUG((DEBUG_ERROR, "Bad HFS+ journal block list at %lu\n", Position));
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        UINT16 BlockCount = JournalGet16(Journal, &Header->numBlocks);
+        UINT32 BytesUsed = JournalGet32(Journal, &Header->bytesUsed);
+        UINT32 Flags = JournalGet32(Journal, &Header->flags);
+        if (BlockCount == 0 ||
+            OFFSET_OF(HFSPlusJournalBlockListHeader, binfo) + (UINTN)BlockCount * sizeof(HFSPlusJournalBlockInfo) > Journal->BlockListSize ||
+            BytesUsed < Journal->BlockListSize || BytesUsed > DataSize - Position) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        UINT64 DataOffset = Position + Journal->BlockListSize;
+        UINT64 ListEnd = Position + BytesUsed;
+        for (UINT16 Index = 1; Index < BlockCount; Index++) {
+            UINT64 Number = JournalGet64(Journal, &Info[Index].bnum);
+            UINT32 Size = JournalGet32(Journal, &Info[Index].bsize);
+
+            if (Size > ListEnd - DataOffset) {
+                return EFI_VOLUME_CORRUPTED;
+            }
+
+            // A superseded block still takes up its space in the list
+            if (Number != MAX_UINT64) {
+                if (Number > DivU64x32(DeviceBlocks * DeviceBlockSize, Journal->HeaderSize)) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+                UINT64 Lba = Number * Journal->HeaderSize / DeviceBlockSize;
+                if (Size % DeviceBlockSize != 0 || Lba + Size / DeviceBlockSize > DeviceBlocks) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+                if ((Flags & HFSPLUS_BLHDR_CHECK_CHECKSUMS) != 0 &&
+                    JournalGet32(Journal, &Info[Index].checksum) != HfsJournalChecksum(Data + DataOffset, Size)) {
+                    DEBUG((DEBUG_ERROR, "Bad HFS+ journal block %lu\n", Number));
+                    return EFI_VOLUME_CORRUPTED;
+                }
+
+                for (UINT32 Block = 0; Block < Size / DeviceBlockSize; Block++) {
+                    JournalMapRecord(Map, Lba + Block, DataOffset + (UINT64)Block * DeviceBlockSize);
+                }
+            }
+            DataOffset += Size;
+        }
+
+        Position = ListEnd;
+    }
+
+    return EFI_SUCCESS;
+}
+
+STATIC
+INTN
+EFIAPI
+CompareJournalBlock(
+    CONST VOID *Left,
+    CONST VOID *Right
+) {
+    UINT64 LeftLba = ((CONST HFSPLUS_JOURNAL_BLOCK *)Left)->Lba;
+    UINT64 RightLba = ((CONST HFSPLUS_JOURNAL_BLOCK *)Right)->Lba;
+
+    if (LeftLba == RightLba) {
+        return 0;
+    }
+    return (LeftLba < RightLba) ? -1 : 1;
+}
+
+// Write the newest copy of every journaled block in LBA order, one device
+// write per run of consecutive blocks up to HFSPLUS_IO_MAX_REQUEST
+STATIC
+EFI_STATUS
+ApplyJournalBlocks(
+    HFSPLUS_VOLUME *Volume,
+    CONST UINT8 *Data,
+    HFSPLUS_JOURNAL_MAP *Map
+) {
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINTN MaxRunBlocks = MAX(HFSPLUS_IO_MAX_REQUEST / DeviceBlockSize, 1);
+    HFSPLUS_JOURNAL_BLOCK Scratch;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    UINT8 *Run = AllocatePool(MIN(Map->Count, MaxRunBlocks) * DeviceBlockSize);
+    if (Run == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    QuickSort(Map->Blocks, Map->Count, sizeof(HFSPLUS_JOURNAL_BLOCK), CompareJournalBlock, &Scratch);
+
+    for (UINTN Index = 0; Index < Map->Count && !EFI_ERROR(Status);) {
+        UINT64 Lba = Map->Blocks[Index].Lba;
+        UINTN RunBlocks = 0;
+
+        while (Index < Map->Count && RunBlocks < MaxRunBlocks && Map->Blocks[Index].Lba == Lba + RunBlocks) {
+            CopyMem(Run + RunBlocks * DeviceBlockSize, Data + Map->Blocks[Index].DataOffset, DeviceBlockSize);
+            RunBlocks++;
+            Index++;
+        }
+        Status = HfsWriteDevice(Volume, Lba, RunBlocks * DeviceBlockSize, Run);
+    }
+
+    FreePool(Run);
+    return Status;
+}
+
+// Replay the journal of a journaled volume, before anything else reads the
+// metadata it covers. All outstanding transactions are read and verified
+// first; then each journaled device block is written once, with its newest
+// contents, in LBA order and coalesced into runs. Finally the journal is
+// marked empty. Replayed is set when any block was written. The journal
+// stays open for the transactions of later writes.
+EFI_STATUS ReplayJournal(
+    HFSPLUS_VOLUME *Volume,
+    BOOLEAN *Replayed
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    HFSPLUS_JOURNAL_MAP Map;
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+    UINT8 *Data = NULL;
+
+    *Replayed = FALSE;
+    ZeroMem(&Map, sizeof(Map));
+
+    EFI_STATUS Status = OpenJournal(Volume);
+    if (Status == EFI_NOT_FOUND) {
+        return EFI_SUCCESS;
+    }
+    if (EFI_ERROR(Status) || Journal->Start == Journal->End) {
+        goto Done;
+    }
+    if (BlockIo->Media->ReadOnly) {
+        DEBUG((DEBUG_ERROR, "HFS+ journal needs replay but the device is read-only\n"));
+        Status = EFI_WRITE_PROTECTED;
+        goto Done;
+    }
+
+    UINT64 DataSize = (Journal->End > Journal->Start) ? Journal->End - Journal->Start
+                                                      : (Journal->Size - Journal->Start) + (Journal->End - Journal->HeaderSize);
+    Map.Capacity = (UINTN)(DataSize / Volume->DeviceBlockSize);
+    if (Map.Capacity > MAX_UINT32 / 2) {
+        Status = EFI_UNSUPPORTED;
+        goto Done;
+    }
+    UINTN TableSize = 1;
+    while (TableSize < 2 * Map.Capacity) {
+        TableSize <<= 1;
+    }
+    Map.TableMask = TableSize - 1;
+
+    Data = AllocatePool((UINTN)DataSize);
+    Map.Blocks = AllocatePool(MAX(Map.Capacity, 1) * sizeof(HFSPLUS_JOURNAL_BLOCK));
+    Map.Table = AllocateZeroPool(TableSize * sizeof(UINT32));
+    if (Data == NULL || Map.Blocks == NULL || Map.Table == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    Status = TransferJournalRange(Volume, Journal->Start, DataSize, Data, FALSE);
+    if (!EFI_ERROR(Status)) {
+        Status = ParseBlockLists(Volume, Data, DataSize, &Map);
+    }
+    if (EFI_ERROR(Status)) {
+        goto Done;
+    }
+
+    DEBUG((DEBUG_INFO, "Replaying HFS+ journal: %lu bytes, %u distinct blocks\n", DataSize, (UINT32)Map.Count));
+    if (Map.Count != 0) {
+        Status = ApplyJournalBlocks(Volume, Data, &Map);
+        *Replayed = !EFI_ERROR(Status);
+    }
+
+    // The replayed blocks must be on disk before the journal says so
+    if (!EFI_ERROR(Status)) {
+        Status = HfsFlushDevice(Volume);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = JournalWriteHeader(Volume, Journal->End, Journal->End);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = HfsFlushDevice(Volume);
+    }
+
+Done:
+    // Transactions need the journal in the same units as the device
+    Journal->Writable = !EFI_ERROR(Status) && !BlockIo->Media->ReadOnly &&
+                        Journal->HeaderSize == Volume->DeviceBlockSize &&
+                        Journal->BlockListSize % Volume->DeviceBlockSize == 0 &&
+                        Journal->BlockListSize >= OFFSET_OF(HFSPlusJournalBlockListHeader, binfo) + 2 * sizeof(HFSPlusJournalBlockInfo);
+    if (Data != NULL) {
+        FreePool(Data);
+    }
+    if (Map.Blocks != NULL) {
+        FreePool(Map.Blocks);
+    }
+    if (Map.Table != NULL) {
+        FreePool(Map.Table);
+    }
+    return Status;
+}
+
+// Index of the first transaction block at or after Lba
+STATIC
+UINTN
+JournalFindBlock(
+    CONST HFSPLUS_JOURNAL *Journal,
+    UINT64 Lba
+) {
+    UINTN Low = 0;
+    UINTN High = Journal->BlockCount;
+
+    while (Low < High) {
+        UINTN Middle = Low + (High - Low) / 2;
+        if (Journal->Blocks[Middle].Lba < Lba) {
+            Low = Middle + 1;
+        } else {
+            High = Middle;
+        }
+    }
+    return Low;
+}
+
+// Copy the blocks of the open transaction over a device read, so metadata
+// reads see what the transaction has written so far
+VOID JournalOverlayRead(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINT64 BlockCount = BufferSize / DeviceBlockSize;
+
+    for (UINTN Index = JournalFindBlock(Journal, Lba);
+         Index < Journal->BlockCount && Journal->Blocks[Index].Lba < Lba + BlockCount;
+         Index++) {
+        CopyMem((UINT8 *)Buffer + (Journal->Blocks[Index].Lba - Lba) * DeviceBlockSize,
+                Journal->Blocks[Index].Data, DeviceBlockSize);
+    }
+}
+
+// Add one device block to the open transaction. A block written again in
+// the same transaction only replaces its data, so it is logged once.
+STATIC
+EFI_STATUS
+JournalAddBlock(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    CONST UINT8 *Data
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINTN Index = JournalFindBlock(Journal, Lba);
+
+    if (Index < Journal->BlockCount && Journal->Blocks[Index].Lba == Lba) {
+        CopyMem(Journal->Blocks[Index].Data, Data, DeviceBlockSize);
+        return EFI_SUCCESS;
+    }
+
+    if (Journal->BlockCount == Journal->BlockCapacity) {
+        UINTN Capacity = MAX(Journal->BlockCapacity * 2, 16);
+        HFSPLUS_TRANSACTION_BLOCK *Blocks = ReallocatePool(
+            Journal->BlockCapacity * sizeof(HFSPLUS_TRANSACTION_BLOCK),
+            Capacity * sizeof(HFSPLUS_TRANSACTION_BLOCK),
+            Journal->Blocks
+        );
+        if (Blocks == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        Journal->Blocks = Blocks;
+        Journal->BlockCapacity = Capacity;
+    }
+
+    UINT8 *Copy = SlabAcquire(&Volume->Arena.Blocks);
+    if (Copy == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    CopyMem(Copy, Data, DeviceBlockSize);
+
+    CopyMem(&Journal->Blocks[Index + 1], &Journal->Blocks[Index],
+            (Journal->BlockCount - Index) * sizeof(HFSPLUS_TRANSACTION_BLOCK));
+    Journal->Blocks[Index].Lba = Lba;
+    Journal->Blocks[Index].Data = Copy;
+    Journal->BlockCount++;
+    return EFI_SUCCESS;
+}
+
+// Forget the blocks of the open transaction, handing their copies back to
+// the block slab
+STATIC
+VOID
+JournalDiscardBlocks(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+
+    for (UINTN Index = 0; Index < Journal->BlockCount; Index++) {
+        SlabRelease(&Volume->Arena.Blocks, Journal->Blocks[Index].Data);
+    }
+    Journal->BlockCount = 0;
+}
+
+// Mark every logged transaction done once their blocks are safely in
+// place, so the whole journal is free again
+STATIC
+EFI_STATUS
+JournalCheckpoint(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+
+    if (Journal->Start == Journal->End) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS Status = HfsFlushDevice(Volume);
+    if (!EFI_ERROR(Status)) {
+        Status = JournalWriteHeader(Volume, Journal->End, Journal->End);
+    }
+    return Status;
+}
+
+// Log the open transaction and then write its blocks in place. Runs of
+// consecutive blocks become one block info and one in-place write each.
+// The data written before the commit and the block lists share the first
+// flush; the second orders the new journal header before the in-place
+// writes, which the next flush makes durable. So a commit costs two
+// flushes however many blocks it holds. Logged is set once the journal
+// header covers the transaction, after which a failure can no longer
+// undo it.
+STATIC
+EFI_STATUS
+CommitTransaction(
+    HFSPLUS_VOLUME *Volume,
+    BOOLEAN *Logged
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+    UINTN MaxRunBlocks = MAX(HFSPLUS_IO_MAX_REQUEST / DeviceBlockSize, 1);
+    UINTN InfoOffset = OFFSET_OF(HFSPlusJournalBlockListHeader, binfo);
+    UINTN MaxInfo = MIN((Journal->BlockListSize - InfoOffset) / sizeof(HFSPlusJournalBlockInfo), (UINTN)MAX_UINT16);
+    UINTN RunCount = 0;
+
+    *Logged = FALSE;
+
+    // Every list holds up to MaxInfo - 1 runs after its own binfo[0]
+    for (UINTN Index = 0; Index < Journal->BlockCount; RunCount++) {
+        UINT64 Lba = Journal->Blocks[Index].Lba;
+        UINTN RunBlocks = 0;
+        while (Index < Journal->BlockCount && RunBlocks < MaxRunBlocks && Journal->Blocks[Index].Lba == Lba + RunBlocks) {
+            RunBlocks++;
+            Index++;
+        }
+    }
+    UINTN ListCount = (RunCount + MaxInfo - 2) / (MaxInfo - 1);
+    UINT64 Length = (UINT64)ListCount * Journal->BlockListSize + (UINT64)Journal->BlockCount * DeviceBlockSize;
+
+    // The end may never catch up with the start, or the journal would
+    // look empty
+    UINT64 Capacity = Journal->Size - Journal->HeaderSize;
+    UINT64 InUse = (Journal->End >= Journal->Start) ? Journal->End - Journal->Start
+                                                    : Capacity - (Journal->Start - Journal->End);
+    if (Length >= Capacity) {
+        DEBUG((DEBUG_ERROR, "HFS+ transaction of %lu bytes does not fit the journal\n", Length));
+        return EFI_VOLUME_FULL;
+    }
+    EFI_STATUS Status = EFI_SUCCESS;
+    if (Length >= Capacity - InUse) {
+        Status = JournalCheckpoint(Volume);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    HFSPLUS_ARENA_MARK Mark;
+    ArenaMark(&Volume->Arena, &Mark);
+    UINT8 *Buffer = ArenaAlloc(&Volume->Arena, (UINTN)Length);
+    if (Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    ZeroMem(Buffer, (UINTN)Length);
+
+    UINT8 *List = Buffer;
+    for (UINTN Index = 0; Index < Journal->BlockCount;) {
+        HFSPlusJournalBlockListHeader *Header = (HFSPlusJournalBlockListHeader *)List;
+        HFSPlusJournalBlockInfo *Info = (HFSPlusJournalBlockInfo *)(List + InfoOffset);
+        UINT8 *Data = List + Journal->BlockListSize;
+        UINTN InfoCount = 1;
+
+        while (Index < Journal->BlockCount && InfoCount < MaxInfo) {
+            UINT64 Lba = Journal->Blocks[Index].Lba;
+            UINTN RunBlocks = 0;
+            while (Index < Journal->BlockCount && RunBlocks < MaxRunBlocks && Journal->Blocks[Index].Lba == Lba + RunBlocks) {
+                CopyMem(Data + RunBlocks * DeviceBlockSize, Journal->Blocks[Index].Data, DeviceBlockSize);
+                RunBlocks++;
+                Index++;
+            }
+
+            // Block numbers count jhdrSize units, which is the device block
+            UINT32 RunSize = (UINT32)(RunBlocks * DeviceBlockSize);
+            JournalPut64(Journal, &Info[InfoCount].bnum, Lba);
+            JournalPut32(Journal, &Info[InfoCount].bsize, RunSize);
+            JournalPut32(Journal, &Info[InfoCount].checksum, HfsJournalChecksum(Data, RunSize));
+            Data += RunSize;
+            InfoCount++;
+        }
+
+        JournalPut16(Journal, &Header->maxBlocks, (UINT16)MaxInfo);
+        JournalPut16(Journal, &Header->numBlocks, (UINT16)InfoCount);
+        JournalPut32(Journal, &Header->bytesUsed, (UINT32)(Data - List));
+        JournalPut32(Journal, &Header->flags,
+                     HFSPLUS_BLHDR_CHECK_CHECKSUMS | ((List == Buffer) ? HFSPLUS_BLHDR_FIRST_HEADER : 0));
+        JournalPut32(Journal, &Header->checksum, HfsJournalChecksum(List, HFSPLUS_BLOCK_LIST_CHECKSUM_SIZE));
+        List = Data;
+    }
+
+    Status = TransferJournalRange(Volume, Journal->End, Length, Buffer, TRUE);
+    if (!EFI_ERROR(Status)) {
+        Status = HfsFlushDevice(Volume);
+    }
+    if (!EFI_ERROR(Status)) {
+        *Logged = TRUE;
+        Status = JournalWriteHeader(Volume, Journal->Start, JournalAdvance(Journal, Journal->End, Length));
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = HfsFlushDevice(Volume);
+    }
+
+    // In place, straight from the logged copies
+    for (List = Buffer; List < Buffer + Length && !EFI_ERROR(Status);) {
+        CONST HFSPlusJournalBlockListHeader *Header = (CONST HFSPlusJournalBlockListHeader *)List;
+        CONST HFSPlusJournalBlockInfo *Info = (CONST HFSPlusJournalBlockInfo *)(List + InfoOffset);
+        UINT8 *Data = List + Journal->BlockListSize;
+
+        for (UINT16 Entry = 1; Entry < JournalGet16(Journal, &Header->numBlocks) && !EFI_ERROR(Status); Entry++) {
+            UINT32 RunSize = JournalGet32(Journal, &Info[Entry].bsize);
+            Status = HfsWriteDevice(Volume, JournalGet64(Journal, &Info[Entry].bnum), RunSize, Data);
+            Data += RunSize;
+        }
+        List += JournalGet32(Journal, &Header->bytesUsed);
+    }
+
+    ArenaReset(&Volume->Arena, &Mark);
+    return Status;
+}
+
+// Undo the in-memory effects of a transaction that never reached the
+// journal: the blocks it wrote are dropped, and the allocation bitmap and
+// volume header are read again from the disk
+STATIC
+VOID
+RollbackTransaction(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+
+    for (UINTN Index = 0; Index < Journal->BlockCount; Index++) {
+        ReadAheadInvalidate(Volume, Journal->Blocks[Index].Lba, 1);
+    }
+    JournalDiscardBlocks(Volume);
+
+    FreeBitmapCache(&Volume->Bitmap);
+    EFI_STATUS Status = HfsReadVolumeHeader(Volume);
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Cannot re-read the HFS+ volume header after a failed transaction: %r\n", Status));
+    }
+}
+
+// Start a transaction. Transactions nest: metadata written until the
+// matching HfsEndTransaction of the outermost one is committed as a whole,
+// so a batch of file writes costs one commit.
+EFI_STATUS HfsBeginTransaction(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+
+    if (Journal->Depth++ == 0) {
+        Journal->TransactionStatus = EFI_SUCCESS;
+    }
+    return EFI_SUCCESS;
+}
+
+// End a transaction. The outermost end commits everything the transaction
+// wrote when Commit is set and nothing inside it failed; otherwise the
+// whole transaction is abandoned and its first error returned.
+EFI_STATUS HfsEndTransaction(
+    HFSPLUS_VOLUME *Volume,
+    BOOLEAN Commit
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    BOOLEAN Logged = FALSE;
+
+    if (Journal->Depth == 0) {
+        return EFI_NOT_STARTED;
+    }
+    if (!Commit && !EFI_ERROR(Journal->TransactionStatus)) {
+        Journal->TransactionStatus = EFI_ABORTED;
+    }
+    if (--Journal->Depth != 0) {
+        return Journal->TransactionStatus;
+    }
+
+    EFI_STATUS Status = Journal->TransactionStatus;
+    if (!EFI_ERROR(Status) && Journal->BlockCount != 0) {
+        Status = CommitTransaction(Volume, &Logged);
+    }
+
+    if (EFI_ERROR(Status) && Logged) {
+        // Replay at the next mount finishes the transaction; until then
+        // the volume takes no more
+        DEBUG((DEBUG_ERROR, "HFS+ transaction logged but not applied: %r\n", Status));
+        Journal->Writable = FALSE;
+    } else if (EFI_ERROR(Status) && Volume->Journaled) {
+        RollbackTransaction(Volume);
+    }
+
+    JournalDiscardBlocks(Volume);
+    return Status;
+}
+
+// Write metadata blocks of a volume. On a journaled volume they join the
+// open transaction, or make one of their own, and reach their home
+// location only after the transaction is in the journal. Other volumes
+// are written in place at once.
+EFI_STATUS HfsWriteMetadata(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+    UINT32 DeviceBlockSize = Volume->DeviceBlockSize;
+
+    ReadAheadInvalidate(Volume, Lba, BufferSize / DeviceBlockSize);
+    if (!Volume->Journaled) {
+        return HfsWriteDevice(Volume, Lba, BufferSize, Buffer);
+    }
+
+    HfsBeginTransaction(Volume);
+
+    EFI_STATUS Status = Journal->Writable ? EFI_SUCCESS : EFI_WRITE_PROTECTED;
+    if (BufferSize % DeviceBlockSize != 0) {
+        Status = EFI_BAD_BUFFER_SIZE;
+    }
+    for (UINTN Offset = 0; Offset < BufferSize && !EFI_ERROR(Status); Offset += DeviceBlockSize) {
+        Status = JournalAddBlock(Volume, Lba + Offset / DeviceBlockSize, (UINT8 *)Buffer + Offset);
+    }
+    if (EFI_ERROR(Status) && !EFI_ERROR(Journal->TransactionStatus)) {
+        Journal->TransactionStatus = Status;
+    }
+
+    return HfsEndTransaction(Volume, !EFI_ERROR(Status));
+}
+
+// Release the journal of a volume that is being unmounted. An unfinished
+// transaction is dropped, and the journal is left empty so the next mount
+// has nothing to replay.
+VOID CloseJournal(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_JOURNAL *Journal = &Volume->Journal;
+
+    JournalDiscardBlocks(Volume);
+    if (Journal->Writable && Journal->Start != Journal->End) {
+        EFI_STATUS Status = JournalCheckpoint(Volume);
+        if (!EFI_ERROR(Status)) {
+            Status = HfsFlushDevice(Volume);
+        }
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_WARN, "HFS+ journal left for replay: %r\n", Status));
+        }
+    }
+
+    if (Journal->Blocks != NULL) {
+        FreePool(Journal->Blocks);
+    }
+    if (Journal->Header != NULL) {
+        FreePool(Journal->Header);
+    }
+    ZeroMem(Journal, sizeof(HFSPLUS_JOURNAL));
+}
@@ -0,0 +1,221 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusLinks.c
+//  This file is the c source for the HFS+ hard link resolution
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Whether a catalog record is a file or directory hard link
+BOOLEAN HfsIsHardLink(
+    CONST VOID *CatalogRecord
+) {
+    CONST HFSPlusCatalogFile *File = CatalogRecord;
+
+    if (HFS_BE16(&File->recordType) != HFSPLUS_FILE_RECORD) {
+        return FALSE;
+    }
+
+    UINT32 Type = HFS_BE32(File->userInfo);
+    UINT32 Creator = HFS_BE32(File->userInfo + 4);
+    return (Type == HFSPLUS_HARDLINK_FILE_TYPE && Creator == HFSPLUS_HARDLINK_CREATOR) ||
+           (Type == HFSPLUS_HARDLINK_FOLDER_TYPE && Creator == HFSPLUS_HARDLINK_FOLDER_CREATOR);
+}
+
+// Look up (ParentID, Name) in the catalog. Unlike TraverseCatalogBTree the
+// name is counted, so it may hold NULs.
+STATIC
+EFI_STATUS
+LookupCatalogName(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    VOID **CatalogRecord
+) {
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    HFSPLUS_CATALOG_SEARCH Search = { ParentID, Name, NameLength };
+    HFSPLUS_BTREE_CURSOR Cursor;
+    UINT8 *Record;
+    UINT16 RecordLength;
+    UINT8 *Data;
+
+    EFI_STATUS Status = PrepareBTree(Volume, &Volume->CatalogFile, HFSPLUS_CATALOG_FILE_ID, Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = SearchBTree(Tree, Volume->CatalogCompare, &Search, &Cursor, &Record, &RecordLength);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = GetBTreeRecordData(Record, RecordLength, &Data, NULL);
+    if (!EFI_ERROR(Status)) {
+        *CatalogRecord = Data;
+    }
+    return Status;
+}
+
+// Find the folder ID of one of the private folders in the root, once per
+// volume. *FolderID is MAX_UINT32 when the volume has no such folder.
+STATIC
+EFI_STATUS
+FindPrivateFolder(
+    HFSPLUS_VOLUME *Volume,
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    UINT32 *FolderID
+) {
+    VOID *Record;
+
+    if (*FolderID != 0) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS Status = LookupCatalogName(Volume, HFSPLUS_ROOT_FOLDER_ID, Name, NameLength, &Record);
+    if (Status == EFI_NOT_FOUND) {
+        *FolderID = MAX_UINT32;
+        return EFI_SUCCESS;
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    if (HFS_BE16(Record) != HFSPLUS_FOLDER_RECORD) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    *FolderID = HFS_BE32(&((HFSPlusCatalogFolder *)Record)->folderID);
+    return EFI_SUCCESS;
+}
+
+// Look up both private folders, so listings of the root can leave them out.
+// Their IDs stay in the link cache.
+EFI_STATUS HfsFindPrivateFolders(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_LINK_CACHE *Cache = &Volume->Links;
+
+    EFI_STATUS Status = FindPrivateFolder(Volume, HFSPLUS_PRIVATE_DATA_NAME, HFSPLUS_PRIVATE_DATA_NAME_LENGTH, &Cache->FilePrivateID);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    return FindPrivateFolder(Volume, HFSPLUS_PRIVATE_DIR_NAME, StrLen(HFSPLUS_PRIVATE_DIR_NAME), &Cache->FolderPrivateID);
+}
+
+// Write the private name of an inode, Prefix followed by the decimal digits
+// of Number, into Name, which holds HFSPLUS_MAX_NAME_LENGTH + 1 characters
+VOID HfsInodeName(
+    CONST CHAR16 *Prefix,
+    UINT32 Number,
+    CHAR16 *Name
+) {
+    CHAR16 Digits[10];
+    UINTN DigitCount = 0;
+    UINTN Length = StrLen(Prefix);
+
+    CopyMem(Name, Prefix, Length * sizeof(CHAR16));
+    do {
+        Digits[DigitCount++] = (CHAR16)(L'0' + Number % 10);
+        Number /= 10;
+    } while (Number != 0);
+    while (DigitCount > 0) {
+        Name[Length++] = Digits[--DigitCount];
+    }
+    Name[Length] = 0;
+}
+
+// Replace a hard link record by the record of the inode it stands for. Any
+// other record is left alone. The inode record is copied into the volume's
+// link cache, where it stays valid until the next link is resolved, and
+// links seen before are answered from there without touching the catalog.
+// A link whose inode is missing gives EFI_NOT_FOUND.
+EFI_STATUS HfsResolveLink(
+    HFSPLUS_VOLUME *Volume,
+    VOID **CatalogRecord
+) {
+    HFSPLUS_LINK_CACHE *Cache = &Volume->Links;
+    CONST HFSPlusCatalogFile *Link = *CatalogRecord;
+    CHAR16 Name[HFSPLUS_MAX_NAME_LENGTH + 1];
+    VOID *Record;
+    EFI_STATUS Status;
+
+    if (!HfsIsHardLink(Link)) {
+        return EFI_SUCCESS;
+    }
+
+    BOOLEAN Folder = (HFS_BE32(Link->userInfo) == HFSPLUS_HARDLINK_FOLDER_TYPE);
+    UINT32 INodeNumber = HFS_BE32(&Link->permissions.special);
+    HFSPLUS_LINK_CACHE_ENTRY *Entry = &Cache->Entries[INodeNumber & (HFSPLUS_LINK_CACHE_ENTRIES - 1)];
+
+    if (INodeNumber == 0) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+    if (Entry->INodeNumber == INodeNumber && Entry->Folder == Folder) {
+        Cache->Hits++;
+        *CatalogRecord = &Entry->Record;
+        return EFI_SUCCESS;
+    }
+    Cache->Misses++;
+
+    UINT32 *PrivateID = Folder ? &Cache->FolderPrivateID : &Cache->FilePrivateID;
+    if (Folder) {
+        Status = FindPrivateFolder(Volume, HFSPLUS_PRIVATE_DIR_NAME, StrLen(HFSPLUS_PRIVATE_DIR_NAME), PrivateID);
+    } else {
+        Status = FindPrivateFolder(Volume, HFSPLUS_PRIVATE_DATA_NAME, HFSPLUS_PRIVATE_DATA_NAME_LENGTH, PrivateID);
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    if (*PrivateID == MAX_UINT32) {
+        return EFI_NOT_FOUND;
+    }
+
+    HfsInodeName(Folder ? L"dir_" : L"iNode", INodeNumber, Name);
+    Status = TraverseCatalogBTree(Volume, *PrivateID, Name, &Record);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    if (HFS_BE16(Record) != (Folder ? HFSPLUS_FOLDER_RECORD : HFSPLUS_FILE_RECORD)) {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    ZeroMem(Entry, sizeof(HFSPLUS_LINK_CACHE_ENTRY));
+    CopyMem(&Entry->Record, Record, Folder ? sizeof(HFSPlusCatalogFolder) : sizeof(HFSPlusCatalogFile));
+    Entry->INodeNumber = INodeNumber;
+    Entry->Folder = Folder;
+    *CatalogRecord = &Entry->Record;
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,397 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusNodeCache.c
+//  This file is the c source for the HFS+ B-tree node cache
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+#define NODE_CACHE_HASH(TreeId, NodeNumber) \
+    ((((TreeId) * 0x9E3779B1U) ^ ((NodeNumber) * 0x85EBCA6BU)) % HFSPLUS_NODE_CACHE_BUCKETS)
+
+STATIC
+VOID
+LruUnlink(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT16 Index
+) {
+    HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+    if (Entry->LruPrev != HFSPLUS_NODE_CACHE_NONE) {
+        Cache->Entries[Entry->LruPrev].LruNext = Entry->LruNext;
+    } else {
+        Cache->LruHead = Entry->LruNext;
+    }
+
+    if (Entry->LruNext != HFSPLUS_NODE_CACHE_NONE) {
+        Cache->Entries[Entry->LruNext].LruPrev = Entry->LruPrev;
+    } else {
+        Cache->LruTail = Entry->LruPrev;
+    }
+
+    Entry->LruPrev = HFSPLUS_NODE_CACHE_NONE;
+    Entry->LruNext = HFSPLUS_NODE_CACHE_NONE;
+}
+
+STATIC
+VOID
+LruPushHead(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT16 Index
+) {
+    HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+    Entry->LruPrev = HFSPLUS_NODE_CACHE_NONE;
+    Entry->LruNext = Cache->LruHead;
+    if (Cache->LruHead != HFSPLUS_NODE_CACHE_NONE) {
+        Cache->Entries[Cache->LruHead].LruPrev = Index;
+    } else {
+        Cache->LruTail = Index;
+    }
+    Cache->LruHead = Index;
+}
+
+STATIC
+VOID
+LruPushTail(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT16 Index
+) {
+    HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+    Entry->LruNext = HFSPLUS_NODE_CACHE_NONE;
+    Entry->LruPrev = Cache->LruTail;
+    if (Cache->LruTail != HFSPLUS_NODE_CACHE_NONE) {
+        Cache->Entries[Cache->LruTail].LruNext = Index;
+    } else {
+        Cache->LruHead = Index;
+    }
+    Cache->LruTail = Index;
+}
+
+STATIC
+VOID
+HashUnlink(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT16 Index
+) {
+    HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+    UINT16 *Link = &Cache->Buckets[NODE_CACHE_HASH(Entry->TreeId, Entry->NodeNumber)];
+
+    while (*Link != HFSPLUS_NODE_CACHE_NONE) {
+        if (*Link == Index) {
+            *Link = Entry->HashNext;
+            break;
+        }
+        Link = &Cache->Entries[*Link].HashNext;
+    }
+
+    Entry->HashNext = HFSPLUS_NODE_CACHE_NONE;
+    Entry->Valid = FALSE;
+}
+
+// Slot holding a node, or HFSPLUS_NODE_CACHE_NONE
+STATIC
+UINT16
+NodeCacheFind(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT32 TreeId,
+    UINT32 NodeNumber
+) {
+    for (UINT16 Index = Cache->Buckets[NODE_CACHE_HASH(TreeId, NodeNumber)];
+         Index != HFSPLUS_NODE_CACHE_NONE;
+         Index = Cache->Entries[Index].HashNext) {
+        HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+        if (Entry->TreeId == TreeId && Entry->NodeNumber == NodeNumber) {
+            return Index;
+        }
+    }
+
+    return HFSPLUS_NODE_CACHE_NONE;
+}
+
+// Take the least recently used slot off the LRU list and out of the hash;
+// unused slots sit at the tail. A slot that is not filled must go back
+// with LruPushTail.
+STATIC
+UINT16
+NodeCacheRecycle(
+    HFSPLUS_NODE_CACHE *Cache
+) {
+    UINT16 Index = Cache->LruTail;
+    HFSPLUS_NODE_CACHE_ENTRY *Victim = &Cache->Entries[Index];
+
+    LruUnlink(Cache, Index);
+    if (Victim->Valid) {
+        HashUnlink(Cache, Index);
+        Cache->Evictions++;
+    }
+    return Index;
+}
+
+// Enter a recycled slot whose buffer now holds a node into the hash
+STATIC
+VOID
+NodeCacheAdd(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT16 Index,
+    UINT32 TreeId,
+    UINT32 NodeNumber
+) {
+    HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+    UINT32 Bucket = NODE_CACHE_HASH(TreeId, NodeNumber);
+
+    Entry->TreeId = TreeId;
+    Entry->NodeNumber = NodeNumber;
+    Entry->Valid = TRUE;
+    Entry->HashNext = Cache->Buckets[Bucket];
+    Cache->Buckets[Bucket] = Index;
+}
+
+// Allocate the node buffers of a cache with room for nodes of SlotSize bytes.
+// Any previously cached nodes are dropped.
+EFI_STATUS NodeCacheInit(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT32 SlotSize
+) {
+    UINT64 Hits = Cache->Hits;
+    UINT64 Misses = Cache->Misses;
+    UINT64 Evictions = Cache->Evictions;
+
+    NodeCacheFree(Cache);
+
+    Cache->Buffer = AllocatePool((UINTN)SlotSize * HFSPLUS_NODE_CACHE_ENTRIES);
+    if (Cache->Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Cache->SlotSize = SlotSize;
+    Cache->Hits = Hits;
+    Cache->Misses = Misses;
+    Cache->Evictions = Evictions;
+    Cache->LruHead = HFSPLUS_NODE_CACHE_NONE;
+    Cache->LruTail = HFSPLUS_NODE_CACHE_NONE;
+    SetMem(Cache->Buckets, sizeof(Cache->Buckets), 0xFF);
+
+    for (UINT16 Index = 0; Index < HFSPLUS_NODE_CACHE_ENTRIES; Index++) {
+        HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+        Entry->Data = Cache->Buffer + (UINTN)Index * SlotSize;
+        Entry->HashNext = HFSPLUS_NODE_CACHE_NONE;
+        LruPushTail(Cache, Index);
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Release the node buffers of a cache. The counters are preserved.
+VOID NodeCacheFree(
+    HFSPLUS_NODE_CACHE *Cache
+) {
+    UINT64 Hits = Cache->Hits;
+    UINT64 Misses = Cache->Misses;
+    UINT64 Evictions = Cache->Evictions;
+#if HFSPLUS_ENABLE_STATS
+    HFSPLUS_STATS *Stats = Cache->Stats;
+#endif
+
+    if (Cache->Buffer != NULL) {
+        FreePool(Cache->Buffer);
+    }
+
+    ZeroMem(Cache, sizeof(*Cache));
+    Cache->Hits = Hits;
+    Cache->Misses = Misses;
+    Cache->Evictions = Evictions;
+#if HFSPLUS_ENABLE_STATS
+    Cache->Stats = Stats;
+#endif
+}
+
+// Return the cached copy of a B-tree node, reading it on a miss. Nodes near
+// the root (Pin set) are pinned and never evicted; everything else is
+// evicted least-recently-used first. The returned buffer stays valid until
+// the next call into the cache.
+EFI_STATUS NodeCacheGet(
+    HFSPLUS_NODE_CACHE *Cache,
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    BOOLEAN Pin,
+    UINT8 **Node
+) {
+    UINT32 TreeId = Tree->TreeId;
+    EFI_STATUS Status;
+    UINT16 Index;
+
+    // Trees with different node sizes share the cache; slots are sized for
+    // the largest node seen so far
+    if (Cache->Buffer == NULL || Tree->NodeSize > Cache->SlotSize) {
+        Status = NodeCacheInit(Cache, Tree->NodeSize);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    Index = NodeCacheFind(Cache, TreeId, NodeNumber);
+    if (Index != HFSPLUS_NODE_CACHE_NONE) {
+        HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+        Cache->Hits++;
+        HFS_STATS_NODE(Cache, TreeId, Entry->Data, TRUE);
+        if (!Entry->Pinned) {
+            LruUnlink(Cache, Index);
+            if (Pin && Cache->PinnedCount < HFSPLUS_NODE_CACHE_MAX_PINNED) {
+                Entry->Pinned = TRUE;
+                Cache->PinnedCount++;
+            } else {
+                LruPushHead(Cache, Index);
+            }
+        }
+        *Node = Entry->Data;
+        return EFI_SUCCESS;
+    }
+
+    Cache->Misses++;
+
+    Index = NodeCacheRecycle(Cache);
+    HFSPLUS_NODE_CACHE_ENTRY *Victim = &Cache->Entries[Index];
+
+    Status = ReadBTreeNodeFromDisk(Tree, NodeNumber, Victim->Data);
+    if (EFI_ERROR(Status)) {
+        LruPushTail(Cache, Index);
+        return Status;
+    }
+
+    HFS_STATS_NODE(Cache, TreeId, Victim->Data, FALSE);
+    NodeCacheAdd(Cache, Index, TreeId, NodeNumber);
+
+    if (Pin && Cache->PinnedCount < HFSPLUS_NODE_CACHE_MAX_PINNED) {
+        Victim->Pinned = TRUE;
+        Cache->PinnedCount++;
+    } else {
+        LruPushHead(Cache, Index);
+    }
+
+    *Node = Victim->Data;
+    return EFI_SUCCESS;
+}
+
+// Read up to Count nodes from NodeNumber on with a single fork read and add
+// them to the cache, for walkers that know which nodes come next. The run
+// stops at the first node that is already cached, and nodes that fail the
+// usual checks are left to be read (and rejected) by NodeCacheGet.
+EFI_STATUS NodeCachePrefetch(
+    HFSPLUS_NODE_CACHE *Cache,
+    HFSPLUS_BTREE *Tree,
+    UINT32 NodeNumber,
+    UINT32 Count
+) {
+    UINT32 TreeId = Tree->TreeId;
+    UINT32 Run = 0;
+    EFI_STATUS Status;
+
+    if (Cache->Buffer == NULL || Tree->NodeSize > Cache->SlotSize) {
+        Status = NodeCacheInit(Cache, Tree->NodeSize);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    // Never displace more than the unpinned half of the cache
+    Count = MIN(Count, (HFSPLUS_NODE_CACHE_ENTRIES - HFSPLUS_NODE_CACHE_MAX_PINNED) / 2);
+    while (Run < Count && NodeNumber + Run < Tree->TotalNodes &&
+           NodeCacheFind(Cache, TreeId, NodeNumber + Run) == HFSPLUS_NODE_CACHE_NONE) {
+        Run++;
+    }
+    if (Run == 0) {
+        return EFI_SUCCESS;
+    }
+
+    HFSPLUS_ARENA_MARK Mark;
+    ArenaMark(&Tree->Volume->Arena, &Mark);
+    UINT8 *Buffer = ArenaAlloc(&Tree->Volume->Arena, (UINTN)Run * Tree->NodeSize);
+    if (Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = ReadForkRange(Tree->Volume, Tree->Extents, Tree->ExtentCount, Tree->Fork.logicalSize, (UINT64)NodeNumber * Tree->NodeSize, (UINTN)Run * Tree->NodeSize, Buffer);
+    for (UINT32 Node = 0; Node < Run && !EFI_ERROR(Status); Node++) {
+        UINT8 *Data = Buffer + (UINTN)Node * Tree->NodeSize;
+        BTNodeDescriptor *NodeDesc = (BTNodeDescriptor *)Data;
+
+        if (sizeof(BTNodeDescriptor) + 2 * ((UINT32)SwapBytes16(NodeDesc->numRecords) + 1) > Tree->NodeSize) {
+            continue;
+        }
+
+        UINT16 Index = NodeCacheRecycle(Cache);
+        CopyMem(Cache->Entries[Index].Data, Data, Tree->NodeSize);
+        HFS_STATS_NODE(Cache, TreeId, Data, FALSE);
+        NodeCacheAdd(Cache, Index, TreeId, NodeNumber + Node);
+        LruPushHead(Cache, Index);
+    }
+
+    ArenaReset(&Tree->Volume->Arena, &Mark);
+    return Status;
+}
+
+// Drop a node from the cache, e.g. after it has been rewritten on disk
+VOID NodeCacheInvalidate(
+    HFSPLUS_NODE_CACHE *Cache,
+    UINT32 TreeId,
+    UINT32 NodeNumber
+) {
+    if (Cache->Buffer == NULL) {
+        return;
+    }
+
+    for (UINT16 Index = Cache->Buckets[NODE_CACHE_HASH(TreeId, NodeNumber)];
+         Index != HFSPLUS_NODE_CACHE_NONE;
+         Index = Cache->Entries[Index].HashNext) {
+        HFSPLUS_NODE_CACHE_ENTRY *Entry = &Cache->Entries[Index];
+
+        if (Entry->TreeId == TreeId && Entry->NodeNumber == NodeNumber) {
+            HashUnlink(Cache, Index);
+            if (Entry->Pinned) {
+                Entry->Pinned = FALSE;
+                Cache->PinnedCount--;
+            } else {
+                LruUnlink(Cache, Index);
+            }
+            LruPushTail(Cache, Index);
+            return;
+        }
+    }
+}
@@ -0,0 +1,309 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusPath.c
+//  This file is the c source for the HFS+ path resolver
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+STATIC
+UINT32
+PathCacheSlot(
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength
+) {
+    UINT32 Hash = 2166136261U ^ ParentID;
+
+    for (UINTN Index = 0; Index < NameLength; Index++) {
+        Hash = (Hash ^ Name[Index]) * 16777619U;
+    }
+
+    return Hash & (HFSPLUS_PATH_CACHE_ENTRIES - 1);
+}
+
+// Look up a component in the cache. Names are matched exactly; a different
+// spelling of a case-insensitive name simply misses and goes to the catalog.
+STATIC
+HFSPLUS_PATH_CACHE_ENTRY *
+PathCacheLookup(
+    HFSPLUS_PATH_CACHE *Cache,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength
+) {
+    HFSPLUS_PATH_CACHE_ENTRY *Entry = &Cache->Entries[PathCacheSlot(ParentID, Name, NameLength)];
+
+    if (Entry->NodeID != 0 && Entry->ParentID == ParentID && Entry->NameLength == NameLength &&
+        CompareMem(Entry->Name, Name, NameLength * sizeof(CHAR16)) == 0) {
+        Cache->Hits++;
+        return Entry;
+    }
+
+    Cache->Misses++;
+    return NULL;
+}
+
+STATIC
+VOID
+PathCacheInsert(
+    HFSPLUS_PATH_CACHE *Cache,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    UINT32 NodeID,
+    UINT32 LinkID,
+    UINT16 RecordType
+) {
+    if (NameLength > HFSPLUS_PATH_CACHE_NAME_LENGTH) {
+        return;
+    }
+
+    HFSPLUS_PATH_CACHE_ENTRY *Entry = &Cache->Entries[PathCacheSlot(ParentID, Name, NameLength)];
+    Entry->ParentID = ParentID;
+    Entry->NodeID = NodeID;
+    Entry->LinkID = LinkID;
+    Entry->RecordType = RecordType;
+    Entry->NameLength = (UINT16)NameLength;
+    CopyMem(Entry->Name, Name, NameLength * sizeof(CHAR16));
+}
+
+// Forget all cached path components of a volume
+VOID PathCacheFlush(
+    HFSPLUS_VOLUME *Volume
+) {
+    if (Volume->PathCache != NULL) {
+        FreePool(Volume->PathCache);
+        Volume->PathCache = NULL;
+    }
+}
+
+// Resolve a path such as L"\\System\\Library\\CoreServices\\boot.efi" (either
+// separator is accepted) to its catalog node ID. Intermediate folders come
+// from the per-volume component cache when possible, so sibling lookups only
+// pay for their last component. If CatalogRecord is not NULL the final
+// component's record is returned; it points into the node cache and is only
+// valid until the next catalog access. Relative paths start at FolderID,
+// paths with a leading separator at the root. Hard links are followed to
+// their inodes, so the node ID and record are those of the inode; LinkID,
+// if not NULL, gets the ID of the link the final component was (0 for an
+// ordinary file or folder).
+STATIC
+EFI_STATUS
+InternalResolvePath(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FolderID,
+    CONST CHAR16 *Path,
+    UINT32 *CatalogNodeID,
+    VOID **CatalogRecord,
+    UINT32 *LinkID
+) {
+    CHAR16 Name[HFSPLUS_MAX_NAME_LENGTH + 1];
+    UINT32 CurrentID = (*Path == L'\\' || *Path == L'/') ? HFSPLUS_ROOT_FOLDER_ID : FolderID;
+    UINT32 CurrentLinkID = 0;
+    UINT16 CurrentType = HFSPLUS_FOLDER_RECORD;
+    VOID *Record = NULL;
+    EFI_STATUS Status;
+
+    if (Volume->CatalogFile.logicalSize == 0) {
+        return EFI_NOT_READY;
+    }
+
+    if (Volume->PathCache == NULL) {
+        Volume->PathCache = AllocateZeroPool(sizeof(HFSPLUS_PATH_CACHE));
+    }
+
+    while (*Path != 0) {
+        while (*Path == L'\\' || *Path == L'/') {
+            Path++;
+        }
+        if (*Path == 0) {
+            break;
+        }
+
+        UINTN NameLength = 0;
+        while (Path[NameLength] != 0 && Path[NameLength] != L'\\' && Path[NameLength] != L'/') {
+            NameLength++;
+        }
+        CONST CHAR16 *Component = Path;
+        Path += NameLength;
+
+        if (CurrentType != HFSPLUS_FOLDER_RECORD) {
+            return EFI_NOT_FOUND;
+        }
+        if (NameLength > HFSPLUS_MAX_NAME_LENGTH) {
+            return EFI_INVALID_PARAMETER;
+        }
+
+        Record = NULL;
+
+        if (NameLength == 1 && Component[0] == L'.') {
+            continue;
+        }
+        CurrentLinkID = 0;
+
+        // ".." goes up through the folder's thread record
+        if (NameLength == 2 && Component[0] == L'.' && Component[1] == L'.') {
+            if (CurrentID != HFSPLUS_ROOT_FOLDER_ID) {
+                Status = TraverseCatalogBTree(Volume, CurrentID, L"", &Record);
+                if (EFI_ERROR(Status)) {
+                    return Status;
+                }
+                if (HFS_BE16(Record) != HFSPLUS_FOLDER_THREAD_RECORD) {
+                    return EFI_VOLUME_CORRUPTED;
+                }
+                CurrentID = HFS_BE32(&((HFSPlusCatalogThread *)Record)->parentID);
+                Record = NULL;
+            }
+            continue;
+        }
+
+        BOOLEAN IsLast = (*Path == 0);
+        HFSPLUS_PATH_CACHE_ENTRY *Entry = NULL;
+
+        // The final record is always read so that its contents can be returned
+        if (Volume->PathCache != NULL && !(IsLast && CatalogRecord != NULL)) {
+            Entry = PathCacheLookup(Volume->PathCache, CurrentID, Component, NameLength);
+        }
+
+        if (Entry != NULL) {
+            CurrentID = Entry->NodeID;
+            CurrentLinkID = Entry->LinkID;
+            CurrentType = Entry->RecordType;
+            continue;
+        }
+
+        CopyMem(Name, Component, NameLength * sizeof(CHAR16));
+        Name[NameLength] = 0;
+
+        Status = TraverseCatalogBTree(Volume, CurrentID, Name, &Record);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        // A hard link names its inode, which is cached along with the link
+        if (HfsIsHardLink(Record)) {
+            CurrentLinkID = HFS_BE32(&((HFSPlusCatalogFile *)Record)->fileID);
+            Status = HfsResolveLink(Volume, &Record);
+            if (EFI_ERROR(Status)) {
+                return Status;
+            }
+        }
+
+        UINT16 RecordType = HFS_BE16(Record);
+        UINT32 NodeID;
+        if (RecordType == HFSPLUS_FOLDER_RECORD) {
+            NodeID = HFS_BE32(&((HFSPlusCatalogFolder *)Record)->folderID);
+        } else if (RecordType == HFSPLUS_FILE_RECORD) {
+            NodeID = HFS_BE32(&((HFSPlusCatalogFile *)Record)->fileID);
+        } else {
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        if (Volume->PathCache != NULL) {
+            PathCacheInsert(Volume->PathCache, CurrentID, Component, NameLength, NodeID, CurrentLinkID, RecordType);
+        }
+
+        CurrentID = NodeID;
+        CurrentType = RecordType;
+    }
+
+    // A path that ends in a folder without a fresh record (root, "." or a
+    // cached component) still needs the folder record for the caller
+    if (CatalogRecord != NULL && Record == NULL) {
+        VOID *Thread;
+
+        Status = TraverseCatalogBTree(Volume, CurrentID, L"", &Thread);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        HFSPlusCatalogThread *ThreadRecord = (HFSPlusCatalogThread *)Thread;
+        UINTN NameLength = HFS_BE16(&ThreadRecord->nodeName.length);
+        UINT32 ParentID = HFS_BE32(&ThreadRecord->parentID);
+        if (NameLength > HFSPLUS_MAX_NAME_LENGTH) {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        for (UINTN Index = 0; Index < NameLength; Index++) {
+            Name[Index] = HFS_BE16(&ThreadRecord->nodeName.unicode[Index]);
+        }
+        Name[NameLength] = 0;
+
+        Status = TraverseCatalogBTree(Volume, ParentID, Name, &Record);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    if (CatalogNodeID != NULL) {
+        *CatalogNodeID = CurrentID;
+    }
+    if (CatalogRecord != NULL) {
+        *CatalogRecord = Record;
+    }
+    if (LinkID != NULL) {
+        *LinkID = CurrentLinkID;
+    }
+    return EFI_SUCCESS;
+}
+
+// Resolve a path to its catalog node ID and, optionally, its record
+EFI_STATUS ResolvePath(
+    HFSPLUS_VOLUME *Volume,
+    CONST CHAR16 *Path,
+    UINT32 *CatalogNodeID,
+    VOID **CatalogRecord
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalResolvePath(Volume, HFSPLUS_ROOT_FOLDER_ID, Path, CatalogNodeID, CatalogRecord, NULL);
+    HFS_STATS_API(Volume, HfsStatsResolvePath, Start, Status);
+    return Status;
+}
+
+// Resolve a path relative to a folder, as EFI_FILE_PROTOCOL.Open does,
+// also telling which hard link, if any, the path went through last
+EFI_STATUS ResolveRelativePath(
+    HFSPLUS_VOLUME *Volume,
+    UINT32 FolderID,
+    CONST CHAR16 *Path,
+    UINT32 *CatalogNodeID,
+    VOID **CatalogRecord,
+    UINT32 *LinkID
+) {
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = InternalResolvePath(Volume, FolderID, Path, CatalogNodeID, CatalogRecord, LinkID);
+    HFS_STATS_API(Volume, HfsStatsResolvePath, Start, Status);
+    return Status;
+}
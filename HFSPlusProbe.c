@@ -0,0 +1,294 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+//
+// @FILE
+//  HFSPlusProbe.c
+//  This file is the c source for finding HFS+ partitions
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// One device being probed. Each probe reads the device blocks that hold
+// byte 1024 into its own slice of a buffer shared by all probes.
+typedef struct {
+    EFI_HANDLE Handle;
+    EFI_BLOCK_IO_PROTOCOL *BlockIo;
+    EFI_BLOCK_IO2_PROTOCOL *BlockIo2;  // NULL when the probe is read synchronously
+    EFI_BLOCK_IO2_TOKEN Token;
+    EFI_LBA Lba;
+    UINTN Size;
+    UINTN BufferOffset;
+    BOOLEAN Pending;
+    EFI_STATUS Status;
+} HFSPLUS_PROBE;
+
+// Check the 512 bytes at offset 1024 of a partition for an HFS+ or HFSX
+// volume header, or an HFS master directory block wrapping an HFS+ volume.
+// Shared by the probes and the mount.
+BOOLEAN HfsClassifyVolumeHeader(
+    CONST UINT8 *Header,
+    HFSPLUS_PARTITION *Partition
+) {
+    CONST HFSPlusVolumeHeader *VolumeHeader = (CONST HFSPlusVolumeHeader *)Header;
+    CONST HFSMasterDirectoryBlock *Mdb = (CONST HFSMasterDirectoryBlock *)Header;
+    UINT16 Signature = HFS_BE16(&VolumeHeader->signature);
+
+    if (Signature == HFSPLUS_SIGNATURE || Signature == HFSX_SIGNATURE) {
+        Partition->Kind = (Signature == HFSX_SIGNATURE) ? HfsProbeHfsx : HfsProbeHfsPlus;
+        Partition->VolumeOffset = 0;
+        Partition->Journaled = (HFS_BE32(&VolumeHeader->attributes) & HFSPLUS_VOL_JOURNALED) != 0;
+        return TRUE;
+    }
+
+    // A plain HFS volume is not something this driver can read
+    if (Signature != HFS_SIGNATURE || HFS_BE16(&Mdb->drEmbedSigWord) != HFSPLUS_SIGNATURE) {
+        return FALSE;
+    }
+
+    UINT32 AllocationBlockSize = HFS_BE32(&Mdb->drAlBlkSiz);
+    if (AllocationBlockSize == 0 || AllocationBlockSize % 512 != 0 ||
+        HFS_BE16(&Mdb->drEmbedExtent.blockCount) == 0) {
+        return FALSE;
+    }
+
+    Partition->Kind = HfsProbeWrapped;
+    Partition->VolumeOffset = (UINT64)HFS_BE16(&Mdb->drAlBlSt) * 512 +
+                              (UINT64)HFS_BE16(&Mdb->drEmbedExtent.startBlock) * AllocationBlockSize;
+    Partition->Journaled = FALSE;
+    return TRUE;
+}
+
+// Check one device for an HFS+ volume, reading only the device blocks that
+// hold the volume header. Used by the driver to test a single handle.
+EFI_STATUS ProbeHfsPlusDevice(
+    EFI_BLOCK_IO_PROTOCOL *BlockIo,
+    HFSPLUS_PARTITION *Partition
+) {
+    EFI_BLOCK_IO_MEDIA *Media = BlockIo->Media;
+
+    if (!Media->MediaPresent || Media->BlockSize == 0) {
+        return EFI_NO_MEDIA;
+    }
+
+    UINTN Skip = HFSPLUS_VOLUME_HEADER_OFFSET % Media->BlockSize;
+    UINTN Size = (Skip + HFSPLUS_VOLUME_HEADER_SIZE + Media->BlockSize - 1) / Media->BlockSize * Media->BlockSize;
+    UINT8 *Buffer = AllocatePool(Size);
+    if (Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EFI_STATUS Status = BlockIo->ReadBlocks(BlockIo, Media->MediaId, HFSPLUS_VOLUME_HEADER_OFFSET / Media->BlockSize, Size, Buffer);
+    if (!EFI_ERROR(Status)) {
+        ZeroMem(Partition, sizeof(*Partition));
+        Partition->BlockIo = BlockIo;
+        Partition->Removable = Media->RemovableMedia;
+        if (!HfsClassifyVolumeHeader(Buffer + Skip, Partition)) {
+            Status = EFI_UNSUPPORTED;
+        }
+    }
+
+    FreePool(Buffer);
+    return Status;
+}
+
+// Lower ranks are better: fixed disks before removable ones, then plain
+// HFS+ before HFSX before wrapped volumes, then journaled volumes first
+STATIC
+UINTN
+PartitionRank(
+    CONST HFSPLUS_PARTITION *Partition
+) {
+    return (Partition->Removable ? 8 : 0) + (UINTN)Partition->Kind * 2 + (Partition->Journaled ? 0 : 1);
+}
+
+// Find HFS+ volumes on every logical partition. Only the device blocks
+// holding the volume header are read, all into one buffer; devices with
+// Block I/O 2 are probed asynchronously and overlap with the synchronous
+// probes of the rest. The result is a pool-allocated list the caller
+// frees, best candidate first with ties kept in handle order.
+EFI_STATUS DetectHfsPlusPartitions(
+    HFSPLUS_PARTITION **Partitions,
+    UINTN *PartitionCount
+) {
+    EFI_HANDLE *HandleBuffer;
+    UINTN HandleCount;
+    UINTN ProbeCount = 0;
+    UINTN BufferSize = 0;
+
+    *Partitions = NULL;
+    *PartitionCount = 0;
+
+    EFI_STATUS Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &HandleCount, &HandleBuffer);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    HFSPLUS_PROBE *Probes = AllocateZeroPool(HandleCount * sizeof(HFSPLUS_PROBE));
+    if (Probes == NULL) {
+        FreePool(HandleBuffer);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Work out what to read from each partition
+    for (UINTN Index = 0; Index < HandleCount; Index++) {
+        EFI_BLOCK_IO_PROTOCOL *BlockIo;
+
+        if (EFI_ERROR(gBS->HandleProtocol(HandleBuffer[Index], &gEfiBlockIoProtocolGuid, (VOID **)&BlockIo))) {
+            continue;
+        }
+
+        EFI_BLOCK_IO_MEDIA *Media = BlockIo->Media;
+        if (!Media->LogicalPartition || !Media->MediaPresent || Media->BlockSize == 0) {
+            continue;  // Skip whole disks and empty drives
+        }
+
+        HFSPLUS_PROBE *Probe = &Probes[ProbeCount++];
+        UINTN Skip = HFSPLUS_VOLUME_HEADER_OFFSET % Media->BlockSize;
+        Probe->Handle = HandleBuffer[Index];
+        Probe->BlockIo = BlockIo;
+        Probe->Lba = HFSPLUS_VOLUME_HEADER_OFFSET / Media->BlockSize;
+        Probe->Size = (Skip + HFSPLUS_VOLUME_HEADER_SIZE + Media->BlockSize - 1) / Media->BlockSize * Media->BlockSize;
+        Probe->BufferOffset = BufferSize;
+        Probe->Status = EFI_NOT_FOUND;
+        BufferSize += Probe->Size;
+
+        if (EFI_ERROR(gBS->HandleProtocol(Probe->Handle, &gEfiBlockIo2ProtocolGuid, (VOID **)&Probe->BlockIo2))) {
+            Probe->BlockIo2 = NULL;
+        }
+    }
+    FreePool(HandleBuffer);
+
+    UINT8 *Buffer = (ProbeCount != 0) ? AllocatePool(BufferSize) : NULL;
+    HFSPLUS_PARTITION *Found = (ProbeCount != 0) ? AllocateZeroPool(ProbeCount * sizeof(HFSPLUS_PARTITION)) : NULL;
+    if (ProbeCount != 0 && (Buffer == NULL || Found == NULL)) {
+        Status = EFI_OUT_OF_RESOURCES;
+        ProbeCount = 0;
+    }
+
+    // Queue every Block I/O 2 probe first. A device that refuses the
+    // request is read synchronously below instead.
+    for (UINTN Index = 0; Index < ProbeCount; Index++) {
+        HFSPLUS_PROBE *Probe = &Probes[Index];
+
+        if (Probe->BlockIo2 == NULL) {
+            continue;
+        }
+        Probe->Token.TransactionStatus = EFI_SUCCESS;
+        if (EFI_ERROR(gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &Probe->Token.Event))) {
+            Probe->BlockIo2 = NULL;
+            continue;
+        }
+
+        if (EFI_ERROR(Probe->BlockIo2->ReadBlocksEx(Probe->BlockIo2, Probe->BlockIo2->Media->MediaId, Probe->Lba,
+                                                    &Probe->Token, Probe->Size, Buffer + Probe->BufferOffset))) {
+            gBS->CloseEvent(Probe->Token.Event);
+            Probe->BlockIo2 = NULL;
+            continue;
+        }
+        Probe->Pending = TRUE;
+    }
+
+    // Read the remaining devices while the queued probes complete
+    for (UINTN Index = 0; Index < ProbeCount; Index++) {
+        HFSPLUS_PROBE *Probe = &Probes[Index];
+
+        if (Probe->BlockIo2 == NULL) {
+            Probe->Status = Probe->BlockIo->ReadBlocks(Probe->BlockIo, Probe->BlockIo->Media->MediaId, Probe->Lba,
+                                                       Probe->Size, Buffer + Probe->BufferOffset);
+        }
+    }
+
+    // Collect the queued probes in whatever order they finish. Completion
+    // is polled with CheckEvent, as for queued fork reads.
+    for (UINTN Pending = ProbeCount; Pending != 0;) {
+        Pending = 0;
+        for (UINTN Index = 0; Index < ProbeCount; Index++) {
+            HFSPLUS_PROBE *Probe = &Probes[Index];
+
+            if (!Probe->Pending) {
+                continue;
+            }
+            if (gBS->CheckEvent(Probe->Token.Event) == EFI_NOT_READY) {
+                Pending++;
+                continue;
+            }
+            Probe->Pending = FALSE;
+            Probe->Status = Probe->Token.TransactionStatus;
+            gBS->CloseEvent(Probe->Token.Event);
+        }
+    }
+
+    // Rank what was found, inserting after every entry that ranks the same
+    // or better so ties stay in handle order
+    for (UINTN Index = 0; Index < ProbeCount; Index++) {
+        HFSPLUS_PROBE *Probe = &Probes[Index];
+        HFSPLUS_PARTITION Partition;
+
+        if (EFI_ERROR(Probe->Status)) {
+            continue;
+        }
+
+        ZeroMem(&Partition, sizeof(Partition));
+        Partition.Handle = Probe->Handle;
+        Partition.BlockIo = Probe->BlockIo;
+        Partition.Removable = Probe->BlockIo->Media->RemovableMedia;
+        if (!HfsClassifyVolumeHeader(Buffer + Probe->BufferOffset + HFSPLUS_VOLUME_HEADER_OFFSET % Probe->BlockIo->Media->BlockSize,
+                           &Partition)) {
+            continue;
+        }
+        DEBUG((DEBUG_INFO, "HFS+ partition found on handle %p (kind %u)\n", Probe->Handle, (UINT32)Partition.Kind));
+
+        UINTN Rank = PartitionRank(&Partition);
+        UINTN Slot = *PartitionCount;
+        while (Slot > 0 && PartitionRank(&Found[Slot - 1]) > Rank) {
+            Found[Slot] = Found[Slot - 1];
+            Slot--;
+        }
+        Found[Slot] = Partition;
+        (*PartitionCount)++;
+    }
+
+    if (Buffer != NULL) {
+        FreePool(Buffer);
+    }
+    FreePool(Probes);
+
+    if (*PartitionCount == 0) {
+        if (Found != NULL) {
+            FreePool(Found);
+        }
+        return EFI_ERROR(Status) ? Status : EFI_NOT_FOUND;
+    }
+
+    *Partitions = Found;
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,148 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusReadAhead.c
+//  This file is the c source for the HFS+ sequential read-ahead
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Copy data for the bytes starting at offset Skip of block Lba out of the
+// read-ahead pool. Returns the number of bytes copied, 0 if no slot holds
+// that block.
+UINTN ReadAheadLookup(
+    HFSPLUS_READAHEAD_POOL *Pool,
+    UINT64 Lba,
+    UINT32 Skip,
+    UINTN Length,
+    VOID *Destination
+) {
+    for (UINTN Index = 0; Index < HFSPLUS_READAHEAD_SLOTS; Index++) {
+        HFSPLUS_READAHEAD_SLOT *Slot = &Pool->Slots[Index];
+
+        if (Slot->BlockCount == 0 || Lba < Slot->Lba || Lba >= Slot->Lba + Slot->BlockCount) {
+            continue;
+        }
+
+        UINT64 SlotOffset = (Lba - Slot->Lba) * Pool->BlockSize + Skip;
+        UINTN Copy = (UINTN)MIN((UINT64)Length, Slot->BlockCount * Pool->BlockSize - SlotOffset);
+
+        CopyMem(Destination, Slot->Data + SlotOffset, Copy);
+        Slot->LastUse = ++Pool->Clock;
+        Pool->Hits++;
+        return Copy;
+    }
+
+    return 0;
+}
+
+// Read BlockCount device blocks starting at Lba into the least recently
+// used slot of the volume's pool. Slot buffers are allocated on first use.
+EFI_STATUS ReadAheadFill(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINTN BlockCount
+) {
+    HFSPLUS_READAHEAD_POOL *Pool = &Volume->ReadAhead;
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+    HFSPLUS_READAHEAD_SLOT *Victim = &Pool->Slots[0];
+    UINT64 VolumeBlocks = BlockIo->Media->LastBlock + 1 - Volume->StartLba;
+
+    Pool->BlockSize = Volume->DeviceBlockSize;
+    BlockCount = MIN(BlockCount, (UINTN)(HFSPLUS_READAHEAD_MAX_WINDOW / Pool->BlockSize));
+    if (Lba >= VolumeBlocks) {
+        return EFI_INVALID_PARAMETER;
+    }
+    BlockCount = (UINTN)MIN((UINT64)BlockCount, VolumeBlocks - Lba);
+    if (BlockCount == 0) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    for (UINTN Index = 1; Index < HFSPLUS_READAHEAD_SLOTS; Index++) {
+        if (Pool->Slots[Index].LastUse < Victim->LastUse) {
+            Victim = &Pool->Slots[Index];
+        }
+    }
+
+    if (Victim->Data == NULL) {
+        Victim->Data = AllocatePool(HFSPLUS_READAHEAD_MAX_WINDOW);
+        if (Victim->Data == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+    }
+
+    Victim->BlockCount = 0;
+    EFI_STATUS Status = HfsReadDevice(
+        Volume,
+        Lba,
+        BlockCount * Pool->BlockSize,
+        Victim->Data
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Victim->Lba = Lba;
+    Victim->BlockCount = BlockCount;
+    Victim->LastUse = ++Pool->Clock;
+    Pool->Fills++;
+    return EFI_SUCCESS;
+}
+
+// Drop read-ahead data that overlaps blocks being written
+VOID ReadAheadInvalidate(
+    HFSPLUS_VOLUME *Volume,
+    UINT64 Lba,
+    UINT64 BlockCount
+) {
+    for (UINTN Index = 0; Index < HFSPLUS_READAHEAD_SLOTS; Index++) {
+        HFSPLUS_READAHEAD_SLOT *Slot = &Volume->ReadAhead.Slots[Index];
+
+        if (Slot->BlockCount != 0 && Lba < Slot->Lba + Slot->BlockCount && Slot->Lba < Lba + BlockCount) {
+            Slot->BlockCount = 0;
+        }
+    }
+}
+
+// Release the buffers of a read-ahead pool
+VOID ReadAheadFree(
+    HFSPLUS_READAHEAD_POOL *Pool
+) {
+    for (UINTN Index = 0; Index < HFSPLUS_READAHEAD_SLOTS; Index++) {
+        if (Pool->Slots[Index].Data != NULL) {
+            FreePool(Pool->Slots[Index].Data);
+        }
+    }
+    ZeroMem(Pool, sizeof(*Pool));
+}
@@ -0,0 +1,283 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusStats.c
+//  This file is the c source for HFS+ device access and statistics
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+
+// Read whole device blocks of a volume. Every synchronous device read of a
+// mounted volume goes through here so statistics builds can count and time it.
+// Lba counts from the start of the HFS+ volume, which inside an HFS wrapper
+// is not the start of the partition.
+EFI_STATUS HfsReadDevice(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, Volume->StartLba + Lba, BufferSize, Buffer);
+    HFS_STATS_IO(Volume, HFSPLUS_TRACE_READ, Lba, BufferSize, Start, Status);
+
+    // Metadata written by the open transaction is not on the disk yet
+    if (!EFI_ERROR(Status) && Volume->Journal.BlockCount != 0) {
+        JournalOverlayRead(Volume, Lba, BufferSize, Buffer);
+    }
+    return Status;
+}
+
+// Write whole device blocks; the counterpart of HfsReadDevice
+EFI_STATUS HfsWriteDevice(
+    HFSPLUS_VOLUME *Volume,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = BlockIo->WriteBlocks(BlockIo, BlockIo->Media->MediaId, Volume->StartLba + Lba, BufferSize, Buffer);
+    HFS_STATS_IO(Volume, HFSPLUS_TRACE_WRITE, Lba, BufferSize, Start, Status);
+    return Status;
+}
+
+// Wait until everything written so far is on stable storage
+EFI_STATUS HfsFlushDevice(
+    HFSPLUS_VOLUME *Volume
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = Volume->BlockIo;
+
+    HFS_STATS_START(Start);
+    EFI_STATUS Status = BlockIo->FlushBlocks(BlockIo);
+    HFS_STATS_IO(Volume, HFSPLUS_TRACE_FLUSH, 0, 0, Start, Status);
+    return Status;
+}
+
+#if HFSPLUS_ENABLE_STATS
+
+STATIC CONST CHAR8 *mHfsStatsApiNames[HfsStatsApiCount] = {
+    "MountHfsPlusVolume",
+    "ResolvePath",
+    "HfsOpenFork",
+    "HfsReadAt",
+    "ReadFileWithFragmentation",
+    "WriteFileWithFragmentation",
+    "LoadBootEfi",
+    "HfsReadDirectory"
+};
+
+STATIC CONST CHAR8 *mHfsStatsTreeNames[HFSPLUS_STATS_TREES] = {
+    "catalog",
+    "extents",
+    "attributes",
+    "other"
+};
+
+// Name of an entry point, for reports
+CONST CHAR8 *HfsStatsApiName(
+    HFSPLUS_STATS_API Api
+) {
+    return (Api < HfsStatsApiCount) ? mHfsStatsApiNames[Api] : "unknown";
+}
+
+// Name of a row of the node counters, for reports
+CONST CHAR8 *HfsStatsTreeName(
+    UINTN Tree
+) {
+    return (Tree < HFSPLUS_STATS_TREES) ? mHfsStatsTreeNames[Tree] : "unknown";
+}
+
+// Append a span to the trace; once it is full further spans are only counted
+STATIC
+VOID
+TraceAppend(
+    HFSPLUS_STATS *Stats,
+    UINT8 Kind,
+    UINT8 Api,
+    EFI_LBA Lba,
+    UINTN Bytes,
+    UINT64 Start,
+    UINT64 Cycles,
+    EFI_STATUS Status
+) {
+    if (Stats->Trace == NULL || Stats->TraceCount == HFSPLUS_STATS_TRACE_EVENTS) {
+        Stats->TraceDropped++;
+        return;
+    }
+
+    HFSPLUS_TRACE_EVENT *Event = &Stats->Trace[Stats->TraceCount++];
+    Event->Start = Start;
+    Event->Cycles = Cycles;
+    Event->Lba = Lba;
+    Event->Bytes = (UINT32)MIN(Bytes, (UINTN)MAX_UINT32);
+    Event->Kind = Kind;
+    Event->Api = Api;
+    Event->Failed = EFI_ERROR(Status) ? 1 : 0;
+}
+
+// Count one device transfer of a volume
+VOID HfsStatsRecordIo(
+    HFSPLUS_VOLUME *Volume,
+    UINT8 Kind,
+    EFI_LBA Lba,
+    UINTN BufferSize,
+    UINT64 Start,
+    EFI_STATUS Status
+) {
+    if (Volume == NULL) {
+        return;
+    }
+
+    HFSPLUS_STATS *Stats = &Volume->Stats;
+    UINT64 Cycles = AsmReadTsc() - Start;
+    UINTN Bucket = (BufferSize < 1024) ? 0 : MIN((UINTN)HighBitSet64(BufferSize / 512), HFSPLUS_STATS_SIZE_BUCKETS - 1);
+
+    if (Kind == HFSPLUS_TRACE_FLUSH) {
+        Stats->Flushes++;
+        Stats->FlushCycles += Cycles;
+    } else if (Kind == HFSPLUS_TRACE_WRITE) {
+        Stats->Writes++;
+        Stats->BytesWritten += BufferSize;
+        Stats->WriteCycles += Cycles;
+        Stats->WriteSizes[Bucket]++;
+    } else {
+        Stats->Reads++;
+        Stats->BytesRead += BufferSize;
+        Stats->ReadCycles += Cycles;
+        Stats->ReadSizes[Bucket]++;
+    }
+
+    TraceAppend(Stats, Kind, 0, Lba, BufferSize, Start, Cycles, Status);
+}
+
+// Count one call of an entry point that started at Start
+VOID HfsStatsRecordApi(
+    HFSPLUS_VOLUME *Volume,
+    HFSPLUS_STATS_API Api,
+    UINT64 Start,
+    EFI_STATUS Status
+) {
+    if (Volume == NULL) {
+        return;
+    }
+
+    HFSPLUS_API_STATS *Entry = &Volume->Stats.Api[Api];
+    UINT64 Cycles = AsmReadTsc() - Start;
+
+    Entry->Calls++;
+    Entry->Cycles += Cycles;
+    Entry->MaxCycles = MAX(Entry->MaxCycles, Cycles);
+    if (EFI_ERROR(Status)) {
+        Entry->Errors++;
+    }
+
+    TraceAppend(&Volume->Stats, HFSPLUS_TRACE_API, (UINT8)Api, 0, 0, Start, Cycles, Status);
+}
+
+// Count a node served by the node cache, by tree and by the node's height
+VOID HfsStatsRecordNode(
+    HFSPLUS_STATS *Stats,
+    UINT32 TreeId,
+    CONST UINT8 *Node,
+    BOOLEAN Hit
+) {
+    UINTN Tree;
+
+    if (Stats == NULL) {
+        return;
+    }
+
+    switch (TreeId) {
+    case HFSPLUS_CATALOG_FILE_ID:
+        Tree = 0;
+        break;
+    case HFSPLUS_EXTENTS_FILE_ID:
+        Tree = 1;
+        break;
+    case HFSPLUS_ATTRIBUTES_FILE_ID:
+        Tree = 2;
+        break;
+    default:
+        Tree = 3;
+        break;
+    }
+
+    UINTN Level = MIN((UINTN)((CONST BTNodeDescriptor *)Node)->height, HFSPLUS_STATS_LEVELS - 1);
+    if (Hit) {
+        Stats->NodeHits[Tree][Level]++;
+    } else {
+        Stats->NodeMisses[Tree][Level]++;
+    }
+}
+
+// Clear every counter of a volume, the cache counters included, and start a
+// new trace. The trace buffer is allocated on first use.
+VOID HfsStatsReset(
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_TRACE_EVENT *Trace = Volume->Stats.Trace;
+
+    ZeroMem(&Volume->Stats, sizeof(HFSPLUS_STATS));
+    Volume->Stats.Trace = (Trace != NULL) ? Trace : AllocatePool(HFSPLUS_STATS_TRACE_EVENTS * sizeof(HFSPLUS_TRACE_EVENT));
+    Volume->NodeCache.Stats = &Volume->Stats;
+
+    Volume->NodeCache.Hits = 0;
+    Volume->NodeCache.Misses = 0;
+    Volume->NodeCache.Evictions = 0;
+    Volume->ReadAhead.Hits = 0;
+    Volume->ReadAhead.Fills = 0;
+    if (Volume->PathCache != NULL) {
+        Volume->PathCache->Hits = 0;
+        Volume->PathCache->Misses = 0;
+    }
+    Volume->Links.Hits = 0;
+    Volume->Links.Misses = 0;
+}
+
+// Release the trace buffer of a volume that is being unmounted
+VOID HfsStatsFree(
+    HFSPLUS_VOLUME *Volume
+) {
+    if (Volume->Stats.Trace != NULL) {
+        FreePool(Volume->Stats.Trace);
+        Volume->Stats.Trace = NULL;
+    }
+    Volume->NodeCache.Stats = NULL;
+}
+
+#endif  // HFSPLUS_ENABLE_STATS
@@ -0,0 +1,194 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HFSPlusUnicode.c
+//  This file is the c source for the HFS+ Unicode name comparison
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HFSPlusFileOps.h"
+#include "HFSPlusCaseFold.h"
+
+#define HFS_LANE_LOW_BYTES   0x00FF00FF00FF00FFULL
+#define HFS_LANE_NON_ASCII   0xFF80FF80FF80FF80ULL
+#define HFS_LANE_HIGH_BITS   0x8000800080008000ULL
+#define HFS_LANE_ONES        0x0001000100010001ULL
+
+// Fold one UTF-16 code unit the way HFS+ orders catalog names. Returns 0
+// for characters that are ignored in comparisons.
+STATIC
+UINT16
+HfsFoldChar(
+    UINT16 Char
+) {
+    UINT8 Page = mHfsCaseFoldIndex[Char >> 8];
+
+    if (Page == 0) {
+        return Char;
+    }
+    return mHfsCaseFoldPages[Page - 1][Char & 0xFF];
+}
+
+// Lower-case four ASCII code units at once. Each 16-bit lane must be below
+// 0x80, so adding to a lane never carries into its neighbour.
+STATIC
+UINT64
+HfsFoldAsciiLanes(
+    UINT64 Lanes
+) {
+    UINT64 AtLeastA = Lanes + (0x80 - 'A') * HFS_LANE_ONES;
+    UINT64 AboveZ = Lanes + (0x80 - 'Z' - 1) * HFS_LANE_ONES;
+    UINT64 Upper = AtLeastA & ~AboveZ & (0x80 * HFS_LANE_ONES);
+
+    return Lanes | (Upper >> 2);
+}
+
+// TRUE if all four lanes are non-zero ASCII, i.e. they fold one to one and
+// none of them is ignored or NUL
+STATIC
+BOOLEAN
+HfsPlainAsciiLanes(
+    UINT64 Lanes
+) {
+    if ((Lanes & HFS_LANE_NON_ASCII) != 0) {
+        return FALSE;
+    }
+    return ((Lanes + 0x7FFF * HFS_LANE_ONES) & HFS_LANE_HIGH_BITS) == HFS_LANE_HIGH_BITS;
+}
+
+// Compare eight code units of each name when all of them are plain ASCII.
+// UEFI targets are little-endian, so the on-disk lanes are byte swapped
+// before folding.
+STATIC
+BOOLEAN
+HfsAsciiBlockEqual(
+    CONST CHAR16 *Name,
+    CONST UINT8 *DiskName
+) {
+    for (UINTN Half = 0; Half < 2; Half++) {
+        UINT64 Left = ReadUnaligned64((CONST UINT64 *)(Name + 4 * Half));
+        UINT64 Right = ReadUnaligned64((CONST UINT64 *)(DiskName + 8 * Half));
+
+        Right = ((Right >> 8) & HFS_LANE_LOW_BYTES) | ((Right & HFS_LANE_LOW_BYTES) << 8);
+        if (!HfsPlainAsciiLanes(Left) || !HfsPlainAsciiLanes(Right)) {
+            return FALSE;
+        }
+        if (HfsFoldAsciiLanes(Left) != HfsFoldAsciiLanes(Right)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// HFS+ FastUnicodeCompare (TN1150) between a host-order name and a
+// big-endian on-disk name, compared in place. Returns <0, 0 or >0 as Name
+// sorts before, equal to or after DiskName.
+INTN HfsFastUnicodeCompare(
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    CONST UINT8 *DiskName,
+    UINTN DiskNameLength
+) {
+    UINTN LeftIndex = 0;
+    UINTN RightIndex = 0;
+    UINTN ScalarSteps = 0;
+
+    while (TRUE) {
+        // Skip runs of identical ASCII; after a miss the next eight code
+        // units go through the full table first
+        if (ScalarSteps == 0) {
+            while (NameLength - LeftIndex >= 8 && DiskNameLength - RightIndex >= 8 &&
+                   HfsAsciiBlockEqual(Name + LeftIndex, DiskName + 2 * RightIndex)) {
+                LeftIndex += 8;
+                RightIndex += 8;
+            }
+            ScalarSteps = 8;
+        }
+        ScalarSteps--;
+
+        UINT16 Left = 0;
+        UINT16 Right = 0;
+
+        while (Left == 0 && LeftIndex < NameLength) {
+            Left = HfsFoldChar(Name[LeftIndex++]);
+        }
+        while (Right == 0 && RightIndex < DiskNameLength) {
+            Right = HfsFoldChar(HFS_BE16(DiskName + 2 * RightIndex));
+            RightIndex++;
+        }
+
+        if (Left != Right) {
+            return (Left < Right) ? -1 : 1;
+        }
+        if (Left == 0) {
+            return 0;  // Both names ended
+        }
+    }
+}
+
+// HFSX binary order (TN1150 kHFSBinaryCompare) between a host-order name
+// and a big-endian on-disk name: code units compare as unsigned numbers
+// and a name sorts before any longer name it is a prefix of. Runs of four
+// equal code units are skipped with one 64-bit compare.
+INTN HfsBinaryUnicodeCompare(
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    CONST UINT8 *DiskName,
+    UINTN DiskNameLength
+) {
+    UINTN Length = MIN(NameLength, DiskNameLength);
+    UINTN Index = 0;
+
+    for (; Index + 4 <= Length; Index += 4) {
+        UINT64 Left = ReadUnaligned64((CONST UINT64 *)(Name + Index));
+        UINT64 Right = ReadUnaligned64((CONST UINT64 *)(DiskName + 2 * Index));
+
+        Right = ((Right >> 8) & HFS_LANE_LOW_BYTES) | ((Right & HFS_LANE_LOW_BYTES) << 8);
+        if (Left != Right) {
+            break;
+        }
+    }
+
+    for (; Index < Length; Index++) {
+        UINT16 Right = HFS_BE16(DiskName + 2 * Index);
+
+        if (Name[Index] != Right) {
+            return (Name[Index] < Right) ? -1 : 1;
+        }
+    }
+
+    if (NameLength != DiskNameLength) {
+        return (NameLength < DiskNameLength) ? -1 : 1;
+    }
+    return 0;
+}
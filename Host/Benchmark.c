@@ -0,0 +1,892 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  Benchmark.c
+//  This file is the c source for the host benchmark harness
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HFSPlusFileOps.h"
+#include "MockBlockIo.h"
+#include "MockHfsImage.h"
+#include "MockDiskImage.h"
+#include "HostShim.h"
+#include "HostStats.h"
+
+#define BENCH_LIST_BATCH  64  // Entries decoded per HfsReadDirectory call by directory_list
+
+// Command line settings
+typedef struct {
+    UINT32 Iterations;
+    UINT32 Files;
+    UINT32 FileSize;
+    UINT32 BlockSize;
+    UINT32 SectorSize;          // Device block size; 0 until parsed, then the block size by default
+    UINT8 VolumeKind;           // MOCK_VOLUME_* of generated volumes
+    CONST CHAR8 *VolumeName;
+    UINT32 SequentialSize;
+    UINT32 ChunkSize;
+    UINT32 FragmentedSize;
+    UINT32 FreeSpaceRunBlocks;
+    UINT32 JournalSize;         // Non-zero formats a journaled volume
+    UINT32 BatchFiles;          // Files written per transaction by batch_write
+    UINT8 Compression;          // MOCK_COMPRESSION_* of the sequentially read file
+    UINT32 Threads;             // Chunk decoding threads; 0 picks a default
+    BOOLEAN Csv;
+    CONST CHAR8 *ImagePath;     // Existing image to open, or the image to create
+    BOOLEAN CreateImage;
+    UINT64 ImageSize;
+    UINT64 ImageOffset;
+    BOOLEAN Writable;
+    MOCK_DISK_IMAGE_MODE ImageMode;
+    CONST CHAR8 *Path;          // File looked up and streamed on existing images
+    CHAR16 WidePath[256];
+    CONST CHAR8 *DeviceName;
+    MOCK_DEVICE_MODEL Device;
+    BOOLEAN Stats;              // Print the driver statistics of each benchmark
+    CONST CHAR8 *TracePath;     // Chrome trace of all benchmarks
+} BENCH_CONFIG;
+
+// Device model presets for --device; the options after it adjust them
+typedef struct {
+    CONST CHAR8 *Name;
+    MOCK_DEVICE_MODEL Model;
+} BENCH_DEVICE_PRESET;
+
+STATIC CONST BENCH_DEVICE_PRESET mDevicePresets[] = {
+    //  Name      Command  Seek     Per MiB  Bytes/s      Queue  Flush
+    { "ideal",  { 0,       0,       0,       0,           1,     0        } },
+    { "usb",    { 500000,  200000,  0,       30000000,    1,     2000000  } },
+    { "hdd",    { 100000,  4000000, 8,       150000000,   1,     10000000 } },
+    { "ssd",    { 60000,   0,       0,       500000000,   32,    1000000  } },
+    { "nvme",   { 20000,   0,       0,       2000000000,  32,    200000   } }
+};
+
+// Everything one benchmark run needs
+typedef struct {
+    BENCH_CONFIG *Config;
+    MockBlockIoProtocol *Disk;
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume;
+    BOOLEAN Generated;  // The volume was formatted by MockHfsImage
+    FILE *Trace;
+} BENCH_CONTEXT;
+
+// Per-operation samples and the counters at the start of a benchmark
+typedef struct {
+    CONST CHAR8 *Name;
+    UINT64 *Samples;
+    UINT32 Count;
+    UINT64 Bytes;
+    UINT64 StartNs;
+    UINT64 ElapsedNs;
+    UINT64 Allocations;
+    UINT64 BytesAllocated;
+    UINT64 DeviceReads;
+    UINT64 DeviceWrites;
+    UINT64 DeviceFlushes;
+    UINT64 DeviceNs;
+} BENCH_RUN;
+
+STATIC BOOLEAN mHeaderPrinted = FALSE;
+
+STATIC
+VOID
+Usage(VOID) {
+    fprintf(stderr,
+        "usage: HfsPlusBenchmark [options]\n"
+        "  --iterations N       operations per benchmark (default 200)\n"
+        "  --files N            files in the lookup folder (default 2000)\n"
+        "  --file-size N        size of each of those files (default 4096)\n"
+        "  --block-size N       allocation block size, and the device's unless given below (default 4096)\n"
+        "  --sector-size N      device block size, dividing the block size (512 or 4096 for real media)\n"
+        "  --volume KIND        generated volume: hfsplus, hfsx or wrapped (in an HFS wrapper)\n"
+        "  --sequential-size N  size of the sequentially read file (default 16 MiB)\n"
+        "  --chunk N            bytes per sequential read call (default 65536)\n"
+        "  --fragmented-size N  size of the one-block-per-extent file (default 1 MiB)\n"
+        "  --free-run N         free space hole size in blocks (default 16)\n"
+        "  --journal N          journal size in bytes; formats a journaled volume\n"
+        "  --batch N            files written per transaction by batch_write (default 16)\n"
+        "  --compression TYPE   store the sequentially read file compressed: none, zlib, lzvn or lzfse\n"
+        "  --threads N          threads decoding compressed chunks (default: one per CPU)\n"
+        "  --format json|csv    output format (default json, one object per line)\n"
+        "  --image PATH         benchmark an existing raw HFS+ image instead of a RAM disk\n"
+        "  --create-image PATH  format a sparse image file and benchmark it\n"
+        "  --image-size N       minimum size of a created image (sparse; may be many GB)\n"
+        "  --offset N           byte offset of the volume inside the image\n"
+        "  --io mmap|pread      how the image is accessed (default mmap)\n"
+        "  --writable           allow writes to an existing image\n"
+        "  --path PATH          file to look up and read on an existing image\n"
+        "                       (default /System/Library/CoreServices/boot.efi)\n"
+        "  --device NAME        device model: ideal, usb, hdd, ssd or nvme (default ideal)\n"
+        "  --command-us N       per-command overhead of the device model\n"
+        "  --seek-us N          cost of a command that does not follow the last one\n"
+        "  --seek-ns-per-mib N  extra seek cost per MiB of distance\n"
+        "  --bandwidth N        sustained transfer rate in MB/s (0 is unlimited)\n"
+        "  --queue-depth N      Block I/O 2 commands the device overlaps\n"
+        "  --flush-us N         cost of a cache flush\n"
+        "  --stats              print driver statistics after each benchmark (to stderr)\n"
+        "  --trace PATH         write a Chrome trace of driver calls and device I/O\n");
+}
+
+STATIC
+BOOLEAN
+ParseArguments(
+    int Argc,
+    char **Argv,
+    BENCH_CONFIG *Config
+) {
+    Config->Iterations = 200;
+    Config->Files = 2000;
+    Config->FileSize = 4096;
+    Config->BlockSize = 4096;
+    Config->SectorSize = 0;
+    Config->VolumeKind = MOCK_VOLUME_HFSPLUS;
+    Config->VolumeName = "hfsplus";
+    Config->SequentialSize = 16 * 1024 * 1024;
+    Config->ChunkSize = 64 * 1024;
+    Config->FragmentedSize = 1024 * 1024;
+    Config->FreeSpaceRunBlocks = 16;
+    Config->JournalSize = 0;
+    Config->BatchFiles = 16;
+    Config->Compression = MOCK_COMPRESSION_NONE;
+    Config->Threads = 0;
+    Config->Csv = FALSE;
+    Config->ImagePath = NULL;
+    Config->CreateImage = FALSE;
+    Config->ImageSize = 0;
+    Config->ImageOffset = 0;
+    Config->Writable = FALSE;
+    Config->ImageMode = MockDiskImageMap;
+    Config->Path = "/System/Library/CoreServices/boot.efi";
+    Config->DeviceName = mDevicePresets[0].Name;
+    Config->Device = mDevicePresets[0].Model;
+    Config->Stats = FALSE;
+    Config->TracePath = NULL;
+
+    for (int Index = 1; Index < Argc; Index++) {
+        CONST char *Name = Argv[Index];
+        CONST char *Value = (Index + 1 < Argc) ? Argv[Index + 1] : NULL;
+        UINT32 *Target = NULL;
+
+        if (strcmp(Name, "--iterations") == 0) {
+            Target = &Config->Iterations;
+        } else if (strcmp(Name, "--files") == 0) {
+            Target = &Config->Files;
+        } else if (strcmp(Name, "--file-size") == 0) {
+            Target = &Config->FileSize;
+        } else if (strcmp(Name, "--block-size") == 0) {
+            Target = &Config->BlockSize;
+        } else if (strcmp(Name, "--sector-size") == 0) {
+            Target = &Config->SectorSize;
+        } else if (strcmp(Name, "--volume") == 0 && Value != NULL) {
+            if (strcmp(Value, "hfsplus") == 0) {
+                Config->VolumeKind = MOCK_VOLUME_HFSPLUS;
+            } else if (strcmp(Value, "hfsx") == 0) {
+                Config->VolumeKind = MOCK_VOLUME_HFSX;
+            } else if (strcmp(Value, "wrapped") == 0) {
+                Config->VolumeKind = MOCK_VOLUME_WRAPPED;
+            } else {
+                return FALSE;
+            }
+            Config->VolumeName = Value;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--sequential-size") == 0) {
+            Target = &Config->SequentialSize;
+        } else if (strcmp(Name, "--chunk") == 0) {
+            Target = &Config->ChunkSize;
+        } else if (strcmp(Name, "--fragmented-size") == 0) {
+            Target = &Config->FragmentedSize;
+        } else if (strcmp(Name, "--free-run") == 0) {
+            Target = &Config->FreeSpaceRunBlocks;
+        } else if (strcmp(Name, "--journal") == 0) {
+            Target = &Config->JournalSize;
+        } else if (strcmp(Name, "--batch") == 0) {
+            Target = &Config->BatchFiles;
+        } else if (strcmp(Name, "--threads") == 0) {
+            Target = &Config->Threads;
+        } else if (strcmp(Name, "--compression") == 0 && Value != NULL) {
+            if (strcmp(Value, "zlib") == 0) {
+                Config->Compression = MOCK_COMPRESSION_ZLIB;
+            } else if (strcmp(Value, "lzvn") == 0) {
+                Config->Compression = MOCK_COMPRESSION_LZVN;
+            } else if (strcmp(Value, "lzfse") == 0) {
+                Config->Compression = MOCK_COMPRESSION_LZFSE;
+            } else if (strcmp(Value, "none") == 0) {
+                Config->Compression = MOCK_COMPRESSION_NONE;
+            } else {
+                return FALSE;
+            }
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--format") == 0 && Value != NULL) {
+            Config->Csv = (strcmp(Value, "csv") == 0);
+            Index++;
+            continue;
+        } else if ((strcmp(Name, "--image") == 0 || strcmp(Name, "--create-image") == 0) && Value != NULL) {
+            Config->ImagePath = Value;
+            Config->CreateImage = (strcmp(Name, "--create-image") == 0);
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--image-size") == 0 && Value != NULL) {
+            Config->ImageSize = strtoull(Value, NULL, 0);
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--offset") == 0 && Value != NULL) {
+            Config->ImageOffset = strtoull(Value, NULL, 0);
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--io") == 0 && Value != NULL) {
+            Config->ImageMode = (strcmp(Value, "pread") == 0) ? MockDiskImagePread : MockDiskImageMap;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--writable") == 0) {
+            Config->Writable = TRUE;
+            continue;
+        } else if (strcmp(Name, "--path") == 0 && Value != NULL) {
+            Config->Path = Value;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--device") == 0 && Value != NULL) {
+            UINTN Preset = 0;
+            while (Preset < ARRAY_SIZE(mDevicePresets) && strcmp(Value, mDevicePresets[Preset].Name) != 0) {
+                Preset++;
+            }
+            if (Preset == ARRAY_SIZE(mDevicePresets)) {
+                return FALSE;
+            }
+            Config->DeviceName = mDevicePresets[Preset].Name;
+            Config->Device = mDevicePresets[Preset].Model;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--command-us") == 0 && Value != NULL) {
+            Config->Device.CommandNs = strtoull(Value, NULL, 0) * 1000;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--seek-us") == 0 && Value != NULL) {
+            Config->Device.SeekNs = strtoull(Value, NULL, 0) * 1000;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--seek-ns-per-mib") == 0 && Value != NULL) {
+            Config->Device.SeekNsPerMiB = strtoull(Value, NULL, 0);
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--flush-us") == 0 && Value != NULL) {
+            Config->Device.FlushNs = strtoull(Value, NULL, 0) * 1000;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--bandwidth") == 0 && Value != NULL) {
+            Config->Device.BytesPerSecond = strtoull(Value, NULL, 0) * 1000000;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--stats") == 0) {
+            Config->Stats = TRUE;
+            continue;
+        } else if (strcmp(Name, "--trace") == 0 && Value != NULL) {
+            Config->TracePath = Value;
+            Index++;
+            continue;
+        } else if (strcmp(Name, "--queue-depth") == 0) {
+            Target = &Config->Device.QueueDepth;
+        } else {
+            return FALSE;
+        }
+
+        if (Value == NULL) {
+            return FALSE;
+        }
+        *Target = (UINT32)strtoul(Value, NULL, 0);
+        Index++;
+    }
+
+    // Paths are given with '/' and handed to the driver as CHAR16
+    UINTN Length = strlen(Config->Path);
+    if (Length >= ARRAY_SIZE(Config->WidePath)) {
+        return FALSE;
+    }
+    for (UINTN Index = 0; Index <= Length; Index++) {
+        Config->WidePath[Index] = (CHAR16)(UINT8)Config->Path[Index];
+    }
+
+    if (Config->SectorSize == 0) {
+        Config->SectorSize = Config->BlockSize;
+    }
+
+    return Config->Iterations != 0 && Config->BlockSize >= 512 && Config->ChunkSize != 0 &&
+           Config->SectorSize >= 512 && Config->BlockSize % Config->SectorSize == 0 &&
+           Config->FreeSpaceRunBlocks != 0 && Config->BatchFiles != 0 && Config->Device.QueueDepth <= MOCK_DEVICE_MAX_QUEUE_DEPTH;
+}
+
+STATIC
+VOID
+BeginRun(
+    BENCH_CONTEXT *Context,
+    BENCH_RUN *Run,
+    CONST CHAR8 *Name
+) {
+    ZeroMem(Run, sizeof(BENCH_RUN));
+    Run->Name = Name;
+    Run->Samples = calloc(Context->Config->Iterations, sizeof(UINT64));
+    Run->Allocations = gHostAllocationStats.Allocations;
+    Run->BytesAllocated = gHostAllocationStats.BytesAllocated;
+    Run->DeviceReads = Context->Disk->ReadCount;
+    Run->DeviceWrites = Context->Disk->WriteCount;
+    Run->DeviceFlushes = Context->Disk->FlushCount;
+    Run->DeviceNs = Context->Disk->DeviceNs;
+#if HFSPLUS_ENABLE_STATS
+    if (Context->Volume != NULL) {
+        HfsStatsReset(Context->Volume);
+    }
+#endif
+    Run->StartNs = HostNanoseconds();
+}
+
+// Record one operation's latency and the bytes it moved
+STATIC
+VOID
+RecordSample(
+    BENCH_RUN *Run,
+    UINT64 Nanoseconds,
+    UINT64 Bytes
+) {
+    Run->Samples[Run->Count++] = Nanoseconds;
+    Run->Bytes += Bytes;
+}
+
+STATIC
+int
+CompareSamples(
+    CONST void *First,
+    CONST void *Second
+) {
+    UINT64 A = *(CONST UINT64 *)First;
+    UINT64 B = *(CONST UINT64 *)Second;
+
+    return (A > B) - (A < B);
+}
+
+// Nearest-rank percentile of the sorted samples, in microseconds
+STATIC
+double
+Percentile(
+    BENCH_RUN *Run,
+    UINT32 Percent
+) {
+    if (Run->Count == 0) {
+        return 0.0;
+    }
+
+    UINT32 Rank = (UINT32)(((UINT64)Percent * Run->Count + 99) / 100);
+    return Run->Samples[MAX(Rank, 1) - 1] / 1000.0;
+}
+
+// Print the summary of a finished benchmark and release its samples
+STATIC
+VOID
+EndRun(
+    BENCH_CONTEXT *Context,
+    BENCH_RUN *Run,
+    EFI_STATUS Status
+) {
+    BENCH_CONFIG *Config = Context->Config;
+    UINT32 Ops = MAX(Run->Count, 1);
+
+    Run->ElapsedNs = HostNanoseconds() - Run->StartNs;
+    qsort(Run->Samples, Run->Count, sizeof(UINT64), CompareSamples);
+
+    double Seconds = Run->ElapsedNs / 1e9;
+    double Busy = 0.0;
+    for (UINT32 Index = 0; Index < Run->Count; Index++) {
+        Busy += Run->Samples[Index] / 1e9;
+    }
+    double DeviceSeconds = (Context->Disk->DeviceNs - Run->DeviceNs) / 1e9;
+    double MegabytesPerSecond = (Busy > 0.0) ? Run->Bytes / Busy / (1024.0 * 1024.0) : 0.0;
+    double DeviceMegabytesPerSecond = (DeviceSeconds > 0.0) ? Run->Bytes / DeviceSeconds / (1024.0 * 1024.0) : 0.0;
+    double OpsPerSecond = (Busy > 0.0) ? Run->Count / Busy : 0.0;
+    double AllocationsPerOp = (double)(gHostAllocationStats.Allocations - Run->Allocations) / Ops;
+    double AllocatedBytesPerOp = (double)(gHostAllocationStats.BytesAllocated - Run->BytesAllocated) / Ops;
+    double ReadsPerOp = (double)(Context->Disk->ReadCount - Run->DeviceReads) / Ops;
+    double WritesPerOp = (double)(Context->Disk->WriteCount - Run->DeviceWrites) / Ops;
+    double FlushesPerOp = (double)(Context->Disk->FlushCount - Run->DeviceFlushes) / Ops;
+    UINT32 Files = Context->Generated ? Config->Files : 0;
+    CONST CHAR8 *Result = (Status == EFI_NOT_STARTED) ? "skipped" : (EFI_ERROR(Status) ? "error" : "ok");
+
+    if (Config->Csv) {
+        if (!mHeaderPrinted) {
+            printf("benchmark,status,ops,bytes,seconds,cpu_seconds,device_seconds,mb_per_s,device_mb_per_s,ops_per_s,"
+                   "p50_us,p90_us,p99_us,max_us,allocs_per_op,alloc_bytes_per_op,device_reads_per_op,"
+                   "device_writes_per_op,device_flushes_per_op,block_size,files,device,sector_size,volume\n");
+            mHeaderPrinted = TRUE;
+        }
+        printf("%s,%s,%u,%llu,%.6f,%.6f,%.6f,%.2f,%.2f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.2f,%.2f,%.2f,%u,%u,%s,%u,%s\n",
+            Run->Name, Result, Run->Count, (unsigned long long)Run->Bytes, Seconds, Busy, DeviceSeconds,
+            MegabytesPerSecond, DeviceMegabytesPerSecond, OpsPerSecond,
+            Percentile(Run, 50), Percentile(Run, 90), Percentile(Run, 99), Percentile(Run, 100),
+            AllocationsPerOp, AllocatedBytesPerOp, ReadsPerOp, WritesPerOp, FlushesPerOp, Config->BlockSize, Files,
+            Config->DeviceName, Config->SectorSize, Context->Generated ? Config->VolumeName : "existing");
+    } else {
+        printf("{\"benchmark\":\"%s\",\"status\":\"%s\",\"ops\":%u,\"bytes\":%llu,\"seconds\":%.6f,"
+               "\"cpu_seconds\":%.6f,\"device_seconds\":%.6f,\"mb_per_s\":%.2f,\"device_mb_per_s\":%.2f,"
+               "\"ops_per_s\":%.1f,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+               "\"allocs_per_op\":%.2f,\"alloc_bytes_per_op\":%.1f,\"device_reads_per_op\":%.2f,"
+               "\"device_writes_per_op\":%.2f,\"device_flushes_per_op\":%.2f,\"block_size\":%u,\"files\":%u,"
+               "\"device\":\"%s\",\"sector_size\":%u,\"volume\":\"%s\"}\n",
+            Run->Name, Result, Run->Count, (unsigned long long)Run->Bytes, Seconds, Busy, DeviceSeconds,
+            MegabytesPerSecond, DeviceMegabytesPerSecond, OpsPerSecond,
+            Percentile(Run, 50), Percentile(Run, 90), Percentile(Run, 99), Percentile(Run, 100),
+            AllocationsPerOp, AllocatedBytesPerOp, ReadsPerOp, WritesPerOp, FlushesPerOp, Config->BlockSize, Files,
+            Config->DeviceName, Config->SectorSize, Context->Generated ? Config->VolumeName : "existing");
+    }
+
+#if HFSPLUS_ENABLE_STATS
+    // The mount benchmark leaves a new volume behind, holding its last mount
+    if (Context->Volume != NULL && Status != EFI_NOT_STARTED) {
+        if (Config->Stats) {
+            HostPrintStats(stderr, Run->Name, Context->Volume);
+        }
+        if (Context->Trace != NULL) {
+            HostTraceAppend(Context->Trace, Run->Name, Context->Volume);
+        }
+    }
+#endif
+
+    free(Run->Samples);
+}
+
+// Report a benchmark that does not apply to this volume
+STATIC
+EFI_STATUS
+SkipRun(
+    BENCH_CONTEXT *Context,
+    CONST CHAR8 *Name
+) {
+    BENCH_RUN Run;
+
+    BeginRun(Context, &Run, Name);
+    EndRun(Context, &Run, EFI_NOT_STARTED);
+    return EFI_SUCCESS;
+}
+
+// Unmount and mount again; each mount re-reads the header and the bitmap
+STATIC
+EFI_STATUS
+BenchMount(
+    BENCH_CONTEXT *Context
+) {
+    BENCH_RUN Run;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    BeginRun(Context, &Run, "mount");
+    for (UINT32 Index = 0; Index < Context->Config->Iterations && !EFI_ERROR(Status); Index++) {
+        UINT64 Start = HostNanoseconds();
+
+        UnmountHfsPlusVolume(Context->Volume);
+        Status = MountHfsPlusVolume(&Context->Disk->BlockIo, &Context->Volume);
+        RecordSample(&Run, HostNanoseconds() - Start, 0);
+    }
+    EndRun(Context, &Run, Status);
+    return Status;
+}
+
+// Resolve paths of random files in the lookup folder, or the --path file on
+// an existing image
+STATIC
+EFI_STATUS
+BenchLookup(
+    BENCH_CONTEXT *Context
+) {
+    CHAR16 Path[8 + MOCK_HFS_FILE_NAME_LENGTH + 1] = L"\\Files\\";
+    BENCH_RUN Run;
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Seed = 12345;
+
+    BOOLEAN RandomFiles = Context->Generated && Context->Config->Files != 0;
+
+    BeginRun(Context, &Run, "lookup");
+    for (UINT32 Index = 0; Index < Context->Config->Iterations && !EFI_ERROR(Status); Index++) {
+        UINT32 CatalogNodeID = 0;
+
+        if (RandomFiles) {
+            Seed = Seed * 1103515245 + 12345;
+            MockHfsFileName((Seed >> 8) % Context->Config->Files, Path + 7);
+        }
+
+        UINT64 Start = HostNanoseconds();
+        Status = ResolvePath(Context->Volume, RandomFiles ? Path : Context->Config->WidePath, &CatalogNodeID, NULL);
+        RecordSample(&Run, HostNanoseconds() - Start, 0);
+    }
+    EndRun(Context, &Run, Status);
+    return Status;
+}
+
+// List the lookup folder (the root folder of an existing image) from the
+// first child to the last, prefetching leaves as the driver's Read does
+STATIC
+EFI_STATUS
+BenchDirectoryList(
+    BENCH_CONTEXT *Context
+) {
+    UINT32 FolderID = Context->Generated ? Context->Image.FilesFolderID : HFSPLUS_ROOT_FOLDER_ID;
+    HFSPLUS_DIR_ENTRY *Entries = malloc(BENCH_LIST_BATCH * sizeof(HFSPLUS_DIR_ENTRY));
+    EFI_STATUS Status = EFI_SUCCESS;
+    BENCH_RUN Run;
+
+    BeginRun(Context, &Run, "directory_list");
+    for (UINT32 Index = 0; Index < Context->Config->Iterations && !EFI_ERROR(Status); Index++) {
+        HFSPLUS_DIR_ITERATOR Iterator;
+        UINTN Count = BENCH_LIST_BATCH;
+
+        UINT64 Start = HostNanoseconds();
+        Status = HfsOpenDirectory(Context->Volume, FolderID, TRUE, &Iterator);
+        while (!EFI_ERROR(Status) && Count == BENCH_LIST_BATCH) {
+            Status = HfsReadDirectory(&Iterator, Entries, &Count);
+        }
+        RecordSample(&Run, HostNanoseconds() - Start, 0);
+    }
+    EndRun(Context, &Run, Status);
+
+    free(Entries);
+    return Status;
+}
+
+// Stream the --path file (boot.efi by default) through the fork reader in
+// ChunkSize calls
+STATIC
+EFI_STATUS
+BenchSequentialRead(
+    BENCH_CONTEXT *Context
+) {
+    BENCH_CONFIG *Config = Context->Config;
+    HFSPlusCatalogFile *Record = NULL;
+    HFSPLUS_FORK *Fork = NULL;
+    BENCH_RUN Run;
+
+    EFI_STATUS Status = ResolvePath(Context->Volume, Config->WidePath, NULL, (VOID **)&Record);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    if (HFS_BE16(&Record->recordType) != HFSPLUS_FILE_RECORD) {
+        return SkipRun(Context, "sequential_read");
+    }
+
+    // Compressed files are decoded as they are read
+    Status = HfsOpenFile(Context->Volume, Record, &Fork);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT8 *Buffer = malloc(Config->ChunkSize);
+    UINT64 Offset = 0;
+
+    BeginRun(Context, &Run, "sequential_read");
+    for (UINT32 Index = 0; Index < Config->Iterations && !EFI_ERROR(Status); Index++) {
+        UINTN Length = Config->ChunkSize;
+
+        if (Offset >= Fork->Size) {
+            Offset = 0;
+        }
+
+        UINT64 Start = HostNanoseconds();
+        Status = HfsReadAt(Fork, Offset, &Length, Buffer);
+        RecordSample(&Run, HostNanoseconds() - Start, Length);
+        Offset += Length;
+    }
+    EndRun(Context, &Run, Status);
+
+    free(Buffer);
+    HfsCloseFork(Fork);
+    return Status;
+}
+
+// Read the whole one-block-per-extent file, extents overflow lookups included
+STATIC
+EFI_STATUS
+BenchFragmentedRead(
+    BENCH_CONTEXT *Context
+) {
+    HFSPlusCatalogFile *Record = NULL;
+    HFSPlusForkData DataFork;
+    BENCH_RUN Run;
+
+    if (!Context->Generated || Context->Config->FragmentedSize == 0) {
+        return SkipRun(Context, "fragmented_read");
+    }
+
+    EFI_STATUS Status = ResolvePath(Context->Volume, L"\\Fragmented.bin", NULL, (VOID **)&Record);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    HfsForkDataFromDisk(&Record->dataFork, &DataFork);
+
+    BeginRun(Context, &Run, "fragmented_read");
+    for (UINT32 Index = 0; Index < Context->Config->Iterations && !EFI_ERROR(Status); Index++) {
+        VOID *Data = NULL;
+
+        UINT64 Start = HostNanoseconds();
+        Status = ReadFileWithFragmentation(
+            Context->Volume, &DataFork, Context->Image.FragmentedFileID, HFSPLUS_DATA_FORK, &Data
+        );
+        RecordSample(&Run, HostNanoseconds() - Start, DataFork.logicalSize);
+
+        if (Data != NULL) {
+            FreePool(Data);
+        }
+    }
+    EndRun(Context, &Run, Status);
+    return Status;
+}
+
+// Write files that need all eight inline extents in the split free space
+STATIC
+EFI_STATUS
+BenchFragmentedWrite(
+    BENCH_CONTEXT *Context
+) {
+    BENCH_CONFIG *Config = Context->Config;
+    UINT64 Size = (UINT64)Config->FreeSpaceRunBlocks * 8 * Config->BlockSize;
+    EFI_STATUS Status = EFI_SUCCESS;
+    BENCH_RUN Run;
+
+    if (Context->Disk->Media.ReadOnly) {
+        return SkipRun(Context, "fragmented_write");
+    }
+
+    UINT8 *Data = malloc((size_t)Size);
+    for (UINT64 Offset = 0; Offset < Size; Offset++) {
+        Data[Offset] = MockHfsFileByte(0, Offset);
+    }
+
+    BeginRun(Context, &Run, "fragmented_write");
+    for (UINT32 Index = 0; Index < Config->Iterations && !EFI_ERROR(Status); Index++) {
+        HFSPlusForkData ForkData;
+
+        ZeroMem(&ForkData, sizeof(ForkData));
+        UINT64 Start = HostNanoseconds();
+        Status = WriteFileWithFragmentation(Context->Volume, &ForkData, Data, Size);
+        RecordSample(&Run, HostNanoseconds() - Start, Size);
+    }
+    EndRun(Context, &Run, Status);
+
+    free(Data);
+    return Status;
+}
+
+// Write BatchFiles files of FileSize bytes in one transaction, as an
+// installer or a log writer would; on a journaled volume each batch is
+// one journal commit
+STATIC
+EFI_STATUS
+BenchBatchWrite(
+    BENCH_CONTEXT *Context
+) {
+    BENCH_CONFIG *Config = Context->Config;
+    UINT64 Size = MAX(Config->FileSize, 1);
+    EFI_STATUS Status = EFI_SUCCESS;
+    BENCH_RUN Run;
+
+    if (Context->Disk->Media.ReadOnly) {
+        return SkipRun(Context, "batch_write");
+    }
+
+    UINT8 *Data = malloc((size_t)Size);
+    for (UINT64 Offset = 0; Offset < Size; Offset++) {
+        Data[Offset] = MockHfsFileByte(1, Offset);
+    }
+
+    BeginRun(Context, &Run, "batch_write");
+    for (UINT32 Index = 0; Index < Config->Iterations && !EFI_ERROR(Status); Index++) {
+        UINT64 Start = HostNanoseconds();
+
+        HfsBeginTransaction(Context->Volume);
+        for (UINT32 File = 0; File < Config->BatchFiles && !EFI_ERROR(Status); File++) {
+            HFSPlusForkData ForkData;
+
+            ZeroMem(&ForkData, sizeof(ForkData));
+            Status = WriteFileWithFragmentation(Context->Volume, &ForkData, Data, Size);
+        }
+        EFI_STATUS CommitStatus = HfsEndTransaction(Context->Volume, !EFI_ERROR(Status));
+        if (!EFI_ERROR(Status)) {
+            Status = CommitStatus;
+        }
+        RecordSample(&Run, HostNanoseconds() - Start, Size * Config->BatchFiles);
+    }
+    EndRun(Context, &Run, Status);
+
+    free(Data);
+    return Status;
+}
+
+int
+main(
+    int Argc,
+    char **Argv
+) {
+    BENCH_CONFIG Config;
+    BENCH_CONTEXT Context;
+    MOCK_HFS_IMAGE_OPTIONS Options;
+
+    if (!ParseArguments(Argc, Argv, &Config)) {
+        Usage();
+        return 2;
+    }
+
+    ZeroMem(&Context, sizeof(Context));
+    ZeroMem(&Options, sizeof(Options));
+    Context.Config = &Config;
+
+    if (Config.Stats || Config.TracePath != NULL) {
+#if HFSPLUS_ENABLE_STATS
+        if (Config.TracePath != NULL) {
+            Context.Trace = HostTraceOpen(Config.TracePath);
+            if (Context.Trace == NULL) {
+                fprintf(stderr, "Cannot create %s\n", Config.TracePath);
+                return 1;
+            }
+        }
+#else
+        fprintf(stderr, "Statistics are not compiled in; configure with -DHFSPLUS_STATS=ON\n");
+        return 2;
+#endif
+    }
+
+    Options.BlockSize = Config.BlockSize;
+    Options.NodeSize = MAX(Config.BlockSize, 4096);
+    Options.BootEfiSize = Config.SequentialSize;
+    Options.FileCount = Config.Files;
+    Options.FileSize = Config.FileSize;
+    Options.FragmentedSize = Config.FragmentedSize;
+    Options.FreeSpaceRunBlocks = Config.FreeSpaceRunBlocks;
+    Options.JournalSize = Config.JournalSize;
+    Options.Compression = Config.Compression;
+    Options.VolumeKind = Config.VolumeKind;
+    HostSetThreadCount(Config.Threads);
+
+    // Room for every file, the scattered file's gaps, the writes (which only
+    // get half of the free space) and the B-trees
+    UINT64 BlockSize = Config.BlockSize;
+    UINT64 Blocks = 1024;
+    Blocks += (Config.SequentialSize + BlockSize - 1) / BlockSize;
+    Blocks += (UINT64)Config.Files * ((Config.FileSize + BlockSize - 1) / BlockSize + 1);
+    Blocks += 2 * ((Config.FragmentedSize + BlockSize - 1) / BlockSize);
+    Blocks += 2 * (UINT64)Config.Iterations * Config.FreeSpaceRunBlocks * 8;
+    Blocks += 2 * (UINT64)Config.Iterations * Config.BatchFiles * ((Config.FileSize + BlockSize - 1) / BlockSize + 1);
+    Blocks += (Config.JournalSize + BlockSize - 1) / BlockSize;
+
+    if (Config.ImagePath == NULL) {
+        Context.Disk = InitializeMockDisk(Blocks * BlockSize / Config.SectorSize, Config.SectorSize);
+        Context.Generated = TRUE;
+    } else if (Config.CreateImage) {
+        Blocks = MAX(Blocks, Config.ImageSize / BlockSize);
+        Context.Disk = CreateMockDiskImage(Config.ImagePath, Blocks * BlockSize, Config.SectorSize, Config.ImageMode);
+        Context.Generated = TRUE;
+    } else {
+        Context.Disk = OpenMockDiskImage(
+            Config.ImagePath,
+            Config.ImageOffset,
+            0,
+            Config.SectorSize,
+            Config.Writable,
+            Config.ImageMode
+        );
+    }
+    if (Context.Disk == NULL) {
+        fprintf(stderr, "Cannot set up a %llu block disk\n", (unsigned long long)Blocks);
+        return 1;
+    }
+
+    EFI_STATUS Status = EFI_SUCCESS;
+    if (Context.Generated) {
+        Status = BuildMockHfsImage(Context.Disk, &Options, &Context.Image);
+    }
+
+    // Formatting is not timed. A queueing device also publishes Block I/O 2
+    // so the driver can find it on the disk's handle.
+    EFI_HANDLE DiskHandle = NULL;
+    MockSetDeviceModel(Context.Disk, &Config.Device);
+    if (!EFI_ERROR(Status) && Config.Device.QueueDepth > 1) {
+        Status = gBS->InstallProtocolInterface(&DiskHandle, &gEfiBlockIoProtocolGuid, EFI_NATIVE_INTERFACE, &Context.Disk->BlockIo);
+        if (!EFI_ERROR(Status)) {
+            Status = gBS->InstallProtocolInterface(&DiskHandle, &gEfiBlockIo2ProtocolGuid, EFI_NATIVE_INTERFACE, &Context.Disk->BlockIo2);
+        }
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Context.Disk->BlockIo, &Context.Volume);
+    }
+    if (EFI_ERROR(Status)) {
+        fprintf(stderr, "Cannot %s the benchmark volume: error %lu\n",
+            Context.Generated ? "build" : "mount", (unsigned long)(Status & ~MAX_BIT));
+        if (DiskHandle != NULL) {
+            gBS->UninstallProtocolInterface(DiskHandle, &gEfiBlockIo2ProtocolGuid, &Context.Disk->BlockIo2);
+            gBS->UninstallProtocolInterface(DiskHandle, &gEfiBlockIoProtocolGuid, &Context.Disk->BlockIo);
+        }
+        FreeMockDisk(Context.Disk);
+        return 1;
+    }
+
+    EFI_STATUS Result = EFI_SUCCESS;
+    EFI_STATUS (*Benchmarks[])(BENCH_CONTEXT *) = {
+        BenchMount,
+        BenchLookup,
+        BenchDirectoryList,
+        BenchSequentialRead,
+        BenchFragmentedRead,
+        BenchFragmentedWrite,
+        BenchBatchWrite
+    };
+
+    // A failed remount leaves no volume for the benchmarks after it
+    for (UINTN Index = 0; Index < ARRAY_SIZE(Benchmarks) && Context.Volume != NULL; Index++) {
+        Status = Benchmarks[Index](&Context);
+        if (EFI_ERROR(Status)) {
+            Result = Status;
+        }
+    }
+
+    UnmountHfsPlusVolume(Context.Volume);
+    if (DiskHandle != NULL) {
+        gBS->UninstallProtocolInterface(DiskHandle, &gEfiBlockIo2ProtocolGuid, &Context.Disk->BlockIo2);
+        gBS->UninstallProtocolInterface(DiskHandle, &gEfiBlockIoProtocolGuid, &Context.Disk->BlockIo);
+    }
+    FreeMockDisk(Context.Disk);
+#if HFSPLUS_ENABLE_STATS
+    if (Context.Trace != NULL) {
+        HostTraceClose(Context.Trace);
+    }
+#endif
+    return EFI_ERROR(Result) ? 1 : 0;
+}
@@ -0,0 +1,614 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HostShim.c
+//  This file is the c source for the host build shim services
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/DebugLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/DriverBinding.h>
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
+
+#include "HostShim.h"
+
+EFI_GUID gEfiBlockIoProtocolGuid = { 0x964e5b21, 0x6459, 0x11d2, { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } };
+EFI_GUID gEfiBlockIo2ProtocolGuid = { 0xa77b2472, 0xe282, 0x4e9f, { 0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1 } };
+EFI_GUID gEfiSimpleFileSystemProtocolGuid = { 0x964e5b22, 0x6459, 0x11d2, { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } };
+EFI_GUID gEfiDriverBindingProtocolGuid = { 0x18a031ab, 0xb443, 0x4d1a, { 0xa5, 0xc0, 0x0c, 0x09, 0x26, 0x1e, 0x9f, 0x71 } };
+EFI_GUID gEfiFileInfoGuid = { 0x09576e92, 0x6d3f, 0x11d2, { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } };
+EFI_GUID gEfiFileSystemInfoGuid = { 0x09576e93, 0x6d3f, 0x11d2, { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } };
+
+HOST_ALLOCATION_STATS gHostAllocationStats;
+
+// Every pool block carries its size in front so FreePool can account for it
+typedef struct {
+    UINT64 Size;
+    UINT64 Pad;
+} HOST_POOL_HEADER;
+
+// Monotonic clock in nanoseconds
+UINT64
+HostNanoseconds(VOID) {
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (UINT64)Now.tv_sec * 1000000000ULL + (UINT64)Now.tv_nsec;
+}
+
+UINT16 EFIAPI SwapBytes16(UINT16 Value) { return __builtin_bswap16(Value); }
+UINT32 EFIAPI SwapBytes32(UINT32 Value) { return __builtin_bswap32(Value); }
+UINT64 EFIAPI SwapBytes64(UINT64 Value) { return __builtin_bswap64(Value); }
+
+UINT16 EFIAPI ReadUnaligned16(CONST UINT16 *Buffer) { UINT16 Value; memcpy(&Value, Buffer, sizeof(Value)); return Value; }
+UINT32 EFIAPI ReadUnaligned32(CONST UINT32 *Buffer) { UINT32 Value; memcpy(&Value, Buffer, sizeof(Value)); return Value; }
+UINT64 EFIAPI ReadUnaligned64(CONST UINT64 *Buffer) { UINT64 Value; memcpy(&Value, Buffer, sizeof(Value)); return Value; }
+UINT16 EFIAPI WriteUnaligned16(UINT16 *Buffer, UINT16 Value) { memcpy(Buffer, &Value, sizeof(Value)); return Value; }
+UINT32 EFIAPI WriteUnaligned32(UINT32 *Buffer, UINT32 Value) { memcpy(Buffer, &Value, sizeof(Value)); return Value; }
+UINT64 EFIAPI WriteUnaligned64(UINT64 *Buffer, UINT64 Value) { memcpy(Buffer, &Value, sizeof(Value)); return Value; }
+
+INTN EFIAPI LowBitSet64(UINT64 Operand) { return Operand == 0 ? -1 : (INTN)__builtin_ctzll(Operand); }
+INTN EFIAPI HighBitSet64(UINT64 Operand) { return Operand == 0 ? -1 : (INTN)(63 - __builtin_clzll(Operand)); }
+
+UINT64 EFIAPI DivU64x32(UINT64 Dividend, UINT32 Divisor) { return Dividend / Divisor; }
+UINT64 EFIAPI MultU64x32(UINT64 Multiplicand, UINT32 Multiplier) { return Multiplicand * Multiplier; }
+UINT64 EFIAPI LShiftU64(UINT64 Operand, UINTN Count) { return Operand << Count; }
+UINT64 EFIAPI RShiftU64(UINT64 Operand, UINTN Count) { return Operand >> Count; }
+
+UINT64
+EFIAPI
+DivU64x32Remainder(UINT64 Dividend, UINT32 Divisor, UINT32 *Remainder) {
+    if (Remainder != NULL) {
+        *Remainder = (UINT32)(Dividend % Divisor);
+    }
+    return Dividend / Divisor;
+}
+
+UINTN
+EFIAPI
+StrLen(CONST CHAR16 *String) {
+    UINTN Length = 0;
+
+    while (String[Length] != 0) {
+        Length++;
+    }
+    return Length;
+}
+
+INTN
+EFIAPI
+StrCmp(CONST CHAR16 *FirstString, CONST CHAR16 *SecondString) {
+    while (*FirstString != 0 && *FirstString == *SecondString) {
+        FirstString++;
+        SecondString++;
+    }
+    return (INTN)*FirstString - (INTN)*SecondString;
+}
+
+UINTN EFIAPI AsciiStrLen(CONST CHAR8 *String) { return strlen(String); }
+
+// The host has no calibrated TSC, so the monotonic clock stands in for it
+UINT64
+EFIAPI
+AsmReadTsc(VOID) {
+    return HostNanoseconds();
+}
+
+UINT32
+EFIAPI
+CalculateCrc32(VOID *Data, UINTN DataSize) {
+    UINT32 Crc = 0xFFFFFFFF;
+    UINT8 *Bytes = Data;
+
+    for (UINTN Index = 0; Index < DataSize; Index++) {
+        Crc ^= Bytes[Index];
+        for (UINTN Bit = 0; Bit < 8; Bit++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    return Crc ^ 0xFFFFFFFF;
+}
+
+VOID *EFIAPI CopyMem(VOID *DestinationBuffer, CONST VOID *SourceBuffer, UINTN Length) { return memmove(DestinationBuffer, SourceBuffer, Length); }
+VOID *EFIAPI SetMem(VOID *Buffer, UINTN Length, UINT8 Value) { return memset(Buffer, Value, Length); }
+VOID *EFIAPI ZeroMem(VOID *Buffer, UINTN Length) { return memset(Buffer, 0, Length); }
+INTN EFIAPI CompareMem(CONST VOID *DestinationBuffer, CONST VOID *SourceBuffer, UINTN Length) { return memcmp(DestinationBuffer, SourceBuffer, Length); }
+BOOLEAN EFIAPI CompareGuid(CONST EFI_GUID *Guid1, CONST EFI_GUID *Guid2) { return memcmp(Guid1, Guid2, sizeof(EFI_GUID)) == 0; }
+
+VOID *
+EFIAPI
+AllocatePool(UINTN AllocationSize) {
+    HOST_POOL_HEADER *Header = malloc(sizeof(HOST_POOL_HEADER) + AllocationSize);
+
+    if (Header == NULL) {
+        return NULL;
+    }
+
+    Header->Size = AllocationSize;
+    gHostAllocationStats.Allocations++;
+    gHostAllocationStats.BytesAllocated += AllocationSize;
+    gHostAllocationStats.LiveBytes += AllocationSize;
+    gHostAllocationStats.PeakBytes = MAX(gHostAllocationStats.PeakBytes, gHostAllocationStats.LiveBytes);
+    return Header + 1;
+}
+
+VOID *
+EFIAPI
+AllocateZeroPool(UINTN AllocationSize) {
+    VOID *Memory = AllocatePool(AllocationSize);
+
+    if (Memory != NULL) {
+        memset(Memory, 0, AllocationSize);
+    }
+    return Memory;
+}
+
+VOID *
+EFIAPI
+AllocateCopyPool(UINTN AllocationSize, CONST VOID *Buffer) {
+    VOID *Memory = AllocatePool(AllocationSize);
+
+    if (Memory != NULL) {
+        memcpy(Memory, Buffer, AllocationSize);
+    }
+    return Memory;
+}
+
+VOID *
+EFIAPI
+ReallocatePool(UINTN OldSize, UINTN NewSize, VOID *OldBuffer) {
+    VOID *NewBuffer = AllocateZeroPool(NewSize);
+
+    if (NewBuffer != NULL && OldBuffer != NULL) {
+        memcpy(NewBuffer, OldBuffer, MIN(OldSize, NewSize));
+        FreePool(OldBuffer);
+    }
+    return NewBuffer;
+}
+
+VOID
+EFIAPI
+FreePool(VOID *Buffer) {
+    HOST_POOL_HEADER *Header = (HOST_POOL_HEADER *)Buffer - 1;
+
+    gHostAllocationStats.Frees++;
+    gHostAllocationStats.LiveBytes -= Header->Size;
+    free(Header);
+}
+
+// Rewrites the EDK II format specifiers (%a, %s, %r, %L) into printf form
+STATIC
+VOID
+HostVPrint(
+    FILE *Stream,
+    CONST CHAR8 *Format,
+    va_list Args
+) {
+    while (*Format != '\0') {
+        if (*Format != '%') {
+            fputc(*Format++, Stream);
+            continue;
+        }
+
+        CHAR8 Spec[32];
+        UINTN SpecLength = 0;
+        BOOLEAN Long = FALSE;
+
+        Spec[SpecLength++] = *Format++;
+        while (*Format != '\0' && strchr("-+ #0123456789.", *Format) != NULL && SpecLength < sizeof(Spec) - 4) {
+            Spec[SpecLength++] = *Format++;
+        }
+        while (*Format == 'l' || *Format == 'L') {
+            Long = TRUE;
+            Format++;
+        }
+
+        CHAR8 Conversion = *Format;
+        if (Conversion == '\0') {
+            break;
+        }
+        Format++;
+
+        switch (Conversion) {
+            case 'd':
+            case 'u':
+            case 'x':
+            case 'X':
+                if (Long) {
+                    Spec[SpecLength++] = 'l';
+                    Spec[SpecLength++] = 'l';
+                    Spec[SpecLength++] = Conversion;
+                    Spec[SpecLength] = '\0';
+                    fprintf(Stream, Spec, va_arg(Args, UINT64));
+                } else {
+                    Spec[SpecLength++] = Conversion;
+                    Spec[SpecLength] = '\0';
+                    fprintf(Stream, Spec, va_arg(Args, UINT32));
+                }
+                break;
+
+            case 'p':
+                fprintf(Stream, "%p", va_arg(Args, VOID *));
+                break;
+
+            case 'c':
+                fputc((int)va_arg(Args, UINT32), Stream);
+                break;
+
+            case 'a':
+                fputs(va_arg(Args, CHAR8 *), Stream);
+                break;
+
+            case 's': {
+                CONST CHAR16 *Wide = va_arg(Args, CHAR16 *);
+                while (*Wide != 0) {
+                    fputc(*Wide < 0x80 ? (int)*Wide : '?', Stream);
+                    Wide++;
+                }
+                break;
+            }
+
+            case 'r': {
+                EFI_STATUS Status = va_arg(Args, EFI_STATUS);
+                if (EFI_ERROR(Status)) {
+                    fprintf(Stream, "Error %lu", (unsigned long)(Status & ~MAX_BIT));
+                } else {
+                    fprintf(Stream, "Success");
+                }
+                break;
+            }
+
+            default:
+                fputc(Conversion, Stream);
+                break;
+        }
+    }
+}
+
+// Prints to stderr when the level is enabled in the HFSPLUS_DEBUG mask
+VOID
+EFIAPI
+DebugPrint(UINTN ErrorLevel, CONST CHAR8 *Format, ...) {
+    STATIC BOOLEAN MaskRead = FALSE;
+    STATIC UINTN Mask = 0;
+    va_list Args;
+
+    if (!MaskRead) {
+        CONST char *Value = getenv("HFSPLUS_DEBUG");
+        Mask = (Value != NULL) ? (UINTN)strtoull(Value, NULL, 0) : 0;
+        MaskRead = TRUE;
+    }
+
+    if ((ErrorLevel & Mask) == 0) {
+        return;
+    }
+
+    va_start(Args, Format);
+    HostVPrint(stderr, Format, Args);
+    va_end(Args);
+}
+
+VOID
+EFIAPI
+DebugAssert(CONST CHAR8 *FileName, UINTN LineNumber, CONST CHAR8 *Description) {
+    fprintf(stderr, "ASSERT %s(%lu): %s\n", FileName, (unsigned long)LineNumber, Description);
+    abort();
+}
+
+// Exchange two elements through the caller's scratch element
+STATIC
+VOID
+HostSwap(
+    UINT8 *First,
+    UINT8 *Second,
+    UINTN ElementSize,
+    VOID *Scratch
+) {
+    if (First != Second) {
+        memcpy(Scratch, First, ElementSize);
+        memcpy(First, Second, ElementSize);
+        memcpy(Second, Scratch, ElementSize);
+    }
+}
+
+// Recursive quicksort with the middle element as pivot, like the firmware's
+VOID
+EFIAPI
+QuickSort(
+    VOID *BufferToSort,
+    UINTN Count,
+    UINTN ElementSize,
+    BASE_SORT_COMPARE CompareFunction,
+    VOID *BufferOneElement
+) {
+    UINT8 *Base = BufferToSort;
+
+    while (Count > 1) {
+        UINTN Store = 0;
+
+        HostSwap(Base + (Count / 2) * ElementSize, Base + (Count - 1) * ElementSize, ElementSize, BufferOneElement);
+        UINT8 *Pivot = Base + (Count - 1) * ElementSize;
+
+        for (UINTN Index = 0; Index + 1 < Count; Index++) {
+            if (CompareFunction(Base + Index * ElementSize, Pivot) < 0) {
+                HostSwap(Base + Index * ElementSize, Base + Store * ElementSize, ElementSize, BufferOneElement);
+                Store++;
+            }
+        }
+        HostSwap(Base + Store * ElementSize, Pivot, ElementSize, BufferOneElement);
+
+        // Recurse into the smaller side and loop on the larger one
+        if (Store < Count - Store - 1) {
+            QuickSort(Base, Store, ElementSize, CompareFunction, BufferOneElement);
+            Base += (Store + 1) * ElementSize;
+            Count -= Store + 1;
+        } else {
+            QuickSort(Base + (Store + 1) * ElementSize, Count - Store - 1, ElementSize, CompareFunction, BufferOneElement);
+            Count = Store;
+        }
+    }
+}
+
+// A small handle database: one entry per installed protocol. Handles are
+// just unique addresses.
+#define HOST_MAX_PROTOCOLS  64
+
+typedef struct {
+    EFI_HANDLE Handle;
+    EFI_GUID *Protocol;
+    VOID *Interface;
+} HOST_PROTOCOL_ENTRY;
+
+STATIC HOST_PROTOCOL_ENTRY mHostProtocols[HOST_MAX_PROTOCOLS];
+STATIC UINTN mHostProtocolCount = 0;
+STATIC UINTN mHostNextHandle = 0;
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateHandleBuffer(EFI_LOCATE_SEARCH_TYPE SearchType, EFI_GUID *Protocol, VOID *SearchKey, UINTN *NoHandles, EFI_HANDLE **Buffer) {
+    UINTN Count = 0;
+
+    *NoHandles = 0;
+    *Buffer = NULL;
+    if (SearchType != ByProtocol && SearchType != AllHandles) {
+        return EFI_UNSUPPORTED;
+    }
+
+    for (UINTN Index = 0; Index < mHostProtocolCount; Index++) {
+        if (SearchType == ByProtocol && !CompareGuid(mHostProtocols[Index].Protocol, Protocol)) {
+            continue;
+        }
+        if (*Buffer == NULL) {
+            *Buffer = AllocatePool(mHostProtocolCount * sizeof(EFI_HANDLE));
+            if (*Buffer == NULL) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+        }
+
+        UINTN Seen = 0;
+        while (Seen < Count && (*Buffer)[Seen] != mHostProtocols[Index].Handle) {
+            Seen++;
+        }
+        if (Seen == Count) {
+            (*Buffer)[Count++] = mHostProtocols[Index].Handle;
+        }
+    }
+
+    *NoHandles = Count;
+    return (Count != 0) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostHandleProtocol(EFI_HANDLE Handle, EFI_GUID *Protocol, VOID **Interface) {
+    for (UINTN Index = 0; Index < mHostProtocolCount; Index++) {
+        if (mHostProtocols[Index].Handle == Handle && CompareGuid(mHostProtocols[Index].Protocol, Protocol)) {
+            *Interface = mHostProtocols[Index].Interface;
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_UNSUPPORTED;
+}
+
+// A NULL *Handle gets a new handle, as with the firmware service
+STATIC
+EFI_STATUS
+EFIAPI
+HostInstallProtocolInterface(EFI_HANDLE *Handle, EFI_GUID *Protocol, EFI_INTERFACE_TYPE InterfaceType, VOID *Interface) {
+    VOID *Existing;
+
+    if (Handle == NULL || Protocol == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (*Handle != NULL && !EFI_ERROR(HostHandleProtocol(*Handle, Protocol, &Existing))) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (mHostProtocolCount == HOST_MAX_PROTOCOLS) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (*Handle == NULL) {
+        *Handle = (EFI_HANDLE)(UINTN)(0x1000 + 0x10 * ++mHostNextHandle);
+    }
+    mHostProtocols[mHostProtocolCount].Handle = *Handle;
+    mHostProtocols[mHostProtocolCount].Protocol = Protocol;
+    mHostProtocols[mHostProtocolCount].Interface = Interface;
+    mHostProtocolCount++;
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostUninstallProtocolInterface(EFI_HANDLE Handle, EFI_GUID *Protocol, VOID *Interface) {
+    for (UINTN Index = 0; Index < mHostProtocolCount; Index++) {
+        HOST_PROTOCOL_ENTRY *Entry = &mHostProtocols[Index];
+
+        if (Entry->Handle == Handle && CompareGuid(Entry->Protocol, Protocol) && Entry->Interface == Interface) {
+            mHostProtocols[Index] = mHostProtocols[--mHostProtocolCount];
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_NOT_FOUND;
+}
+
+// Opening a protocol is looking it up; BY_DRIVER opens are counted per
+// handle so a second driver, or a second Start, is refused
+#define HOST_MAX_DRIVER_OPENS  16
+
+typedef struct {
+    EFI_HANDLE Handle;
+    EFI_GUID *Protocol;
+    EFI_HANDLE AgentHandle;
+} HOST_DRIVER_OPEN;
+
+STATIC HOST_DRIVER_OPEN mHostDriverOpens[HOST_MAX_DRIVER_OPENS];
+STATIC UINTN mHostDriverOpenCount = 0;
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostOpenProtocol(EFI_HANDLE Handle, EFI_GUID *Protocol, VOID **Interface, EFI_HANDLE AgentHandle, EFI_HANDLE ControllerHandle, UINT32 Attributes) {
+    VOID *Found;
+
+    EFI_STATUS Status = HostHandleProtocol(Handle, Protocol, &Found);
+    if (EFI_ERROR(Status) || (Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) == 0) {
+        if (Interface != NULL && !EFI_ERROR(Status)) {
+            *Interface = Found;
+        }
+        return Status;
+    }
+
+    for (UINTN Index = 0; Index < mHostDriverOpenCount; Index++) {
+        if (mHostDriverOpens[Index].Handle == Handle && CompareGuid(mHostDriverOpens[Index].Protocol, Protocol)) {
+            return (mHostDriverOpens[Index].AgentHandle == AgentHandle) ? EFI_ALREADY_STARTED : EFI_ACCESS_DENIED;
+        }
+    }
+    if (mHostDriverOpenCount == HOST_MAX_DRIVER_OPENS) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    mHostDriverOpens[mHostDriverOpenCount].Handle = Handle;
+    mHostDriverOpens[mHostDriverOpenCount].Protocol = Protocol;
+    mHostDriverOpens[mHostDriverOpenCount].AgentHandle = AgentHandle;
+    mHostDriverOpenCount++;
+    if (Interface != NULL) {
+        *Interface = Found;
+    }
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCloseProtocol(EFI_HANDLE Handle, EFI_GUID *Protocol, EFI_HANDLE AgentHandle, EFI_HANDLE ControllerHandle) {
+    for (UINTN Index = 0; Index < mHostDriverOpenCount; Index++) {
+        HOST_DRIVER_OPEN *Open = &mHostDriverOpens[Index];
+
+        if (Open->Handle == Handle && CompareGuid(Open->Protocol, Protocol) && Open->AgentHandle == AgentHandle) {
+            mHostDriverOpens[Index] = mHostDriverOpens[--mHostDriverOpenCount];
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_NOT_FOUND;
+}
+
+// Events are a single signalled flag; notify functions are never queued
+STATIC
+EFI_STATUS
+EFIAPI
+HostCreateEvent(UINT32 Type, EFI_TPL NotifyTpl, EFI_EVENT_NOTIFY NotifyFunction, VOID *NotifyContext, EFI_EVENT *Event) {
+    *Event = calloc(1, sizeof(UINTN));
+    return (*Event != NULL) ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSignalEvent(EFI_EVENT Event) {
+    *(UINTN *)Event = 1;
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCheckEvent(EFI_EVENT Event) {
+    if (*(UINTN *)Event == 0) {
+        return EFI_NOT_READY;
+    }
+    *(UINTN *)Event = 0;
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCloseEvent(EFI_EVENT Event) {
+    free(Event);
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_BOOT_SERVICES mHostBootServices = {
+    HostLocateHandleBuffer,
+    HostHandleProtocol,
+    HostCreateEvent,
+    HostSignalEvent,
+    HostCheckEvent,
+    HostCloseEvent,
+    HostInstallProtocolInterface,
+    HostUninstallProtocolInterface,
+    HostOpenProtocol,
+    HostCloseProtocol
+};
+
+EFI_BOOT_SERVICES *gBS = &mHostBootServices;
+EFI_SYSTEM_TABLE *gST = NULL;
+EFI_HANDLE gImageHandle = NULL;
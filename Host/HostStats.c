@@ -0,0 +1,194 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HostStats.c
+//  This file is the c source for the host statistics and trace export
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "HostStats.h"
+
+#if HFSPLUS_ENABLE_STATS
+
+// AsmReadTsc() counts nanoseconds on the host
+#define CYCLES_TO_US(Cycles)  ((Cycles) / 1000.0)
+
+STATIC BOOLEAN mTraceFirstEvent = TRUE;
+
+// Print one row of transfer counters with its size histogram
+STATIC
+VOID
+PrintIoRow(
+    FILE *Output,
+    CONST CHAR8 *Name,
+    UINT64 Count,
+    UINT64 Bytes,
+    UINT64 Cycles,
+    CONST UINT64 *Sizes
+) {
+    fprintf(Output, "%-8s %10llu %14llu %12.1f", Name, (unsigned long long)Count, (unsigned long long)Bytes,
+        CYCLES_TO_US(Cycles));
+    for (UINTN Bucket = 0; Bucket < HFSPLUS_STATS_SIZE_BUCKETS; Bucket++) {
+        fprintf(Output, " %6llu", (unsigned long long)Sizes[Bucket]);
+    }
+    fprintf(Output, "\n");
+}
+
+// Print the statistics of a volume as a compact table
+VOID HostPrintStats(
+    FILE *Output,
+    CONST CHAR8 *Title,
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_STATS *Stats = &Volume->Stats;
+
+    fprintf(Output, "== %s ==\n", Title);
+    fprintf(Output, "%-28s %10s %8s %12s %10s %10s\n", "api", "calls", "errors", "total_us", "avg_us", "max_us");
+    for (UINTN Api = 0; Api < HfsStatsApiCount; Api++) {
+        HFSPLUS_API_STATS *Entry = &Stats->Api[Api];
+
+        if (Entry->Calls == 0) {
+            continue;
+        }
+        fprintf(Output, "%-28s %10llu %8llu %12.1f %10.2f %10.2f\n", HfsStatsApiName((HFSPLUS_STATS_API)Api),
+            (unsigned long long)Entry->Calls, (unsigned long long)Entry->Errors, CYCLES_TO_US(Entry->Cycles),
+            CYCLES_TO_US(Entry->Cycles) / Entry->Calls, CYCLES_TO_US(Entry->MaxCycles));
+    }
+
+    fprintf(Output, "%-8s %10s %14s %12s", "device", "ops", "bytes", "total_us");
+    for (UINTN Bucket = 0; Bucket < HFSPLUS_STATS_SIZE_BUCKETS; Bucket++) {
+        UINT64 Size = 512ULL << Bucket;
+        if (Size >= 1024 * 1024) {
+            fprintf(Output, " %5lluM", (unsigned long long)(Size >> 20));
+        } else if (Size >= 1024) {
+            fprintf(Output, " %5lluK", (unsigned long long)(Size >> 10));
+        } else {
+            fprintf(Output, " %6llu", (unsigned long long)Size);
+        }
+    }
+    fprintf(Output, "\n");
+    PrintIoRow(Output, "read", Stats->Reads, Stats->BytesRead, Stats->ReadCycles, Stats->ReadSizes);
+    PrintIoRow(Output, "write", Stats->Writes, Stats->BytesWritten, Stats->WriteCycles, Stats->WriteSizes);
+    fprintf(Output, "%-8s %10llu %14s %12.1f\n", "flush", (unsigned long long)Stats->Flushes, "-",
+        CYCLES_TO_US(Stats->FlushCycles));
+
+    // Node rows list hits/misses for each height that was visited
+    fprintf(Output, "%-10s %s\n", "nodes", "height:hits/misses");
+    for (UINTN Tree = 0; Tree < HFSPLUS_STATS_TREES; Tree++) {
+        BOOLEAN Any = FALSE;
+
+        for (UINTN Level = 0; Level < HFSPLUS_STATS_LEVELS; Level++) {
+            UINT64 Hits = Stats->NodeHits[Tree][Level];
+            UINT64 Misses = Stats->NodeMisses[Tree][Level];
+
+            if (Hits == 0 && Misses == 0) {
+                continue;
+            }
+            if (!Any) {
+                fprintf(Output, "%-10s", HfsStatsTreeName(Tree));
+                Any = TRUE;
+            }
+            fprintf(Output, " %lu:%llu/%llu", (unsigned long)Level, (unsigned long long)Hits, (unsigned long long)Misses);
+        }
+        if (Any) {
+            fprintf(Output, "\n");
+        }
+    }
+
+    fprintf(Output, "caches     node %llu/%llu (%llu evicted), path %llu/%llu, link %llu/%llu, read-ahead %llu hits/%llu fills\n",
+        (unsigned long long)Volume->NodeCache.Hits, (unsigned long long)Volume->NodeCache.Misses,
+        (unsigned long long)Volume->NodeCache.Evictions,
+        (unsigned long long)((Volume->PathCache != NULL) ? Volume->PathCache->Hits : 0),
+        (unsigned long long)((Volume->PathCache != NULL) ? Volume->PathCache->Misses : 0),
+        (unsigned long long)Volume->Links.Hits, (unsigned long long)Volume->Links.Misses,
+        (unsigned long long)Volume->ReadAhead.Hits, (unsigned long long)Volume->ReadAhead.Fills);
+    fprintf(Output, "trace      %lu events, %llu dropped\n", (unsigned long)Stats->TraceCount,
+        (unsigned long long)Stats->TraceDropped);
+}
+
+// Start a Chrome trace file (chrome://tracing, Perfetto)
+FILE *HostTraceOpen(
+    CONST CHAR8 *Path
+) {
+    FILE *Output = fopen(Path, "w");
+
+    if (Output != NULL) {
+        fprintf(Output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        mTraceFirstEvent = TRUE;
+    }
+    return Output;
+}
+
+// Add the trace of a volume as complete events, marked with Label
+VOID HostTraceAppend(
+    FILE *Output,
+    CONST CHAR8 *Label,
+    HFSPLUS_VOLUME *Volume
+) {
+    HFSPLUS_STATS *Stats = &Volume->Stats;
+
+    if (Stats->TraceCount == 0) {
+        return;
+    }
+
+    fprintf(Output, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":1,\"ts\":%.3f}",
+        mTraceFirstEvent ? "" : ",\n", Label, CYCLES_TO_US(Stats->Trace[0].Start));
+    mTraceFirstEvent = FALSE;
+
+    for (UINT32 Index = 0; Index < Stats->TraceCount; Index++) {
+        HFSPLUS_TRACE_EVENT *Event = &Stats->Trace[Index];
+
+        if (Event->Kind == HFSPLUS_TRACE_API) {
+            fprintf(Output, ",\n{\"name\":\"%s\",\"cat\":\"api\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"failed\":%u}}",
+                HfsStatsApiName((HFSPLUS_STATS_API)Event->Api), CYCLES_TO_US(Event->Start), CYCLES_TO_US(Event->Cycles),
+                Event->Failed);
+        } else {
+            fprintf(Output, ",\n{\"name\":\"%s\",\"cat\":\"io\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"lba\":%llu,\"bytes\":%u,\"failed\":%u}}",
+                (Event->Kind == HFSPLUS_TRACE_FLUSH) ? "flush" : ((Event->Kind == HFSPLUS_TRACE_WRITE) ? "write" : "read"),
+                CYCLES_TO_US(Event->Start),
+                CYCLES_TO_US(Event->Cycles), (unsigned long long)Event->Lba, Event->Bytes, Event->Failed);
+        }
+    }
+}
+
+// Finish a trace file started with HostTraceOpen
+VOID HostTraceClose(
+    FILE *Output
+) {
+    fprintf(Output, "\n]}\n");
+    fclose(Output);
+}
+
+#endif  // HFSPLUS_ENABLE_STATS
@@ -0,0 +1,208 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  HostThreads.c
+//  This file is the c source for the host build's parallel work items
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include <stdlib.h>
+
+#include "HFSPlusFileOps.h"
+#include "HostShim.h"
+
+#define HOST_MAX_THREADS  16
+
+STATIC UINTN mRequestedThreads;
+
+// Set the number of threads HfsParallelFor may use, the caller's included;
+// zero picks one per online CPU unless HFSPLUS_THREADS says otherwise
+VOID HostSetThreadCount(
+    UINTN Count
+) {
+    mRequestedThreads = Count;
+}
+
+#if HFSPLUS_ENABLE_THREADS
+
+#include <pthread.h>
+#include <unistd.h>
+
+// A pool of workers started on first use. Each call publishes one job and
+// bumps Generation; the workers and the caller then claim items through
+// Next until none are left.
+typedef struct {
+    pthread_mutex_t Lock;
+    pthread_cond_t Start;
+    pthread_cond_t Done;
+    pthread_mutex_t CallLock;   // One job at a time
+    UINTN Workers;
+    UINTN Helpers;              // Workers taking part in the current job
+    UINTN Generation;
+    UINTN Active;
+    HFSPLUS_WORK_ITEM Work;
+    VOID *Context;
+    UINTN Count;
+    UINTN Next;
+} HOST_THREAD_POOL;
+
+STATIC HOST_THREAD_POOL mPool = {
+    .Lock = PTHREAD_MUTEX_INITIALIZER,
+    .Start = PTHREAD_COND_INITIALIZER,
+    .Done = PTHREAD_COND_INITIALIZER,
+    .CallLock = PTHREAD_MUTEX_INITIALIZER,
+};
+STATIC BOOLEAN mPoolStarted;
+
+// Threads to use, the caller's included
+STATIC
+UINTN
+ThreadCount(
+    VOID
+) {
+    UINTN Count = mRequestedThreads;
+
+    if (Count == 0) {
+        CONST char *Value = getenv("HFSPLUS_THREADS");
+        long Online = sysconf(_SC_NPROCESSORS_ONLN);
+
+        Count = (Value != NULL) ? (UINTN)strtoul(Value, NULL, 0) : (Online > 0 ? (UINTN)Online : 1);
+    }
+    return MAX(MIN(Count, (UINTN)HOST_MAX_THREADS), 1);
+}
+
+// Claim and run items of the current job until there are none left
+STATIC
+VOID
+RunItems(
+    VOID
+) {
+    UINTN Index;
+
+    while ((Index = __atomic_fetch_add(&mPool.Next, 1, __ATOMIC_RELAXED)) < mPool.Count) {
+        mPool.Work(mPool.Context, Index);
+    }
+}
+
+STATIC
+VOID *
+WorkerMain(
+    VOID *Argument
+) {
+    UINTN Worker = (UINTN)Argument;
+    UINTN Seen = 0;
+
+    pthread_mutex_lock(&mPool.Lock);
+    while (TRUE) {
+        while (mPool.Generation == Seen) {
+            pthread_cond_wait(&mPool.Start, &mPool.Lock);
+        }
+        Seen = mPool.Generation;
+        BOOLEAN Helping = Worker < mPool.Helpers;
+        pthread_mutex_unlock(&mPool.Lock);
+
+        if (Helping) {
+            RunItems();
+        }
+
+        pthread_mutex_lock(&mPool.Lock);
+        if (--mPool.Active == 0) {
+            pthread_cond_signal(&mPool.Done);
+        }
+    }
+    return NULL;
+}
+
+// Start the workers, one fewer than the thread count since the caller works too
+STATIC
+VOID
+StartPool(
+    VOID
+) {
+    UINTN Threads = ThreadCount();
+
+    for (UINTN Index = 0; Index + 1 < Threads; Index++) {
+        pthread_t Thread;
+
+        if (pthread_create(&Thread, NULL, WorkerMain, (VOID *)Index) != 0) {
+            break;
+        }
+        pthread_detach(Thread);
+        mPool.Workers++;
+    }
+    mPoolStarted = TRUE;
+}
+
+// Run Work for every index below Count on the pool and the calling thread,
+// returning once all of them have finished
+VOID HfsParallelFor(
+    UINTN Count,
+    HFSPLUS_WORK_ITEM Work,
+    VOID *Context
+) {
+    pthread_mutex_lock(&mPool.CallLock);
+    if (!mPoolStarted) {
+        StartPool();
+    }
+
+    UINTN Helpers = MIN(MIN(ThreadCount() - 1, mPool.Workers), (Count > 0) ? Count - 1 : 0);
+    if (Helpers == 0) {
+        pthread_mutex_unlock(&mPool.CallLock);
+        for (UINTN Index = 0; Index < Count; Index++) {
+            Work(Context, Index);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&mPool.Lock);
+    mPool.Work = Work;
+    mPool.Context = Context;
+    mPool.Count = Count;
+    mPool.Next = 0;
+    mPool.Helpers = Helpers;
+    mPool.Active = mPool.Workers;
+    mPool.Generation++;
+    pthread_cond_broadcast(&mPool.Start);
+    pthread_mutex_unlock(&mPool.Lock);
+
+    RunItems();
+
+    pthread_mutex_lock(&mPool.Lock);
+    while (mPool.Active > 0) {
+        pthread_cond_wait(&mPool.Done, &mPool.Lock);
+    }
+    pthread_mutex_unlock(&mPool.Lock);
+    pthread_mutex_unlock(&mPool.CallLock);
+}
+
+#endif  // HFSPLUS_ENABLE_THREADS
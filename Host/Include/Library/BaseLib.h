@@ -0,0 +1,67 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  BaseLib.h
+//  This file is the host build shim for the EDK II BaseLib
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#ifndef HOST_BASE_LIB_H
+#define HOST_BASE_LIB_H
+
+typedef INTN (EFIAPI *BASE_SORT_COMPARE)(CONST VOID *Buffer1, CONST VOID *Buffer2);
+
+UINT16 EFIAPI SwapBytes16(UINT16 Value);
+UINT32 EFIAPI SwapBytes32(UINT32 Value);
+UINT64 EFIAPI SwapBytes64(UINT64 Value);
+UINT16 EFIAPI ReadUnaligned16(CONST UINT16 *Buffer);
+UINT32 EFIAPI ReadUnaligned32(CONST UINT32 *Buffer);
+UINT64 EFIAPI ReadUnaligned64(CONST UINT64 *Buffer);
+UINT16 EFIAPI WriteUnaligned16(UINT16 *Buffer, UINT16 Value);
+UINT32 EFIAPI WriteUnaligned32(UINT32 *Buffer, UINT32 Value);
+UINT64 EFIAPI WriteUnaligned64(UINT64 *Buffer, UINT64 Value);
+INTN EFIAPI LowBitSet64(UINT64 Operand);
+INTN EFIAPI HighBitSet64(UINT64 Operand);
+UINT64 EFIAPI DivU64x32(UINT64 Dividend, UINT32 Divisor);
+UINT64 EFIAPI DivU64x32Remainder(UINT64 Dividend, UINT32 Divisor, UINT32 *Remainder);
+UINT64 EFIAPI MultU64x32(UINT64 Multiplicand, UINT32 Multiplier);
+UINT64 EFIAPI LShiftU64(UINT64 Operand, UINTN Count);
+UINT64 EFIAPI RShiftU64(UINT64 Operand, UINTN Count);
+UINTN EFIAPI StrLen(CONST CHAR16 *String);
+INTN EFIAPI StrCmp(CONST CHAR16 *FirstString, CONST CHAR16 *SecondString);
+UINTN EFIAPI AsciiStrLen(CONST CHAR8 *String);
+UINT64 EFIAPI AsmReadTsc(VOID);
+UINT32 EFIAPI CalculateCrc32(VOID *Data, UINTN DataSize);
+VOID EFIAPI QuickSort(VOID *BufferToSort, UINTN Count, UINTN ElementSize, BASE_SORT_COMPARE CompareFunction, VOID *BufferOneElement);
+
+#endif  // HOST_BASE_LIB_H
@@ -0,0 +1,58 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  DebugLib.h
+//  This file is the host build shim for the EDK II DebugLib
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#ifndef HOST_DEBUG_LIB_H
+#define HOST_DEBUG_LIB_H
+
+#define DEBUG_WARN     0x00000002
+#define DEBUG_INFO     0x00000040
+#define DEBUG_VERBOSE  0x00400000
+#define DEBUG_ERROR    0x80000000
+
+VOID EFIAPI DebugPrint(UINTN ErrorLevel, CONST CHAR8 *Format, ...);
+VOID EFIAPI DebugAssert(CONST CHAR8 *FileName, UINTN LineNumber, CONST CHAR8 *Description);
+
+#define DEBUG(Expression)  DebugPrint Expression
+#define ASSERT(Expression) \
+    do { \
+        if (!(Expression)) { \
+            DebugAssert(__FILE__, __LINE__, #Expression); \
+        } \
+    } while (FALSE)
+
+#endif  // HOST_DEBUG_LIB_H
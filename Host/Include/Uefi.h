@@ -0,0 +1,147 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  Uefi.h
+//  This file is the host build shim for the EDK II base types
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#ifndef HOST_UEFI_H
+#define HOST_UEFI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t   UINT8;
+typedef int8_t    INT8;
+typedef uint16_t  UINT16;
+typedef int16_t   INT16;
+typedef uint32_t  UINT32;
+typedef int32_t   INT32;
+typedef uint64_t  UINT64;
+typedef int64_t   INT64;
+typedef uintptr_t UINTN;
+typedef intptr_t  INTN;
+typedef uint16_t  CHAR16;  // Matches L"" literals only when built with -fshort-wchar
+typedef char      CHAR8;
+typedef uint8_t   BOOLEAN;
+typedef void      VOID;
+typedef UINTN     EFI_STATUS;
+typedef VOID      *EFI_HANDLE;
+typedef VOID      *EFI_EVENT;
+typedef UINT64    EFI_LBA;
+typedef UINTN     EFI_TPL;
+
+typedef struct {
+    UINT32 Data1;
+    UINT16 Data2;
+    UINT16 Data3;
+    UINT8 Data4[8];
+} EFI_GUID;
+
+typedef struct {
+    UINT16 Year;
+    UINT8 Month;
+    UINT8 Day;
+    UINT8 Hour;
+    UINT8 Minute;
+    UINT8 Second;
+    UINT8 Pad1;
+    UINT32 Nanosecond;
+    INT16 TimeZone;
+    UINT8 Daylight;
+    UINT8 Pad2;
+} EFI_TIME;
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST   const
+#define STATIC  static
+#define EFIAPI
+#define TRUE    ((BOOLEAN)1)
+#define FALSE   ((BOOLEAN)0)
+#ifndef NULL
+#define NULL    ((VOID *)0)
+#endif
+
+#define MAX_BIT          ((UINTN)1 << (sizeof(UINTN) * 8 - 1))
+#define ENCODE_ERROR(a)  ((EFI_STATUS)(MAX_BIT | (a)))
+#define EFI_ERROR(a)     (((INTN)(EFI_STATUS)(a)) < 0)
+
+#define EFI_SUCCESS            ((EFI_STATUS)0)
+#define EFI_LOAD_ERROR         ENCODE_ERROR(1)
+#define EFI_INVALID_PARAMETER  ENCODE_ERROR(2)
+#define EFI_UNSUPPORTED        ENCODE_ERROR(3)
+#define EFI_BAD_BUFFER_SIZE    ENCODE_ERROR(4)
+#define EFI_BUFFER_TOO_SMALL   ENCODE_ERROR(5)
+#define EFI_NOT_READY          ENCODE_ERROR(6)
+#define EFI_DEVICE_ERROR       ENCODE_ERROR(7)
+#define EFI_WRITE_PROTECTED    ENCODE_ERROR(8)
+#define EFI_OUT_OF_RESOURCES   ENCODE_ERROR(9)
+#define EFI_VOLUME_CORRUPTED   ENCODE_ERROR(10)
+#define EFI_VOLUME_FULL        ENCODE_ERROR(11)
+#define EFI_NO_MEDIA           ENCODE_ERROR(12)
+#define EFI_MEDIA_CHANGED      ENCODE_ERROR(13)
+#define EFI_NOT_FOUND          ENCODE_ERROR(14)
+#define EFI_ACCESS_DENIED      ENCODE_ERROR(15)
+#define EFI_NO_RESPONSE        ENCODE_ERROR(16)
+#define EFI_NO_MAPPING         ENCODE_ERROR(17)
+#define EFI_TIMEOUT            ENCODE_ERROR(18)
+#define EFI_NOT_STARTED        ENCODE_ERROR(19)
+#define EFI_ALREADY_STARTED    ENCODE_ERROR(20)
+#define EFI_ABORTED            ENCODE_ERROR(21)
+#define EFI_CRC_ERROR          ENCODE_ERROR(27)
+#define EFI_END_OF_FILE        ENCODE_ERROR(31)
+
+#define EFI_WARN_DELETE_FAILURE  ((EFI_STATUS)2)
+
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+
+#define MAX_UINT16  ((UINT16)0xFFFF)
+#define MAX_UINT32  ((UINT32)0xFFFFFFFF)
+#define MAX_UINT64  ((UINT64)0xFFFFFFFFFFFFFFFFULL)
+#define MAX_UINTN   ((UINTN)-1)
+
+#define ARRAY_SIZE(Array)                        (sizeof(Array) / sizeof((Array)[0]))
+#define OFFSET_OF(TYPE, Field)                   ((UINTN)offsetof(TYPE, Field))
+#define BASE_CR(Record, TYPE, Field)             ((TYPE *)((CHAR8 *)(Record) - OFFSET_OF(TYPE, Field)))
+#define CR(Record, TYPE, Field, TestSignature)   BASE_CR(Record, TYPE, Field)
+#define ALIGN_VALUE(Value, Alignment)            ((Value) + (((Alignment) - (Value)) & ((Alignment) - 1)))
+#define SIGNATURE_16(A, B)                       ((A) | ((B) << 8))
+#define SIGNATURE_32(A, B, C, D)                 (SIGNATURE_16(A, B) | (SIGNATURE_16(C, D) << 16))
+
+#include <Library/UefiBootServicesTableLib.h>
+
+#endif  // HOST_UEFI_H
@@ -0,0 +1,333 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  MockDiskImage.c
+//  This file is the c source for the file-backed Mock Block IO disks
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MockDiskImage.h"
+
+// Backend state of an image-backed disk
+typedef struct {
+    int Fd;
+    UINT64 Offset;     // Byte offset of the disk inside the image file
+    VOID *Mapping;     // Page-aligned mapping that DiskData points into
+    UINTN MappingSize;
+} MOCK_DISK_IMAGE;
+
+STATIC
+EFI_STATUS
+EFIAPI
+ImageReadBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    MockBlockIoProtocol *MockBlockIo = (MockBlockIoProtocol *)This;
+    MOCK_DISK_IMAGE *Image = MockBlockIo->BackendContext;
+    UINT8 *Destination = Buffer;
+
+    EFI_STATUS Status = MockCheckTransfer(MockBlockIo, MediaId, LBA, BufferSize);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // Holes in sparse images and short files read back as zeros
+    UINT64 Position = Image->Offset + LBA * MockBlockIo->BlockSize;
+    UINTN Remaining = BufferSize;
+    while (Remaining > 0) {
+        ssize_t Done = pread(Image->Fd, Destination, Remaining, (off_t)Position);
+        if (Done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (Done < 0) {
+            return EFI_DEVICE_ERROR;
+        }
+        if (Done == 0) {
+            ZeroMem(Destination, Remaining);
+            break;
+        }
+        Destination += Done;
+        Position += (UINT64)Done;
+        Remaining -= (UINTN)Done;
+    }
+
+    MockRecordTransfer(MockBlockIo, LBA, BufferSize, FALSE);
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+ImageWriteBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    MockBlockIoProtocol *MockBlockIo = (MockBlockIoProtocol *)This;
+    MOCK_DISK_IMAGE *Image = MockBlockIo->BackendContext;
+    CONST UINT8 *Source = Buffer;
+
+    if (MockBlockIo->Media.ReadOnly) {
+        return EFI_WRITE_PROTECTED;
+    }
+
+    EFI_STATUS Status = MockCheckTransfer(MockBlockIo, MediaId, LBA, BufferSize);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT64 Position = Image->Offset + LBA * MockBlockIo->BlockSize;
+    UINTN Remaining = BufferSize;
+    while (Remaining > 0) {
+        ssize_t Done = pwrite(Image->Fd, Source, Remaining, (off_t)Position);
+        if (Done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (Done <= 0) {
+            return EFI_DEVICE_ERROR;
+        }
+        Source += Done;
+        Position += (UINT64)Done;
+        Remaining -= (UINTN)Done;
+    }
+
+    MockRecordTransfer(MockBlockIo, LBA, BufferSize, TRUE);
+    return EFI_SUCCESS;
+}
+
+// Mapped images use the in-memory paths but still honour read-only media
+STATIC
+EFI_STATUS
+EFIAPI
+MappedWriteBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    if (This->Media->ReadOnly) {
+        return EFI_WRITE_PROTECTED;
+    }
+    return MockWriteBlocks(This, MediaId, LBA, BufferSize, Buffer);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+ImageFlushBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This
+) {
+    MockBlockIoProtocol *MockBlockIo = (MockBlockIoProtocol *)This;
+    MOCK_DISK_IMAGE *Image = MockBlockIo->BackendContext;
+
+    if (Image->Mapping != NULL && msync(Image->Mapping, Image->MappingSize, MS_SYNC) != 0) {
+        return EFI_DEVICE_ERROR;
+    }
+    if (Image->Mapping == NULL && fsync(Image->Fd) != 0) {
+        return EFI_DEVICE_ERROR;
+    }
+    MockRecordFlush(MockBlockIo);
+    return EFI_SUCCESS;
+}
+
+// Release callback for FreeMockDisk
+STATIC
+VOID
+ReleaseMockDiskImage(
+    MockBlockIoProtocol *MockBlockIo
+) {
+    MOCK_DISK_IMAGE *Image = MockBlockIo->BackendContext;
+
+    if (Image->Mapping != NULL) {
+        munmap(Image->Mapping, Image->MappingSize);
+    }
+    close(Image->Fd);
+    FreePool(Image);
+    MockBlockIo->DiskData = NULL;
+    MockBlockIo->BackendContext = NULL;
+}
+
+// Set up a mock disk on an open image file descriptor
+STATIC
+MockBlockIoProtocol *
+AttachMockDiskImage(
+    int Fd,
+    UINT64 Offset,
+    UINT64 Length,
+    UINT32 BlockSize,
+    BOOLEAN Writable,
+    MOCK_DISK_IMAGE_MODE Mode
+) {
+    UINT64 TotalBlocks = Length / BlockSize;
+
+    if (TotalBlocks == 0) {
+        close(Fd);
+        return NULL;
+    }
+
+    MockBlockIoProtocol *MockBlockIo = AllocateZeroPool(sizeof(MockBlockIoProtocol));
+    MOCK_DISK_IMAGE *Image = AllocateZeroPool(sizeof(MOCK_DISK_IMAGE));
+    if (MockBlockIo == NULL || Image == NULL) {
+        if (MockBlockIo != NULL) {
+            FreePool(MockBlockIo);
+        }
+        if (Image != NULL) {
+            FreePool(Image);
+        }
+        close(Fd);
+        return NULL;
+    }
+
+    Image->Fd = Fd;
+    Image->Offset = Offset;
+
+    MockBlockIo->BlockSize = BlockSize;
+    MockBlockIo->LastBlock = TotalBlocks - 1;
+    MockBlockIo->BackendContext = Image;
+    MockBlockIo->Release = ReleaseMockDiskImage;
+
+    MockBlockIo->Media.MediaId = MockBlockIo->MediaId;
+    MockBlockIo->Media.MediaPresent = TRUE;
+    MockBlockIo->Media.LogicalPartition = TRUE;
+    MockBlockIo->Media.ReadOnly = !Writable;
+    MockBlockIo->Media.BlockSize = BlockSize;
+    MockBlockIo->Media.IoAlign = 1;
+    MockBlockIo->Media.LastBlock = MockBlockIo->LastBlock;
+
+    MockBlockIo->BlockIo.Revision = EFI_BLOCK_IO_PROTOCOL_REVISION3;
+    MockBlockIo->BlockIo.Media = &MockBlockIo->Media;
+    MockBlockIo->BlockIo.ReadBlocks = ImageReadBlocks;
+    MockBlockIo->BlockIo.WriteBlocks = ImageWriteBlocks;
+    MockBlockIo->BlockIo.FlushBlocks = ImageFlushBlocks;
+    MockInitializeBlockIo2(MockBlockIo);
+
+    // The mapping starts on a page boundary at or below Offset
+    if (Mode == MockDiskImageMap && sizeof(UINTN) >= sizeof(UINT64)) {
+        UINT64 PageSize = (UINT64)sysconf(_SC_PAGESIZE);
+        UINT64 Slack = Offset % PageSize;
+
+        Image->MappingSize = (UINTN)(Slack + TotalBlocks * BlockSize);
+        Image->Mapping = mmap(
+            NULL,
+            Image->MappingSize,
+            Writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+            MAP_SHARED,
+            Fd,
+            (off_t)(Offset - Slack)
+        );
+        if (Image->Mapping == MAP_FAILED) {
+            Image->Mapping = NULL;  // Fall back to pread/pwrite
+        } else {
+            madvise(Image->Mapping, Image->MappingSize, MADV_RANDOM);
+            MockBlockIo->DiskData = (UINT8 *)Image->Mapping + Slack;
+            MockBlockIo->BlockIo.ReadBlocks = MockReadBlocks;
+            MockBlockIo->BlockIo.WriteBlocks = MappedWriteBlocks;
+        }
+    }
+
+    return MockBlockIo;
+}
+
+// Open a raw disk image (for example one made by newfs_hfs or mkfs.hfsplus).
+// Offset and Length select a partition inside the image; a Length of 0 uses
+// the rest of the file.
+MockBlockIoProtocol *OpenMockDiskImage(
+    CONST CHAR8 *Path,
+    UINT64 Offset,
+    UINT64 Length,
+    UINT32 BlockSize,
+    BOOLEAN Writable,
+    MOCK_DISK_IMAGE_MODE Mode
+) {
+    struct stat Info;
+
+    if (BlockSize == 0 || Offset % BlockSize != 0) {
+        return NULL;
+    }
+
+    int Fd = open(Path, Writable ? O_RDWR : O_RDONLY);
+    if (Fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(Fd, &Info) != 0 || (UINT64)Info.st_size <= Offset) {
+        close(Fd);
+        return NULL;
+    }
+
+    if (Length == 0 || Length > (UINT64)Info.st_size - Offset) {
+        Length = (UINT64)Info.st_size - Offset;
+    }
+
+    return AttachMockDiskImage(Fd, Offset, Length, BlockSize, Writable, Mode);
+}
+
+// Create (or truncate) a sparse image file of Size bytes and open it
+// writable. Only blocks that are written take space on the host.
+MockBlockIoProtocol *CreateMockDiskImage(
+    CONST CHAR8 *Path,
+    UINT64 Size,
+    UINT32 BlockSize,
+    MOCK_DISK_IMAGE_MODE Mode
+) {
+    if (BlockSize == 0 || Size < BlockSize) {
+        return NULL;
+    }
+
+    int Fd = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (Fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(Fd, (off_t)Size) != 0) {
+        close(Fd);
+        return NULL;
+    }
+
+    return AttachMockDiskImage(Fd, 0, Size, BlockSize, TRUE, Mode);
+}
@@ -0,0 +1,66 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  MockDiskImage.h
+//  This file is the header for the file-backed Mock Block IO disks
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#ifndef MOCK_DISK_IMAGE_H
+#define MOCK_DISK_IMAGE_H
+
+#include "MockBlockIo.h"
+
+// How a disk image file backs the mock disk
+typedef enum {
+    MockDiskImageMap,    // mmap the image; reads and writes are CopyMem
+    MockDiskImagePread   // pread/pwrite per request, for images too large to map
+} MOCK_DISK_IMAGE_MODE;
+
+MockBlockIoProtocol *OpenMockDiskImage(
+    CONST CHAR8 *Path,
+    UINT64 Offset,
+    UINT64 Length,
+    UINT32 BlockSize,
+    BOOLEAN Writable,
+    MOCK_DISK_IMAGE_MODE Mode
+);
+
+MockBlockIoProtocol *CreateMockDiskImage(
+    CONST CHAR8 *Path,
+    UINT64 Size,
+    UINT32 BlockSize,
+    MOCK_DISK_IMAGE_MODE Mode
+);
+
+#endif  // MOCK_DISK_IMAGE_H
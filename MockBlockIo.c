@@ -38,43 +38,298 @@
 
 #include "MockBlockIo.h"
 
+#include <Library/UefiBootServicesTableLib.h>
+
+// Check that a transfer is whole blocks and lies inside the disk
+EFI_STATUS
+MockCheckTransfer(
+    MockBlockIoProtocol *MockBlockIo,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    UINTN BufferSize
+) {
+    if (MediaId != MockBlockIo->MediaId) {
+        return EFI_MEDIA_CHANGED;
+    }
+    if (BufferSize % MockBlockIo->BlockSize != 0) {
+        return EFI_BAD_BUFFER_SIZE;
+    }
+    if (LBA > MockBlockIo->LastBlock || BufferSize / MockBlockIo->BlockSize > MockBlockIo->LastBlock + 1 - LBA) {
+        return EFI_INVALID_PARAMETER;
+    }
+    return EFI_SUCCESS;
+}
+
+// Count a completed transfer and advance the simulated device clock by the
+// time the device model says it took. Synchronous commands wait for the
+// whole queue to drain first. Queued commands take the next of QueueDepth
+// slots, position in parallel and then share one transfer channel, which
+// assumes the host keeps the queue full.
+VOID
+MockRecordTransfer(
+    MockBlockIoProtocol *MockBlockIo,
+    EFI_LBA LBA,
+    UINTN BufferSize,
+    BOOLEAN Write
+) {
+    MOCK_DEVICE_MODEL *Model = &MockBlockIo->Model;
+    UINT64 Blocks = BufferSize / MockBlockIo->BlockSize;
+
+    if (Write) {
+        MockBlockIo->WriteCount++;
+        MockBlockIo->BytesWritten += BufferSize;
+    } else {
+        MockBlockIo->ReadCount++;
+        MockBlockIo->BytesRead += BufferSize;
+    }
+
+    UINT64 PositionNs = Model->CommandNs;
+    if (LBA != MockBlockIo->HeadLba) {
+        UINT64 Distance = (LBA > MockBlockIo->HeadLba) ? LBA - MockBlockIo->HeadLba : MockBlockIo->HeadLba - LBA;
+        PositionNs += Model->SeekNs + Distance * MockBlockIo->BlockSize * Model->SeekNsPerMiB / (1024 * 1024);
+    }
+    UINT64 TransferNs = (Model->BytesPerSecond != 0) ? (UINT64)BufferSize * 1000000000ULL / Model->BytesPerSecond : 0;
+    MockBlockIo->HeadLba = LBA + Blocks;
+
+    if (!MockBlockIo->Queued || Model->QueueDepth <= 1) {
+        UINT64 Start = MAX(MockBlockIo->HostNs, MockBlockIo->DeviceNs);
+        MockBlockIo->DeviceNs = Start + PositionNs + TransferNs;
+        MockBlockIo->HostNs = MockBlockIo->DeviceNs;
+        MockBlockIo->BusFreeNs = MockBlockIo->DeviceNs;
+        return;
+    }
+
+    UINT32 Slot = MockBlockIo->QueueSlot;
+    MockBlockIo->QueueSlot = (Slot + 1) % MIN(Model->QueueDepth, MOCK_DEVICE_MAX_QUEUE_DEPTH);
+
+    UINT64 Start = MAX(MockBlockIo->HostNs, MockBlockIo->QueueDoneNs[Slot]);
+    UINT64 Done = MAX(Start + PositionNs, MockBlockIo->BusFreeNs) + TransferNs;
+    MockBlockIo->QueueDoneNs[Slot] = Done;
+    MockBlockIo->BusFreeNs = Done;
+    MockBlockIo->DeviceNs = MAX(MockBlockIo->DeviceNs, Done);
+}
+
+// Count a cache flush. It waits for every queued command, then takes
+// FlushNs of device time.
+VOID
+MockRecordFlush(
+    MockBlockIoProtocol *MockBlockIo
+) {
+    UINT64 Start = MAX(MockBlockIo->HostNs, MockBlockIo->DeviceNs);
+
+    MockBlockIo->FlushCount++;
+    MockBlockIo->DeviceNs = Start + MockBlockIo->Model.FlushNs;
+    MockBlockIo->HostNs = MockBlockIo->DeviceNs;
+    MockBlockIo->BusFreeNs = MockBlockIo->DeviceNs;
+}
+
+// Install a device model and restart the simulated clock
+VOID
+MockSetDeviceModel(
+    MockBlockIoProtocol *MockBlockIo,
+    CONST MOCK_DEVICE_MODEL *Model
+) {
+    CopyMem(&MockBlockIo->Model, Model, sizeof(MOCK_DEVICE_MODEL));
+    MockBlockIo->DeviceNs = 0;
+    MockBlockIo->HostNs = 0;
+    MockBlockIo->BusFreeNs = 0;
+    MockBlockIo->HeadLba = 0;
+    MockBlockIo->QueueSlot = 0;
+    ZeroMem(MockBlockIo->QueueDoneNs, sizeof(MockBlockIo->QueueDoneNs));
+}
+
 EFI_STATUS
+EFIAPI
 MockReadBlocks(
-    MockBlockIoProtocol *BlockIo,
+    EFI_BLOCK_IO_PROTOCOL *This,
     UINT32 MediaId,
-    UINT64 LBA,
+    EFI_LBA LBA,
     UINTN BufferSize,
     VOID *Buffer
 ) {
-    if (LBA + BufferSize / BlockIo->BlockSize > BlockIo->LastBlock) {
-        return EFI_DEVICE_ERROR;
+    MockBlockIoProtocol *MockBlockIo = (MockBlockIoProtocol *)This;
+
+    EFI_STATUS Status = MockCheckTransfer(MockBlockIo, MediaId, LBA, BufferSize);
+    if (EFI_ERROR(Status)) {
+        return Status;
     }
 
-    CopyMem(Buffer, BlockIo->DiskData + LBA * BlockIo->BlockSize, BufferSize);
+    CopyMem(Buffer, MockBlockIo->DiskData + LBA * MockBlockIo->BlockSize, BufferSize);
+    MockRecordTransfer(MockBlockIo, LBA, BufferSize, FALSE);
     return EFI_SUCCESS;
 }
 
 EFI_STATUS
+EFIAPI
 MockWriteBlocks(
-    MockBlockIoProtocol *BlockIo,
+    EFI_BLOCK_IO_PROTOCOL *This,
     UINT32 MediaId,
-    UINT64 LBA,
+    EFI_LBA LBA,
     UINTN BufferSize,
     VOID *Buffer
 ) {
-    if (LBA + BufferSize / BlockIo->BlockSize > BlockIo->LastBlock) {
-        return EFI_DEVICE_ERROR;
+    MockBlockIoProtocol *MockBlockIo = (MockBlockIoProtocol *)This;
+
+    EFI_STATUS Status = MockCheckTransfer(MockBlockIo, MediaId, LBA, BufferSize);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CopyMem(MockBlockIo->DiskData + LBA * MockBlockIo->BlockSize, Buffer, BufferSize);
+    MockRecordTransfer(MockBlockIo, LBA, BufferSize, TRUE);
+    return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockFlushBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This
+) {
+    MockRecordFlush((MockBlockIoProtocol *)This);
+    return EFI_SUCCESS;
+}
+
+// Block I/O 2 goes through whichever Block I/O backend the disk uses. The
+// command finishes before ReadBlocksEx returns, with its token signalled;
+// only the simulated clock treats it as queued.
+STATIC
+EFI_STATUS
+MockTransferEx(
+    EFI_BLOCK_IO2_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    EFI_BLOCK_IO2_TOKEN *Token,
+    UINTN BufferSize,
+    VOID *Buffer,
+    BOOLEAN Write
+) {
+    MockBlockIoProtocol *MockBlockIo = BASE_CR(This, MockBlockIoProtocol, BlockIo2);
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = &MockBlockIo->BlockIo;
+    BOOLEAN Queued = (Token != NULL && Token->Event != NULL);
+
+    MockBlockIo->Queued = Queued;
+    EFI_STATUS Status = Write ? BlockIo->WriteBlocks(BlockIo, MediaId, LBA, BufferSize, Buffer)
+                              : BlockIo->ReadBlocks(BlockIo, MediaId, LBA, BufferSize, Buffer);
+    MockBlockIo->Queued = FALSE;
+
+    if (!Queued || EFI_ERROR(Status)) {
+        return Status;
     }
+    Token->TransactionStatus = Status;
+    gBS->SignalEvent(Token->Event);
+    return EFI_SUCCESS;
+}
 
-    CopyMem(BlockIo->DiskData + LBA * BlockIo->BlockSize, Buffer, BufferSize);
+STATIC
+EFI_STATUS
+EFIAPI
+MockResetEx(
+    EFI_BLOCK_IO2_PROTOCOL *This,
+    BOOLEAN ExtendedVerification
+) {
     return EFI_SUCCESS;
 }
 
+STATIC
+EFI_STATUS
+EFIAPI
+MockReadBlocksEx(
+    EFI_BLOCK_IO2_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    EFI_BLOCK_IO2_TOKEN *Token,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    return MockTransferEx(This, MediaId, LBA, Token, BufferSize, Buffer, FALSE);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockWriteBlocksEx(
+    EFI_BLOCK_IO2_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
+    EFI_BLOCK_IO2_TOKEN *Token,
+    UINTN BufferSize,
+    VOID *Buffer
+) {
+    return MockTransferEx(This, MediaId, LBA, Token, BufferSize, Buffer, TRUE);
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+MockFlushBlocksEx(
+    EFI_BLOCK_IO2_PROTOCOL *This,
+    EFI_BLOCK_IO2_TOKEN *Token
+) {
+    MockBlockIoProtocol *MockBlockIo = BASE_CR(This, MockBlockIoProtocol, BlockIo2);
+
+    EFI_STATUS Status = MockBlockIo->BlockIo.FlushBlocks(&MockBlockIo->BlockIo);
+    if (Token != NULL && Token->Event != NULL && !EFI_ERROR(Status)) {
+        Token->TransactionStatus = Status;
+        gBS->SignalEvent(Token->Event);
+    }
+    return Status;
+}
+
+// Fill in the Block I/O 2 interface; backends call this after setting up Media
+VOID
+MockInitializeBlockIo2(
+    MockBlockIoProtocol *MockBlockIo
+) {
+    MockBlockIo->BlockIo2.Media = &MockBlockIo->Media;
+    MockBlockIo->BlockIo2.Reset = MockResetEx;
+    MockBlockIo->BlockIo2.ReadBlocksEx = MockReadBlocksEx;
+    MockBlockIo->BlockIo2.WriteBlocksEx = MockWriteBlocksEx;
+    MockBlockIo->BlockIo2.FlushBlocksEx = MockFlushBlocksEx;
+}
+
 MockBlockIoProtocol *
 InitializeMockDisk(UINT64 TotalBlocks, UINTN BlockSize) {
     MockBlockIoProtocol *MockBlockIo = AllocateZeroPool(sizeof(MockBlockIoProtocol));
+    if (MockBlockIo == NULL) {
+        return NULL;
+    }
+
+    MockBlockIo->DiskData = AllocateZeroPool(TotalBlocks * BlockSize);
+    if (MockBlockIo->DiskData == NULL) {
+        FreePool(MockBlockIo);
+        return NULL;
+    }
+
     MockBlockIo->BlockSize = BlockSize;
     MockBlockIo->LastBlock = TotalBlocks - 1;
-    MockBlockIo->DiskData = AllocateZeroPool(TotalBlocks * BlockSize);
+
+    MockBlockIo->Media.MediaId = MockBlockIo->MediaId;
+    MockBlockIo->Media.MediaPresent = TRUE;
+    MockBlockIo->Media.LogicalPartition = TRUE;
+    MockBlockIo->Media.BlockSize = (UINT32)BlockSize;
+    MockBlockIo->Media.IoAlign = 1;
+    MockBlockIo->Media.LastBlock = MockBlockIo->LastBlock;
+
+    MockBlockIo->BlockIo.Revision = EFI_BLOCK_IO_PROTOCOL_REVISION3;
+    MockBlockIo->BlockIo.Media = &MockBlockIo->Media;
+    MockBlockIo->BlockIo.ReadBlocks = MockReadBlocks;
+    MockBlockIo->BlockIo.WriteBlocks = MockWriteBlocks;
+    MockBlockIo->BlockIo.FlushBlocks = MockFlushBlocks;
+    MockInitializeBlockIo2(MockBlockIo);
     return MockBlockIo;
-}
\ No newline at end of file
+}
+
+VOID
+FreeMockDisk(MockBlockIoProtocol *MockBlockIo) {
+    if (MockBlockIo == NULL) {
+        return;
+    }
+
+    if (MockBlockIo->Release != NULL) {
+        MockBlockIo->Release(MockBlockIo);
+    } else {
+        FreePool(MockBlockIo->DiskData);
+    }
+    FreePool(MockBlockIo);
+}
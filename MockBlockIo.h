@@ -43,30 +43,104 @@
 #include <Library/MemoryAllocationLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 
+#define MOCK_DEVICE_MAX_QUEUE_DEPTH  64
+
+typedef struct _MockBlockIoProtocol MockBlockIoProtocol;
+
+typedef VOID (*MOCK_DISK_RELEASE)(MockBlockIoProtocol *MockBlockIo);
+
+// Timing model of the simulated device. Commands still complete at once;
+// the model only advances a simulated clock, so runs are reproducible. An
+// all-zero model is an ideal device that takes no time at all.
 typedef struct {
+    UINT64 CommandNs;       // Fixed cost of every command
+    UINT64 SeekNs;          // Extra cost when a command does not continue the last one
+    UINT64 SeekNsPerMiB;    // Seek cost per MiB of distance from the last command
+    UINT64 BytesPerSecond;  // Sustained transfer rate; 0 is unlimited
+    UINT32 QueueDepth;      // Block I/O 2 commands the device overlaps; 0 or 1 is serial
+    UINT64 FlushNs;         // Cost of writing back the device cache once the queue drains
+} MOCK_DEVICE_MODEL;
+
+// A simulated disk exposing EFI_BLOCK_IO_PROTOCOL. The protocol is the first
+// member so a MockBlockIoProtocol can be passed wherever the driver expects
+// an EFI_BLOCK_IO_PROTOCOL.
+struct _MockBlockIoProtocol {
+    EFI_BLOCK_IO_PROTOCOL BlockIo;
+    EFI_BLOCK_IO_MEDIA Media;
     UINT32 MediaId;
     UINTN BlockSize;
     UINT64 LastBlock;
-    UINT8 *DiskData;  // Simulated disk data
-} MockBlockIoProtocol;
+    UINT8 *DiskData;  // Simulated disk data; NULL when a backend does its own I/O
+    UINT64 ReadCount;
+    UINT64 WriteCount;
+    UINT64 BytesRead;
+    UINT64 BytesWritten;
+    UINT64 FlushCount;
+    EFI_BLOCK_IO2_PROTOCOL BlockIo2;
+    MOCK_DEVICE_MODEL Model;
+    UINT64 DeviceNs;    // Simulated time at which the last command completes
+    UINT64 HostNs;      // Simulated time at which the host may issue again
+    UINT64 BusFreeNs;   // Queued commands share one transfer channel
+    UINT64 HeadLba;     // Block after the last one transferred
+    UINT64 QueueDoneNs[MOCK_DEVICE_MAX_QUEUE_DEPTH];
+    UINT32 QueueSlot;
+    BOOLEAN Queued;     // The command in progress came through Block I/O 2
+    VOID *BackendContext;       // Owned by the backend that opened the disk
+    MOCK_DISK_RELEASE Release;  // Frees DiskData and BackendContext when set
+};
 
-EFI_STATUS MockReadBlocks(
-    MockBlockIoProtocol *BlockIo,
+EFI_STATUS MockCheckTransfer(
+    MockBlockIoProtocol *MockBlockIo,
     UINT32 MediaId,
-    UINT64 LBA,
+    EFI_LBA LBA,
+    UINTN BufferSize
+);
+
+VOID MockRecordTransfer(
+    MockBlockIoProtocol *MockBlockIo,
+    EFI_LBA LBA,
+    UINTN BufferSize,
+    BOOLEAN Write
+);
+
+VOID MockRecordFlush(
+    MockBlockIoProtocol *MockBlockIo
+);
+
+VOID MockSetDeviceModel(
+    MockBlockIoProtocol *MockBlockIo,
+    CONST MOCK_DEVICE_MODEL *Model
+);
+
+EFI_STATUS
+EFIAPI
+MockReadBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This,
+    UINT32 MediaId,
+    EFI_LBA LBA,
     UINTN BufferSize,
     VOID *Buffer
 );
 
-EFI_STATUS MockWriteBlocks(
-    MockBlockIoProtocol *BlockIo,
+EFI_STATUS
+EFIAPI
+MockWriteBlocks(
+    EFI_BLOCK_IO_PROTOCOL *This,
     UINT32 MediaId,
-    UINT64 LBA,
+    EFI_LBA LBA,
     UINTN BufferSize,
     VOID *Buffer
 );
 
+VOID MockInitializeBlockIo2(
+    MockBlockIoProtocol *MockBlockIo
+);
+
 MockBlockIoProtocol *InitializeMockDisk(UINT64 TotalBlocks, UINTN BlockSize);
 
-#endif  // MOCK_BLOCK_IO_H
\ No newline at end of file
+VOID FreeMockDisk(MockBlockIoProtocol *MockBlockIo);
+
+#endif  // MOCK_BLOCK_IO_H
@@ -0,0 +1,813 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  MockCompress.c
+//  This file is the c source for the Mock zlib, LZVN and LZFSE compressors used by tests
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "MockCompress.h"
+
+#define MOCK_HASH_BITS      12
+#define MOCK_MIN_MATCH      3
+#define MOCK_ZLIB_WINDOW    32768
+#define MOCK_ZLIB_MAX_MATCH 258
+#define MOCK_LZVN_WINDOW    65535
+#define MOCK_LZVN_MAX_MATCH 271
+#define MOCK_LZFSE_BLOCK     16384
+#define MOCK_LZFSE_WINDOW    262139
+#define MOCK_LZFSE_MAX_MATCH 2359
+#define MOCK_LZFSE_MAX_L     315
+#define MOCK_LZFSE_MAX_LMD   (MOCK_LZFSE_BLOCK / MOCK_MIN_MATCH + MOCK_LZFSE_BLOCK / MOCK_LZFSE_MAX_L + 2)
+
+// Length and distance codes of deflate, from 257 and 0
+STATIC CONST UINT16 mMockLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+STATIC CONST UINT8 mMockLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+STATIC CONST UINT16 mMockDistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+STATIC CONST UINT8 mMockDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Longest match a short opcode can hold, by the literals it carries; LZVN
+// leaves the rest of that opcode space undefined
+STATIC CONST UINT8 mMockLzvnShortMatch[4] = { 10, 8, 6, 4 };
+
+// Extra bits of the LZFSE literal count and match length symbols; the
+// base values follow from them, and distance symbol N has N / 4 extra bits
+STATIC CONST UINT8 mMockLzfseLExtra[20] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 5, 8
+};
+STATIC CONST UINT8 mMockLzfseMExtra[20] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 5, 8, 11
+};
+
+// Frequency codes of an LZFSE header for the values 0 to 7, and their
+// lengths
+STATIC CONST UINT8 mMockLzfseSmallCode[8] = { 0, 2, 1, 5, 3, 11, 19, 27 };
+STATIC CONST UINT8 mMockLzfseSmallBits[8] = { 2, 2, 3, 3, 5, 5, 5, 5 };
+
+// Deflate bits, least significant first
+typedef struct {
+    UINT8 *Out;
+    UINT8 *OutEnd;
+    UINT32 Bits;
+    UINT32 Count;
+    BOOLEAN Overflow;
+} MOCK_BIT_WRITER;
+
+STATIC
+VOID
+MockPutBits(
+    MOCK_BIT_WRITER *Writer,
+    UINT32 Value,
+    UINT32 Count
+) {
+    Writer->Bits |= Value << Writer->Count;
+    Writer->Count += Count;
+    while (Writer->Count >= 8) {
+        if (Writer->Out == Writer->OutEnd) {
+            Writer->Overflow = TRUE;
+            return;
+        }
+        *Writer->Out++ = (UINT8)Writer->Bits;
+        Writer->Bits >>= 8;
+        Writer->Count -= 8;
+    }
+}
+
+// Huffman codes are packed starting with their most significant bit
+STATIC
+VOID
+MockPutCode(
+    MOCK_BIT_WRITER *Writer,
+    UINT32 Code,
+    UINT32 Length
+) {
+    UINT32 Reversed = 0;
+
+    for (UINT32 Bit = 0; Bit < Length; Bit++) {
+        Reversed = (Reversed << 1) | ((Code >> Bit) & 1);
+    }
+    MockPutBits(Writer, Reversed, Length);
+}
+
+// Literal or length symbol in the fixed Huffman code
+STATIC
+VOID
+MockPutFixedSymbol(
+    MOCK_BIT_WRITER *Writer,
+    UINT32 Symbol
+) {
+    if (Symbol < 144) {
+        MockPutCode(Writer, 0x30 + Symbol, 8);
+    } else if (Symbol < 256) {
+        MockPutCode(Writer, 0x190 + Symbol - 144, 9);
+    } else if (Symbol < 280) {
+        MockPutCode(Writer, Symbol - 256, 7);
+    } else {
+        MockPutCode(Writer, 0xC0 + Symbol - 280, 8);
+    }
+}
+
+STATIC
+UINT32
+MockHash(
+    CONST UINT8 *Bytes
+) {
+    return ((Bytes[0] << 16 | Bytes[1] << 8 | Bytes[2]) * 2654435761U) >> (32 - MOCK_HASH_BITS);
+}
+
+// Greedy match at Position against the last position with the same hash
+STATIC
+UINTN
+MockFindMatch(
+    CONST UINT8 *Source,
+    UINTN SourceSize,
+    UINTN Position,
+    UINT32 *Head,
+    UINTN Window,
+    UINTN MaxMatch,
+    UINTN *Distance
+) {
+    UINTN Length = 0;
+
+    if (Position + MOCK_MIN_MATCH > SourceSize) {
+        return 0;
+    }
+
+    UINT32 Hash = MockHash(Source + Position);
+    UINTN Candidate = Head[Hash];
+    Head[Hash] = (UINT32)Position + 1;  // Zero means empty
+
+    if (Candidate == 0 || Position - (Candidate - 1) > Window) {
+        return 0;
+    }
+    Candidate--;
+
+    while (Position + Length < SourceSize && Length < MaxMatch && Source[Candidate + Length] == Source[Position + Length]) {
+        Length++;
+    }
+    *Distance = Position - Candidate;
+    return (Length >= MOCK_MIN_MATCH) ? Length : 0;
+}
+
+STATIC
+UINT32
+MockAdler32(
+    CONST UINT8 *Data,
+    UINTN Size
+) {
+    UINT32 A = 1;
+    UINT32 B = 0;
+
+    for (UINTN Index = 0; Index < Size; Index++) {
+        A = (A + Data[Index]) % 65521;
+        B = (B + A) % 65521;
+    }
+    return (B << 16) | A;
+}
+
+// Compress into a zlib stream of one fixed Huffman block. Returns the
+// stream size, or 0 when it does not fit the destination.
+UINTN MockZlibCompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize
+) {
+    CONST UINT8 *Input = Source;
+    MOCK_BIT_WRITER Writer;
+    UINT32 *Head;
+    UINTN Position = 0;
+
+    if (DestinationSize < 6) {
+        return 0;
+    }
+    Head = AllocateZeroPool(sizeof(UINT32) << MOCK_HASH_BITS);
+    if (Head == NULL) {
+        return 0;
+    }
+
+    ZeroMem(&Writer, sizeof(Writer));
+    Writer.Out = Destination;
+    Writer.OutEnd = Writer.Out + DestinationSize - 4;
+    *Writer.Out++ = 0x78;  // Deflate, 32 KiB window
+    *Writer.Out++ = 0x01;
+
+    MockPutBits(&Writer, 1, 1);  // Final block
+    MockPutBits(&Writer, 1, 2);  // Fixed Huffman codes
+
+    while (Position < SourceSize && !Writer.Overflow) {
+        UINTN Distance = 0;
+        UINTN Length = MockFindMatch(Input, SourceSize, Position, Head, MOCK_ZLIB_WINDOW, MOCK_ZLIB_MAX_MATCH, &Distance);
+
+        if (Length == 0) {
+            MockPutFixedSymbol(&Writer, Input[Position++]);
+            continue;
+        }
+
+        UINT32 Code = 28;
+        while (mMockLengthBase[Code] > Length) {
+            Code--;
+        }
+        MockPutFixedSymbol(&Writer, 257 + Code);
+        MockPutBits(&Writer, (UINT32)(Length - mMockLengthBase[Code]), mMockLengthExtra[Code]);
+
+        Code = 29;
+        while (mMockDistanceBase[Code] > Distance) {
+            Code--;
+        }
+        MockPutCode(&Writer, Code, 5);
+        MockPutBits(&Writer, (UINT32)(Distance - mMockDistanceBase[Code]), mMockDistanceExtra[Code]);
+
+        Position += Length;
+    }
+
+    MockPutFixedSymbol(&Writer, 256);
+    MockPutBits(&Writer, 0, (8 - Writer.Count % 8) % 8);  // Flush the last partial byte
+    FreePool(Head);
+
+    if (Writer.Overflow) {
+        return 0;
+    }
+
+    // The Adler-32 trailer was kept out of the writer's space
+    HFS_PUT32(Writer.Out, MockAdler32(Input, SourceSize));
+    return (UINTN)(Writer.Out + 4 - (UINT8 *)Destination);
+}
+
+// Append literals with literal-only opcodes
+STATIC
+UINT8 *
+MockLzvnLiterals(
+    UINT8 *Out,
+    UINT8 *OutEnd,
+    CONST UINT8 *Literals,
+    UINTN Count
+) {
+    while (Count > 0 && Out != NULL) {
+        UINTN Run = MIN(Count, (UINTN)271);
+
+        if ((UINTN)(OutEnd - Out) < Run + 2) {
+            return NULL;
+        }
+        if (Run >= 16) {
+            *Out++ = 0xE0;
+            *Out++ = (UINT8)(Run - 16);
+        } else {
+            *Out++ = (UINT8)(0xE0 | Run);
+        }
+        CopyMem(Out, Literals, Run);
+        Out += Run;
+        Literals += Run;
+        Count -= Run;
+    }
+    return Out;
+}
+
+// Compress into an LZVN stream. Up to three pending literals ride on each
+// match opcode, longer runs get literal opcodes of their own, and match
+// length the opcode cannot hold continues at the same distance. Returns
+// the stream size, or 0 when it does not fit the destination.
+UINTN MockLzvnCompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize
+) {
+    CONST UINT8 *Input = Source;
+    UINT8 *Out = Destination;
+    UINT8 *OutEnd = Out + DestinationSize;
+    UINT32 *Head;
+    UINTN Position = 0;
+    UINTN Pending = 0;
+    UINTN LastDistance = 0;
+
+    Head = AllocateZeroPool(sizeof(UINT32) << MOCK_HASH_BITS);
+    if (Head == NULL) {
+        return 0;
+    }
+
+    while (Position < SourceSize && Out != NULL) {
+        UINTN Distance = 0;
+        UINTN Length = MockFindMatch(Input, SourceSize, Position, Head, MOCK_LZVN_WINDOW, MOCK_LZVN_MAX_MATCH, &Distance);
+
+        if (Length == 0) {
+            Pending++;
+            Position++;
+            continue;
+        }
+
+        CONST UINT8 *Literals = Input + Position - Pending;
+        if (Pending > 3) {
+            Out = MockLzvnLiterals(Out, OutEnd, Literals, Pending);
+            Literals += Pending;
+            Pending = 0;
+            if (Out == NULL) {
+                break;
+            }
+        }
+
+        if ((UINTN)(OutEnd - Out) < 3 + Pending) {
+            Out = NULL;
+            break;
+        }
+
+        UINTN Remaining = Length;
+        UINTN Match;
+        if (Distance == LastDistance && Pending == 0) {
+            Match = 0;  // All of it at the previous distance below
+        } else if (Distance == LastDistance) {
+            Match = MIN(Remaining, (UINTN)mMockLzvnShortMatch[Pending]);
+            *Out++ = (UINT8)(Pending << 6 | (Match - 3) << 3 | 6);
+        } else if (Distance < 1536) {
+            Match = MIN(Remaining, (UINTN)mMockLzvnShortMatch[Pending]);
+            *Out++ = (UINT8)(Pending << 6 | (Match - 3) << 3 | (Distance >> 8));
+            *Out++ = (UINT8)Distance;
+        } else if (Distance < 16384) {
+            Match = MIN(Remaining, (UINTN)34);
+            UINTN Operand = Distance << 2 | ((Match - 3) & 3);
+            *Out++ = (UINT8)(0xA0 | Pending << 3 | (Match - 3) >> 2);
+            *Out++ = (UINT8)Operand;
+            *Out++ = (UINT8)(Operand >> 8);
+        } else {
+            Match = MIN(Remaining, (UINTN)mMockLzvnShortMatch[Pending]);
+            *Out++ = (UINT8)(Pending << 6 | (Match - 3) << 3 | 7);
+            *Out++ = (UINT8)Distance;
+            *Out++ = (UINT8)(Distance >> 8);
+        }
+        CopyMem(Out, Literals, Pending);
+        Out += Pending;
+        Pending = 0;
+        Remaining -= Match;
+        LastDistance = Distance;
+
+        // The rest of the match at the previous distance
+        while (Remaining > 0) {
+            UINTN Part = MIN(Remaining, (UINTN)271);
+
+            if ((UINTN)(OutEnd - Out) < 2) {
+                Out = NULL;
+                break;
+            }
+            if (Part >= 16) {
+                *Out++ = 0xF0;
+                *Out++ = (UINT8)(Part - 16);
+            } else {
+                *Out++ = (UINT8)(0xF0 | Part);
+            }
+            Remaining -= Part;
+        }
+
+        Position += Length;
+    }
+
+    if (Out != NULL) {
+        Out = MockLzvnLiterals(Out, OutEnd, Input + Position - Pending, Pending);
+    }
+    FreePool(Head);
+
+    // End of stream: the opcode and seven bytes of padding
+    if (Out == NULL || OutEnd - Out < 8) {
+        return 0;
+    }
+    *Out++ = 0x06;
+    ZeroMem(Out, 7);
+    Out += 7;
+    return (UINTN)(Out - (UINT8 *)Destination);
+}
+
+// LZFSE literal count, match length or distance, split into its symbol
+// and the extra bits that follow the symbol's base value
+typedef struct {
+    UINT32 Symbol;
+    UINT32 Extra;
+    UINT32 ExtraBits;
+} MOCK_LZFSE_VALUE;
+
+// Finite state entropy encoding of one symbol: states from S0 up move on
+// with K bits and Delta0, the ones below with K - 1 bits and Delta1
+typedef struct {
+    INT32 S0;
+    UINT32 K;
+    INT32 Delta0;
+    INT32 Delta1;
+} MOCK_FSE_ENTRY;
+
+// One block's literals, (literal count, match length, distance) triples
+// and coding tables
+typedef struct {
+    UINT8 Literals[MOCK_LZFSE_BLOCK + 4];
+    UINT32 L[MOCK_LZFSE_MAX_LMD];
+    UINT32 M[MOCK_LZFSE_MAX_LMD];
+    UINT32 D[MOCK_LZFSE_MAX_LMD];
+    UINT32 Counts[256];
+    UINT16 Frequency[20 + 20 + 64 + 256];
+    MOCK_FSE_ENTRY LTable[20];
+    MOCK_FSE_ENTRY MTable[20];
+    MOCK_FSE_ENTRY DTable[64];
+    MOCK_FSE_ENTRY LiteralTable[256];
+} MOCK_LZFSE_WORK;
+
+STATIC
+MOCK_LZFSE_VALUE
+MockLzfseValue(
+    CONST UINT8 *ExtraBits,
+    UINT32 Value
+) {
+    MOCK_LZFSE_VALUE Result;
+    UINT32 Base = 0;
+
+    Result.Symbol = 0;
+    for (;;) {
+        UINT32 Bits = (ExtraBits != NULL) ? ExtraBits[Result.Symbol] : Result.Symbol / 4;
+
+        if (Value - Base < (1U << Bits)) {
+            Result.Extra = Value - Base;
+            Result.ExtraBits = Bits;
+            return Result;
+        }
+        Base += 1U << Bits;
+        Result.Symbol++;
+    }
+}
+
+// Scale symbol counts to frequencies that add up to States, keeping every
+// symbol that occurs
+STATIC
+VOID
+MockLzfseNormalize(
+    CONST UINT32 *Counts,
+    UINT32 SymbolCount,
+    UINT32 States,
+    UINT16 *Frequency
+) {
+    UINT32 Total = 0;
+    UINT32 Sum = 0;
+    UINT32 Largest = 0;
+
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        Total += Counts[Symbol];
+    }
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        Frequency[Symbol] = 0;
+        if (Counts[Symbol] != 0) {
+            Frequency[Symbol] = (UINT16)MAX((UINT64)Counts[Symbol] * States / Total, 1);
+            Sum += Frequency[Symbol];
+        }
+    }
+    if (Total == 0) {
+        return;
+    }
+
+    // Rounding up the rare symbols can overshoot; take it back from the
+    // most frequent ones
+    while (Sum > States) {
+        for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+            if (Frequency[Symbol] > Frequency[Largest]) {
+                Largest = Symbol;
+            }
+        }
+        Frequency[Largest]--;
+        Sum--;
+    }
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        if (Frequency[Symbol] > Frequency[Largest]) {
+            Largest = Symbol;
+        }
+    }
+    Frequency[Largest] = (UINT16)(Frequency[Largest] + States - Sum);
+}
+
+STATIC
+VOID
+MockFseBuildTable(
+    CONST UINT16 *Frequency,
+    UINT32 SymbolCount,
+    UINT32 StateBits,
+    MOCK_FSE_ENTRY *Table
+) {
+    INT32 States = 1 << StateBits;
+    INT32 Offset = 0;
+
+    for (UINT32 Symbol = 0; Symbol < SymbolCount; Symbol++) {
+        INT32 Count = Frequency[Symbol];
+
+        if (Count == 0) {
+            continue;
+        }
+        UINT32 K = StateBits - (UINT32)HighBitSet64((UINT64)Count);
+        Table[Symbol].K = K;
+        Table[Symbol].S0 = (Count << K) - States;
+        Table[Symbol].Delta0 = Offset - Count + (States >> K);
+        Table[Symbol].Delta1 = (K != 0) ? Offset - Count + (States >> (K - 1)) : 0;
+        Offset += Count;
+    }
+}
+
+// Encode one symbol, backwards: the decoder reads the state bits pushed
+// here to get back the previous State
+STATIC
+VOID
+MockFseEncode(
+    MOCK_BIT_WRITER *Writer,
+    UINT16 *State,
+    CONST MOCK_FSE_ENTRY *Entry
+) {
+    INT32 Current = *State;
+    BOOLEAN High = Current >= Entry->S0;
+    UINT32 Bits = High ? Entry->K : Entry->K - 1;
+
+    MockPutBits(Writer, (UINT32)Current & ((1U << Bits) - 1), Bits);
+    *State = (UINT16)((High ? Entry->Delta0 : Entry->Delta1) + (Current >> Bits));
+}
+
+STATIC
+VOID
+MockLzfsePutValue(
+    MOCK_BIT_WRITER *Writer,
+    UINT16 *State,
+    CONST MOCK_FSE_ENTRY *Table,
+    MOCK_LZFSE_VALUE Value
+) {
+    MockPutBits(Writer, Value.Extra, Value.ExtraBits);
+    MockFseEncode(Writer, State, &Table[Value.Symbol]);
+}
+
+// Start an entropy coded payload. Eight zero bytes in front let the
+// decoder load whole words all the way to its first value.
+STATIC
+VOID
+MockLzfseStartPayload(
+    MOCK_BIT_WRITER *Writer,
+    UINT8 *Out,
+    UINT8 *OutEnd
+) {
+    ZeroMem(Writer, sizeof(*Writer));
+    Writer->Out = Out;
+    Writer->OutEnd = OutEnd;
+    for (UINT32 Index = 0; Index < 8; Index++) {
+        MockPutBits(Writer, 0, 8);
+    }
+}
+
+// Write the last partial byte; returns the valid bits in it, less 8
+STATIC
+INT32
+MockLzfseEndPayload(
+    MOCK_BIT_WRITER *Writer
+) {
+    INT32 Extra = (Writer->Count != 0) ? (INT32)Writer->Count - 8 : 0;
+
+    MockPutBits(Writer, 0, (8 - Writer->Count % 8) % 8);
+    return Extra;
+}
+
+// Compress Input[Start..End) into a version 2 block: greedy matches, up to
+// the window back into earlier blocks, coded with tables fitted to this
+// block. Returns the end of the block, or NULL when it does not fit.
+STATIC
+UINT8 *
+MockLzfseBlock(
+    MOCK_LZFSE_WORK *Work,
+    CONST UINT8 *Input,
+    UINTN Start,
+    UINTN End,
+    UINT32 *Head,
+    UINT8 *Out,
+    UINT8 *OutEnd
+) {
+    UINT32 LiteralCount = 0;
+    UINT32 MatchCount = 0;
+    UINTN Position = Start;
+    UINTN Pending = 0;
+    UINTN LastDistance = 0;
+    MOCK_BIT_WRITER Writer;
+
+    if ((UINTN)(OutEnd - Out) < 32) {
+        return NULL;
+    }
+
+    // Literal runs longer than one symbol holds go in match-less triples,
+    // whose zero distance leaves the previous one in place
+    while (Position <= End) {
+        UINTN Distance = 0;
+        UINTN Length = (Position < End)
+            ? MockFindMatch(Input, End, Position, Head, MOCK_LZFSE_WINDOW, MOCK_LZFSE_MAX_MATCH, &Distance)
+            : 0;
+
+        if (Length == 0 && Position < End) {
+            Work->Literals[LiteralCount++] = Input[Position++];
+            Pending++;
+            continue;
+        }
+        while (Pending > MOCK_LZFSE_MAX_L || (Length == 0 && Pending > 0)) {
+            UINT32 Run = (UINT32)MIN(Pending, (UINTN)MOCK_LZFSE_MAX_L);
+
+            Work->L[MatchCount] = Run;
+            Work->M[MatchCount] = 0;
+            Work->D[MatchCount++] = 0;
+            Pending -= Run;
+        }
+        if (Length == 0) {
+            break;
+        }
+        Work->L[MatchCount] = (UINT32)Pending;
+        Work->M[MatchCount] = (UINT32)Length;
+        Work->D[MatchCount++] = (Distance == LastDistance) ? 0 : (UINT32)Distance;
+        LastDistance = Distance;
+        Pending = 0;
+        Position += Length;
+    }
+    while (LiteralCount % 4 != 0) {
+        Work->Literals[LiteralCount++] = 0;
+    }
+
+    // Frequencies of the L, M, D and literal symbols, in header order
+    ZeroMem(Work->Counts, sizeof(Work->Counts));
+    for (UINT32 Index = 0; Index < MatchCount; Index++) {
+        Work->Counts[MockLzfseValue(mMockLzfseLExtra, Work->L[Index]).Symbol]++;
+    }
+    MockLzfseNormalize(Work->Counts, 20, 64, Work->Frequency);
+    ZeroMem(Work->Counts, sizeof(Work->Counts));
+    for (UINT32 Index = 0; Index < MatchCount; Index++) {
+        Work->Counts[MockLzfseValue(mMockLzfseMExtra, Work->M[Index]).Symbol]++;
+    }
+    MockLzfseNormalize(Work->Counts, 20, 64, Work->Frequency + 20);
+    ZeroMem(Work->Counts, sizeof(Work->Counts));
+    for (UINT32 Index = 0; Index < MatchCount; Index++) {
+        Work->Counts[MockLzfseValue(NULL, Work->D[Index]).Symbol]++;
+    }
+    MockLzfseNormalize(Work->Counts, 64, 256, Work->Frequency + 40);
+    ZeroMem(Work->Counts, sizeof(Work->Counts));
+    for (UINT32 Index = 0; Index < LiteralCount; Index++) {
+        Work->Counts[Work->Literals[Index]]++;
+    }
+    MockLzfseNormalize(Work->Counts, 256, 1024, Work->Frequency + 104);
+
+    MockFseBuildTable(Work->Frequency, 20, 6, Work->LTable);
+    MockFseBuildTable(Work->Frequency + 20, 20, 6, Work->MTable);
+    MockFseBuildTable(Work->Frequency + 40, 64, 8, Work->DTable);
+    MockFseBuildTable(Work->Frequency + 104, 256, 10, Work->LiteralTable);
+
+    ZeroMem(&Writer, sizeof(Writer));
+    Writer.Out = Out + 32;
+    Writer.OutEnd = OutEnd;
+    for (UINT32 Index = 0; Index < ARRAY_SIZE(Work->Frequency); Index++) {
+        UINT32 Value = Work->Frequency[Index];
+
+        if (Value < 8) {
+            MockPutBits(&Writer, mMockLzfseSmallCode[Value], mMockLzfseSmallBits[Value]);
+        } else if (Value < 24) {
+            MockPutBits(&Writer, 7 + ((Value - 8) << 4), 8);
+        } else {
+            MockPutBits(&Writer, 15 + ((Value - 24) << 4), 14);
+        }
+    }
+    MockPutBits(&Writer, 0, (8 - Writer.Count % 8) % 8);
+    if (Writer.Overflow) {
+        return NULL;
+    }
+    UINT32 HeaderSize = (UINT32)(Writer.Out - Out);
+
+    // Both payloads are read back to front, so the last value goes first
+    UINT16 LiteralState[4] = { 0, 0, 0, 0 };
+    MockLzfseStartPayload(&Writer, Out + HeaderSize, OutEnd);
+    for (UINT32 Index = LiteralCount; Index > 0; Index -= 4) {
+        for (UINT32 Stream = 4; Stream > 0; Stream--) {
+            MockFseEncode(&Writer, &LiteralState[Stream - 1], &Work->LiteralTable[Work->Literals[Index - 5 + Stream]]);
+        }
+    }
+    INT32 LiteralExtra = MockLzfseEndPayload(&Writer);
+    UINT8 *Lmd = Writer.Out;
+
+    UINT16 LState = 0;
+    UINT16 MState = 0;
+    UINT16 DState = 0;
+    MockLzfseStartPayload(&Writer, Lmd, OutEnd);
+    for (UINT32 Index = MatchCount; Index > 0; Index--) {
+        MockLzfsePutValue(&Writer, &DState, Work->DTable, MockLzfseValue(NULL, Work->D[Index - 1]));
+        MockLzfsePutValue(&Writer, &MState, Work->MTable, MockLzfseValue(mMockLzfseMExtra, Work->M[Index - 1]));
+        MockLzfsePutValue(&Writer, &LState, Work->LTable, MockLzfseValue(mMockLzfseLExtra, Work->L[Index - 1]));
+    }
+    INT32 LmdExtra = MockLzfseEndPayload(&Writer);
+    if (Writer.Overflow) {
+        return NULL;
+    }
+
+    UINT64 Fields0 = LiteralCount | LShiftU64((UINT64)(Lmd - Out - HeaderSize), 20) |
+        LShiftU64(MatchCount, 40) | LShiftU64((UINT64)(LiteralExtra + 7), 60);
+    UINT64 Fields1 = LiteralState[0] | LShiftU64(LiteralState[1], 10) | LShiftU64(LiteralState[2], 20) |
+        LShiftU64(LiteralState[3], 30) | LShiftU64((UINT64)(Writer.Out - Lmd), 40) | LShiftU64((UINT64)(LmdExtra + 7), 60);
+    UINT64 Fields2 = HeaderSize | LShiftU64(LState, 32) | LShiftU64(MState, 42) | LShiftU64(DState, 52);
+    WriteUnaligned32((UINT32 *)Out, 0x32787662);  // 'bvx2'
+    WriteUnaligned32((UINT32 *)(Out + 4), (UINT32)(End - Start));
+    WriteUnaligned64((UINT64 *)(Out + 8), Fields0);
+    WriteUnaligned64((UINT64 *)(Out + 16), Fields1);
+    WriteUnaligned64((UINT64 *)(Out + 24), Fields2);
+    return Writer.Out;
+}
+
+// Compress into an LZFSE stream. Blocks of 16 KiB take turns at being
+// entropy coded, LZVN coded and stored, so every kind of block gets
+// decoded. A block that does not fit, or an LZVN block that does not
+// shrink, is stored instead. Returns the stream size, or 0 when it does not
+// fit the destination.
+UINTN MockLzfseCompress(
+    CONST VOID *Source,
+    UINTN SourceSize,
+    VOID *Destination,
+    UINTN DestinationSize
+) {
+    CONST UINT8 *Input = Source;
+    UINT8 *Out = Destination;
+    UINT8 *OutEnd = Out + DestinationSize;
+    MOCK_LZFSE_WORK *Work;
+    UINT32 *Head;
+    UINTN Block = 0;
+
+    Head = AllocateZeroPool(sizeof(UINT32) << MOCK_HASH_BITS);
+    Work = AllocatePool(sizeof(MOCK_LZFSE_WORK));
+    if (Head == NULL || Work == NULL) {
+        Out = NULL;
+    }
+
+    for (UINTN Start = 0; Start < SourceSize && Out != NULL; Start += MOCK_LZFSE_BLOCK, Block++) {
+        UINTN End = MIN(SourceSize, Start + MOCK_LZFSE_BLOCK);
+        UINTN Size = End - Start;
+        UINT8 *Next = NULL;
+
+        if (Block % 3 == 0) {
+            Next = MockLzfseBlock(Work, Input, Start, End, Head, Out, OutEnd);
+        } else if (Block % 3 == 1 && (UINTN)(OutEnd - Out) > 12) {
+            UINTN Compressed = MockLzvnCompress(Input + Start, Size, Out + 12, (UINTN)(OutEnd - Out) - 12);
+
+            if (Compressed != 0 && Compressed < Size) {
+                WriteUnaligned32((UINT32 *)Out, 0x6E787662);  // 'bvxn'
+                WriteUnaligned32((UINT32 *)(Out + 4), (UINT32)Size);
+                WriteUnaligned32((UINT32 *)(Out + 8), (UINT32)Compressed);
+                Next = Out + 12 + Compressed;
+            }
+        }
+        if (Next == NULL && (UINTN)(OutEnd - Out) >= 8 + Size) {
+            WriteUnaligned32((UINT32 *)Out, 0x2D787662);  // 'bvx-'
+            WriteUnaligned32((UINT32 *)(Out + 4), (UINT32)Size);
+            CopyMem(Out + 8, Input + Start, Size);
+            Next = Out + 8 + Size;
+        }
+        Out = Next;
+    }
+
+    if (Head != NULL) {
+        FreePool(Head);
+    }
+    if (Work != NULL) {
+        FreePool(Work);
+    }
+
+    if (Out == NULL || OutEnd - Out < 4) {
+        return 0;
+    }
+    WriteUnaligned32((UINT32 *)Out, 0x24787662);  // 'bvx$'
+    return (UINTN)(Out + 4 - (UINT8 *)Destination);
+}
@@ -0,0 +1,1742 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  MockHfsImage.c
+//  This file is the c source for the Mock HFS+ image builder used by tests
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#include "MockHfsImage.h"
+#include "MockCompress.h"
+
+#define MOCK_PUT16(Pointer, Value)  WriteUnaligned16((UINT16 *)(VOID *)(Pointer), SwapBytes16((UINT16)(Value)))
+#define MOCK_PUT32(Pointer, Value)  WriteUnaligned32((UINT32 *)(VOID *)(Pointer), SwapBytes32((UINT32)(Value)))
+#define MOCK_PUT64(Pointer, Value)  WriteUnaligned64((UINT64 *)(VOID *)(Pointer), SwapBytes64((UINT64)(Value)))
+
+#define MOCK_CATALOG_MAX_KEY_LENGTH  516
+#define MOCK_EXTENTS_MAX_KEY_LENGTH  10
+#define MOCK_ATTRIBUTES_MAX_KEY_LENGTH  266
+#define MOCK_DECMPFS_MAX_INLINE      3802  // Largest decmpfs attribute kept inline, as on macOS
+#define MOCK_RESOURCE_DATA_OFFSET    0x100
+#define MOCK_RESOURCE_MAP_SIZE       50
+#define MOCK_BTREE_HEADER_SIZE       106
+#define MOCK_BTREE_USER_DATA_SIZE    128
+#define MOCK_FILE_RECORD_SIZE        248
+#define MOCK_FOLDER_RECORD_SIZE      88
+#define MOCK_JOURNAL_BLOCK_LIST_SIZE 4096
+
+// One B-tree leaf record: the key followed by its data
+typedef struct {
+    UINT8 *Bytes;
+    UINT16 KeySize;  // Including the key length field
+    UINT16 Size;
+} MOCK_RECORD;
+
+typedef struct {
+    MOCK_RECORD *Records;
+    UINTN Count;
+    UINTN Capacity;
+} MOCK_RECORD_LIST;
+
+// First key of a node, carried up to build the next index level
+typedef struct {
+    CONST UINT8 *Key;
+    UINT16 KeySize;
+    UINT32 Node;
+} MOCK_INDEX_ENTRY;
+
+// A B-tree file image under construction
+typedef struct {
+    UINT8 *Data;
+    UINT32 NodeSize;
+    UINT32 Capacity;
+    UINT32 Count;
+} MOCK_TREE;
+
+#define MOCK_TREE_NODE(Tree, Number)  ((Tree)->Data + (UINTN)(Number) * (Tree)->NodeSize)
+
+// Builder state
+typedef struct {
+    MockBlockIoProtocol *Disk;
+    UINT32 BlockSize;
+    UINT32 TotalBlocks;
+    UINT8 *Used;  // One byte per allocation block
+    UINT32 FirstFree;  // Every block below this one is in use
+    UINT32 NextCatalogID;
+    MOCK_RECORD_LIST Catalog;
+    MOCK_RECORD_LIST Extents;
+    MOCK_RECORD_LIST Attributes;
+    UINT8 *BlockBuffer;
+    UINT8 Compression;
+    UINT32 MaxInlineAttribute;
+    BOOLEAN BinaryKeys;  // HFSX catalog order
+    BOOLEAN ScatteredCatalog;
+    HFSPlusExtentDescriptor *BitmapRuns;  // Allocation file, one extent per block when scattered
+    UINT32 BitmapRunCount;
+} MOCK_BUILDER;
+
+// Expected content of every generated file
+UINT8 MockHfsFileByte(
+    UINT32 FileID,
+    UINT64 Offset
+) {
+    return (UINT8)(Offset * 7 + (Offset >> 9) + FileID * 13);
+}
+
+// Name of the Index-th file in \Files, always MOCK_HFS_FILE_NAME_LENGTH long
+VOID MockHfsFileName(
+    UINT32 Index,
+    CHAR16 *Name
+) {
+    CONST CHAR16 *Template = L"File00000.bin";
+
+    for (UINTN Position = 0; Position <= MOCK_HFS_FILE_NAME_LENGTH; Position++) {
+        Name[Position] = Template[Position];
+    }
+    for (UINTN Digit = 8; Digit >= 4; Digit--) {
+        Name[Digit] = (CHAR16)(L'0' + Index % 10);
+        Index /= 10;
+    }
+}
+
+// Write a byte range of the disk; partial device blocks are read back first
+STATIC
+EFI_STATUS
+MockWriteBytes(
+    MockBlockIoProtocol *Disk,
+    UINT64 Offset,
+    CONST VOID *Data,
+    UINTN Length
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = &Disk->BlockIo;
+    UINT32 DeviceBlockSize = BlockIo->Media->BlockSize;
+    CONST UINT8 *Source = Data;
+    UINT8 *Bounce = NULL;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    while (Length > 0 && !EFI_ERROR(Status)) {
+        UINT64 Lba = Offset / DeviceBlockSize;
+        UINT32 Skip = (UINT32)(Offset % DeviceBlockSize);
+        UINTN Chunk;
+
+        if (Skip == 0 && Length >= DeviceBlockSize) {
+            Chunk = Length - Length % DeviceBlockSize;
+            Status = BlockIo->WriteBlocks(BlockIo, BlockIo->Media->MediaId, Lba, Chunk, (VOID *)Source);
+        } else {
+            Chunk = MIN(Length, (UINTN)(DeviceBlockSize - Skip));
+            if (Bounce == NULL) {
+                Bounce = AllocatePool(DeviceBlockSize);
+                if (Bounce == NULL) {
+                    return EFI_OUT_OF_RESOURCES;
+                }
+            }
+            Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, Lba, DeviceBlockSize, Bounce);
+            if (!EFI_ERROR(Status)) {
+                CopyMem(Bounce + Skip, Source, Chunk);
+                Status = BlockIo->WriteBlocks(BlockIo, BlockIo->Media->MediaId, Lba, DeviceBlockSize, Bounce);
+            }
+        }
+
+        Source += Chunk;
+        Offset += Chunk;
+        Length -= Chunk;
+    }
+
+    if (Bounce != NULL) {
+        FreePool(Bounce);
+    }
+    return Status;
+}
+
+// Journal fields are in the byte order of the machine that wrote them,
+// which the image options choose
+STATIC
+VOID
+MockJournalPut(
+    CONST MOCK_HFS_IMAGE *Image,
+    VOID *Pointer,
+    UINT64 Value,
+    UINTN Size
+) {
+    switch (Size) {
+    case sizeof(UINT16):
+        WriteUnaligned16((UINT16 *)Pointer, Image->JournalSwapped ? SwapBytes16((UINT16)Value) : (UINT16)Value);
+        break;
+    case sizeof(UINT32):
+        WriteUnaligned32((UINT32 *)Pointer, Image->JournalSwapped ? SwapBytes32((UINT32)Value) : (UINT32)Value);
+        break;
+    default:
+        WriteUnaligned64((UINT64 *)Pointer, Image->JournalSwapped ? SwapBytes64(Value) : Value);
+        break;
+    }
+}
+
+#define MOCK_JOURNAL_PUT(Image, Field, Value)  MockJournalPut((Image), &(Field), (Value), sizeof(Field))
+
+STATIC
+UINT64
+MockJournalGet64(
+    CONST MOCK_HFS_IMAGE *Image,
+    CONST VOID *Pointer
+) {
+    UINT64 Value = ReadUnaligned64((CONST UINT64 *)Pointer);
+    return Image->JournalSwapped ? SwapBytes64(Value) : Value;
+}
+
+// Write the journal header with the given start and end
+STATIC
+EFI_STATUS
+MockWriteJournalHeader(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE *Image,
+    UINT64 Start,
+    UINT64 End
+) {
+    UINT8 Raw[sizeof(HFSPlusJournalHeader)];
+    HFSPlusJournalHeader *Header = (HFSPlusJournalHeader *)Raw;
+
+    ZeroMem(Raw, sizeof(Raw));
+    MOCK_JOURNAL_PUT(Image, Header->magic, HFSPLUS_JOURNAL_MAGIC);
+    MOCK_JOURNAL_PUT(Image, Header->endian, HFSPLUS_JOURNAL_ENDIAN);
+    MOCK_JOURNAL_PUT(Image, Header->start, Start);
+    MOCK_JOURNAL_PUT(Image, Header->end, End);
+    MOCK_JOURNAL_PUT(Image, Header->size, Image->JournalSize);
+    MOCK_JOURNAL_PUT(Image, Header->blhdrSize, MOCK_JOURNAL_BLOCK_LIST_SIZE);
+    MOCK_JOURNAL_PUT(Image, Header->jhdrSize, Disk->BlockIo.Media->BlockSize);
+    MOCK_JOURNAL_PUT(Image, Header->checksum, HfsJournalChecksum(Raw, HFSPLUS_JOURNAL_HEADER_CHECKSUM_SIZE));
+    return MockWriteBytes(Disk, Image->JournalOffset, Raw, sizeof(Raw));
+}
+
+// Write the journal info block and a journal with nothing to replay
+STATIC
+EFI_STATUS
+MockWriteEmptyJournal(
+    MOCK_BUILDER *Builder,
+    CONST MOCK_HFS_IMAGE *Image
+) {
+    HFSPlusJournalInfoBlock InfoBlock;
+    UINT32 HeaderSize = Builder->Disk->BlockIo.Media->BlockSize;
+
+    ZeroMem(&InfoBlock, sizeof(InfoBlock));
+    MOCK_PUT32(&InfoBlock.flags, HFSPLUS_JIB_JOURNAL_IN_FS);
+    MOCK_PUT64(&InfoBlock.offset, Image->JournalOffset);
+    MOCK_PUT64(&InfoBlock.size, Image->JournalSize);
+
+    EFI_STATUS Status = MockWriteBytes(Builder->Disk, (UINT64)Image->JournalInfoBlock * Builder->BlockSize, &InfoBlock, sizeof(InfoBlock));
+    if (!EFI_ERROR(Status)) {
+        Status = MockWriteJournalHeader(Builder->Disk, Image, HeaderSize, HeaderSize);
+    }
+    return Status;
+}
+
+// Append a transaction to the journal of a journaled image, leaving the
+// volume as a crash would: the blocks are logged but their home locations
+// still hold the old contents. Block data is checksummed.
+EFI_STATUS MockJournalTransaction(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE *Image,
+    CONST MOCK_JOURNAL_BLOCK *Blocks,
+    UINTN BlockCount
+) {
+    EFI_BLOCK_IO_PROTOCOL *BlockIo = &Disk->BlockIo;
+    UINT32 DeviceBlockSize = BlockIo->Media->BlockSize;
+    UINTN InfoOffset = OFFSET_OF(HFSPlusJournalBlockListHeader, binfo);
+    UINT64 DataSize = 0;
+
+    if (Image->JournalSize == 0 ||
+        InfoOffset + (BlockCount + 1) * sizeof(HFSPlusJournalBlockInfo) > MOCK_JOURNAL_BLOCK_LIST_SIZE) {
+        return EFI_INVALID_PARAMETER;
+    }
+    for (UINTN Index = 0; Index < BlockCount; Index++) {
+        DataSize += Blocks[Index].Size;
+    }
+
+    UINT8 *Header = AllocatePool(DeviceBlockSize);
+    UINTN ListSize = (UINTN)(MOCK_JOURNAL_BLOCK_LIST_SIZE + DataSize);
+    UINT8 *List = AllocateZeroPool(ListSize);
+    if (Header == NULL || List == NULL) {
+        if (Header != NULL) {
+            FreePool(Header);
+        }
+        if (List != NULL) {
+            FreePool(List);
+        }
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EFI_STATUS Status = BlockIo->ReadBlocks(BlockIo, BlockIo->Media->MediaId, Image->JournalOffset / DeviceBlockSize, DeviceBlockSize, Header);
+    UINT64 Start = MockJournalGet64(Image, &((HFSPlusJournalHeader *)Header)->start);
+    UINT64 End = MockJournalGet64(Image, &((HFSPlusJournalHeader *)Header)->end);
+    FreePool(Header);
+
+    // The journal is circular between its header and its end
+    UINT64 Capacity = Image->JournalSize - DeviceBlockSize;
+    UINT64 InUse = (End >= Start) ? End - Start : Capacity - (Start - End);
+    if (!EFI_ERROR(Status) && ListSize >= Capacity - InUse) {
+        Status = EFI_VOLUME_FULL;
+    }
+
+    HFSPlusJournalBlockListHeader *ListHeader = (HFSPlusJournalBlockListHeader *)List;
+    HFSPlusJournalBlockInfo *Info = (HFSPlusJournalBlockInfo *)(List + InfoOffset);
+    UINT8 *Data = List + MOCK_JOURNAL_BLOCK_LIST_SIZE;
+
+    MOCK_JOURNAL_PUT(Image, ListHeader->maxBlocks, (MOCK_JOURNAL_BLOCK_LIST_SIZE - InfoOffset) / sizeof(HFSPlusJournalBlockInfo));
+    MOCK_JOURNAL_PUT(Image, ListHeader->numBlocks, BlockCount + 1);
+    MOCK_JOURNAL_PUT(Image, ListHeader->bytesUsed, ListSize);
+    MOCK_JOURNAL_PUT(Image, ListHeader->flags, HFSPLUS_BLHDR_CHECK_CHECKSUMS | HFSPLUS_BLHDR_FIRST_HEADER);
+    for (UINTN Index = 0; Index < BlockCount; Index++) {
+        MOCK_JOURNAL_PUT(Image, Info[Index + 1].bnum, Blocks[Index].Lba);
+        MOCK_JOURNAL_PUT(Image, Info[Index + 1].bsize, Blocks[Index].Size);
+        MOCK_JOURNAL_PUT(Image, Info[Index + 1].checksum, HfsJournalChecksum(Blocks[Index].Data, Blocks[Index].Size));
+        CopyMem(Data, Blocks[Index].Data, Blocks[Index].Size);
+        Data += Blocks[Index].Size;
+    }
+    MOCK_JOURNAL_PUT(Image, ListHeader->checksum, HfsJournalChecksum(List, HFSPLUS_BLOCK_LIST_CHECKSUM_SIZE));
+
+    // Write the list at the end of the journal, wrapping past its last byte
+    for (UINTN Written = 0; Written < ListSize && !EFI_ERROR(Status);) {
+        UINTN Chunk = (UINTN)MIN((UINT64)(ListSize - Written), Image->JournalSize - End);
+
+        Status = MockWriteBytes(Disk, Image->JournalOffset + End, List + Written, Chunk);
+        Written += Chunk;
+        End += Chunk;
+        if (End == Image->JournalSize) {
+            End = DeviceBlockSize;
+        }
+    }
+    FreePool(List);
+
+    if (!EFI_ERROR(Status)) {
+        Status = MockWriteJournalHeader(Disk, Image, Start, End);
+    }
+    return Status;
+}
+
+// Allocate Count contiguous blocks, first fit
+STATIC
+EFI_STATUS
+MockAllocateRun(
+    MOCK_BUILDER *Builder,
+    UINT32 Count,
+    HFSPlusExtentDescriptor *Run
+) {
+    UINT32 Start = 0;
+    UINT32 Length = 0;
+
+    Run->startBlock = 0;
+    Run->blockCount = 0;
+    if (Count == 0) {
+        return EFI_SUCCESS;
+    }
+
+    for (UINT32 Block = Builder->FirstFree; Block < Builder->TotalBlocks; Block++) {
+        if (Builder->Used[Block]) {
+            Length = 0;
+            continue;
+        }
+        if (Length == 0) {
+            Start = Block;
+        }
+        if (++Length == Count) {
+            SetMem(Builder->Used + Start, Count, 1);
+            while (Builder->FirstFree < Builder->TotalBlocks && Builder->Used[Builder->FirstFree]) {
+                Builder->FirstFree++;
+            }
+            Run->startBlock = Start;
+            Run->blockCount = Count;
+            return EFI_SUCCESS;
+        }
+    }
+
+    return EFI_VOLUME_FULL;
+}
+
+// Allocate Count single blocks with a free block between each of them
+STATIC
+EFI_STATUS
+MockAllocateScattered(
+    MOCK_BUILDER *Builder,
+    UINT32 Count,
+    HFSPlusExtentDescriptor *Runs
+) {
+    UINT32 Block = Builder->FirstFree;
+
+    for (UINT32 Index = 0; Index < Count; Index++) {
+        while (Block < Builder->TotalBlocks && (Builder->Used[Block] || (Block % 2) != 0)) {
+            Block++;
+        }
+        if (Block >= Builder->TotalBlocks) {
+            return EFI_VOLUME_FULL;
+        }
+        Builder->Used[Block] = 1;
+        if (Block == Builder->FirstFree) {
+            Builder->FirstFree++;
+        }
+        Runs[Index].startBlock = Block;
+        Runs[Index].blockCount = 1;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Append a record built from a key and its data
+STATIC
+EFI_STATUS
+MockAddRecord(
+    MOCK_RECORD_LIST *List,
+    CONST UINT8 *Key,
+    UINT16 KeySize,
+    CONST UINT8 *Data,
+    UINT16 DataSize
+) {
+    if (List->Count == List->Capacity) {
+        UINTN NewCapacity = MAX(List->Capacity * 2, 64);
+        MOCK_RECORD *Records = ReallocatePool(
+            List->Capacity * sizeof(MOCK_RECORD),
+            NewCapacity * sizeof(MOCK_RECORD),
+            List->Records
+        );
+        if (Records == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        List->Records = Records;
+        List->Capacity = NewCapacity;
+    }
+
+    MOCK_RECORD *Record = &List->Records[List->Count];
+    Record->Bytes = AllocatePool(KeySize + DataSize);
+    if (Record->Bytes == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    CopyMem(Record->Bytes, Key, KeySize);
+    CopyMem(Record->Bytes + KeySize, Data, DataSize);
+    Record->KeySize = KeySize;
+    Record->Size = KeySize + DataSize;
+    List->Count++;
+    return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+MockFreeRecords(
+    MOCK_RECORD_LIST *List
+) {
+    for (UINTN Index = 0; Index < List->Count; Index++) {
+        FreePool(List->Records[Index].Bytes);
+    }
+    if (List->Records != NULL) {
+        FreePool(List->Records);
+    }
+    ZeroMem(List, sizeof(MOCK_RECORD_LIST));
+}
+
+// Encode a catalog key; returns its size including the key length field
+STATIC
+UINT16
+MockCatalogKey(
+    UINT8 *Key,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength
+) {
+    MOCK_PUT16(Key, 6 + 2 * NameLength);
+    MOCK_PUT32(Key + 2, ParentID);
+    MOCK_PUT16(Key + 6, NameLength);
+    for (UINTN Index = 0; Index < NameLength; Index++) {
+        MOCK_PUT16(Key + 8 + 2 * Index, Name[Index]);
+    }
+    return (UINT16)(8 + 2 * NameLength);
+}
+
+// Encode a host fork as the 80 on-disk bytes
+STATIC
+VOID
+MockForkToDisk(
+    CONST HFSPlusForkData *Fork,
+    UINT8 *Raw
+) {
+    MOCK_PUT64(Raw, Fork->logicalSize);
+    MOCK_PUT32(Raw + 8, Fork->clumpSize);
+    MOCK_PUT32(Raw + 12, Fork->totalBlocks);
+    for (UINTN Index = 0; Index < 8; Index++) {
+        MOCK_PUT32(Raw + 16 + 8 * Index, Fork->extents[Index].startBlock);
+        MOCK_PUT32(Raw + 20 + 8 * Index, Fork->extents[Index].blockCount);
+    }
+}
+
+// Add the thread record that maps a file or folder ID back to its parent
+// and name
+STATIC
+EFI_STATUS
+MockAddThread(
+    MOCK_BUILDER *Builder,
+    UINT16 RecordType,
+    UINT32 NodeID,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength
+) {
+    UINT8 Key[8];
+    UINT8 Thread[10 + 2 * 255];
+
+    MOCK_PUT16(Thread, RecordType);
+    MOCK_PUT16(Thread + 2, 0);
+    MOCK_PUT32(Thread + 4, ParentID);
+    MOCK_PUT16(Thread + 8, NameLength);
+    for (UINTN Index = 0; Index < NameLength; Index++) {
+        MOCK_PUT16(Thread + 10 + 2 * Index, Name[Index]);
+    }
+
+    UINT16 KeySize = MockCatalogKey(Key, NodeID, NULL, 0);
+    return MockAddRecord(&Builder->Catalog, Key, KeySize, Thread, (UINT16)(10 + 2 * NameLength));
+}
+
+// Add the folder record and the folder thread record for a folder. The
+// name is counted, so it may hold NULs.
+STATIC
+EFI_STATUS
+MockAddNamedFolder(
+    MOCK_BUILDER *Builder,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINTN NameLength,
+    UINT32 FolderID,
+    UINT32 Valence
+) {
+    UINT8 Key[8 + 2 * 255];
+    UINT8 Data[MOCK_FOLDER_RECORD_SIZE];
+
+    ZeroMem(Data, sizeof(Data));
+    HFSPlusCatalogFolder *Folder = (HFSPlusCatalogFolder *)Data;
+    MOCK_PUT16(&Folder->recordType, HFSPLUS_FOLDER_RECORD);
+    MOCK_PUT32(&Folder->valence, Valence);
+    MOCK_PUT32(&Folder->folderID, FolderID);
+    MOCK_PUT16(&Folder->permissions.fileMode, 0040755);
+
+    UINT16 KeySize = MockCatalogKey(Key, ParentID, Name, NameLength);
+    EFI_STATUS Status = MockAddRecord(&Builder->Catalog, Key, KeySize, Data, sizeof(Data));
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    return MockAddThread(Builder, HFSPLUS_FOLDER_THREAD_RECORD, FolderID, ParentID, Name, NameLength);
+}
+
+// Add a folder with an ordinary name
+STATIC
+EFI_STATUS
+MockAddFolder(
+    MOCK_BUILDER *Builder,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINT32 FolderID,
+    UINT32 Valence
+) {
+    return MockAddNamedFolder(Builder, ParentID, Name, StrLen(Name), FolderID, Valence);
+}
+
+// Add the extents past the eighth of a fork to the extents overflow tree,
+// eight extents per record, keyed by the first fork block they describe
+STATIC
+EFI_STATUS
+MockAddOverflowExtents(
+    MOCK_BUILDER *Builder,
+    UINT32 FileID,
+    UINT8 ForkType,
+    CONST HFSPlusExtentDescriptor *Runs,
+    UINT32 RunCount
+) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 ForkBlock = 0;
+
+    for (UINT32 RunIndex = 0; RunIndex < RunCount && !EFI_ERROR(Status); RunIndex += 8) {
+        if (RunIndex >= 8) {
+            UINT8 Key[12];
+            UINT8 Data[64];
+
+            MOCK_PUT16(Key, MOCK_EXTENTS_MAX_KEY_LENGTH);
+            Key[2] = ForkType;
+            Key[3] = 0;
+            MOCK_PUT32(Key + 4, FileID);
+            MOCK_PUT32(Key + 8, ForkBlock);
+
+            ZeroMem(Data, sizeof(Data));
+            for (UINT32 Index = 0; Index < 8 && RunIndex + Index < RunCount; Index++) {
+                MOCK_PUT32(Data + 8 * Index, Runs[RunIndex + Index].startBlock);
+                MOCK_PUT32(Data + 8 * Index + 4, Runs[RunIndex + Index].blockCount);
+            }
+
+            Status = MockAddRecord(&Builder->Extents, Key, sizeof(Key), Data, sizeof(Data));
+        }
+        for (UINT32 Index = 0; Index < 8 && RunIndex + Index < RunCount; Index++) {
+            ForkBlock += Runs[RunIndex + Index].blockCount;
+        }
+    }
+
+    return Status;
+}
+
+// Allocate and fill a fork, with Data or else the file's pattern. Extents
+// past the eighth go to the extents overflow tree.
+STATIC
+EFI_STATUS
+MockAllocateFork(
+    MOCK_BUILDER *Builder,
+    UINT32 FileID,
+    UINT8 ForkType,
+    CONST UINT8 *Contents,
+    UINT64 Size,
+    BOOLEAN Scattered,
+    HFSPlusForkData *Fork
+) {
+    UINT32 BlockCount = (UINT32)((Size + Builder->BlockSize - 1) / Builder->BlockSize);
+    HFSPlusExtentDescriptor *Runs = AllocateZeroPool(MAX(BlockCount, 1) * sizeof(HFSPlusExtentDescriptor));
+    UINT32 RunCount = 0;
+    EFI_STATUS Status;
+
+    if (Runs == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (Scattered) {
+        Status = MockAllocateScattered(Builder, BlockCount, Runs);
+        RunCount = BlockCount;
+    } else {
+        Status = MockAllocateRun(Builder, BlockCount, Runs);
+        RunCount = (BlockCount != 0) ? 1 : 0;
+    }
+
+    // Fill the fork block by block
+    UINT64 Offset = 0;
+    for (UINT32 RunIndex = 0; RunIndex < RunCount && !EFI_ERROR(Status); RunIndex++) {
+        for (UINT32 Block = 0; Block < Runs[RunIndex].blockCount && !EFI_ERROR(Status); Block++) {
+            for (UINT32 Byte = 0; Byte < Builder->BlockSize; Byte++, Offset++) {
+                if (Offset >= Size) {
+                    Builder->BlockBuffer[Byte] = 0;
+                } else {
+                    Builder->BlockBuffer[Byte] = (Contents != NULL) ? Contents[Offset] : MockHfsFileByte(FileID, Offset);
+                }
+            }
+            Status = MockWriteBytes(
+                Builder->Disk,
+                (UINT64)(Runs[RunIndex].startBlock + Block) * Builder->BlockSize,
+                Builder->BlockBuffer,
+                Builder->BlockSize
+            );
+        }
+    }
+
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddOverflowExtents(Builder, FileID, ForkType, Runs, RunCount);
+    }
+
+    ZeroMem(Fork, sizeof(HFSPlusForkData));
+    Fork->logicalSize = Size;
+    Fork->totalBlocks = BlockCount;
+    for (UINT32 Index = 0; Index < 8 && Index < RunCount; Index++) {
+        Fork->extents[Index] = Runs[Index];
+    }
+    FreePool(Runs);
+    return Status;
+}
+
+// Compress Length bytes into Destination, falling back to the raw marker
+// byte and the bytes themselves when they do not shrink. Returns the size.
+STATIC
+UINTN
+MockCompressChunk(
+    UINT8 Compression,
+    CONST UINT8 *Source,
+    UINTN Length,
+    UINT8 *Destination,
+    UINTN Capacity
+) {
+    UINTN Size;
+
+    switch (Compression) {
+    case MOCK_COMPRESSION_ZLIB:
+        Size = MockZlibCompress(Source, Length, Destination, Capacity);
+        break;
+    case MOCK_COMPRESSION_LZFSE:
+        Size = MockLzfseCompress(Source, Length, Destination, Capacity);
+        break;
+    default:
+        Size = MockLzvnCompress(Source, Length, Destination, Capacity);
+        break;
+    }
+
+    if (Size != 0 && Size < Length) {
+        return Size;
+    }
+    if (Length + 1 > Capacity) {
+        return 0;
+    }
+    Destination[0] = (Compression == MOCK_COMPRESSION_ZLIB) ? 0xFF : 0x06;
+    CopyMem(Destination + 1, Source, Length);
+    return Length + 1;
+}
+
+// Lay out compressed file contents as a resource fork: the chunk table and
+// then the chunks. zlib files wrap them in a classic resource fork, with
+// the table in its resource data and an empty resource map at the end.
+STATIC
+EFI_STATUS
+MockBuildResourceFork(
+    UINT8 Compression,
+    CONST UINT8 *Contents,
+    UINT64 Size,
+    UINT8 **ResourceFork,
+    UINT64 *ResourceSize
+) {
+    UINT32 ChunkCount = (UINT32)((Size + HFSPLUS_DECMPFS_CHUNK_SIZE - 1) / HFSPLUS_DECMPFS_CHUNK_SIZE);
+    BOOLEAN Zlib = (Compression == MOCK_COMPRESSION_ZLIB);
+    UINTN TableOffset = Zlib ? MOCK_RESOURCE_DATA_OFFSET + 4 : 0;
+    UINTN TableSize = Zlib ? 4 + 8 * (UINTN)ChunkCount : 4 * ((UINTN)ChunkCount + 1);
+    UINTN Capacity = TableOffset + TableSize + (UINTN)ChunkCount * HFSPLUS_DECMPFS_MAX_CHUNK + MOCK_RESOURCE_MAP_SIZE;
+    UINT8 *Fork = AllocateZeroPool(Capacity);
+    UINTN End = TableOffset + TableSize;
+
+    if (Fork == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    for (UINT32 Chunk = 0; Chunk < ChunkCount; Chunk++) {
+        UINT64 Start = (UINT64)Chunk * HFSPLUS_DECMPFS_CHUNK_SIZE;
+        UINTN Length = (UINTN)MIN((UINT64)HFSPLUS_DECMPFS_CHUNK_SIZE, Size - Start);
+        UINTN Compressed = MockCompressChunk(Compression, Contents + Start, Length, Fork + End, HFSPLUS_DECMPFS_MAX_CHUNK);
+
+        if (Zlib) {
+            WriteUnaligned32((UINT32 *)(Fork + TableOffset + 4 + 8 * Chunk), (UINT32)(End - TableOffset));
+            WriteUnaligned32((UINT32 *)(Fork + TableOffset + 8 + 8 * Chunk), (UINT32)Compressed);
+        } else {
+            WriteUnaligned32((UINT32 *)(Fork + 4 * Chunk), (UINT32)End);
+        }
+        End += Compressed;
+    }
+
+    if (Zlib) {
+        UINT32 DataLength = (UINT32)(End - MOCK_RESOURCE_DATA_OFFSET);
+
+        WriteUnaligned32((UINT32 *)(Fork + TableOffset), ChunkCount);
+        MOCK_PUT32(Fork + MOCK_RESOURCE_DATA_OFFSET, DataLength - 4);
+        MOCK_PUT32(Fork, MOCK_RESOURCE_DATA_OFFSET);
+        MOCK_PUT32(Fork + 4, End);
+        MOCK_PUT32(Fork + 8, DataLength);
+        MOCK_PUT32(Fork + 12, MOCK_RESOURCE_MAP_SIZE);
+        CopyMem(Fork + End, Fork, 16);
+        End += MOCK_RESOURCE_MAP_SIZE;
+    } else {
+        WriteUnaligned32((UINT32 *)(Fork + 4 * ChunkCount), (UINT32)End);
+    }
+
+    *ResourceFork = Fork;
+    *ResourceSize = End;
+    return EFI_SUCCESS;
+}
+
+// Compress a file's pattern: into its com.apple.decmpfs attribute when the
+// result is small enough, else into its resource fork
+STATIC
+EFI_STATUS
+MockCompressFile(
+    MOCK_BUILDER *Builder,
+    UINT32 FileID,
+    UINT64 Size,
+    HFSPlusForkData *ResourceFork
+) {
+    UINT32 AttributeType = HFSPLUS_DECMPFS_LZVN_ATTR;
+    UINT32 ResourceType = HFSPLUS_DECMPFS_LZVN_RSRC;
+    UINT8 *Contents = AllocatePool((UINTN)MAX(Size, 1));
+    UINT8 *Attribute = AllocateZeroPool(Builder->MaxInlineAttribute);
+    UINTN AttributeSize = 0;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Builder->Compression == MOCK_COMPRESSION_ZLIB) {
+        AttributeType = HFSPLUS_DECMPFS_ZLIB_ATTR;
+        ResourceType = HFSPLUS_DECMPFS_ZLIB_RSRC;
+    } else if (Builder->Compression == MOCK_COMPRESSION_LZFSE) {
+        AttributeType = HFSPLUS_DECMPFS_LZFSE_ATTR;
+        ResourceType = HFSPLUS_DECMPFS_LZFSE_RSRC;
+    }
+
+    ZeroMem(ResourceFork, sizeof(HFSPlusForkData));
+    if (Contents == NULL || Attribute == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+    for (UINT64 Offset = 0; Offset < Size; Offset++) {
+        Contents[Offset] = MockHfsFileByte(FileID, Offset);
+    }
+
+    HFSPlusDecmpfsHeader *Header = (HFSPlusDecmpfsHeader *)Attribute;
+    WriteUnaligned32(&Header->compressionMagic, HFSPLUS_DECMPFS_MAGIC);
+    WriteUnaligned64(&Header->uncompressedSize, Size);
+
+    if (Size == 0) {
+        AttributeSize = sizeof(HFSPlusDecmpfsHeader);
+    } else if (Size <= HFSPLUS_DECMPFS_CHUNK_SIZE) {
+        AttributeSize = MockCompressChunk(
+            Builder->Compression,
+            Contents,
+            (UINTN)Size,
+            Attribute + sizeof(HFSPlusDecmpfsHeader),
+            Builder->MaxInlineAttribute - sizeof(HFSPlusDecmpfsHeader)
+        );
+        if (AttributeSize != 0) {
+            AttributeSize += sizeof(HFSPlusDecmpfsHeader);
+        }
+    }
+
+    if (AttributeSize != 0) {
+        WriteUnaligned32(&Header->compressionType, AttributeType);
+    } else {
+        UINT8 *Fork;
+        UINT64 ForkSize;
+
+        WriteUnaligned32(&Header->compressionType, ResourceType);
+        AttributeSize = sizeof(HFSPlusDecmpfsHeader);
+
+        Status = MockBuildResourceFork(Builder->Compression, Contents, Size, &Fork, &ForkSize);
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+        Status = MockAllocateFork(Builder, FileID, HFSPLUS_RESOURCE_FORK, Fork, ForkSize, FALSE, ResourceFork);
+        FreePool(Fork);
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+    }
+
+    // Inline attribute record, padded to an even size
+    UINT8 Key[14 + 2 * 17];
+    UINT8 Data[16 + MOCK_DECMPFS_MAX_INLINE + 1];
+    CONST CHAR16 *Name = HFSPLUS_DECMPFS_ATTRIBUTE;
+    UINTN NameLength = StrLen(Name);
+
+    MOCK_PUT16(Key, 12 + 2 * NameLength);
+    MOCK_PUT16(Key + 2, 0);
+    MOCK_PUT32(Key + 4, FileID);
+    MOCK_PUT32(Key + 8, 0);
+    MOCK_PUT16(Key + 12, NameLength);
+    for (UINTN Index = 0; Index < NameLength; Index++) {
+        MOCK_PUT16(Key + 14 + 2 * Index, Name[Index]);
+    }
+
+    ZeroMem(Data, sizeof(Data));
+    MOCK_PUT32(Data, HFSPLUS_ATTR_INLINE_DATA);
+    MOCK_PUT32(Data + 12, AttributeSize);
+    CopyMem(Data + 16, Attribute, AttributeSize);
+    Status = MockAddRecord(&Builder->Attributes, Key, (UINT16)(14 + 2 * NameLength), Data, (UINT16)ALIGN_VALUE(16 + AttributeSize, 2));
+
+Done:
+    if (Contents != NULL) {
+        FreePool(Contents);
+    }
+    if (Attribute != NULL) {
+        FreePool(Attribute);
+    }
+    return Status;
+}
+
+// Allocate, fill and catalog a file, compressed when the volume asks for it
+STATIC
+EFI_STATUS
+MockAddFile(
+    MOCK_BUILDER *Builder,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINT32 FileID,
+    UINT64 Size,
+    BOOLEAN Scattered,
+    BOOLEAN Compressed
+) {
+    HFSPlusForkData DataFork;
+    HFSPlusForkData ResourceFork;
+    EFI_STATUS Status;
+
+    ZeroMem(&DataFork, sizeof(DataFork));
+    ZeroMem(&ResourceFork, sizeof(ResourceFork));
+    if (Compressed) {
+        Status = MockCompressFile(Builder, FileID, Size, &ResourceFork);
+    } else {
+        Status = MockAllocateFork(Builder, FileID, HFSPLUS_DATA_FORK, NULL, Size, Scattered, &DataFork);
+    }
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT8 Key[8 + 2 * 255];
+    UINT8 Data[MOCK_FILE_RECORD_SIZE];
+    UINTN NameLength = StrLen(Name);
+
+    ZeroMem(Data, sizeof(Data));
+    HFSPlusCatalogFile *File = (HFSPlusCatalogFile *)Data;
+    MOCK_PUT16(&File->recordType, HFSPLUS_FILE_RECORD);
+    MOCK_PUT16(&File->flags, 0x0002);  // Thread record exists
+    MOCK_PUT32(&File->fileID, FileID);
+    MOCK_PUT16(&File->permissions.fileMode, 0100644);
+    MockForkToDisk(&DataFork, (UINT8 *)&File->dataFork);
+    MockForkToDisk(&ResourceFork, (UINT8 *)&File->resourceFork);
+    if (Compressed) {
+        File->permissions.ownerFlags = HFSPLUS_UF_COMPRESSED;
+    }
+
+    UINT16 KeySize = MockCatalogKey(Key, ParentID, Name, NameLength);
+    Status = MockAddRecord(&Builder->Catalog, Key, KeySize, Data, sizeof(Data));
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    return MockAddThread(Builder, HFSPLUS_FILE_THREAD_RECORD, FileID, ParentID, Name, NameLength);
+}
+
+// Catalog a hard link: a file record with no data whose Finder type and
+// creator mark it as a file or folder link to inode INodeNumber
+STATIC
+EFI_STATUS
+MockAddLink(
+    MOCK_BUILDER *Builder,
+    UINT32 ParentID,
+    CONST CHAR16 *Name,
+    UINT32 LinkID,
+    BOOLEAN Folder,
+    UINT32 INodeNumber
+) {
+    UINT8 Key[8 + 2 * 255];
+    UINT8 Data[MOCK_FILE_RECORD_SIZE];
+    UINTN NameLength = StrLen(Name);
+
+    ZeroMem(Data, sizeof(Data));
+    HFSPlusCatalogFile *File = (HFSPlusCatalogFile *)Data;
+    MOCK_PUT16(&File->recordType, HFSPLUS_FILE_RECORD);
+    MOCK_PUT16(&File->flags, 0x0022);  // Thread record exists, has a link chain
+    MOCK_PUT32(&File->fileID, LinkID);
+    MOCK_PUT16(&File->permissions.fileMode, 0100644);
+    MOCK_PUT32(&File->permissions.special, INodeNumber);
+    MOCK_PUT32(File->userInfo, Folder ? HFSPLUS_HARDLINK_FOLDER_TYPE : HFSPLUS_HARDLINK_FILE_TYPE);
+    MOCK_PUT32(File->userInfo + 4, Folder ? HFSPLUS_HARDLINK_FOLDER_CREATOR : HFSPLUS_HARDLINK_CREATOR);
+
+    UINT16 KeySize = MockCatalogKey(Key, ParentID, Name, NameLength);
+    EFI_STATUS Status = MockAddRecord(&Builder->Catalog, Key, KeySize, Data, sizeof(Data));
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    return MockAddThread(Builder, HFSPLUS_FILE_THREAD_RECORD, LinkID, ParentID, Name, NameLength);
+}
+
+// Catalog order: parent ID, then FastUnicodeCompare on the names
+STATIC
+INTN
+EFIAPI
+MockCompareCatalogRecords(
+    CONST VOID *Buffer1,
+    CONST VOID *Buffer2
+) {
+    CONST UINT8 *Key1 = ((CONST MOCK_RECORD *)Buffer1)->Bytes;
+    CONST UINT8 *Key2 = ((CONST MOCK_RECORD *)Buffer2)->Bytes;
+    UINT32 Parent1 = HFS_BE32(Key1 + 2);
+    UINT32 Parent2 = HFS_BE32(Key2 + 2);
+    CHAR16 Name[255];
+
+    if (Parent1 != Parent2) {
+        return (Parent1 < Parent2) ? -1 : 1;
+    }
+
+    UINT16 Length1 = HFS_BE16(Key1 + 6);
+    for (UINTN Index = 0; Index < Length1; Index++) {
+        Name[Index] = HFS_BE16(Key1 + 8 + 2 * Index);
+    }
+    return HfsFastUnicodeCompare(Name, Length1, Key2 + 8, HFS_BE16(Key2 + 6));
+}
+
+// HFSX binary catalog order: parent ID, then the names as raw code units
+STATIC
+INTN
+EFIAPI
+MockCompareBinaryCatalogRecords(
+    CONST VOID *Buffer1,
+    CONST VOID *Buffer2
+) {
+    CONST UINT8 *Key1 = ((CONST MOCK_RECORD *)Buffer1)->Bytes;
+    CONST UINT8 *Key2 = ((CONST MOCK_RECORD *)Buffer2)->Bytes;
+    UINT32 Parent1 = HFS_BE32(Key1 + 2);
+    UINT32 Parent2 = HFS_BE32(Key2 + 2);
+    CHAR16 Name[255];
+
+    if (Parent1 != Parent2) {
+        return (Parent1 < Parent2) ? -1 : 1;
+    }
+
+    UINT16 Length1 = HFS_BE16(Key1 + 6);
+    for (UINTN Index = 0; Index < Length1; Index++) {
+        Name[Index] = HFS_BE16(Key1 + 8 + 2 * Index);
+    }
+    return HfsBinaryUnicodeCompare(Name, Length1, Key2 + 8, HFS_BE16(Key2 + 6));
+}
+
+// Extents order: file ID, fork type, then start block
+STATIC
+INTN
+EFIAPI
+MockCompareExtentRecords(
+    CONST VOID *Buffer1,
+    CONST VOID *Buffer2
+) {
+    CONST UINT8 *Key1 = ((CONST MOCK_RECORD *)Buffer1)->Bytes;
+    CONST UINT8 *Key2 = ((CONST MOCK_RECORD *)Buffer2)->Bytes;
+
+    if (HFS_BE32(Key1 + 4) != HFS_BE32(Key2 + 4)) {
+        return (HFS_BE32(Key1 + 4) < HFS_BE32(Key2 + 4)) ? -1 : 1;
+    }
+    if (Key1[2] != Key2[2]) {
+        return (Key1[2] < Key2[2]) ? -1 : 1;
+    }
+    if (HFS_BE32(Key1 + 8) != HFS_BE32(Key2 + 8)) {
+        return (HFS_BE32(Key1 + 8) < HFS_BE32(Key2 + 8)) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Attributes order: file ID, attribute name as binary UTF-16, then start block
+STATIC
+INTN
+EFIAPI
+MockCompareAttributeRecords(
+    CONST VOID *Buffer1,
+    CONST VOID *Buffer2
+) {
+    CONST UINT8 *Key1 = ((CONST MOCK_RECORD *)Buffer1)->Bytes;
+    CONST UINT8 *Key2 = ((CONST MOCK_RECORD *)Buffer2)->Bytes;
+    UINT16 Length1 = HFS_BE16(Key1 + 12);
+    UINT16 Length2 = HFS_BE16(Key2 + 12);
+
+    if (HFS_BE32(Key1 + 4) != HFS_BE32(Key2 + 4)) {
+        return (HFS_BE32(Key1 + 4) < HFS_BE32(Key2 + 4)) ? -1 : 1;
+    }
+    for (UINTN Index = 0; Index < MIN(Length1, Length2); Index++) {
+        if (HFS_BE16(Key1 + 14 + 2 * Index) != HFS_BE16(Key2 + 14 + 2 * Index)) {
+            return (HFS_BE16(Key1 + 14 + 2 * Index) < HFS_BE16(Key2 + 14 + 2 * Index)) ? -1 : 1;
+        }
+    }
+    if (Length1 != Length2) {
+        return (Length1 < Length2) ? -1 : 1;
+    }
+    if (HFS_BE32(Key1 + 8) != HFS_BE32(Key2 + 8)) {
+        return (HFS_BE32(Key1 + 8) < HFS_BE32(Key2 + 8)) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Make room for Count nodes in the tree image; new nodes are zeroed
+STATIC
+EFI_STATUS
+MockGrowTree(
+    MOCK_TREE *Tree,
+    UINT32 Count
+) {
+    if (Count <= Tree->Capacity) {
+        return EFI_SUCCESS;
+    }
+
+    UINT32 NewCapacity = MAX(Count, MAX(Tree->Capacity * 2, 16));
+    UINT8 *Data = ReallocatePool(
+        (UINTN)Tree->Capacity * Tree->NodeSize,
+        (UINTN)NewCapacity * Tree->NodeSize,
+        Tree->Data
+    );
+    if (Data == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    ZeroMem(Data + (UINTN)Tree->Capacity * Tree->NodeSize, (UINTN)(NewCapacity - Tree->Capacity) * Tree->NodeSize);
+    Tree->Data = Data;
+    Tree->Capacity = NewCapacity;
+    return EFI_SUCCESS;
+}
+
+// Start the next node of the tree image, linked after Previous when non-zero
+STATIC
+EFI_STATUS
+MockNewNode(
+    MOCK_TREE *Tree,
+    UINT8 Kind,
+    UINT8 Height,
+    UINT32 Previous,
+    UINT32 *Number
+) {
+    EFI_STATUS Status = MockGrowTree(Tree, Tree->Count + 1);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    *Number = Tree->Count++;
+    UINT8 *Data = MOCK_TREE_NODE(Tree, *Number);
+    Data[8] = Kind;
+    Data[9] = Height;
+    MOCK_PUT16(Data + Tree->NodeSize - 2, sizeof(BTNodeDescriptor));
+
+    if (Previous != 0) {
+        MOCK_PUT32(MOCK_TREE_NODE(Tree, Previous), *Number);
+        MOCK_PUT32(Data + 4, Previous);
+    }
+    return EFI_SUCCESS;
+}
+
+// Append a record to a node, keeping the offset table at the node's end
+STATIC
+VOID
+MockNodeAppend(
+    UINT8 *Data,
+    UINT32 NodeSize,
+    CONST UINT8 *Bytes,
+    UINTN Size
+) {
+    UINT16 Count = HFS_BE16(Data + 10);
+    UINT16 Free = HFS_BE16(Data + NodeSize - 2 * (Count + 1));
+
+    CopyMem(Data + Free, Bytes, Size);
+    MOCK_PUT16(Data + 10, Count + 1);
+    MOCK_PUT16(Data + NodeSize - 2 * (Count + 2), Free + Size);
+}
+
+// Whether a record of Size bytes still fits in the node
+STATIC
+BOOLEAN
+MockNodeFits(
+    CONST UINT8 *Data,
+    UINT32 NodeSize,
+    UINTN Size
+) {
+    UINT16 Count = HFS_BE16(Data + 10);
+    UINT16 Free = HFS_BE16(Data + NodeSize - 2 * (Count + 1));
+
+    return Free + Size + 2 * (Count + 2) <= NodeSize;
+}
+
+// Lay out a B-tree file holding the records: header node, leaves, then the
+// index levels bottom up. Nodes are packed full in key order.
+STATIC
+EFI_STATUS
+MockBuildTree(
+    MOCK_RECORD_LIST *List,
+    UINT32 NodeSize,
+    UINT32 BlockSize,
+    UINT16 MaxKeyLength,
+    UINT32 Attributes,
+    UINT8 KeyCompareType,
+    BASE_SORT_COMPARE Compare,
+    UINT8 **TreeImage,
+    UINT64 *TreeSize
+) {
+    MOCK_TREE Tree = { NULL, NodeSize, 0, 1 };  // Node 0 is the header node
+    MOCK_RECORD Scratch;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (List->Count > 1) {
+        QuickSort(List->Records, List->Count, sizeof(MOCK_RECORD), Compare, &Scratch);
+    }
+
+    MOCK_INDEX_ENTRY *Level = AllocatePool(MAX(List->Count, 1) * sizeof(MOCK_INDEX_ENTRY));
+    if (Level == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    UINTN LevelCount = 0;
+    UINT32 FirstLeaf = 0;
+    UINT32 LastLeaf = 0;
+    UINT16 Depth = 0;
+
+    // Leaves, chained left to right
+    for (UINTN Index = 0; Index < List->Count && !EFI_ERROR(Status); Index++) {
+        MOCK_RECORD *Record = &List->Records[Index];
+
+        if (LastLeaf == 0 || !MockNodeFits(MOCK_TREE_NODE(&Tree, LastLeaf), NodeSize, Record->Size)) {
+            Status = MockNewNode(&Tree, BT_LEAF_NODE, 1, LastLeaf, &LastLeaf);
+            if (EFI_ERROR(Status)) {
+                break;
+            }
+            if (FirstLeaf == 0) {
+                FirstLeaf = LastLeaf;
+            }
+
+            Level[LevelCount].Key = Record->Bytes;
+            Level[LevelCount].KeySize = Record->KeySize;
+            Level[LevelCount].Node = LastLeaf;
+            LevelCount++;
+        }
+        MockNodeAppend(MOCK_TREE_NODE(&Tree, LastLeaf), NodeSize, Record->Bytes, Record->Size);
+    }
+    if (List->Count != 0) {
+        Depth = 1;
+    }
+
+    // Index levels until one node remains; that node is the root
+    UINT8 IndexRecord[2 + MOCK_CATALOG_MAX_KEY_LENGTH + 4];
+    while (LevelCount > 1 && !EFI_ERROR(Status)) {
+        UINTN Written = 0;
+        UINT32 Node = 0;
+
+        Depth++;
+        for (UINTN Index = 0; Index < LevelCount; Index++) {
+            UINTN KeySize = Level[Index].KeySize;
+
+            ZeroMem(IndexRecord, sizeof(IndexRecord));
+            CopyMem(IndexRecord, Level[Index].Key, KeySize);
+            if ((Attributes & BT_VARIABLE_INDEX_KEYS_MASK) == 0) {
+                KeySize = 2 + MaxKeyLength;
+                MOCK_PUT16(IndexRecord, MaxKeyLength);
+            }
+            MOCK_PUT32(IndexRecord + KeySize, Level[Index].Node);
+
+            if (Node == 0 || !MockNodeFits(MOCK_TREE_NODE(&Tree, Node), NodeSize, KeySize + 4)) {
+                Status = MockNewNode(&Tree, BT_INDEX_NODE, (UINT8)Depth, Node, &Node);
+                if (EFI_ERROR(Status)) {
+                    break;
+                }
+
+                // Entries are consumed before they are overwritten
+                Level[Written].Key = Level[Index].Key;
+                Level[Written].KeySize = Level[Index].KeySize;
+                Level[Written].Node = Node;
+                Written++;
+            }
+            MockNodeAppend(MOCK_TREE_NODE(&Tree, Node), NodeSize, IndexRecord, KeySize + 4);
+        }
+        LevelCount = Written;
+    }
+
+    // Spare nodes for later inserts, rounded up to whole allocation blocks
+    UINT32 UsedNodes = Tree.Count;
+    UINT32 NodesPerBlock = MAX(BlockSize / NodeSize, 1);
+    UINT32 TotalNodes = (UsedNodes + 8 + NodesPerBlock - 1) / NodesPerBlock * NodesPerBlock;
+    UINT32 MapNodes = (NodeSize - sizeof(BTNodeDescriptor) - MOCK_BTREE_HEADER_SIZE - MOCK_BTREE_USER_DATA_SIZE - 8) * 8;
+    if (!EFI_ERROR(Status) && TotalNodes > MapNodes) {
+        Status = EFI_UNSUPPORTED;  // Would need map nodes
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockGrowTree(&Tree, TotalNodes);
+    }
+    if (EFI_ERROR(Status)) {
+        FreePool(Level);
+        if (Tree.Data != NULL) {
+            FreePool(Tree.Data);
+        }
+        return Status;
+    }
+
+    // Header node: header record, user data record and the node map
+    UINT8 *Header = MOCK_TREE_NODE(&Tree, 0);
+    Header[8] = BT_HEADER_NODE;
+    MOCK_PUT16(Header + NodeSize - 2, sizeof(BTNodeDescriptor));
+
+    UINT8 Record[MOCK_BTREE_HEADER_SIZE];
+    ZeroMem(Record, sizeof(Record));
+    BTHeaderRec *HeaderRecord = (BTHeaderRec *)Record;
+    MOCK_PUT16(&HeaderRecord->treeDepth, Depth);
+    MOCK_PUT32(&HeaderRecord->rootNode, (LevelCount != 0) ? Level[0].Node : 0);
+    MOCK_PUT32(&HeaderRecord->leafRecords, List->Count);
+    MOCK_PUT32(&HeaderRecord->firstLeafNode, FirstLeaf);
+    MOCK_PUT32(&HeaderRecord->lastLeafNode, LastLeaf);
+    MOCK_PUT16(&HeaderRecord->nodeSize, NodeSize);
+    MOCK_PUT16(&HeaderRecord->maxKeyLength, MaxKeyLength);
+    MOCK_PUT32(&HeaderRecord->totalNodes, TotalNodes);
+    MOCK_PUT32(&HeaderRecord->freeNodes, TotalNodes - UsedNodes);
+    MOCK_PUT32(&HeaderRecord->clumpSize, BlockSize);
+    HeaderRecord->keyCompareType = KeyCompareType;
+    MOCK_PUT32(&HeaderRecord->attributes, Attributes);
+    MockNodeAppend(Header, NodeSize, Record, sizeof(Record));
+
+    UINT8 UserData[MOCK_BTREE_USER_DATA_SIZE];
+    ZeroMem(UserData, sizeof(UserData));
+    MockNodeAppend(Header, NodeSize, UserData, sizeof(UserData));
+
+    UINT16 MapOffset = HFS_BE16(Header + NodeSize - 6);
+    for (UINT32 Number = 0; Number < UsedNodes; Number++) {
+        Header[MapOffset + Number / 8] |= (UINT8)(0x80 >> (Number % 8));
+    }
+    MOCK_PUT16(Header + 10, 3);
+    MOCK_PUT16(Header + NodeSize - 8, NodeSize - 8);
+
+    FreePool(Level);
+    *TreeImage = Tree.Data;
+    *TreeSize = (UINT64)TotalNodes * NodeSize;
+    return EFI_SUCCESS;
+}
+
+// Allocate space for a B-tree image and write it out as one extent
+STATIC
+EFI_STATUS
+MockPlaceTree(
+    MOCK_BUILDER *Builder,
+    UINT8 *Tree,
+    UINT64 TreeSize,
+    HFSPlusForkData *Fork
+) {
+    UINT32 BlockCount = (UINT32)((TreeSize + Builder->BlockSize - 1) / Builder->BlockSize);
+
+    ZeroMem(Fork, sizeof(HFSPlusForkData));
+    EFI_STATUS Status = MockAllocateRun(Builder, BlockCount, &Fork->extents[0]);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Fork->logicalSize = TreeSize;
+    Fork->clumpSize = Builder->BlockSize;
+    Fork->totalBlocks = BlockCount;
+    return MockWriteBytes(Builder->Disk, (UINT64)Fork->extents[0].startBlock * Builder->BlockSize, Tree, (UINTN)TreeSize);
+}
+
+// Build the trees and write them to the disk. The catalog goes first, as it
+// may add to the extents tree. The attributes tree is only written when some
+// file has attributes.
+STATIC
+EFI_STATUS
+MockWriteTrees(
+    MOCK_BUILDER *Builder,
+    UINT32 NodeSize,
+    MOCK_HFS_IMAGE *Image
+) {
+    UINT8 *Tree;
+    UINT64 TreeSize;
+
+    EFI_STATUS Status = MockBuildTree(
+        &Builder->Catalog,
+        NodeSize,
+        Builder->BlockSize,
+        MOCK_CATALOG_MAX_KEY_LENGTH,
+        BT_BIG_KEYS_MASK | BT_VARIABLE_INDEX_KEYS_MASK,
+        Builder->BinaryKeys ? HFSPLUS_KEY_BINARY_COMPARE : HFSPLUS_KEY_CASE_FOLDING,
+        Builder->BinaryKeys ? MockCompareBinaryCatalogRecords : MockCompareCatalogRecords,
+        &Tree,
+        &TreeSize
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    // A scattered catalog takes one extent per block, so its overflow
+    // records must be in place before the extents tree is built
+    if (Builder->ScatteredCatalog) {
+        Status = MockAllocateFork(Builder, HFSPLUS_CATALOG_FILE_ID, HFSPLUS_DATA_FORK, Tree, TreeSize, TRUE, &Image->CatalogFile);
+        Image->CatalogFile.clumpSize = Builder->BlockSize;
+    } else {
+        Status = MockPlaceTree(Builder, Tree, TreeSize, &Image->CatalogFile);
+    }
+    FreePool(Tree);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = MockBuildTree(
+        &Builder->Extents,
+        NodeSize,
+        Builder->BlockSize,
+        MOCK_EXTENTS_MAX_KEY_LENGTH,
+        BT_BIG_KEYS_MASK,
+        0,
+        MockCompareExtentRecords,
+        &Tree,
+        &TreeSize
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    Status = MockPlaceTree(Builder, Tree, TreeSize, &Image->ExtentsFile);
+    FreePool(Tree);
+    if (EFI_ERROR(Status) || Builder->Attributes.Count == 0) {
+        return Status;
+    }
+
+    Status = MockBuildTree(
+        &Builder->Attributes,
+        NodeSize,
+        Builder->BlockSize,
+        MOCK_ATTRIBUTES_MAX_KEY_LENGTH,
+        BT_BIG_KEYS_MASK | BT_VARIABLE_INDEX_KEYS_MASK,
+        0,
+        MockCompareAttributeRecords,
+        &Tree,
+        &TreeSize
+    );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    Status = MockPlaceTree(Builder, Tree, TreeSize, &Image->AttributesFile);
+    FreePool(Tree);
+    return Status;
+}
+
+// Mark every other run of RunBlocks free blocks as allocated, leaving free
+// space in fixed-size holes. The filler blocks belong to no file.
+STATIC
+VOID
+MockFragmentFreeSpace(
+    MOCK_BUILDER *Builder,
+    UINT32 RunBlocks
+) {
+    UINT32 InRun = 0;
+    BOOLEAN Fill = FALSE;
+
+    for (UINT32 Block = 0; Block < Builder->TotalBlocks; Block++) {
+        if (Builder->Used[Block]) {
+            continue;
+        }
+        if (Fill) {
+            Builder->Used[Block] = 1;
+        }
+        if (++InRun == RunBlocks) {
+            InRun = 0;
+            Fill = !Fill;
+        }
+    }
+}
+
+// Format the disk as an HFS wrapper around an HFS+ volume. The wrapper's
+// master directory block goes at byte 1024 and the HFS+ volume, built on a
+// RAM disk of its own, is copied in as the wrapper's embedded extent, which
+// starts at wrapper allocation block 1.
+STATIC
+EFI_STATUS
+MockBuildWrappedImage(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE_OPTIONS *Options,
+    MOCK_HFS_IMAGE *Image
+) {
+    UINT32 DeviceBlockSize = Disk->BlockIo.Media->BlockSize;
+    UINT64 DiskBytes = (Disk->BlockIo.Media->LastBlock + 1) * DeviceBlockSize;
+    UINT32 WrapperStart = MAX(4096, DeviceBlockSize);  // Boot blocks and the master directory block
+    UINT32 WrapperBlockSize = WrapperStart;
+    MOCK_HFS_IMAGE_OPTIONS EmbeddedOptions = *Options;
+
+    // The journal helpers address the disk by volume offset
+    if (Options->JournalSize != 0 || DiskBytes < 4 * (UINT64)WrapperStart) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    // HFS counts allocation blocks in 16 bits
+    while ((DiskBytes - WrapperStart) / WrapperBlockSize > MAX_UINT16) {
+        WrapperBlockSize *= 2;
+    }
+    UINT16 EmbedBlocks = (UINT16)((DiskBytes - WrapperStart) / WrapperBlockSize - 1);
+    UINT64 VolumeOffset = WrapperStart + WrapperBlockSize;
+    UINT64 VolumeBytes = (UINT64)EmbedBlocks * WrapperBlockSize;
+
+    MockBlockIoProtocol *Embedded = InitializeMockDisk(VolumeBytes / DeviceBlockSize, DeviceBlockSize);
+    if (Embedded == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EmbeddedOptions.VolumeKind = MOCK_VOLUME_HFSPLUS;
+    EFI_STATUS Status = BuildMockHfsImage(Embedded, &EmbeddedOptions, Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MockWriteBytes(Disk, VolumeOffset, Embedded->DiskData, (UINTN)VolumeBytes);
+    }
+    FreeMockDisk(Embedded);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    UINT8 Raw[HFSPLUS_VOLUME_HEADER_SIZE];
+    ZeroMem(Raw, sizeof(Raw));
+    HFSMasterDirectoryBlock *Mdb = (HFSMasterDirectoryBlock *)Raw;
+    MOCK_PUT16(&Mdb->drSigWord, HFS_SIGNATURE);
+    MOCK_PUT16(&Mdb->drNmAlBlks, EmbedBlocks + 1);
+    MOCK_PUT32(&Mdb->drAlBlkSiz, WrapperBlockSize);
+    MOCK_PUT16(&Mdb->drAlBlSt, WrapperStart / 512);
+    MOCK_PUT16(&Mdb->drEmbedSigWord, HFSPLUS_SIGNATURE);
+    MOCK_PUT16(&Mdb->drEmbedExtent.startBlock, 1);
+    MOCK_PUT16(&Mdb->drEmbedExtent.blockCount, EmbedBlocks);
+
+    Image->VolumeOffset = VolumeOffset;
+    return MockWriteBytes(Disk, HFSPLUS_VOLUME_HEADER_OFFSET, Raw, sizeof(Raw));
+}
+
+// Format the disk as an HFS+ volume populated as described by Options
+EFI_STATUS BuildMockHfsImage(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE_OPTIONS *Options,
+    MOCK_HFS_IMAGE *Image
+) {
+    UINT32 DeviceBlockSize = Disk->BlockIo.Media->BlockSize;
+    UINT64 DiskBytes = (Disk->BlockIo.Media->LastBlock + 1) * DeviceBlockSize;
+    MOCK_BUILDER Builder;
+    EFI_STATUS Status;
+
+    if (Options->VolumeKind == MOCK_VOLUME_WRAPPED) {
+        return MockBuildWrappedImage(Disk, Options, Image);
+    }
+
+    if (Options->BlockSize < DeviceBlockSize || Options->BlockSize % DeviceBlockSize != 0 ||
+        Options->NodeSize < BT_MIN_NODE_SIZE || Options->NodeSize > BT_MAX_NODE_SIZE ||
+        DiskBytes / Options->BlockSize > MAX_UINT32) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    ZeroMem(&Builder, sizeof(Builder));
+    ZeroMem(Image, sizeof(MOCK_HFS_IMAGE));
+    Builder.Disk = Disk;
+    Builder.BlockSize = Options->BlockSize;
+    Builder.TotalBlocks = (UINT32)(DiskBytes / Options->BlockSize);
+    Builder.NextCatalogID = HFSPLUS_FIRST_USER_ID;
+    Builder.Compression = Options->Compression;
+    Builder.BinaryKeys = (Options->VolumeKind == MOCK_VOLUME_HFSX);
+    Builder.ScatteredCatalog = Options->ScatteredCatalog;
+    Builder.MaxInlineAttribute = MIN(MOCK_DECMPFS_MAX_INLINE, Options->NodeSize / 2);  // Leaves room in the leaf
+    Builder.Used = AllocateZeroPool(Builder.TotalBlocks);
+    Builder.BlockBuffer = AllocatePool(Builder.BlockSize);
+    if (Builder.Used == NULL || Builder.BlockBuffer == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    // The boot blocks and volume header at the start, the alternate header at the end
+    UINT32 Reserved = (HFSPLUS_VOLUME_HEADER_OFFSET + HFSPLUS_VOLUME_HEADER_SIZE + Builder.BlockSize - 1) / Builder.BlockSize;
+    SetMem(Builder.Used, MIN(Reserved, Builder.TotalBlocks), 1);
+    Builder.Used[Builder.TotalBlocks - 1] = 1;
+    if (Builder.BlockSize < 2 * HFSPLUS_VOLUME_HEADER_SIZE && Builder.TotalBlocks > 1) {
+        Builder.Used[Builder.TotalBlocks - 2] = 1;
+    }
+
+    // Allocation file sized for the whole volume
+    UINT32 BitmapBlocks = (Builder.TotalBlocks / 8 + Builder.BlockSize) / Builder.BlockSize;
+    Builder.BitmapRuns = AllocateZeroPool(BitmapBlocks * sizeof(HFSPlusExtentDescriptor));
+    if (Builder.BitmapRuns == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+    if (Options->ScatteredAllocationFile) {
+        Status = MockAllocateScattered(&Builder, BitmapBlocks, Builder.BitmapRuns);
+        Builder.BitmapRunCount = BitmapBlocks;
+    } else {
+        Status = MockAllocateRun(&Builder, BitmapBlocks, Builder.BitmapRuns);
+        Builder.BitmapRunCount = 1;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddOverflowExtents(&Builder, HFSPLUS_ALLOCATION_FILE_ID, HFSPLUS_DATA_FORK, Builder.BitmapRuns, Builder.BitmapRunCount);
+    }
+    if (EFI_ERROR(Status)) {
+        goto Done;
+    }
+    for (UINT32 Index = 0; Index < 8 && Index < Builder.BitmapRunCount; Index++) {
+        Image->AllocationFile.extents[Index] = Builder.BitmapRuns[Index];
+    }
+    Image->AllocationFile.logicalSize = (UINT64)BitmapBlocks * Builder.BlockSize;
+    Image->AllocationFile.clumpSize = Builder.BlockSize;
+    Image->AllocationFile.totalBlocks = BitmapBlocks;
+
+    // Journal info block and journal
+    if (Options->JournalSize != 0) {
+        HFSPlusExtentDescriptor Run;
+        UINT32 JournalBlocks = (Options->JournalSize + Builder.BlockSize - 1) / Builder.BlockSize;
+
+        Status = MockAllocateRun(&Builder, 1, &Run);
+        Image->JournalInfoBlock = Run.startBlock;
+        if (!EFI_ERROR(Status)) {
+            Status = MockAllocateRun(&Builder, JournalBlocks, &Run);
+        }
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+        Image->JournalOffset = (UINT64)Run.startBlock * Builder.BlockSize;
+        Image->JournalSize = (UINT64)JournalBlocks * Builder.BlockSize;
+        Image->JournalSwapped = Options->JournalSwapped;
+    }
+
+    UINT32 SystemID = Builder.NextCatalogID++;
+    UINT32 LibraryID = Builder.NextCatalogID++;
+    UINT32 CoreServicesID = Builder.NextCatalogID++;
+    Image->FilesFolderID = Builder.NextCatalogID++;
+
+    Status = MockAddFolder(&Builder, HFSPLUS_ROOT_PARENT_ID, L"MockHFS", HFSPLUS_ROOT_FOLDER_ID,
+                           2 + (Options->FragmentedSize != 0) + (Options->HardLinks ? 3 : 0));
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddFolder(&Builder, HFSPLUS_ROOT_FOLDER_ID, L"System", SystemID, 1);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddFolder(&Builder, SystemID, L"Library", LibraryID, 1);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddFolder(&Builder, LibraryID, L"CoreServices", CoreServicesID, Options->BootEfiSize != 0);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockAddFolder(&Builder, HFSPLUS_ROOT_FOLDER_ID, L"Files", Image->FilesFolderID, Options->FileCount);
+    }
+
+    if (!EFI_ERROR(Status) && Options->BootEfiSize != 0) {
+        Image->BootEfiFileID = Builder.NextCatalogID++;
+        Status = MockAddFile(&Builder, CoreServicesID, L"boot.efi", Image->BootEfiFileID, Options->BootEfiSize, FALSE, Options->Compression != MOCK_COMPRESSION_NONE);
+    }
+
+    Image->FirstFileID = Builder.NextCatalogID;
+    for (UINT32 Index = 0; Index < Options->FileCount && !EFI_ERROR(Status); Index++) {
+        CHAR16 Name[MOCK_HFS_FILE_NAME_LENGTH + 1];
+
+        MockHfsFileName(Index, Name);
+        Status = MockAddFile(&Builder, Image->FilesFolderID, Name, Builder.NextCatalogID++, Options->FileSize, FALSE, Options->Compression != MOCK_COMPRESSION_NONE);
+    }
+
+    if (!EFI_ERROR(Status) && Options->FragmentedSize != 0) {
+        Image->FragmentedFileID = Builder.NextCatalogID++;
+        Status = MockAddFile(&Builder, HFSPLUS_ROOT_FOLDER_ID, L"Fragmented.bin", Image->FragmentedFileID, Options->FragmentedSize, TRUE, FALSE);
+    }
+
+    // \Links\Linked.bin links to the inode file iNode<n> and \Links\LinkedDir
+    // to the folder dir_<n>, which holds Inside.bin. Inode numbers are the
+    // inodes' own IDs.
+    if (!EFI_ERROR(Status) && Options->HardLinks) {
+        UINT32 FilePrivateID = Builder.NextCatalogID++;
+        UINT32 FolderPrivateID = Builder.NextCatalogID++;
+        CHAR16 Name[HFSPLUS_MAX_NAME_LENGTH + 1];
+
+        Image->LinksFolderID = Builder.NextCatalogID++;
+        Image->LinkedFileID = Builder.NextCatalogID++;
+        Image->LinkedFolderID = Builder.NextCatalogID++;
+        Image->LinkedFolderFileID = Builder.NextCatalogID++;
+        Image->FileLinkID = Builder.NextCatalogID++;
+        Image->FolderLinkID = Builder.NextCatalogID++;
+
+        Status = MockAddNamedFolder(&Builder, HFSPLUS_ROOT_FOLDER_ID, HFSPLUS_PRIVATE_DATA_NAME,
+                                    HFSPLUS_PRIVATE_DATA_NAME_LENGTH, FilePrivateID, 1);
+        if (!EFI_ERROR(Status)) {
+            Status = MockAddFolder(&Builder, HFSPLUS_ROOT_FOLDER_ID, HFSPLUS_PRIVATE_DIR_NAME, FolderPrivateID, 1);
+        }
+        if (!EFI_ERROR(Status)) {
+            Status = MockAddFolder(&Builder, HFSPLUS_ROOT_FOLDER_ID, L"Links", Image->LinksFolderID, 2);
+        }
+        if (!EFI_ERROR(Status)) {
+            HfsInodeName(L"iNode", Image->LinkedFileID, Name);
+            Status = MockAddFile(&Builder, FilePrivateID, Name, Image->LinkedFileID, Options->FileSize, FALSE, FALSE);
+        }
+        if (!EFI_ERROR(Status)) {
+            HfsInodeName(L"dir_", Image->LinkedFolderID, Name);
+            Status = MockAddFolder(&Builder, FolderPrivateID, Name, Image->LinkedFolderID, 1);
+        }
+        if (!EFI_ERROR(Status)) {
+            Status = MockAddFile(&Builder, Image->LinkedFolderID, L"Inside.bin", Image->LinkedFolderFileID, Options->FileSize, FALSE, FALSE);
+        }
+        if (!EFI_ERROR(Status)) {
+            Status = MockAddLink(&Builder, Image->LinksFolderID, L"Linked.bin", Image->FileLinkID, FALSE, Image->LinkedFileID);
+        }
+        if (!EFI_ERROR(Status)) {
+            Status = MockAddLink(&Builder, Image->LinksFolderID, L"LinkedDir", Image->FolderLinkID, TRUE, Image->LinkedFolderID);
+        }
+    }
+
+    if (!EFI_ERROR(Status)) {
+        Status = MockWriteTrees(&Builder, Options->NodeSize, Image);
+    }
+    if (EFI_ERROR(Status)) {
+        goto Done;
+    }
+
+    if (Options->FreeSpaceRunBlocks != 0) {
+        MockFragmentFreeSpace(&Builder, Options->FreeSpaceRunBlocks);
+    }
+
+    // Allocation bitmap, most significant bit first; bits past the end of
+    // the volume are set
+    UINT64 BitmapBytes = Image->AllocationFile.logicalSize;
+    UINT8 *Bitmap = AllocateZeroPool((UINTN)BitmapBytes);
+    if (Bitmap == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+    for (UINT64 Block = 0; Block < BitmapBytes * 8; Block++) {
+        if (Block >= Builder.TotalBlocks || Builder.Used[Block]) {
+            Bitmap[Block / 8] |= (UINT8)(0x80 >> (Block % 8));
+        } else {
+            Image->FreeBlocks++;
+        }
+    }
+    UINT64 Written = 0;
+    for (UINT32 Index = 0; Index < Builder.BitmapRunCount && !EFI_ERROR(Status); Index++) {
+        UINT64 RunBytes = (UINT64)Builder.BitmapRuns[Index].blockCount * Builder.BlockSize;
+        Status = MockWriteBytes(Disk, (UINT64)Builder.BitmapRuns[Index].startBlock * Builder.BlockSize, Bitmap + Written, (UINTN)RunBytes);
+        Written += RunBytes;
+    }
+    FreePool(Bitmap);
+    if (EFI_ERROR(Status)) {
+        goto Done;
+    }
+
+    if (Options->JournalSize != 0) {
+        Status = MockWriteEmptyJournal(&Builder, Image);
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+    }
+
+    // Volume header, written at the start and as the alternate near the end
+    UINT8 Raw[HFSPLUS_VOLUME_HEADER_SIZE];
+    ZeroMem(Raw, sizeof(Raw));
+    HFSPlusVolumeHeader *Header = (HFSPlusVolumeHeader *)Raw;
+    MOCK_PUT16(&Header->signature, Builder.BinaryKeys ? HFSX_SIGNATURE : HFSPLUS_SIGNATURE);
+    MOCK_PUT16(&Header->version, Builder.BinaryKeys ? 5 : 4);
+    MOCK_PUT32(&Header->attributes, 0x00000100 | (Options->JournalSize != 0 ? HFSPLUS_VOL_JOURNALED : 0));  // Cleanly unmounted
+    MOCK_PUT32(&Header->journalInfoBlock, Image->JournalInfoBlock);
+    MOCK_PUT32(&Header->lastMountedVersion, 0x31302E30);  // '10.0'
+    MOCK_PUT32(&Header->fileCount, Options->FileCount + (Options->BootEfiSize != 0) + (Options->FragmentedSize != 0));
+    MOCK_PUT32(&Header->folderCount, 4);
+    MOCK_PUT32(&Header->blockSize, Builder.BlockSize);
+    MOCK_PUT32(&Header->totalBlocks, Builder.TotalBlocks);
+    MOCK_PUT32(&Header->freeBlocks, Image->FreeBlocks);
+    MOCK_PUT32(&Header->rsrcClumpSize, Builder.BlockSize);
+    MOCK_PUT32(&Header->dataClumpSize, Builder.BlockSize);
+    MOCK_PUT32(&Header->nextCatalogID, Builder.NextCatalogID);
+    MockForkToDisk(&Image->AllocationFile, (UINT8 *)&Header->allocationFile);
+    MockForkToDisk(&Image->ExtentsFile, (UINT8 *)&Header->extentsFile);
+    MockForkToDisk(&Image->CatalogFile, (UINT8 *)&Header->catalogFile);
+    MockForkToDisk(&Image->AttributesFile, (UINT8 *)&Header->attributesFile);
+
+    Status = MockWriteBytes(Disk, HFSPLUS_VOLUME_HEADER_OFFSET, Raw, sizeof(Raw));
+    if (!EFI_ERROR(Status)) {
+        Status = MockWriteBytes(Disk, (UINT64)Builder.TotalBlocks * Builder.BlockSize - 2 * HFSPLUS_VOLUME_HEADER_SIZE, Raw, sizeof(Raw));
+    }
+    Image->TotalBlocks = Builder.TotalBlocks;
+
+Done:
+    MockFreeRecords(&Builder.Catalog);
+    MockFreeRecords(&Builder.Extents);
+    MockFreeRecords(&Builder.Attributes);
+    if (Builder.Used != NULL) {
+        FreePool(Builder.Used);
+    }
+    if (Builder.BlockBuffer != NULL) {
+        FreePool(Builder.BlockBuffer);
+    }
+    if (Builder.BitmapRuns != NULL) {
+        FreePool(Builder.BitmapRuns);
+    }
+    return Status;
+}
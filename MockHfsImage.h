@@ -0,0 +1,139 @@
+//
+// Copyright (c) 2007-Present The PureDarwin Project.
+// All rights reserved.
+//
+// @LICENSE_HEADER_START@
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// @LICENSE_HEADER_END@
+//
+//
+// @FILE
+//  MockHfsImage.h
+//  This file is the header for the Mock HFS+ image builder used by tests
+//
+// @AUTHOR
+// Created by Cliff Sekel  for The PureDarwin Project github.com/PureDarwin
+//
+
+#ifndef MOCK_HFS_IMAGE_H
+#define MOCK_HFS_IMAGE_H
+
+#include "HFSPlusFileOps.h"
+#include "MockBlockIo.h"
+
+// Layout of a generated volume:
+//   \System\Library\CoreServices\boot.efi   BootEfiSize bytes
+//   \Files\File00000.bin ...                FileCount files of FileSize bytes
+//   \Fragmented.bin                         FragmentedSize bytes, one block per extent
+//   \Links\Linked.bin                       hard link to a FileSize byte file
+//   \Links\LinkedDir\Inside.bin             directory hard link holding a FileSize byte file
+// With Compression set, boot.efi and the \Files files are HFS+ compressed:
+// in their decmpfs attribute when that stays small, else in the resource fork.
+#define MOCK_COMPRESSION_NONE  0
+#define MOCK_COMPRESSION_ZLIB  1
+#define MOCK_COMPRESSION_LZVN  2
+#define MOCK_COMPRESSION_LZFSE 3
+
+// What kind of volume to format. An HFSX volume keeps its catalog in binary
+// (case-sensitive) order. A wrapped volume is a plain HFS+ volume embedded
+// in an HFS wrapper; it is built in memory first and cannot be journaled.
+#define MOCK_VOLUME_HFSPLUS  0
+#define MOCK_VOLUME_HFSX     1
+#define MOCK_VOLUME_WRAPPED  2
+
+typedef struct {
+    UINT32 BlockSize;           // Allocation block size, a multiple of the device block size
+    UINT32 NodeSize;            // Catalog and extents B-tree node size
+    UINT32 BootEfiSize;         // 0 leaves out boot.efi
+    UINT32 FileCount;
+    UINT32 FileSize;
+    UINT32 FragmentedSize;      // 0 leaves out Fragmented.bin
+    UINT32 FreeSpaceRunBlocks;  // Non-zero splits free space into runs this long
+    UINT32 JournalSize;         // Non-zero makes the volume journaled with an empty journal
+    BOOLEAN JournalSwapped;     // Write the journal in the other byte order
+    UINT8 Compression;          // MOCK_COMPRESSION_*
+    BOOLEAN HardLinks;          // Add \Links and the private folders behind it
+    UINT8 VolumeKind;           // MOCK_VOLUME_*
+    BOOLEAN ScatteredCatalog;   // One catalog extent per block, past the eighth in the overflow tree
+    BOOLEAN ScatteredAllocationFile;  // The same for the allocation file
+} MOCK_HFS_IMAGE_OPTIONS;
+
+// What the builder produced, for tests to check against
+typedef struct {
+    UINT64 VolumeOffset;        // Bytes from the start of the disk to the HFS+ volume
+    UINT32 TotalBlocks;
+    UINT32 FreeBlocks;
+    UINT32 BootEfiFileID;
+    UINT32 FilesFolderID;
+    UINT32 FirstFileID;
+    UINT32 FragmentedFileID;
+    UINT32 LinksFolderID;
+    UINT32 FileLinkID;          // Link record of \Links\Linked.bin
+    UINT32 FolderLinkID;        // Link record of \Links\LinkedDir
+    UINT32 LinkedFileID;        // Inode file behind Linked.bin
+    UINT32 LinkedFolderID;      // Inode folder behind LinkedDir
+    UINT32 LinkedFolderFileID;  // Inside.bin
+    HFSPlusForkData AllocationFile;
+    HFSPlusForkData ExtentsFile;
+    HFSPlusForkData CatalogFile;
+    HFSPlusForkData AttributesFile;  // Empty unless files are compressed
+    UINT32 JournalInfoBlock;
+    UINT64 JournalOffset;       // Bytes from the start of the volume
+    UINT64 JournalSize;
+    BOOLEAN JournalSwapped;
+} MOCK_HFS_IMAGE;
+
+// One block of a journal transaction written by MockJournalTransaction
+typedef struct {
+    UINT64 Lba;        // Device block; MAX_UINT64 logs a superseded block
+    UINT32 Size;       // Whole device blocks
+    CONST VOID *Data;
+} MOCK_JOURNAL_BLOCK;
+
+EFI_STATUS BuildMockHfsImage(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE_OPTIONS *Options,
+    MOCK_HFS_IMAGE *Image
+);
+
+EFI_STATUS MockJournalTransaction(
+    MockBlockIoProtocol *Disk,
+    CONST MOCK_HFS_IMAGE *Image,
+    CONST MOCK_JOURNAL_BLOCK *Blocks,
+    UINTN BlockCount
+);
+
+UINT8 MockHfsFileByte(
+    UINT32 FileID,
+    UINT64 Offset
+);
+
+VOID MockHfsFileName(
+    UINT32 Index,
+    CHAR16 *Name
+);
+
+#define MOCK_HFS_FILE_NAME_LENGTH  13  // L"File00000.bin"
+
+#endif  // MOCK_HFS_IMAGE_H
@@ -38,43 +38,55 @@
 
 #include "HFSPlusFileOps.h"
 #include "MockBlockIo.h"
+#include "MockHfsImage.h"
+#include "MockCompress.h"
 
-EFI_STATUS TestWriteLargeFile(MockBlockIoProtocol *BlockIo) {
-    UINTN BlockSize = BlockIo->BlockSize;
-    UINT64 DataSize = BlockSize * 15;  // File spanning 15 blocks
+#define TEST_DISK_BLOCKS       4096
+#define TEST_BLOCK_SIZE        512
+#define TEST_LARGE_FILE_ID     0x1000
+#define TEST_LARGE_FILE_BLOCKS 15
+
+// Check a buffer against the generated content of a file
+BOOLEAN CheckFileContent(UINT32 FileID, CONST UINT8 *Data, UINT64 Size) {
+    for (UINT64 i = 0; i < Size; i++) {
+        if (Data[i] != MockHfsFileByte(FileID, i)) {
+            DEBUG((DEBUG_ERROR, "File %u differs at byte %lu\n", FileID, i));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+EFI_STATUS TestWriteLargeFile(HFSPLUS_VOLUME *Volume, HFSPlusForkData *FileForkData) {
+    UINTN BlockSize = Volume->AllocationBlockSize;
+    UINT64 DataSize = BlockSize * TEST_LARGE_FILE_BLOCKS - 100;  // File spanning 15 blocks
 
     UINT8 *TestData = AllocateZeroPool(DataSize);
     for (UINT64 i = 0; i < DataSize; i++) {
-        TestData[i] = (UINT8)(i % 256);  // Fill pattern
+        TestData[i] = MockHfsFileByte(TEST_LARGE_FILE_ID, i);  // Fill pattern
     }
 
-    HFSPlusForkData FileForkData = {0};
-    HFSPlusForkData ExtentOverflowFile = {0};
+    // Free space is split into short runs, so the file lands in several extents
+    EFI_STATUS Status = WriteFileWithFragmentation(Volume, FileForkData, TestData, DataSize);
 
-    EFI_STATUS Status = WriteFileWithFragmentation(
-        NULL, (EFI_BLOCK_IO_PROTOCOL *)BlockIo, &FileForkData, BlockIo->LastBlock,
-        TestData, DataSize, &FileForkData, &ExtentOverflowFile
-    );
+    if (!EFI_ERROR(Status) && FileForkData->extents[1].blockCount == 0) {
+        DEBUG((DEBUG_ERROR, "Large file was not fragmented.\n"));
+        Status = EFI_ABORTED;
+    }
 
     FreePool(TestData);
     return Status;
 }
 
-EFI_STATUS TestReadLargeFile(MockBlockIoProtocol *BlockIo, HFSPlusForkData *FileForkData, HFSPlusForkData *ExtentOverflowFile) {
-    UINT64 FileSize = 15 * BlockIo->BlockSize;
+EFI_STATUS TestReadLargeFile(HFSPLUS_VOLUME *Volume, HFSPlusForkData *FileForkData) {
     VOID *ReadData = NULL;
 
-    EFI_STATUS Status = ReadFileWithFragmentation(
-        NULL, (EFI_BLOCK_IO_PROTOCOL *)BlockIo, FileForkData, BlockIo->LastBlock,
-        &ReadData, ExtentOverflowFile
-    );
-
-    UINT8 *TestData = AllocateZeroPool(FileSize);
-    for (UINT64 i = 0; i < FileSize; i++) {
-        TestData[i] = (UINT8)(i % 256);
+    EFI_STATUS Status = ReadFileWithFragmentation(Volume, FileForkData, TEST_LARGE_FILE_ID, HFSPLUS_DATA_FORK, &ReadData);
+    if (EFI_ERROR(Status)) {
+        return Status;
     }
 
-    if (CompareMem(ReadData, TestData, FileSize) == 0) {
+    if (CheckFileContent(TEST_LARGE_FILE_ID, ReadData, FileForkData->logicalSize)) {
         DEBUG((DEBUG_INFO, "File read matches written data.\n"));
         Status = EFI_SUCCESS;
     } else {
@@ -82,29 +94,233 @@ EFI_STATUS TestReadLargeFile(MockBlockIoProtocol *BlockIo, HFSPlusForkData *File
         Status = EFI_ABORTED;
     }
 
-    FreePool(TestData);
     FreePool(ReadData);
     return Status;
 }
 
-EFI_STATUS TestLoadBootEfi(MockBlockIoProtocol *BlockIo) {
-    HFSPlusForkData CatalogFile = {0};       // Simulated catalog B-tree file
-    HFSPlusForkData ExtentOverflowFile = {0};  // Simulated overflow file
+// Read a file whose extents continue in the extents overflow tree
+EFI_STATUS TestReadFragmentedFile(HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image) {
+    HFSPlusCatalogFile *Record = NULL;
+    HFSPlusForkData DataFork;
+    VOID *ReadData = NULL;
+
+    EFI_STATUS Status = ResolvePath(Volume, L"\\fragmented.BIN", NULL, (VOID **)&Record);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // The record points into the node cache, so copy the fork out first
+    HfsForkDataFromDisk(&Record->dataFork, &DataFork);
+
+    Status = ReadFileWithFragmentation(Volume, &DataFork, Image->FragmentedFileID, HFSPLUS_DATA_FORK, &ReadData);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    if (!CheckFileContent(Image->FragmentedFileID, ReadData, DataFork.logicalSize)) {
+        Status = EFI_ABORTED;
+    }
+
+    FreePool(ReadData);
+    return Status;
+}
+
+// Count the scratch chunks an arena holds, in use or spare
+UINTN CountArenaChunks(HFSPLUS_ARENA *Arena) {
+    UINTN Count = 0;
+
+    for (HFSPLUS_ARENA_CHUNK *Chunk = Arena->Chunks; Chunk != NULL; Chunk = Chunk->Next) {
+        Count++;
+    }
+    for (HFSPLUS_ARENA_CHUNK *Chunk = Arena->Spare; Chunk != NULL; Chunk = Chunk->Next) {
+        Count++;
+    }
+    return Count;
+}
+
+// Slab buffers come back in LIFO order, a reset drops exactly what was
+// allocated after its mark, and reading the fragmented file again reuses
+// the scratch and slab memory of the first read
+EFI_STATUS TestArena(HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image) {
+    HFSPLUS_ARENA *Arena = &Volume->Arena;
+    HFSPLUS_ARENA_MARK Outer;
+    HFSPLUS_ARENA_MARK Inner;
+
+    UINT8 *Block = SlabAcquire(&Arena->Blocks);
+    SlabRelease(&Arena->Blocks, Block);
+    if (Block == NULL || SlabAcquire(&Arena->Blocks) != Block) {
+        return EFI_ABORTED;
+    }
+    SlabRelease(&Arena->Blocks, Block);
+
+    ArenaMark(Arena, &Outer);
+    UINT8 *First = ArenaAlloc(Arena, 100);
+    ArenaMark(Arena, &Inner);
+    UINT8 *Large = ArenaAlloc(Arena, 2 * HFSPLUS_ARENA_CHUNK_SIZE);
+    ArenaReset(Arena, &Inner);
+    UINT8 *Second = ArenaAlloc(Arena, 16);
+    ArenaReset(Arena, &Outer);
+    if (First == NULL || Large == NULL || Second != First + ALIGN_VALUE(100, HFSPLUS_ARENA_ALIGNMENT) ||
+        ((UINTN)First % HFSPLUS_ARENA_ALIGNMENT) != 0 || Arena->Chunks != NULL) {
+        DEBUG((DEBUG_ERROR, "Scratch arena reset did not restore its mark\n"));
+        return EFI_ABORTED;
+    }
+
+    UINTN Chunks = CountArenaChunks(Arena);
+    UINT32 FreeBlocks = Arena->Blocks.FreeCount;
+    EFI_STATUS Status = TestReadFragmentedFile(Volume, Image);
+    if (!EFI_ERROR(Status) &&
+        (Arena->Chunks != NULL || Arena->Blocks.Outstanding != 0 ||
+         CountArenaChunks(Arena) != Chunks || Arena->Blocks.FreeCount != FreeBlocks)) {
+        DEBUG((DEBUG_ERROR, "Second fragmented read did not reuse the arena\n"));
+        Status = EFI_ABORTED;
+    }
+
+    return Status;
+}
+
+// Walk the children of \Files with one catalog search and the leaf chain:
+// the folder's thread record, then every file in name order
+EFI_STATUS TestCatalogRangeScan(HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image, UINT32 FileCount) {
+    HFSPLUS_BTREE *Tree = &Volume->CatalogTree;
+    HFSPLUS_CATALOG_SEARCH Search = { Image->FilesFolderID, L"", 0 };
+    HFSPLUS_BTREE_CURSOR Cursor;
+    UINT8 *Record;
+    UINT16 RecordLength;
+    UINT8 *Data;
+    CHAR16 Name[MOCK_HFS_FILE_NAME_LENGTH + 1];
+
+    EFI_STATUS Status = SearchBTree(Tree, CompareCatalogSearchKey, &Search, &Cursor, NULL, NULL);
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Thread record of the files folder not found: %r\n", Status));
+        return Status;
+    }
+
+    for (UINT32 Index = 0; Index <= FileCount + 1; Index++, Cursor.RecordIndex++) {
+        Status = ReadBTreeCursor(Tree, &Cursor, &Record, &RecordLength);
+        if (Status == EFI_NOT_FOUND && Index == FileCount + 1) {
+            break;  // The folder's children end the catalog
+        }
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        Status = GetBTreeRecordData(Record, RecordLength, &Data, NULL);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+
+        UINT16 RecordType = HFS_BE16(Data);
+        if (Index == 0) {
+            if (RecordType != HFSPLUS_FOLDER_THREAD_RECORD) {
+                return EFI_ABORTED;
+            }
+        } else if (Index <= FileCount) {
+            MockHfsFileName(Index - 1, Name);
+            if (RecordType != HFSPLUS_FILE_RECORD ||
+                CompareCatalogKey(Image->FilesFolderID, Name, MOCK_HFS_FILE_NAME_LENGTH, Record, RecordLength) != 0) {
+                DEBUG((DEBUG_ERROR, "Catalog scan out of order at file %u\n", Index - 1));
+                return EFI_ABORTED;
+            }
+
+            // The same key in a record too short for its name matches nothing
+            HFSPLUS_CATALOG_SEARCH FileSearch = { Image->FilesFolderID, Name, MOCK_HFS_FILE_NAME_LENGTH };
+            UINT16 CutLength = (UINT16)(OFFSET_OF(HFSPlusCatalogKey, nodeName.unicode) + 2 * MOCK_HFS_FILE_NAME_LENGTH - 1);
+            if (Index == 1 &&
+                (CompareCatalogSearchKey(&FileSearch, Record, CutLength) == 0 ||
+                 CompareBinaryCatalogSearchKey(&FileSearch, Record, CutLength) == 0)) {
+                DEBUG((DEBUG_ERROR, "Catalog key running past its record was matched\n"));
+                return EFI_ABORTED;
+            }
+        } else if (HFS_BE32(Record + 2) == Image->FilesFolderID) {
+            return EFI_ABORTED;  // More children than files
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+// List the files folder in small batches, once with a cold cache and no
+// prefetch and once with prefetch, which must read the leaves in fewer
+// device reads
+EFI_STATUS TestDirectoryListing(MockBlockIoProtocol *BlockIo, HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image, UINT32 FileCount, UINT32 FileSize) {
+    HFSPLUS_DIR_ITERATOR Iterator;
+    HFSPLUS_DIR_ENTRY Entries[7];
+    CHAR16 Name[MOCK_HFS_FILE_NAME_LENGTH + 1];
+    UINT64 Reads[2];
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    for (UINTN Pass = 0; Pass < 2 && !EFI_ERROR(Status); Pass++) {
+        UINT32 Listed = 0;
+
+        Status = NodeCacheInit(&Volume->NodeCache, Volume->NodeCache.SlotSize);
+        if (!EFI_ERROR(Status)) {
+            Status = HfsOpenDirectory(Volume, Image->FilesFolderID, Pass == 1, &Iterator);
+        }
+
+        UINT64 ReadCount = BlockIo->ReadCount;
+        while (!EFI_ERROR(Status)) {
+            UINTN Count = ARRAY_SIZE(Entries);
+
+            Status = HfsReadDirectory(&Iterator, Entries, &Count);
+            for (UINTN Index = 0; Index < Count && !EFI_ERROR(Status); Index++, Listed++) {
+                MockHfsFileName(Listed, Name);
+                if (Entries[Index].RecordType != HFSPLUS_FILE_RECORD ||
+                    Entries[Index].NodeID != Image->FirstFileID + Listed ||
+                    Entries[Index].Size != FileSize || Entries[Index].NameLength != MOCK_HFS_FILE_NAME_LENGTH ||
+                    StrCmp(Entries[Index].Name, Name) != 0) {
+                    DEBUG((DEBUG_ERROR, "Directory entry %u is wrong\n", Listed));
+                    Status = EFI_ABORTED;
+                }
+            }
+            if (Count < ARRAY_SIZE(Entries)) {
+                break;
+            }
+        }
+        Reads[Pass] = BlockIo->ReadCount - ReadCount;
+
+        if (!EFI_ERROR(Status) && Listed != FileCount) {
+            DEBUG((DEBUG_ERROR, "Listed %u of %u files\n", Listed, FileCount));
+            Status = EFI_ABORTED;
+        }
+    }
+
+    if (!EFI_ERROR(Status) && Reads[1] >= Reads[0]) {
+        DEBUG((DEBUG_ERROR, "Prefetching listing took %lu reads, %lu without\n", Reads[1], Reads[0]));
+        Status = EFI_ABORTED;
+    }
+
+    // A file has no children
+    if (!EFI_ERROR(Status) && HfsOpenDirectory(Volume, Image->FirstFileID, FALSE, &Iterator) != EFI_NOT_FOUND) {
+        Status = EFI_ABORTED;
+    }
+
+    return Status;
+}
+
+EFI_STATUS TestLoadBootEfi(HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image, UINT32 BootEfiSize) {
     VOID *BootEfiData = NULL;
 
-    EFI_STATUS Status = LoadBootEfi(
-        (EFI_BLOCK_IO_PROTOCOL *)BlockIo,
-        &CatalogFile,
-        &ExtentOverflowFile,
-        &BootEfiData
-    );
+    EFI_STATUS Status = LoadBootEfi(Volume, &BootEfiData);
 
     if (EFI_ERROR(Status)) {
         DEBUG((DEBUG_ERROR, "Failed to load boot.efi: %r\n", Status));
+    } else if (!CheckFileContent(Image->BootEfiFileID, BootEfiData, BootEfiSize)) {
+        Status = EFI_ABORTED;
     } else {
         DEBUG((DEBUG_INFO, "boot.efi loaded successfully.\n"));
     }
 
+#if HFSPLUS_ENABLE_STATS
+    // The load and the reads under it must show up in the volume statistics
+    if (!EFI_ERROR(Status) &&
+        (Volume->Stats.Api[HfsStatsLoadBootEfi].Calls == 0 ||
+         Volume->Stats.Api[HfsStatsReadAt].Calls == 0 || Volume->Stats.BytesRead < BootEfiSize)) {
+        DEBUG((DEBUG_ERROR, "boot.efi load missing from the volume statistics\n"));
+        Status = EFI_ABORTED;
+    }
+#endif
+
     if (BootEfiData != NULL) {
         FreePool(BootEfiData);
     }
@@ -112,32 +328,1850 @@ EFI_STATUS TestLoadBootEfi(MockBlockIoProtocol *BlockIo) {
     return Status;
 }
 
-EFI_STATUS RunTests() {
-    UINT64 TotalBlocks = 100;
-    UINTN BlockSize = 512;
-    MockBlockIoProtocol *MockBlockIo = InitializeMockDisk(TotalBlocks, BlockSize);
+// The volume must hold what the image builder wrote into its header, and a
+// second mount must hand back the same volume and keep it alive when it is
+// unmounted
+EFI_STATUS TestVolumeHeader(MockBlockIoProtocol *BlockIo, HFSPLUS_VOLUME *Volume, MOCK_HFS_IMAGE *Image) {
+    HFSPLUS_VOLUME *Again = NULL;
+    UINT64 Reads = BlockIo->ReadCount;
+
+    EFI_STATUS Status = MountHfsPlusVolume(&BlockIo->BlockIo, &Again);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    if (Again != Volume || BlockIo->ReadCount != Reads ||
+        Volume->TotalBlocks != Image->TotalBlocks ||
+        CompareMem(&Volume->CatalogFile, &Image->CatalogFile, sizeof(HFSPlusForkData)) != 0 ||
+        CompareMem(&Volume->ExtentsFile, &Image->ExtentsFile, sizeof(HFSPlusForkData)) != 0 ||
+        CompareMem(&Volume->AllocationFile, &Image->AllocationFile, sizeof(HFSPlusForkData)) != 0) {
+        DEBUG((DEBUG_ERROR, "Mounted volume does not match the image header\n"));
+        UnmountHfsPlusVolume(Again);
+        return EFI_ABORTED;
+    }
+
+    UnmountHfsPlusVolume(Again);
+    if (HfsLookupVolume(&BlockIo->BlockIo) != Volume || Volume->MountCount != 1) {
+        DEBUG((DEBUG_ERROR, "Unmounting a second mount released the volume\n"));
+        return EFI_ABORTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Remount and check that the bitmap read back from disk has the large
+// file's extents allocated
+EFI_STATUS TestBitmapWriteBack(MockBlockIoProtocol *BlockIo, HFSPLUS_VOLUME **Volume, HFSPlusForkData *FileForkData) {
+    UnmountHfsPlusVolume(*Volume);
+    EFI_STATUS Status = MountHfsPlusVolume(&BlockIo->BlockIo, Volume);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // Mounting leaves the bitmap for the first allocation to load
+    if ((*Volume)->Bitmap.Loaded) {
+        DEBUG((DEBUG_ERROR, "Mount loaded the allocation bitmap\n"));
+        return EFI_ABORTED;
+    }
+    Status = LoadBitmapCache(*Volume, &(*Volume)->Bitmap);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    for (UINTN i = 0; i < 8 && FileForkData->extents[i].blockCount != 0; i++) {
+        UINT64 Cursor = FileForkData->extents[i].startBlock;
+        UINT64 End = Cursor + FileForkData->extents[i].blockCount;
+        UINT64 RunStart;
+        UINT64 RunLength;
+
+        if (BitmapCacheNextFreeRun(&(*Volume)->Bitmap, &Cursor, End, 1, &RunStart, &RunLength)) {
+            DEBUG((DEBUG_ERROR, "Extent %u of the large file is free after a remount\n", (UINT32)i));
+            return EFI_ABORTED;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Rewrite the large file and check that its old extents are released, then
+// ask for more space than the eight largest free runs can hold
+EFI_STATUS TestRewriteLargeFile(HFSPLUS_VOLUME *Volume, HFSPlusForkData *FileForkData) {
+    HFSPlusForkData OldFork = *FileForkData;
+    UINT32 FreeBlocks = Volume->FreeBlocks;
+
+    EFI_STATUS Status = TestWriteLargeFile(Volume, FileForkData);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    for (UINTN i = 0; i < 8 && OldFork.extents[i].blockCount != 0; i++) {
+        UINT64 Cursor = OldFork.extents[i].startBlock;
+        UINT64 RunStart;
+        UINT64 RunLength;
+
+        if (!BitmapCacheNextFreeRun(&Volume->Bitmap, &Cursor, Cursor + OldFork.extents[i].blockCount, 1, &RunStart, &RunLength) ||
+            RunStart != OldFork.extents[i].startBlock || RunLength != OldFork.extents[i].blockCount) {
+            DEBUG((DEBUG_ERROR, "Extent %u of the rewritten file was not released\n", (UINT32)i));
+            return EFI_ABORTED;
+        }
+    }
+    if (Volume->FreeBlocks != FreeBlocks) {
+        DEBUG((DEBUG_ERROR, "Rewrite left %u free blocks, expected %u\n", Volume->FreeBlocks, FreeBlocks));
+        return EFI_ABORTED;
+    }
+
+    Status = TestReadLargeFile(Volume, FileForkData);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    // Free space is split into short runs, so all of it needs far more
+    // than eight extents
+    HFSPlusForkData Fork = {0};
+    UINT64 DataSize = (UINT64)FreeBlocks * Volume->AllocationBlockSize;
+    UINT8 *Data = AllocateZeroPool((UINTN)DataSize);
+    if (Data == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = WriteFileWithFragmentation(Volume, &Fork, Data, DataSize);
+    FreePool(Data);
+    if (Status != EFI_VOLUME_FULL || Fork.totalBlocks != 0 || Volume->FreeBlocks != FreeBlocks) {
+        DEBUG((DEBUG_ERROR, "Fragmented write returned %r\n", Status));
+        return EFI_ABORTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Build a volume with the given allocation block size on a 512-byte-sector
+// disk and run every test against it
+EFI_STATUS RunVolumeTests(UINT32 AllocationBlockSize) {
+    MockBlockIoProtocol *MockBlockIo = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+
+    if (MockBlockIo == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-    DEBUG((DEBUG_INFO, "Testing large file write...\n"));
-    EFI_STATUS Status = TestWriteLargeFile(MockBlockIo);
+    Options.BlockSize = AllocationBlockSize;
+    Options.NodeSize = 4096;
+    Options.BootEfiSize = 40000;
+    Options.FileCount = 50;
+    Options.FileSize = 700;
+    Options.FragmentedSize = 30 * AllocationBlockSize - 300;
+    Options.FreeSpaceRunBlocks = 4;
+
+    EFI_STATUS Status = BuildMockHfsImage(MockBlockIo, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&MockBlockIo->BlockIo, &Volume);
+    }
     if (EFI_ERROR(Status)) {
-        DEBUG((DEBUG_ERROR, "Error writing large file: %r\n", Status));
+        DEBUG((DEBUG_ERROR, "Error mounting test volume: %r\n", Status));
+        FreeMockDisk(MockBlockIo);
         return Status;
     }
 
     HFSPlusForkData FileForkData = {0};
-    HFSPlusForkData ExtentOverflowFile = {0};
 
-    DEBUG((DEBUG_INFO, "Testing large file read...\n"));
-    Status = TestReadLargeFile(MockBlockIo, &FileForkData, &ExtentOverflowFile);
+    DEBUG((DEBUG_INFO, "Testing volume header...\n"));
+    Status = TestVolumeHeader(MockBlockIo, Volume, &Image);
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing large file write...\n"));
+        Status = TestWriteLargeFile(Volume, &FileForkData);
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_ERROR, "Error writing large file: %r\n", Status));
+        }
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing large file read...\n"));
+        Status = TestReadLargeFile(Volume, &FileForkData);
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_ERROR, "Error reading large file: %r\n", Status));
+        }
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing bitmap write-back...\n"));
+        Status = TestBitmapWriteBack(MockBlockIo, &Volume, &FileForkData);
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing large file rewrite...\n"));
+        Status = TestRewriteLargeFile(Volume, &FileForkData);
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing fragmented file read...\n"));
+        Status = TestReadFragmentedFile(Volume, &Image);
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_ERROR, "Error reading fragmented file: %r\n", Status));
+        }
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing arena reuse...\n"));
+        Status = TestArena(Volume, &Image);
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing catalog range scan...\n"));
+        Status = TestCatalogRangeScan(Volume, &Image, Options.FileCount);
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing directory listing...\n"));
+        Status = TestDirectoryListing(MockBlockIo, Volume, &Image, Options.FileCount, Options.FileSize);
+    }
+
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing boot.efi load...\n"));
+        Status = TestLoadBootEfi(Volume, &Image, Options.BootEfiSize);
+    }
+
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(MockBlockIo);
+    return Status;
+}
+
+// A disk for the partition probe test: the volume header area written
+// directly and Block I/O (plus Block I/O 2 when asked) installed on a handle
+typedef struct {
+    UINTN BlockSize;
+    UINT16 Signature;
+    BOOLEAN Journaled;
+    BOOLEAN Embedded;      // For HFS signatures: wraps an HFS+ volume
+    BOOLEAN Removable;
+    BOOLEAN LogicalPartition;
+    BOOLEAN BlockIo2;
+    MockBlockIoProtocol *Disk;
+    EFI_HANDLE Handle;
+} TEST_PROBE_DISK;
+
+#define TEST_PROBE_WRAPPER_OFFSET  (5 * 512 + 3 * 4096)
+
+STATIC
+EFI_STATUS
+CreateProbeDisk(
+    TEST_PROBE_DISK *Probe
+) {
+    Probe->Disk = InitializeMockDisk(16384 / Probe->BlockSize, Probe->BlockSize);
+    if (Probe->Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Probe->Disk->Media.RemovableMedia = Probe->Removable;
+    Probe->Disk->Media.LogicalPartition = Probe->LogicalPartition;
+
+    UINT8 *Header = Probe->Disk->DiskData + HFSPLUS_VOLUME_HEADER_OFFSET;
+    HFSMasterDirectoryBlock *Mdb = (HFSMasterDirectoryBlock *)Header;
+    WriteUnaligned16((UINT16 *)Header, SwapBytes16(Probe->Signature));
+    if (Probe->Signature == HFS_SIGNATURE) {
+        // Wrapped volume at sector 5 plus three 4 KiB allocation blocks
+        WriteUnaligned32(&Mdb->drAlBlkSiz, SwapBytes32(4096));
+        WriteUnaligned16(&Mdb->drAlBlSt, SwapBytes16(5));
+        if (Probe->Embedded) {
+            WriteUnaligned16(&Mdb->drEmbedSigWord, SwapBytes16(HFSPLUS_SIGNATURE));
+            WriteUnaligned16(&Mdb->drEmbedExtent.startBlock, SwapBytes16(3));
+            WriteUnaligned16(&Mdb->drEmbedExtent.blockCount, SwapBytes16(1));
+        }
+    } else if (Probe->Journaled) {
+        WriteUnaligned32(&((HFSPlusVolumeHeader *)Header)->attributes, SwapBytes32(HFSPLUS_VOL_JOURNALED));
+    }
+
+    EFI_STATUS Status = gBS->InstallProtocolInterface(&Probe->Handle, &gEfiBlockIoProtocolGuid, EFI_NATIVE_INTERFACE,
+                                                      &Probe->Disk->BlockIo);
+    if (!EFI_ERROR(Status) && Probe->BlockIo2) {
+        Status = gBS->InstallProtocolInterface(&Probe->Handle, &gEfiBlockIo2ProtocolGuid, EFI_NATIVE_INTERFACE,
+                                               &Probe->Disk->BlockIo2);
+    }
+    return Status;
+}
+
+// Probe a mix of partitions and check that only the HFS+ ones come back,
+// best first, each after a single device read
+EFI_STATUS TestDetectPartitions() {
+    TEST_PROBE_DISK Disks[] = {
+        { 512,  HFSPLUS_SIGNATURE, TRUE,  FALSE, TRUE,  TRUE,  TRUE  },  // Removable
+        { 2048, HFS_SIGNATURE,     FALSE, TRUE,  FALSE, TRUE,  TRUE  },  // Wrapped
+        { 4096, HFSX_SIGNATURE,    TRUE,  FALSE, FALSE, TRUE,  FALSE },  // HFSX
+        { 512,  HFSPLUS_SIGNATURE, FALSE, FALSE, FALSE, TRUE,  TRUE  },  // Plain HFS+
+        { 512,  0,                 FALSE, FALSE, FALSE, TRUE,  TRUE  },  // Blank
+        { 512,  HFS_SIGNATURE,     FALSE, FALSE, FALSE, TRUE,  FALSE },  // HFS only
+        { 512,  HFSPLUS_SIGNATURE, FALSE, FALSE, FALSE, FALSE, TRUE  },  // Whole disk
+    };
+    // Indices into Disks in the order the probe must rank them
+    CONST UINTN Expected[] = { 3, 2, 1, 0 };
+    CONST HFSPLUS_PROBE_KIND ExpectedKind[] = { HfsProbeHfsPlus, HfsProbeHfsx, HfsProbeWrapped, HfsProbeHfsPlus };
+    HFSPLUS_PARTITION *Partitions = NULL;
+    UINTN PartitionCount = 0;
+    UINTN Matched = 0;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    for (UINTN i = 0; i < ARRAY_SIZE(Disks) && !EFI_ERROR(Status); i++) {
+        Status = CreateProbeDisk(&Disks[i]);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = DetectHfsPlusPartitions(&Partitions, &PartitionCount);
+    }
+
+    // Other devices may be present on real firmware; only look at ours
+    for (UINTN i = 0; i < PartitionCount && !EFI_ERROR(Status); i++) {
+        UINTN Disk = 0;
+        while (Disk < ARRAY_SIZE(Disks) && Disks[Disk].Handle != Partitions[i].Handle) {
+            Disk++;
+        }
+        if (Disk == ARRAY_SIZE(Disks)) {
+            continue;
+        }
+
+        if (Matched == ARRAY_SIZE(Expected) || Disk != Expected[Matched] ||
+            Partitions[i].Kind != ExpectedKind[Matched] ||
+            Partitions[i].BlockIo != &Disks[Disk].Disk->BlockIo ||
+            Partitions[i].Journaled != Disks[Disk].Journaled ||
+            Partitions[i].Removable != Disks[Disk].Removable ||
+            Partitions[i].VolumeOffset != (Disks[Disk].Embedded ? TEST_PROBE_WRAPPER_OFFSET : 0)) {
+            DEBUG((DEBUG_ERROR, "Partition %u of the probe is wrong\n", (UINT32)i));
+            Status = EFI_ABORTED;
+        }
+        Matched++;
+    }
+
+    for (UINTN i = 0; i < ARRAY_SIZE(Disks) && !EFI_ERROR(Status); i++) {
+        if (Disks[i].Disk->ReadCount != (Disks[i].LogicalPartition ? 1 : 0)) {
+            DEBUG((DEBUG_ERROR, "Probe disk %u was read %lu times\n", (UINT32)i, Disks[i].Disk->ReadCount));
+            Status = EFI_ABORTED;
+        }
+    }
+    if (!EFI_ERROR(Status) && Matched != ARRAY_SIZE(Expected)) {
+        DEBUG((DEBUG_ERROR, "Probe found %u of %u partitions\n", (UINT32)Matched, (UINT32)ARRAY_SIZE(Expected)));
+        Status = EFI_ABORTED;
+    }
+
+    if (Partitions != NULL) {
+        FreePool(Partitions);
+    }
+    for (UINTN i = 0; i < ARRAY_SIZE(Disks); i++) {
+        if (Disks[i].Disk == NULL) {
+            continue;
+        }
+        if (Disks[i].Handle != NULL) {
+            gBS->UninstallProtocolInterface(Disks[i].Handle, &gEfiBlockIoProtocolGuid, &Disks[i].Disk->BlockIo);
+            if (Disks[i].BlockIo2) {
+                gBS->UninstallProtocolInterface(Disks[i].Handle, &gEfiBlockIo2ProtocolGuid, &Disks[i].Disk->BlockIo2);
+            }
+        }
+        FreeMockDisk(Disks[i].Disk);
+    }
+    return Status;
+}
+
+#define TEST_JOURNAL_SIZE  (64 * 1024)
+
+// Contents of a journaled test block
+STATIC
+VOID
+FillJournalBlock(
+    UINT8 *Buffer,
+    UINTN Size,
+    UINT8 Seed
+) {
+    for (UINTN i = 0; i < Size; i++) {
+        Buffer[i] = (UINT8)(Seed + i * 3);
+    }
+}
+
+// Check that the device blocks at Lba hold what FillJournalBlock wrote
+STATIC
+BOOLEAN
+CheckJournalBlock(
+    MockBlockIoProtocol *Disk,
+    UINT64 Lba,
+    UINTN Size,
+    UINT8 Seed
+) {
+    UINT8 *Data = Disk->DiskData + Lba * Disk->BlockSize;
+
+    for (UINTN i = 0; i < Size; i++) {
+        if (Data[i] != (UINT8)(Seed + i * 3)) {
+            DEBUG((DEBUG_ERROR, "Block %lu differs after journal replay\n", Lba + i / Disk->BlockSize));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Log transactions without applying them, as a crash would leave them, and
+// check that mounting replays the newest copy of each block exactly once,
+// re-reads a journaled volume header, refuses a damaged journal and
+// follows the journal as it wraps around
+EFI_STATUS TestJournalReplay(BOOLEAN Swapped) {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+    UINT8 First[2 * TEST_BLOCK_SIZE];
+    UINT8 Second[TEST_BLOCK_SIZE];
+    UINT8 Third[TEST_BLOCK_SIZE];
+    UINT8 Superseded[TEST_BLOCK_SIZE];
+    UINT8 Header[TEST_BLOCK_SIZE];
+    UINT8 Damaged[TEST_BLOCK_SIZE];
+    UINT8 Wrapped[16 * TEST_BLOCK_SIZE];
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.FileCount = 8;
+    Options.FileSize = 5000;
+    Options.JournalSize = TEST_JOURNAL_SIZE;
+    Options.JournalSwapped = Swapped;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+
+    // Two transactions: the second rewrites half of a block from the first,
+    // logs a superseded block and a new volume header
+    FillJournalBlock(First, sizeof(First), 1);
+    FillJournalBlock(Second, sizeof(Second), 2);
+    FillJournalBlock(Third, sizeof(Third), 3);
+    FillJournalBlock(Superseded, sizeof(Superseded), 9);
+    CopyMem(Header, Disk->DiskData + HFSPLUS_VOLUME_HEADER_OFFSET, sizeof(Header));
+    UINT32 NextCatalogID = SwapBytes32(ReadUnaligned32(&((HFSPlusVolumeHeader *)Header)->nextCatalogID)) + 100;
+    WriteUnaligned32(&((HFSPlusVolumeHeader *)Header)->nextCatalogID, SwapBytes32(NextCatalogID));
+
+    MOCK_JOURNAL_BLOCK FirstTransaction[] = {
+        { 3000, sizeof(First), First },
+        { 3500, sizeof(Second), Second },
+    };
+    MOCK_JOURNAL_BLOCK SecondTransaction[] = {
+        { 3001, sizeof(Third), Third },
+        { MAX_UINT64, sizeof(Superseded), Superseded },
+        { HFSPLUS_VOLUME_HEADER_OFFSET / TEST_BLOCK_SIZE, sizeof(Header), Header },
+    };
+    if (!EFI_ERROR(Status)) {
+        Status = MockJournalTransaction(Disk, &Image, FirstTransaction, ARRAY_SIZE(FirstTransaction));
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MockJournalTransaction(Disk, &Image, SecondTransaction, ARRAY_SIZE(SecondTransaction));
+    }
+
+    // Three runs of blocks, then the journal header
+    UINT64 Writes = Disk->WriteCount;
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status) &&
+        (Disk->WriteCount - Writes != 4 || Volume->NextCatalogID != NextCatalogID ||
+         !CheckJournalBlock(Disk, 3000, TEST_BLOCK_SIZE, 1) || !CheckJournalBlock(Disk, 3001, TEST_BLOCK_SIZE, 3) ||
+         !CheckJournalBlock(Disk, 3500, TEST_BLOCK_SIZE, 2) || Disk->DiskData[3002 * TEST_BLOCK_SIZE] != 0)) {
+        DEBUG((DEBUG_ERROR, "Journal replay wrote %lu times\n", Disk->WriteCount - Writes));
+        Status = EFI_ABORTED;
+    }
+
+    // The journal is empty now, so a second mount writes nothing
+    if (!EFI_ERROR(Status)) {
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+        Writes = Disk->WriteCount;
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+        if (!EFI_ERROR(Status) && Disk->WriteCount != Writes) {
+            DEBUG((DEBUG_ERROR, "Replayed journal was replayed again\n"));
+            Status = EFI_ABORTED;
+        }
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+    }
+
+    // Damage the logged copy of a block: the mount must fail and leave the
+    // volume alone
+    FillJournalBlock(Damaged, sizeof(Damaged), 0x5A);
+    MOCK_JOURNAL_BLOCK DamagedTransaction[] = {
+        { 3700, sizeof(Damaged), Damaged },
+    };
+    if (!EFI_ERROR(Status)) {
+        Status = MockJournalTransaction(Disk, &Image, DamagedTransaction, ARRAY_SIZE(DamagedTransaction));
+    }
+    UINT8 *Logged = NULL;
+    for (UINT64 Offset = Image.JournalOffset; Offset < Image.JournalOffset + Image.JournalSize && !EFI_ERROR(Status); Offset += TEST_BLOCK_SIZE) {
+        if (CompareMem(Disk->DiskData + Offset, Damaged, sizeof(Damaged)) == 0) {
+            Logged = Disk->DiskData + Offset;
+        }
+    }
+    if (Logged != NULL) {
+        Logged[17] ^= 0xFF;
+        Writes = Disk->WriteCount;
+        if (MountHfsPlusVolume(&Disk->BlockIo, &Volume) != EFI_VOLUME_CORRUPTED || Disk->WriteCount != Writes) {
+            DEBUG((DEBUG_ERROR, "Damaged journal was replayed\n"));
+            Status = EFI_ABORTED;
+        }
+        Logged[17] ^= 0xFF;
+    } else if (!EFI_ERROR(Status)) {
+        Status = EFI_NOT_FOUND;
+    }
+
+    // Many rounds of a 12 KiB transaction wrap the 64 KiB journal
+    for (UINT8 Round = 0; Round < 20 && !EFI_ERROR(Status); Round++) {
+        MOCK_JOURNAL_BLOCK Transaction[] = {
+            { 3600, sizeof(Wrapped), Wrapped },
+        };
+
+        FillJournalBlock(Wrapped, sizeof(Wrapped), Round);
+        Status = MockJournalTransaction(Disk, &Image, Transaction, ARRAY_SIZE(Transaction));
+        if (!EFI_ERROR(Status)) {
+            Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+        }
+        if (!EFI_ERROR(Status) &&
+            (!CheckJournalBlock(Disk, 3600, sizeof(Wrapped), Round) || !CheckJournalBlock(Disk, 3700, sizeof(Damaged), 0x5A))) {
+            Status = EFI_ABORTED;
+        }
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Journal replay test failed: %r\n", Status));
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+#define TEST_BATCH_FILES  6
+
+// Check that a volume counts FreeBlocks free blocks and that every extent
+// of the given forks is allocated in its bitmap
+STATIC
+BOOLEAN
+CheckAllocated(
+    HFSPLUS_VOLUME *Volume,
+    CONST HFSPlusForkData *Forks,
+    UINTN ForkCount,
+    UINT32 FreeBlocks
+) {
+    if (Volume->FreeBlocks != FreeBlocks ||
+        (!Volume->Bitmap.Loaded && EFI_ERROR(LoadBitmapCache(Volume, &Volume->Bitmap)))) {
+        DEBUG((DEBUG_ERROR, "Volume has %u free blocks, expected %u\n", Volume->FreeBlocks, FreeBlocks));
+        return FALSE;
+    }
+
+    for (UINTN Fork = 0; Fork < ForkCount; Fork++) {
+        for (UINTN i = 0; i < 8 && Forks[Fork].extents[i].blockCount != 0; i++) {
+            UINT64 Cursor = Forks[Fork].extents[i].startBlock;
+            UINT64 RunStart;
+            UINT64 RunLength;
+
+            if (BitmapCacheNextFreeRun(&Volume->Bitmap, &Cursor, Cursor + Forks[Fork].extents[i].blockCount, 1, &RunStart, &RunLength)) {
+                DEBUG((DEBUG_ERROR, "Block %lu of written file %u is free\n", RunStart, (UINT32)Fork));
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+// Write a batch of files in one transaction on a journaled volume and
+// check that their metadata is committed at once with a fixed number of
+// flushes, survives a crash before it reaches its home location, and is
+// dropped entirely when the transaction is abandoned
+EFI_STATUS TestJournaledWrite() {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+    HFSPlusForkData Forks[TEST_BATCH_FILES + 1];
+    HFSPlusVolumeHeader *DiskHeader;
+    UINT8 Data[3 * 4096];
+    UINT8 HeaderBlock[TEST_BLOCK_SIZE];
+    UINT8 *Snapshot = NULL;
+    UINT8 *Journal = NULL;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.FileCount = 8;
+    Options.FileSize = 5000;
+    Options.JournalSize = TEST_JOURNAL_SIZE;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status)) {
+        Snapshot = AllocateCopyPool(TEST_DISK_BLOCKS * TEST_BLOCK_SIZE, Disk->DiskData);
+        Journal = AllocatePool((UINTN)Image.JournalSize);
+        if (Snapshot == NULL || Journal == NULL) {
+            Status = EFI_OUT_OF_RESOURCES;
+        }
+    }
+
+    for (UINTN i = 0; i < sizeof(Data); i++) {
+        Data[i] = MockHfsFileByte(TEST_LARGE_FILE_ID, i);
+    }
+    ZeroMem(Forks, sizeof(Forks));
+    DiskHeader = (HFSPlusVolumeHeader *)(Disk->DiskData + HFSPLUS_VOLUME_HEADER_OFFSET);
+
+    // Until the commit, metadata changes are only visible through the volume
+    UINT32 FreeBlocks = (Volume != NULL) ? Volume->FreeBlocks : 0;
+    UINT64 Flushes = Disk->FlushCount;
+    if (!EFI_ERROR(Status)) {
+        HfsBeginTransaction(Volume);
+        for (UINTN i = 0; i < TEST_BATCH_FILES && !EFI_ERROR(Status); i++) {
+            Status = WriteFileWithFragmentation(Volume, &Forks[i], Data, 1000 + i * 2000);
+            FreeBlocks -= Forks[i].totalBlocks;
+        }
+        if (!EFI_ERROR(Status)) {
+            Status = HfsReadDevice(Volume, HFSPLUS_VOLUME_HEADER_OFFSET / TEST_BLOCK_SIZE, sizeof(HeaderBlock), HeaderBlock);
+        }
+        if (!EFI_ERROR(Status) &&
+            (Disk->FlushCount != Flushes || SwapBytes32(ReadUnaligned32(&DiskHeader->freeBlocks)) != Image.FreeBlocks ||
+             SwapBytes32(ReadUnaligned32(&((HFSPlusVolumeHeader *)HeaderBlock)->freeBlocks)) != FreeBlocks)) {
+            DEBUG((DEBUG_ERROR, "Transaction metadata reached the disk before the commit\n"));
+            Status = EFI_ABORTED;
+        }
+        EFI_STATUS CommitStatus = HfsEndTransaction(Volume, !EFI_ERROR(Status));
+        if (!EFI_ERROR(Status)) {
+            Status = CommitStatus;
+        }
+    }
+
+    // One commit for the whole batch: a flush after the block lists and
+    // one after the journal header
+    if (!EFI_ERROR(Status) &&
+        (Disk->FlushCount - Flushes != 2 || SwapBytes32(ReadUnaligned32(&DiskHeader->freeBlocks)) != FreeBlocks ||
+         !CheckAllocated(Volume, Forks, TEST_BATCH_FILES, FreeBlocks))) {
+        DEBUG((DEBUG_ERROR, "Batch commit took %lu flushes\n", Disk->FlushCount - Flushes));
+        Status = EFI_ABORTED;
+    }
+
+    // Crash after the commit: the journal holds the transaction but the
+    // bitmap and header in place are as they were before it
+    if (!EFI_ERROR(Status)) {
+        CopyMem(Journal, Disk->DiskData + Image.JournalOffset, (UINTN)Image.JournalSize);
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+
+        CopyMem(Disk->DiskData + Image.JournalOffset, Journal, (UINTN)Image.JournalSize);
+        CopyMem(DiskHeader, Snapshot + HFSPLUS_VOLUME_HEADER_OFFSET, HFSPLUS_VOLUME_HEADER_SIZE);
+        for (UINTN i = 0; i < 8 && Image.AllocationFile.extents[i].blockCount != 0; i++) {
+            UINT64 Offset = (UINT64)Image.AllocationFile.extents[i].startBlock * Options.BlockSize;
+            CopyMem(Disk->DiskData + Offset, Snapshot + Offset, (UINTN)Image.AllocationFile.extents[i].blockCount * Options.BlockSize);
+        }
+
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+        if (!EFI_ERROR(Status) && !CheckAllocated(Volume, Forks, TEST_BATCH_FILES, FreeBlocks)) {
+            Status = EFI_ABORTED;
+        }
+    }
+
+    // An abandoned transaction leaves the volume as it was
+    if (!EFI_ERROR(Status)) {
+        Flushes = Disk->FlushCount;
+        CopyMem(HeaderBlock, DiskHeader, sizeof(HeaderBlock));
+        HfsBeginTransaction(Volume);
+        Status = WriteFileWithFragmentation(Volume, &Forks[TEST_BATCH_FILES], Data, sizeof(Data));
+        if (!EFI_ERROR(Status) && HfsEndTransaction(Volume, FALSE) != EFI_ABORTED) {
+            Status = EFI_ABORTED;
+        }
+        UINT64 Cursor = Forks[TEST_BATCH_FILES].extents[0].startBlock;
+        UINT64 RunStart;
+        UINT64 RunLength;
+        if (!EFI_ERROR(Status) &&
+            (Disk->FlushCount != Flushes || CompareMem(HeaderBlock, DiskHeader, sizeof(HeaderBlock)) != 0 ||
+             !CheckAllocated(Volume, Forks, TEST_BATCH_FILES, FreeBlocks) ||
+             !BitmapCacheNextFreeRun(&Volume->Bitmap, &Cursor, Cursor + 1, 1, &RunStart, &RunLength))) {
+            DEBUG((DEBUG_ERROR, "Abandoned transaction changed the volume\n"));
+            Status = EFI_ABORTED;
+        }
+    }
+
+    // Single writes commit one by one and keep wrapping the journal, which
+    // frees its space by checkpointing now and then. Each rewrite releases
+    // the block the last one took.
+    ZeroMem(&Forks[TEST_BATCH_FILES], sizeof(HFSPlusForkData));
+    FreeBlocks -= 1;
+    for (UINTN Round = 0; Round < 40 && !EFI_ERROR(Status); Round++) {
+        Flushes = Disk->FlushCount;
+        Status = WriteFileWithFragmentation(Volume, &Forks[TEST_BATCH_FILES], Data, 100);
+        if (!EFI_ERROR(Status) && (Disk->FlushCount - Flushes < 2 || Disk->FlushCount - Flushes > 3)) {
+            Status = EFI_ABORTED;
+        }
+    }
+    if (!EFI_ERROR(Status)) {
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status) && !CheckAllocated(Volume, Forks, TEST_BATCH_FILES + 1, FreeBlocks)) {
+        Status = EFI_ABORTED;
+    }
+
     if (EFI_ERROR(Status)) {
-        DEBUG((DEBUG_ERROR, "Error reading large file: %r\n", Status));
+        DEBUG((DEBUG_ERROR, "Journaled write test failed: %r\n", Status));
     }
+    if (Snapshot != NULL) {
+        FreePool(Snapshot);
+    }
+    if (Journal != NULL) {
+        FreePool(Journal);
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// zlib streams from a reference compressor: a stored block, and a dynamic
+// Huffman block of TEST_DYNAMIC_LINES generated lines
+STATIC CONST UINT8 mTestZlibStored[] = {
+    0x78, 0x01, 0x01, 0x0C, 0x00, 0xF3, 0xFF, 0x48, 0x46, 0x53, 0x2B, 0x20,
+    0x73, 0x74, 0x6F, 0x72, 0x65, 0x64, 0x20, 0x18, 0x16, 0x03, 0xDE,
+};
+
+STATIC CONST UINT8 mTestZlibDynamic[] = {
+    0x78, 0xDA, 0x6D, 0xD2, 0x49, 0x12, 0x82, 0x40, 0x10, 0x44, 0xD1, 0xBD,
+    0x87, 0xE9, 0x68, 0xBA, 0x64, 0x3A, 0x0E, 0xB4, 0xA8, 0x4C, 0x02, 0x0A,
+    0xA2, 0x9E, 0xDE, 0x74, 0x69, 0x65, 0x6D, 0xDF, 0xEE, 0x47, 0xFC, 0x38,
+    0x8D, 0xAE, 0x9A, 0xE7, 0xA1, 0x71, 0xE3, 0x14, 0x7B, 0x57, 0x55, 0xCE,
+    0x7B, 0x7F, 0x88, 0xFF, 0x7A, 0x1D, 0xA0, 0x89, 0xD6, 0x69, 0x87, 0x06,
+    0xAD, 0xCF, 0x2B, 0x54, 0xB4, 0xC6, 0x07, 0xF4, 0xA8, 0xB5, 0x3B, 0x41,
+    0x53, 0xAD, 0xCB, 0x04, 0xCD, 0xB4, 0xBE, 0x3E, 0xD0, 0x5C, 0x6B, 0xD3,
+    0x43, 0x0B, 0xAD, 0xC3, 0x13, 0x5A, 0x6A, 0x7D, 0x5C, 0x9C, 0x4F, 0xA8,
+    0xED, 0x73, 0x87, 0x52, 0xDB, 0x25, 0x42, 0xA9, 0xED, 0x76, 0x83, 0x52,
+    0xDB, 0xF6, 0x86, 0x52, 0x5B, 0xDD, 0x41, 0xA9, 0xAD, 0xDD, 0xA0, 0xD4,
+    0x36, 0x9F, 0xA1, 0xD4, 0xB6, 0x2F, 0x50, 0x6A, 0x3B, 0xD5, 0x50, 0x6A,
+    0xEB, 0x47, 0xE7, 0x03, 0xB5, 0xDD, 0x5F, 0x50, 0x6A, 0x7B, 0xB7, 0x50,
+    0x6A, 0x3B, 0xAF, 0x50, 0x6A, 0x1B, 0x1B, 0x28, 0xB5, 0xAD, 0x33, 0x94,
+    0xDA, 0x7E, 0xEF, 0x84, 0xCC, 0x7A, 0x27, 0xE4, 0xD6, 0x3B, 0xA1, 0xB0,
+    0xDE, 0x09, 0xA5, 0xF5, 0x8E, 0x78, 0xEB, 0x1D, 0x49, 0xAC, 0x77, 0x24,
+    0x58, 0xEF, 0x88, 0x58, 0xEF, 0xC8, 0xD1, 0x7A, 0x47, 0x52, 0xEB, 0x1D,
+    0xC9, 0xAC, 0x77, 0x24, 0xB7, 0xDE, 0x91, 0xC2, 0x7A, 0x47, 0xCA, 0xC3,
+    0x17, 0x51, 0xF7, 0x1F, 0x34,
+};
+
+// An LZFSE stream built by hand: a stored block, an LZVN block of one
+// literal run and the end of stream. A version 1 block in its place is
+// refused as unsupported.
+STATIC CONST UINT8 mTestLzfseBlocks[] = {
+    0x62, 0x76, 0x78, 0x2D, 0x06, 0x00, 0x00, 0x00, 0x48, 0x46, 0x53, 0x2B, 0x20, 0x20,
+    0x62, 0x76, 0x78, 0x6E, 0x05, 0x00, 0x00, 0x00, 0x0E, 0x00, 0x00, 0x00,
+    0xE5, 0x4C, 0x5A, 0x46, 0x53, 0x45, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x62, 0x76, 0x78, 0x24,
+};
+
+#define TEST_DYNAMIC_LINES     40
+#define TEST_DYNAMIC_LINE_SIZE 22
+#define TEST_ROUND_TRIP_SIZE   200000
+
+// Line Index of the dynamic Huffman vector: "com.apple.mock.xy.NNN\n"
+STATIC
+VOID
+TestDynamicLine(
+    UINT32 Index,
+    CHAR8 *Line
+) {
+    CopyMem(Line, "com.apple.mock.", 15);
+    Line[15] = (CHAR8)('a' + Index * 7 % 26);
+    Line[16] = (CHAR8)('a' + Index * 11 % 26);
+    Line[17] = '.';
+    Line[18] = (CHAR8)('0' + Index / 100);
+    Line[19] = (CHAR8)('0' + Index / 10 % 10);
+    Line[20] = (CHAR8)('0' + Index % 10);
+    Line[21] = '\n';
+}
+
+// A mock compressor, the decoder for its streams and how many bytes at
+// the end of a stream only mark its end
+typedef struct {
+    CONST CHAR8 *Name;
+    UINTN (*Compress)(CONST VOID *Source, UINTN SourceSize, VOID *Destination, UINTN DestinationSize);
+    EFI_STATUS (*Decompress)(CONST VOID *Source, UINTN SourceSize, VOID *Destination, UINTN DestinationSize, UINTN *DecompressedSize);
+    UINTN Trailer;
+} TEST_CODEC;
 
-    DEBUG((DEBUG_INFO, "Testing boot.efi load...\n"));
-    Status = TestLoadBootEfi(MockBlockIo);
+// LZVN streams end in an end-of-stream opcode and seven bytes of padding,
+// LZFSE streams in an end-of-stream block magic
+STATIC CONST TEST_CODEC mTestCodecs[] = {
+    { "zlib", MockZlibCompress, HfsZlibDecompress, 0 },
+    { "LZVN", MockLzvnCompress, HfsLzvnDecompress, 8 },
+    { "LZFSE", MockLzfseCompress, HfsLzfseDecompress, 4 },
+};
 
-    FreePool(MockBlockIo->DiskData);
-    FreePool(MockBlockIo);
+// Compress with a mock compressor and decompress again; damaged and
+// truncated streams must never decode to the original
+STATIC
+EFI_STATUS
+TestRoundTrip(
+    CONST UINT8 *Original,
+    UINTN Size,
+    CONST TEST_CODEC *Codec
+) {
+    UINTN Capacity = Size + Size / 8 + 64;
+    UINT8 *Compressed = AllocatePool(Capacity);
+    UINT8 *Decompressed = AllocatePool(Size + 1);
+    UINTN CompressedSize;
+    UINTN DecompressedSize = 0;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Compressed == NULL || Decompressed == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    CompressedSize = Codec->Compress(Original, Size, Compressed, Capacity);
+    Status = (CompressedSize == 0) ? EFI_ABORTED
+        : Codec->Decompress(Compressed, CompressedSize, Decompressed, Size, &DecompressedSize);
+    if (!EFI_ERROR(Status) && (DecompressedSize != Size || CompareMem(Decompressed, Original, Size) != 0)) {
+        Status = EFI_ABORTED;
+    }
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "%a round trip of %lu bytes failed: %r\n", Codec->Name, (UINT64)Size, Status));
+        goto Done;
+    }
+
+    // Too small a buffer, a cut-off stream and a damaged one. The end of
+    // stream marker is left out of the middle.
+    UINTN Middle = (CompressedSize - Codec->Trailer) / 2;
+    for (UINTN Case = 0; Case < 3 && !EFI_ERROR(Status); Case++) {
+        UINTN Length = (Case == 1) ? Middle : CompressedSize;
+        UINTN Room = (Case == 0) ? Size - 1 : Size;
+        EFI_STATUS Result;
+
+        if (Case == 2) {
+            Compressed[Middle] ^= 0x5A;
+        }
+        Result = Codec->Decompress(Compressed, Length, Decompressed, Room, &DecompressedSize);
+        if (!EFI_ERROR(Result) && DecompressedSize == Size && CompareMem(Decompressed, Original, Size) == 0) {
+            DEBUG((DEBUG_ERROR, "%a stream case %lu decoded anyway\n", Codec->Name, (UINT64)Case));
+            Status = EFI_ABORTED;
+        }
+    }
+
+Done:
+    if (Compressed != NULL) {
+        FreePool(Compressed);
+    }
+    if (Decompressed != NULL) {
+        FreePool(Decompressed);
+    }
+    return Status;
+}
+
+// A pair of one-character names and how FastUnicodeCompare orders them
+typedef struct {
+    CHAR16 Left[3];
+    CHAR16 Right[3];
+    INTN Order;
+} TEST_FOLD_CASE;
+
+// Fold names through the TN1150 table: capitals that Unicode 2.0 mapped
+// fold, precomposed and later letters do not, ignorable characters vanish
+// and an embedded NUL sorts after everything
+EFI_STATUS TestCaseFolding() {
+    STATIC CONST TEST_FOLD_CASE Cases[] = {
+        { { 0x0041 }, { 0x0061 }, 0 },
+        { { 0x00C6 }, { 0x00E6 }, 0 },
+        { { 0x00C0 }, { 0x00E0 }, -1 },
+        { { 0x0130 }, { 0x0069 }, 1 },
+        { { 0x0130 }, { 0x0130 }, 0 },
+        { { 0x0110 }, { 0x0111 }, 0 },
+        { { 0x0186 }, { 0x0254 }, 0 },
+        { { 0x0392 }, { 0x03B2 }, 0 },
+        { { 0x0386 }, { 0x03AC }, -1 },
+        { { 0x0416 }, { 0x0436 }, 0 },
+        { { 0x0402 }, { 0x0452 }, 0 },
+        { { 0x0401 }, { 0x0451 }, -1 },
+        { { 0x04C0 }, { 0x04CF }, -1 },
+        { { 0x0531 }, { 0x0561 }, 0 },
+        { { 0x10A0 }, { 0x10D0 }, 0 },
+        { { 0x10A0 }, { 0x2D00 }, -1 },
+        { { 0x2160 }, { 0x2170 }, 0 },
+        { { 0xFF21 }, { 0xFF41 }, 0 },
+        { { L'a', 0x200C, L'b' }, { L'a', L'b' }, 0 },
+        { { 0x202A, L'a', 0x206F }, { L'a' }, 0 },
+        { { 0xFEFF, L'a' }, { L'A' }, 0 },
+        { { 0x0000 }, { 0xFFFE }, 1 },
+    };
+
+    for (UINTN Index = 0; Index < ARRAY_SIZE(Cases); Index++) {
+        UINTN LeftLength = 1;
+        UINTN RightLength = 1;
+        UINT8 DiskName[6];
+
+        while (LeftLength < 3 && Cases[Index].Left[LeftLength] != 0) {
+            LeftLength++;
+        }
+        while (RightLength < 3 && Cases[Index].Right[RightLength] != 0) {
+            RightLength++;
+        }
+        for (UINTN Char = 0; Char < RightLength; Char++) {
+            WriteUnaligned16((UINT16 *)(DiskName + 2 * Char), SwapBytes16(Cases[Index].Right[Char]));
+        }
+
+        INTN Order = HfsFastUnicodeCompare(Cases[Index].Left, LeftLength, DiskName, RightLength);
+        Order = (Order < 0) ? -1 : (Order > 0) ? 1 : 0;
+        if (Order != Cases[Index].Order) {
+            DEBUG((DEBUG_ERROR, "Case folding of %04x against %04x is wrong\n", Cases[Index].Left[0], Cases[Index].Right[0]));
+            return EFI_ABORTED;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Decode reference zlib streams, then round-trip data that compresses well,
+// poorly and not at all through both decoders
+EFI_STATUS TestDecompressors() {
+    UINT8 Output[TEST_DYNAMIC_LINES * TEST_DYNAMIC_LINE_SIZE];
+    CHAR8 Line[TEST_DYNAMIC_LINE_SIZE];
+    UINTN Size = 0;
+
+    EFI_STATUS Status = HfsZlibDecompress(mTestZlibStored, sizeof(mTestZlibStored), Output, sizeof(Output), &Size);
+    if (!EFI_ERROR(Status) && (Size != 12 || CompareMem(Output, "HFS+ stored ", 12) != 0)) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = HfsZlibDecompress(mTestZlibDynamic, sizeof(mTestZlibDynamic), Output, sizeof(Output), &Size);
+    }
+    for (UINT32 Index = 0; Index < TEST_DYNAMIC_LINES && !EFI_ERROR(Status); Index++) {
+        TestDynamicLine(Index, Line);
+        if (Size != sizeof(Output) || CompareMem(Output + Index * TEST_DYNAMIC_LINE_SIZE, Line, sizeof(Line)) != 0) {
+            Status = EFI_ABORTED;
+        }
+    }
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Reference zlib streams did not decode: %r\n", Status));
+        return Status;
+    }
+
+    UINT8 Blocks[sizeof(mTestLzfseBlocks)];
+    CopyMem(Blocks, mTestLzfseBlocks, sizeof(Blocks));
+    Status = HfsLzfseDecompress(Blocks, sizeof(Blocks), Output, sizeof(Output), &Size);
+    if (!EFI_ERROR(Status) && (Size != 11 || CompareMem(Output, "HFS+  LZFSE", 11) != 0)) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Blocks[17] = 0x31;  // 'bvx1'
+        Status = HfsLzfseDecompress(Blocks, sizeof(Blocks), Output, sizeof(Output), &Size);
+        Status = (Status == EFI_UNSUPPORTED) ? EFI_SUCCESS : EFI_ABORTED;
+    }
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Hand-built LZFSE stream did not decode: %r\n", Status));
+        return Status;
+    }
+
+    // The file pattern, a random stretch and long runs
+    UINT8 *Data = AllocatePool(TEST_ROUND_TRIP_SIZE);
+    if (Data == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    UINT32 Seed = 12345;
+    for (UINTN i = 0; i < TEST_ROUND_TRIP_SIZE; i++) {
+        Seed = Seed * 1103515245 + 12345;
+        if (i < 80000) {
+            Data[i] = MockHfsFileByte(TEST_LARGE_FILE_ID, i);
+        } else if (i < 140000) {
+            Data[i] = (UINT8)(Seed >> 16);
+        } else {
+            Data[i] = (UINT8)(i / 5000);
+        }
+    }
+
+    UINTN Sizes[] = { 1, 3, 1000, 70000, TEST_ROUND_TRIP_SIZE };
+    for (UINTN i = 0; i < ARRAY_SIZE(Sizes) && !EFI_ERROR(Status); i++) {
+        for (UINTN Codec = 0; Codec < ARRAY_SIZE(mTestCodecs) && !EFI_ERROR(Status); Codec++) {
+            Status = TestRoundTrip(Data, Sizes[i], &mTestCodecs[Codec]);
+        }
+    }
+
+    FreePool(Data);
+    return Status;
+}
+
+// Read a compressed file through HfsReadAt at offsets that start, end and
+// straddle chunk boundaries
+STATIC
+EFI_STATUS
+TestCompressedReads(
+    HFSPLUS_VOLUME *Volume,
+    CONST CHAR16 *Path,
+    UINT32 FileID,
+    UINT64 Size,
+    UINT32 ExpectedType
+) {
+    VOID *Record;
+    HFSPLUS_FORK *Fork = NULL;
+    UINT8 *Buffer = AllocatePool((UINTN)Size + 1);
+
+    if (Buffer == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EFI_STATUS Status = ResolvePath(Volume, Path, NULL, &Record);
+    if (!EFI_ERROR(Status)) {
+        Status = HfsOpenFile(Volume, Record, &Fork);
+    }
+    if (!EFI_ERROR(Status) && (Fork->Compressed == NULL || Fork->Compressed->Type != ExpectedType || Fork->Size != Size)) {
+        DEBUG((DEBUG_ERROR, "File %u did not open as compressed type %u\n", FileID, ExpectedType));
+        Status = EFI_ABORTED;
+    }
+
+    UINT64 Ranges[][2] = {
+        { 0, Size },
+        { 0, 1 },
+        { HFSPLUS_DECMPFS_CHUNK_SIZE - 100, 300 },
+        { HFSPLUS_DECMPFS_CHUNK_SIZE, 2 * HFSPLUS_DECMPFS_CHUNK_SIZE },
+        { 3 * HFSPLUS_DECMPFS_CHUNK_SIZE - 1, HFSPLUS_DECMPFS_CHUNK_SIZE + 2 },
+        { Size - 10, 100 },
+        { Size, 10 },
+    };
+    for (UINTN i = 0; i < ARRAY_SIZE(Ranges) && !EFI_ERROR(Status); i++) {
+        UINT64 Offset = MIN(Ranges[i][0], Size);
+        UINTN Length = (UINTN)Ranges[i][1];
+        UINTN Expected = (UINTN)MIN((UINT64)Length, Size - Offset);
+
+        Status = HfsReadAt(Fork, Offset, &Length, Buffer);
+        if (EFI_ERROR(Status)) {
+            break;
+        }
+        if (Length != Expected) {
+            Status = EFI_ABORTED;
+        }
+        for (UINTN Byte = 0; Byte < Length && !EFI_ERROR(Status); Byte++) {
+            if (Buffer[Byte] != MockHfsFileByte(FileID, Offset + Byte)) {
+                DEBUG((DEBUG_ERROR, "File %u differs at byte %lu\n", FileID, Offset + Byte));
+                Status = EFI_ABORTED;
+            }
+        }
+    }
+
+    HfsCloseFork(Fork);
+    FreePool(Buffer);
+    return Status;
+}
+
+// Build a volume whose boot.efi and files are compressed: boot.efi in
+// several resource fork chunks, the small files in their attributes
+EFI_STATUS TestCompressedVolume(UINT8 Compression) {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+    UINT32 AttributeType = HFSPLUS_DECMPFS_LZVN_ATTR;
+    UINT32 ResourceType = HFSPLUS_DECMPFS_LZVN_RSRC;
+    VOID *BootEfiData = NULL;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    if (Compression == MOCK_COMPRESSION_ZLIB) {
+        AttributeType = HFSPLUS_DECMPFS_ZLIB_ATTR;
+        ResourceType = HFSPLUS_DECMPFS_ZLIB_RSRC;
+    } else if (Compression == MOCK_COMPRESSION_LZFSE) {
+        AttributeType = HFSPLUS_DECMPFS_LZFSE_ATTR;
+        ResourceType = HFSPLUS_DECMPFS_LZFSE_RSRC;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.BootEfiSize = 5 * HFSPLUS_DECMPFS_CHUNK_SIZE + 1234;
+    Options.FileCount = 20;
+    Options.FileSize = 3000;
+    Options.FreeSpaceRunBlocks = 4;
+    Options.Compression = Compression;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+
+    // The whole of boot.efi, reading less than its size from the device
+    UINT64 BytesRead = Disk->BytesRead;
+    if (!EFI_ERROR(Status)) {
+        Status = LoadBootEfi(Volume, &BootEfiData);
+    }
+    if (!EFI_ERROR(Status) && !CheckFileContent(Image.BootEfiFileID, BootEfiData, Options.BootEfiSize)) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status) && Disk->BytesRead - BytesRead >= Options.BootEfiSize) {
+        DEBUG((DEBUG_ERROR, "Compressed boot.efi read %lu bytes\n", Disk->BytesRead - BytesRead));
+        Status = EFI_ABORTED;
+    }
+
+    if (!EFI_ERROR(Status)) {
+        Status = TestCompressedReads(
+            Volume,
+            HFSPLUS_BOOT_EFI_PATH,
+            Image.BootEfiFileID,
+            Options.BootEfiSize,
+            ResourceType
+        );
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestCompressedReads(
+            Volume,
+            L"\\Files\\File00007.bin",
+            Image.FirstFileID + 7,
+            Options.FileSize,
+            AttributeType
+        );
+    }
+
+    // Uncompressed files on the same volume still read from their data fork
+    if (!EFI_ERROR(Status)) {
+        HFSPlusForkData FileForkData = {0};
+
+        Status = TestWriteLargeFile(Volume, &FileForkData);
+        if (!EFI_ERROR(Status)) {
+            Status = TestReadLargeFile(Volume, &FileForkData);
+        }
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Compressed volume test failed: %r\n", Status));
+    }
+    if (BootEfiData != NULL) {
+        FreePool(BootEfiData);
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// Read a file through EFI_FILE_PROTOCOL in uneven chunks and check it
+STATIC
+EFI_STATUS
+TestFileProtocolRead(
+    EFI_FILE_PROTOCOL *File,
+    UINT32 FileID,
+    UINT64 Size
+) {
+    UINT8 *Data = AllocatePool(Size);
+    UINT64 Offset = 0;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Data == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    while (!EFI_ERROR(Status) && Offset < Size) {
+        UINTN Length = MIN(Size - Offset, 3000);
+        Status = File->Read(File, &Length, Data + Offset);
+        if (!EFI_ERROR(Status) && Length == 0) {
+            Status = EFI_END_OF_FILE;
+        }
+        Offset += Length;
+    }
+    if (!EFI_ERROR(Status) && !CheckFileContent(FileID, Data, Size)) {
+        Status = EFI_ABORTED;
+    }
+
+    // Back to the middle, then past the end
+    UINT64 Position = 0;
+    UINTN Length = 100;
+    if (!EFI_ERROR(Status)) {
+        Status = File->SetPosition(File, Size / 2);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = File->Read(File, &Length, Data);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = File->GetPosition(File, &Position);
+    }
+    if (!EFI_ERROR(Status) && (Length != 100 || Position != Size / 2 + 100 ||
+                               Data[0] != MockHfsFileByte(FileID, Size / 2))) {
+        DEBUG((DEBUG_ERROR, "Read after SetPosition is wrong\n"));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = File->SetPosition(File, MAX_UINT64);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = File->Read(File, &Length, Data);
+    }
+    if (!EFI_ERROR(Status) && Length != 0) {
+        DEBUG((DEBUG_ERROR, "Read at the end of the file returned %u bytes\n", (UINT32)Length));
+        Status = EFI_ABORTED;
+    }
+
+    FreePool(Data);
+    return Status;
+}
+
+// Check a handle's EFI_FILE_INFO. A compressed file may take less space
+// than its size.
+STATIC
+EFI_STATUS
+TestFileProtocolInfo(
+    EFI_FILE_PROTOCOL *File,
+    CONST CHAR16 *Name,
+    UINT64 Size,
+    BOOLEAN Directory,
+    BOOLEAN Compressed
+) {
+    UINTN InfoSize = 0;
+
+    EFI_STATUS Status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, NULL);
+    if (Status != EFI_BUFFER_TOO_SMALL) {
+        return EFI_ERROR(Status) ? Status : EFI_ABORTED;
+    }
+
+    EFI_FILE_INFO *Info = AllocatePool(InfoSize);
+    if (Info == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = File->GetInfo(File, &gEfiFileInfoGuid, &InfoSize, Info);
+    if (!EFI_ERROR(Status) &&
+        (Info->Size != InfoSize || Info->FileSize != Size || StrCmp(Info->FileName, Name) != 0 ||
+         ((Info->Attribute & EFI_FILE_DIRECTORY) != 0) != Directory ||
+         (Info->Attribute & EFI_FILE_READ_ONLY) == 0 || (!Directory && !Compressed && Info->PhysicalSize < Size))) {
+        DEBUG((DEBUG_ERROR, "File info is wrong\n"));
+        Status = EFI_ABORTED;
+    }
+
+    FreePool(Info);
+    return Status;
+}
+
+// Read a folder's children through EFI_FILE_PROTOCOL, rewind, and check
+// that an entry too big for the buffer is returned by the next call
+STATIC
+EFI_STATUS
+TestFileProtocolDirectory(
+    EFI_FILE_PROTOCOL *Folder,
+    UINT32 FileCount,
+    UINT64 FileSize,
+    UINT32 BrokenFile
+) {
+    UINT8 Buffer[SIZE_OF_EFI_FILE_INFO + (HFSPLUS_MAX_NAME_LENGTH + 1) * sizeof(CHAR16)];
+    EFI_FILE_INFO *Info = (EFI_FILE_INFO *)Buffer;
+    CHAR16 Name[MOCK_HFS_FILE_NAME_LENGTH + 1];
+    UINT32 Listed = 0;
+    EFI_STATUS Status;
+
+    for (;;) {
+        UINTN Size = sizeof(Buffer);
+        Status = Folder->Read(Folder, &Size, Buffer);
+        if (EFI_ERROR(Status) || Size == 0) {
+            break;
+        }
+
+        // A compressed file with a broken header lists with its stored size
+        MockHfsFileName(Listed, Name);
+        if (StrCmp(Info->FileName, Name) != 0 || Info->FileSize != ((Listed == BrokenFile) ? 0 : FileSize) ||
+            (Info->Attribute & EFI_FILE_DIRECTORY) != 0) {
+            DEBUG((DEBUG_ERROR, "Folder entry %u is wrong\n", Listed));
+            return EFI_ABORTED;
+        }
+        Listed++;
+    }
+    if (!EFI_ERROR(Status) && Listed != FileCount) {
+        DEBUG((DEBUG_ERROR, "Folder Read returned %u of %u files\n", Listed, FileCount));
+        Status = EFI_ABORTED;
+    }
+
+    UINTN Size = 1;
+    if (!EFI_ERROR(Status)) {
+        Status = Folder->SetPosition(Folder, 0);
+    }
+    if (!EFI_ERROR(Status) && Folder->Read(Folder, &Size, Buffer) != EFI_BUFFER_TOO_SMALL) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status) && Size <= SIZE_OF_EFI_FILE_INFO) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = Folder->Read(Folder, &Size, Buffer);
+    }
+    MockHfsFileName(0, Name);
+    if (!EFI_ERROR(Status) && StrCmp(Info->FileName, Name) != 0) {
+        DEBUG((DEBUG_ERROR, "Folder Read after rewind did not start over\n"));
+        Status = EFI_ABORTED;
+    }
+
+    return Status;
+}
+
+// Overwrite the magic of a file's com.apple.decmpfs header on the disk
+STATIC
+EFI_STATUS
+BreakDecmpfsHeader(
+    MockBlockIoProtocol *Disk,
+    UINT32 FileID
+) {
+    CONST CHAR16 *Name = HFSPLUS_DECMPFS_ATTRIBUTE;
+    UINTN NameLength = StrLen(Name);
+    UINT8 Key[10 + 2 * 17];
+    UINTN KeySize = 10 + 2 * NameLength;
+
+    // The attribute key after its length and padding: file ID, start
+    // block, then the name
+    WriteUnaligned32((UINT32 *)Key, SwapBytes32(FileID));
+    WriteUnaligned32((UINT32 *)(Key + 4), 0);
+    WriteUnaligned16((UINT16 *)(Key + 8), SwapBytes16((UINT16)NameLength));
+    for (UINTN Char = 0; Char < NameLength; Char++) {
+        WriteUnaligned16((UINT16 *)(Key + 10 + 2 * Char), SwapBytes16(Name[Char]));
+    }
+
+    UINTN DiskSize = TEST_DISK_BLOCKS * TEST_BLOCK_SIZE;
+    for (UINTN Offset = 4; Offset + KeySize + 20 <= DiskSize; Offset += 2) {
+        if (CompareMem(Disk->DiskData + Offset, Key, KeySize) == 0) {
+            // The inline data record follows the key; the header starts
+            // 16 bytes into it
+            Disk->DiskData[Offset + KeySize + 16] ^= 0xFF;
+            return EFI_SUCCESS;
+        }
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+// Bind the driver to a mock disk and use the volume through
+// EFI_SIMPLE_FILE_SYSTEM_PROTOCOL and EFI_FILE_PROTOCOL. On a compressed
+// volume one file's decmpfs header is broken, which must not stop the
+// listing of its folder.
+EFI_STATUS TestSimpleFileSystem(UINT8 Compression) {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    EFI_HANDLE DiskHandle = NULL;
+    EFI_HANDLE *Handles = NULL;
+    UINTN HandleCount = 0;
+    EFI_DRIVER_BINDING_PROTOCOL *Binding = NULL;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *SimpleFileSystem = NULL;
+    EFI_FILE_PROTOCOL *Root = NULL;
+    EFI_FILE_PROTOCOL *Folder = NULL;
+    EFI_FILE_PROTOCOL *BootEfi = NULL;
+    EFI_FILE_PROTOCOL *File = NULL;
+    EFI_FILE_PROTOCOL *Missing = NULL;
+    BOOLEAN Started = FALSE;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.BootEfiSize = 100000;
+    Options.FileCount = 20;
+    Options.FileSize = 5000;
+    Options.Compression = Compression;
+    UINT32 BrokenFile = (Compression != MOCK_COMPRESSION_NONE) ? 3 : MAX_UINT32;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status) && BrokenFile != MAX_UINT32) {
+        Status = BreakDecmpfsHeader(Disk, Image.FirstFileID + BrokenFile);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = gBS->InstallProtocolInterface(&DiskHandle, &gEfiBlockIoProtocolGuid, EFI_NATIVE_INTERFACE, &Disk->BlockIo);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = HfsPlusDriverEntryPoint(NULL, NULL);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiDriverBindingProtocolGuid, NULL, &HandleCount, &Handles);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = gBS->HandleProtocol(Handles[HandleCount - 1], &gEfiDriverBindingProtocolGuid, (VOID **)&Binding);
+    }
+
+    // One mount per device, however often Start is called
+    if (!EFI_ERROR(Status)) {
+        Status = Binding->Supported(Binding, DiskHandle, NULL);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = Binding->Start(Binding, DiskHandle, NULL);
+        Started = !EFI_ERROR(Status);
+    }
+    if (!EFI_ERROR(Status) && Binding->Start(Binding, DiskHandle, NULL) != EFI_ALREADY_STARTED) {
+        DEBUG((DEBUG_ERROR, "Second Start did not report the volume as started\n"));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = gBS->HandleProtocol(DiskHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&SimpleFileSystem);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = SimpleFileSystem->OpenVolume(SimpleFileSystem, &Root);
+    }
+
+    // boot.efi by absolute path, a small file relative to its folder
+    if (!EFI_ERROR(Status)) {
+        Status = Root->Open(Root, &BootEfi, HFSPLUS_BOOT_EFI_PATH, EFI_FILE_MODE_READ, 0);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestFileProtocolRead(BootEfi, Image.BootEfiFileID, Options.BootEfiSize);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestFileProtocolInfo(BootEfi, L"boot.efi", Options.BootEfiSize, FALSE, Compression != MOCK_COMPRESSION_NONE);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = Root->Open(Root, &Folder, L"Files", EFI_FILE_MODE_READ, 0);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestFileProtocolInfo(Folder, L"Files", 0, TRUE, FALSE);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestFileProtocolDirectory(Folder, Options.FileCount, Options.FileSize, BrokenFile);
+    }
+    if (!EFI_ERROR(Status)) {
+        CHAR16 Name[32];
+        MockHfsFileName(7, Name);
+        Status = Folder->Open(Folder, &File, Name, EFI_FILE_MODE_READ, 0);
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestFileProtocolRead(File, Image.FirstFileID + 7, Options.FileSize);
+    }
+
+    // Volume information, then what a read-only volume refuses
+    if (!EFI_ERROR(Status)) {
+        UINT8 Buffer[SIZE_OF_EFI_FILE_SYSTEM_INFO + 64 * sizeof(CHAR16)];
+        UINTN InfoSize = sizeof(Buffer);
+        EFI_FILE_SYSTEM_INFO *Info = (EFI_FILE_SYSTEM_INFO *)Buffer;
+
+        Status = Root->GetInfo(Root, &gEfiFileSystemInfoGuid, &InfoSize, Info);
+        if (!EFI_ERROR(Status) &&
+            (!Info->ReadOnly || Info->BlockSize != Options.BlockSize ||
+             Info->VolumeSize != (UINT64)Image.TotalBlocks * Options.BlockSize ||
+             Info->FreeSpace != (UINT64)Image.FreeBlocks * Options.BlockSize || Info->VolumeLabel[0] == 0)) {
+            DEBUG((DEBUG_ERROR, "File system info is wrong\n"));
+            Status = EFI_ABORTED;
+        }
+    }
+    if (!EFI_ERROR(Status) && Folder->Open(Folder, &Missing, L"Missing.bin", EFI_FILE_MODE_READ, 0) != EFI_NOT_FOUND) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status) &&
+        Root->Open(Root, &Missing, HFSPLUS_BOOT_EFI_PATH, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0) != EFI_WRITE_PROTECTED) {
+        Status = EFI_ABORTED;
+    }
+
+    // The volume stays while files are open on it
+    if (!EFI_ERROR(Status) && Binding->Stop(Binding, DiskHandle, 0, NULL) != EFI_ACCESS_DENIED) {
+        DEBUG((DEBUG_ERROR, "Stop succeeded with open files\n"));
+        Status = EFI_ABORTED;
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "SimpleFileSystem test failed: %r\n", Status));
+    }
+    EFI_FILE_PROTOCOL *Open[] = { File, Folder, BootEfi, Root };
+    for (UINTN i = 0; i < ARRAY_SIZE(Open); i++) {
+        if (Open[i] != NULL) {
+            Open[i]->Close(Open[i]);
+        }
+    }
+    if (Started) {
+        EFI_STATUS StopStatus = Binding->Stop(Binding, DiskHandle, 0, NULL);
+        if (!EFI_ERROR(Status)) {
+            Status = StopStatus;
+        }
+    }
+    if (Binding != NULL) {
+        gBS->UninstallProtocolInterface(Handles[HandleCount - 1], &gEfiDriverBindingProtocolGuid, Binding);
+    }
+    if (Handles != NULL) {
+        FreePool(Handles);
+    }
+    if (DiskHandle != NULL) {
+        gBS->UninstallProtocolInterface(DiskHandle, &gEfiBlockIoProtocolGuid, &Disk->BlockIo);
+    }
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// Open a file and a folder through hard links, reopen the file from the
+// link cache, and list the links with what their inodes hold
+EFI_STATUS TestHardLinks() {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+    HFSPlusCatalogFile *Record = NULL;
+    HFSPlusForkData DataFork;
+    VOID *ReadData = NULL;
+    UINT32 NodeID = 0;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.FileCount = 4;
+    Options.FileSize = 5000;
+    Options.HardLinks = TRUE;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+
+    // The link resolves to its inode, whose data fork holds the content
+    if (!EFI_ERROR(Status)) {
+        Status = ResolvePath(Volume, L"\\Links\\Linked.bin", &NodeID, (VOID **)&Record);
+    }
+    if (!EFI_ERROR(Status) && (NodeID != Image.LinkedFileID || HFS_BE16(&Record->recordType) != HFSPLUS_FILE_RECORD)) {
+        DEBUG((DEBUG_ERROR, "File link resolved to node %u\n", NodeID));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        HfsForkDataFromDisk(&Record->dataFork, &DataFork);
+        Status = ReadFileWithFragmentation(Volume, &DataFork, NodeID, HFSPLUS_DATA_FORK, &ReadData);
+    }
+    if (!EFI_ERROR(Status) &&
+        (DataFork.logicalSize != Options.FileSize || !CheckFileContent(Image.LinkedFileID, ReadData, DataFork.logicalSize))) {
+        Status = EFI_ABORTED;
+    }
+
+    // Reopening the link finds the inode in the link cache
+    UINT64 Misses = Volume != NULL ? Volume->Links.Misses : 0;
+    UINT64 Hits = Volume != NULL ? Volume->Links.Hits : 0;
+    if (!EFI_ERROR(Status)) {
+        Status = ResolvePath(Volume, L"\\Links\\Linked.bin", &NodeID, (VOID **)&Record);
+    }
+    if (!EFI_ERROR(Status) &&
+        (NodeID != Image.LinkedFileID || Volume->Links.Misses != Misses || Volume->Links.Hits != Hits + 1)) {
+        DEBUG((DEBUG_ERROR, "Reopened file link missed the link cache\n"));
+        Status = EFI_ABORTED;
+    }
+
+    // A directory link leads into its inode folder
+    if (!EFI_ERROR(Status)) {
+        Status = ResolvePath(Volume, L"\\Links\\LinkedDir\\Inside.bin", &NodeID, NULL);
+    }
+    if (!EFI_ERROR(Status) && NodeID != Image.LinkedFolderFileID) {
+        DEBUG((DEBUG_ERROR, "Directory link led to node %u\n", NodeID));
+        Status = EFI_ABORTED;
+    }
+
+    // Listing \Links shows the link names with the inodes' IDs and sizes
+    if (!EFI_ERROR(Status)) {
+        HFSPLUS_DIR_ITERATOR Iterator;
+        HFSPLUS_DIR_ENTRY Entries[3];
+        UINTN Count = ARRAY_SIZE(Entries);
+
+        Status = HfsOpenDirectory(Volume, Image.LinksFolderID, FALSE, &Iterator);
+        if (!EFI_ERROR(Status)) {
+            Status = HfsReadDirectory(&Iterator, Entries, &Count);
+        }
+        if (!EFI_ERROR(Status) &&
+            (Count != 2 ||
+             StrCmp(Entries[0].Name, L"Linked.bin") != 0 || Entries[0].RecordType != HFSPLUS_FILE_RECORD ||
+             Entries[0].NodeID != Image.LinkedFileID || Entries[0].Size != Options.FileSize ||
+             StrCmp(Entries[1].Name, L"LinkedDir") != 0 || Entries[1].RecordType != HFSPLUS_FOLDER_RECORD ||
+             Entries[1].NodeID != Image.LinkedFolderID)) {
+            DEBUG((DEBUG_ERROR, "Listing of hard links is wrong\n"));
+            Status = EFI_ABORTED;
+        }
+    }
+
+    // Listing the root leaves out the private folders behind the links
+    if (!EFI_ERROR(Status)) {
+        HFSPLUS_DIR_ITERATOR Iterator;
+        HFSPLUS_DIR_ENTRY Entries[4];
+        UINTN Count = ARRAY_SIZE(Entries);
+
+        Status = HfsOpenDirectory(Volume, HFSPLUS_ROOT_FOLDER_ID, FALSE, &Iterator);
+        if (!EFI_ERROR(Status)) {
+            Status = HfsReadDirectory(&Iterator, Entries, &Count);
+        }
+        if (!EFI_ERROR(Status) &&
+            (Count != 3 ||
+             StrCmp(Entries[0].Name, L"Files") != 0 || Entries[0].NodeID != Image.FilesFolderID ||
+             StrCmp(Entries[1].Name, L"Links") != 0 || Entries[1].NodeID != Image.LinksFolderID ||
+             StrCmp(Entries[2].Name, L"System") != 0)) {
+            DEBUG((DEBUG_ERROR, "Root listing shows %u entries\n", (UINT32)Count));
+            Status = EFI_ABORTED;
+        }
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Hard link test failed: %r\n", Status));
+    }
+    if (ReadData != NULL) {
+        FreePool(ReadData);
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// Mount a volume of the given kind on media with the given sector size:
+// the header is found through the wrapper when there is one, HFSX names
+// match case-sensitively and HFS+ names do not, and a write lands inside
+// the embedded volume where a fresh mount sees it
+EFI_STATUS TestVolumeKind(UINT8 VolumeKind, UINT32 SectorSize) {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS * TEST_BLOCK_SIZE / SectorSize, SectorSize);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+    VOID *BootEfiData = NULL;
+    UINT32 NodeID = 0;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = 4096;
+    Options.NodeSize = 4096;
+    Options.BootEfiSize = 100000;
+    Options.FileCount = 20;
+    Options.FileSize = 3000;
+    Options.FreeSpaceRunBlocks = 4;
+    Options.VolumeKind = VolumeKind;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+
+    UINT16 Signature = (VolumeKind == MOCK_VOLUME_HFSX) ? HFSX_SIGNATURE : HFSPLUS_SIGNATURE;
+    if (!EFI_ERROR(Status) &&
+        (Volume->Signature != Signature || Volume->StartLba * SectorSize != Image.VolumeOffset ||
+         (VolumeKind == MOCK_VOLUME_WRAPPED) != (Image.VolumeOffset != 0))) {
+        DEBUG((DEBUG_ERROR, "Volume kind %u mounted at block %lu\n", VolumeKind, Volume->StartLba));
+        Status = EFI_ABORTED;
+    }
+
+    if (!EFI_ERROR(Status)) {
+        Status = LoadBootEfi(Volume, &BootEfiData);
+    }
+    if (!EFI_ERROR(Status) && !CheckFileContent(Image.BootEfiFileID, BootEfiData, Options.BootEfiSize)) {
+        Status = EFI_ABORTED;
+    }
+
+    // Only HFSX tells the spellings apart
+    if (!EFI_ERROR(Status)) {
+        Status = ResolvePath(Volume, L"\\Files\\File00007.bin", &NodeID, NULL);
+    }
+    if (!EFI_ERROR(Status) && NodeID != Image.FirstFileID + 7) {
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        EFI_STATUS Expected = (VolumeKind == MOCK_VOLUME_HFSX) ? EFI_NOT_FOUND : EFI_SUCCESS;
+        if (ResolvePath(Volume, L"\\files\\FILE00007.BIN", NULL, NULL) != Expected) {
+            DEBUG((DEBUG_ERROR, "Volume kind %u matched names with the wrong case rules\n", VolumeKind));
+            Status = EFI_ABORTED;
+        }
+    }
+
+    HFSPlusForkData FileForkData = {0};
+    if (!EFI_ERROR(Status)) {
+        Status = TestWriteLargeFile(Volume, &FileForkData);
+    }
+    UINT32 FreeBlocks = (Volume != NULL) ? Volume->FreeBlocks : 0;
+    if (!EFI_ERROR(Status)) {
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status) && Volume->FreeBlocks != FreeBlocks) {
+        DEBUG((DEBUG_ERROR, "Remount found %u free blocks, not %u\n", Volume->FreeBlocks, FreeBlocks));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestReadLargeFile(Volume, &FileForkData);
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Volume kind %u on %u-byte sectors failed: %r\n", VolumeKind, SectorSize, Status));
+    }
+    if (BootEfiData != NULL) {
+        FreePool(BootEfiData);
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// Mount a volume whose catalog is spread over one extent per block, most of
+// them in the extents overflow tree: lookups and the leaf chain walk must
+// reach nodes past the eighth extent
+EFI_STATUS TestScatteredCatalog() {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = TEST_BLOCK_SIZE;
+    Options.NodeSize = 1024;
+    Options.FileCount = 60;
+    Options.FileSize = 700;
+    Options.ScatteredCatalog = TRUE;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status) && Image.CatalogFile.totalBlocks <= 8) {
+        DEBUG((DEBUG_ERROR, "Catalog of %u blocks does not overflow its extents\n", Image.CatalogFile.totalBlocks));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+
+    // Every file, last ones included, through a fresh descent
+    for (UINT32 Index = 0; Index < Options.FileCount && !EFI_ERROR(Status); Index++) {
+        CHAR16 Path[32];
+        UINT32 NodeID = 0;
+
+        MockHfsFileName(Index, Path + 7);
+        CopyMem(Path, L"\\Files\\", 7 * sizeof(CHAR16));
+        Status = ResolvePath(Volume, Path, &NodeID, NULL);
+        if (!EFI_ERROR(Status) && NodeID != Image.FirstFileID + Index) {
+            Status = EFI_ABORTED;
+        }
+    }
+
+    if (!EFI_ERROR(Status) && Volume->CatalogTree.ExtentCount <= 8) {
+        DEBUG((DEBUG_ERROR, "Catalog opened with only %u extents\n", (UINT32)Volume->CatalogTree.ExtentCount));
+        Status = EFI_ABORTED;
+    }
+    if (!EFI_ERROR(Status)) {
+        Status = TestCatalogRangeScan(Volume, &Image, Options.FileCount);
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Scattered catalog failed: %r\n", Status));
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+// Allocate blocks near the end of a volume whose allocation file is spread
+// over one extent per block: the bitmap block that covers them is past the
+// eighth extent, and a remount must find them allocated
+EFI_STATUS TestScatteredAllocationFile() {
+    MockBlockIoProtocol *Disk = InitializeMockDisk(16 * TEST_DISK_BLOCKS, TEST_BLOCK_SIZE);
+    MOCK_HFS_IMAGE_OPTIONS Options = {0};
+    MOCK_HFS_IMAGE Image;
+    HFSPLUS_VOLUME *Volume = NULL;
+
+    if (Disk == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Options.BlockSize = TEST_BLOCK_SIZE;
+    Options.NodeSize = 4096;
+    Options.FileCount = 4;
+    Options.FileSize = 700;
+    Options.ScatteredAllocationFile = TRUE;
+    EFI_STATUS Status = BuildMockHfsImage(Disk, &Options, &Image);
+    if (!EFI_ERROR(Status)) {
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status) && !Volume->Bitmap.Loaded) {
+        Status = LoadBitmapCache(Volume, &Volume->Bitmap);
+    }
+    if (!EFI_ERROR(Status) && Volume->Bitmap.ExtentCount <= 8) {
+        DEBUG((DEBUG_ERROR, "Allocation file has only %u extents\n", (UINT32)Volume->Bitmap.ExtentCount));
+        Status = EFI_ABORTED;
+    }
+
+    HFSPlusExtentDescriptor Run = { Image.TotalBlocks - 100, 10 };
+    UINT32 FreeBlocks = (Volume != NULL) ? Volume->FreeBlocks : 0;
+    if (!EFI_ERROR(Status)) {
+        Status = MarkBlockRunsAllocated(Volume, &Run, 1);
+    }
+    if (!EFI_ERROR(Status)) {
+        UnmountHfsPlusVolume(Volume);
+        Volume = NULL;
+        Status = MountHfsPlusVolume(&Disk->BlockIo, &Volume);
+    }
+    if (!EFI_ERROR(Status) && !Volume->Bitmap.Loaded) {
+        Status = LoadBitmapCache(Volume, &Volume->Bitmap);
+    }
+
+    UINT64 Cursor = Run.startBlock;
+    UINT64 RunStart;
+    UINT64 RunLength;
+    if (!EFI_ERROR(Status) &&
+        (Volume->FreeBlocks != FreeBlocks - Run.blockCount ||
+         BitmapCacheNextFreeRun(&Volume->Bitmap, &Cursor, Cursor + Run.blockCount, 1, &RunStart, &RunLength))) {
+        DEBUG((DEBUG_ERROR, "Blocks allocated past the eighth bitmap extent are free after a remount\n"));
+        Status = EFI_ABORTED;
+    }
+
+    if (EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "Scattered allocation file failed: %r\n", Status));
+    }
+    UnmountHfsPlusVolume(Volume);
+    FreeMockDisk(Disk);
+    return Status;
+}
+
+EFI_STATUS RunTests() {
+    // Allocation blocks the size of a sector, and eight sectors long
+    EFI_STATUS Status = RunVolumeTests(TEST_BLOCK_SIZE);
+    if (!EFI_ERROR(Status)) {
+        Status = RunVolumeTests(8 * TEST_BLOCK_SIZE);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing partition probe...\n"));
+        Status = TestDetectPartitions();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing journal replay...\n"));
+        Status = TestJournalReplay(FALSE);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing journal replay, other byte order...\n"));
+        Status = TestJournalReplay(TRUE);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing journaled batch write...\n"));
+        Status = TestJournaledWrite();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing case folding...\n"));
+        Status = TestCaseFolding();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing zlib, LZVN and LZFSE decoders...\n"));
+        Status = TestDecompressors();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing zlib compressed volume...\n"));
+        Status = TestCompressedVolume(MOCK_COMPRESSION_ZLIB);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing LZVN compressed volume...\n"));
+        Status = TestCompressedVolume(MOCK_COMPRESSION_LZVN);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing LZFSE compressed volume...\n"));
+        Status = TestCompressedVolume(MOCK_COMPRESSION_LZFSE);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing SimpleFileSystem driver...\n"));
+        Status = TestSimpleFileSystem(MOCK_COMPRESSION_NONE);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing SimpleFileSystem driver on a compressed volume...\n"));
+        Status = TestSimpleFileSystem(MOCK_COMPRESSION_LZVN);
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing hard links...\n"));
+        Status = TestHardLinks();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing catalog with overflow extents...\n"));
+        Status = TestScatteredCatalog();
+    }
+    if (!EFI_ERROR(Status)) {
+        DEBUG((DEBUG_INFO, "Testing allocation file with overflow extents...\n"));
+        Status = TestScatteredAllocationFile();
+    }
+    for (UINT32 SectorSize = 512; SectorSize <= 4096 && !EFI_ERROR(Status); SectorSize *= 8) {
+        DEBUG((DEBUG_INFO, "Testing HFSX and wrapped volumes on %u-byte sectors...\n", SectorSize));
+        Status = TestVolumeKind(MOCK_VOLUME_HFSX, SectorSize);
+        if (!EFI_ERROR(Status)) {
+            Status = TestVolumeKind(MOCK_VOLUME_WRAPPED, SectorSize);
+        }
+    }
     return Status;
 }
 